@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #define DEFAULT_MAX_READ_SIZE (16*1024*1024)
 
@@ -49,6 +50,7 @@ typedef struct {
   const gchar *path;
   gchar *start_tag;
   int fd;
+  gint64 remaining;
 
   CockpitPipe *pipe;
   gboolean open;
@@ -128,6 +130,7 @@ static void
 cockpit_fsread_init (CockpitFsread *self)
 {
   self->fd = -1;
+  self->remaining = -1;
 }
 
 static void
@@ -143,6 +146,20 @@ on_pipe_read (CockpitPipe *pipe,
   GBytes *message;
   gchar *tag;
 
+  /* Already sent all that was asked for */
+  if (self->remaining == 0)
+    return;
+
+  if (self->remaining > 0)
+    {
+      if (data->len >= self->remaining)
+        {
+          g_byte_array_set_size (data, self->remaining);
+          end_of_data = TRUE;
+        }
+      self->remaining -= data->len;
+    }
+
   if (data->len)
     {
       /* When array is reffed, this just clears byte array */
@@ -194,6 +211,9 @@ cockpit_fsread_prepare (CockpitChannel *channel)
   CockpitFsread *self = COCKPIT_FSREAD (channel);
   JsonObject *options;
   gint64 max_read_size;
+  gint64 offset;
+  gint64 length;
+  gint64 size;
   struct stat statbuf;
   mode_t ifmt;
   int fd;
@@ -219,6 +239,18 @@ cockpit_fsread_prepare (CockpitChannel *channel)
       return;
     }
 
+  if (!cockpit_json_get_int (options, "offset", 0, &offset) || offset < 0)
+    {
+      cockpit_channel_fail (channel, "protocol-error", "invalid \"offset\" option for fsread channel");
+      return;
+    }
+
+  if (!cockpit_json_get_int (options, "length", -1, &length) || (length <= 0 && length != -1))
+    {
+      cockpit_channel_fail (channel, "protocol-error", "invalid \"length\" option for fsread channel");
+      return;
+    }
+
   if (self->closing)
     return;
 
@@ -260,12 +292,24 @@ cockpit_fsread_prepare (CockpitChannel *channel)
       cockpit_channel_fail (channel, "internal-error", "%s: not a readable file", self->path);
       goto out;
     }
-  if (ifmt == S_IFREG && statbuf.st_size > max_read_size)
+
+  /* Only what we actually send counts against the limit */
+  size = MAX (statbuf.st_size - offset, 0);
+  if (length >= 0)
+    size = MIN (size, length);
+  if (ifmt == S_IFREG && size > max_read_size)
     {
       cockpit_channel_close (channel, "too-large");
       goto out;
     }
 
+  if (offset > 0 && lseek (fd, offset, SEEK_SET) < 0)
+    {
+      cockpit_channel_fail (channel, "internal-error", "%s: couldn't seek: %s", self->path, strerror (errno));
+      goto out;
+    }
+  self->remaining = length;
+
   /* This owns the file descriptor */
   self->pipe = cockpit_pipe_new (self->path, fd, -1);
   self->fd = fd;
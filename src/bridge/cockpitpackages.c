@@ -951,7 +951,7 @@ package_content (CockpitPackages *packages,
                  const gchar *name,
                  const gchar *path,
                  const gchar *language,
-                 gboolean allow_gzipped,
+                 const gchar * const *encodings,
                  const gchar *self_origin,
                  GHashTable *headers)
 {
@@ -962,10 +962,14 @@ package_content (CockpitPackages *packages,
   GError *error = NULL;
   GBytes *bytes = NULL;
   gboolean globbing;
-  gboolean gzipped = FALSE;
+  const gchar *encoding = NULL;
   gboolean is_language_specific = FALSE;
   const gchar *type;
   gchar *policy;
+  guint status = 200;
+  gsize offset;
+  gsize length;
+  gchar *content_range = NULL;
 
   if (!self_origin)
     self_origin = cockpit_web_response_get_origin (response);
@@ -977,12 +981,16 @@ package_content (CockpitPackages *packages,
       names = g_hash_table_get_keys (packages->listing);
       names = g_list_sort (names, (GCompareFunc) g_strcmp0);
 
-      /* When globbing files together no gzip encoding is possible */
-      allow_gzipped = FALSE;
+      /* When globbing files together no content encoding is possible */
+      encodings = NULL;
     }
   else
     names = g_list_prepend (NULL, (gchar *) name);
 
+  /* Which precompressed variant gets picked depends on Accept-Encoding */
+  if (encodings)
+    cockpit_web_response_set_vary_encoding (response, TRUE);
+
   for (GList *l = names; l != NULL; l = g_list_next (l))
     {
       name = l->data;
@@ -1017,7 +1025,8 @@ package_content (CockpitPackages *packages,
 
       g_clear_error (&error);
 
-      bytes = cockpit_web_response_negotiation (filename, package ? package->paths : NULL, language, &is_language_specific, &gzipped, &error);
+      bytes = cockpit_web_response_negotiation_encoded (filename, package ? package->paths : NULL, language, encodings,
+                                                        &is_language_specific, &encoding, &error);
 
       /* HACK: if a translation file is missing, just return empty
        * content. This saves a whole lot of 404s in the developer
@@ -1028,7 +1037,7 @@ package_content (CockpitPackages *packages,
         {
           bytes = g_bytes_new_static ("", 0);
           is_language_specific = TRUE;
-          gzipped = FALSE;
+          encoding = NULL;
         }
 
       /* When globbing most errors result in a zero length block */
@@ -1038,7 +1047,7 @@ package_content (CockpitPackages *packages,
             {
               g_message ("%s", error->message);
               bytes = g_bytes_new_static ("", 0);
-              gzipped = FALSE;
+              encoding = NULL;
               is_language_specific = FALSE;
             }
         }
@@ -1078,7 +1087,7 @@ package_content (CockpitPackages *packages,
         cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
 
       /* Do we need to decompress this content? */
-      if (gzipped && !allow_gzipped)
+      if (g_strcmp0 (encoding, "gzip") == 0 && !(encodings && g_strv_contains (encodings, "gzip")))
         {
           g_clear_error (&error);
           uncompressed = cockpit_web_response_gunzip (bytes, &error);
@@ -1090,14 +1099,14 @@ package_content (CockpitPackages *packages,
             }
           g_bytes_unref (bytes);
           bytes = uncompressed;
-          gzipped = FALSE;
+          encoding = NULL;
         }
 
       /* The first one */
       if (l == names)
         {
-          if (gzipped)
-            g_hash_table_insert (headers, g_strdup ("Content-Encoding"), g_strdup ("gzip"));
+          if (encoding)
+            g_hash_table_insert (headers, g_strdup ("Content-Encoding"), g_strdup (encoding));
 
           type = cockpit_web_response_content_type (path);
           if (type)
@@ -1114,7 +1123,32 @@ package_content (CockpitPackages *packages,
                 }
             }
 
-          cockpit_web_response_headers_full (response, 200, "OK", -1, headers);
+          /* A single file can be sent in part */
+          if (!globbing)
+            {
+              status = cockpit_web_response_negotiate_range (response, g_bytes_get_size (bytes), NULL,
+                                                             &offset, &length, &content_range);
+              if (content_range)
+                g_hash_table_insert (headers, g_strdup ("Content-Range"), content_range);
+            }
+
+          if (status == 416)
+            {
+              g_hash_table_remove (headers, "Content-Encoding");
+              cockpit_web_response_headers_full (response, 416, "Range Not Satisfiable", 0, headers);
+              break;
+            }
+          else if (status == 206)
+            {
+              GBytes *part = g_bytes_new_from_bytes (bytes, offset, length);
+              g_bytes_unref (bytes);
+              bytes = part;
+              cockpit_web_response_headers_full (response, 206, "Partial Content", length, headers);
+            }
+          else
+            {
+              cockpit_web_response_headers_full (response, 200, "OK", -1, headers);
+            }
         }
 
       if (bytes && !cockpit_web_response_queue (response, bytes))
@@ -1189,9 +1223,9 @@ handle_packages (CockpitWebServer *server,
   if (origin)
     g_hash_table_insert (out_headers, g_strdup ("Access-Control-Allow-Origin"), origin);
 
+  encodings = cockpit_web_request_get_accepted_encodings (request, cockpit_web_response_encodings);
   package_content (packages, response, name, path, languages[0],
-                   cockpit_web_request_accepts_encoding (request, "gzip"),
-                   origin, out_headers);
+                   (const gchar * const *) encodings, origin, out_headers);
 
 out:
   if (out_headers)
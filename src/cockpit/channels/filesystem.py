@@ -123,24 +123,41 @@ class FsReadChannel(GeneratorChannel):
     def do_yield_data(self, options: JsonObject) -> Generator[bytes, None, JsonObject]:
         path = get_str(options, 'path')
         max_read_size = get_int(options, 'max_read_size', None)
+        offset = get_int(options, 'offset', 0)
+        length = get_int(options, 'length', None)
+        if offset < 0:
+            raise ChannelError('protocol-error', message='invalid "offset" option for fsread channel')
+        if length is not None and length <= 0:
+            raise ChannelError('protocol-error', message='invalid "length" option for fsread channel')
 
         logger.debug('Opening file "%s" for reading', path)
 
         try:
             with open(path, 'rb') as filep:
                 buf = os.stat(filep.fileno())
-                if max_read_size is not None and buf.st_size > max_read_size:
+
+                # only what we actually send counts against the limit
+                remaining = max(buf.st_size - offset, 0)
+                if length is not None:
+                    remaining = min(remaining, length)
+                if max_read_size is not None and remaining > max_read_size:
                     raise ChannelError('too-large')
 
+                if offset:
+                    filep.seek(offset)
+
                 if self.is_binary and stat.S_ISREG(buf.st_mode):
                     self.ready(size_hint=buf.st_size)
                 else:
                     self.ready()
 
-                while True:
-                    data = filep.read1(Channel.BLOCK_SIZE)
+                while length is None or length > 0:
+                    size = Channel.BLOCK_SIZE if length is None else min(length, Channel.BLOCK_SIZE)
+                    data = filep.read1(size)
                     if data == b'':
                         break
+                    if length is not None:
+                        length -= len(data)
                     logger.debug('  ...sending %d bytes', len(data))
                     if not self.is_binary:
                         data = data.replace(b'\0', b'').decode(errors='ignore').encode()
@@ -15,8 +15,10 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+import io
 import logging
-from typing import Optional
+import re
+from typing import BinaryIO, Optional, Tuple
 
 from ..channel import AsyncChannel
 from ..data import read_cockpit_data_file
@@ -26,6 +28,61 @@ from ..packages import Packages
 logger = logging.getLogger(__name__)
 
 
+def negotiate_range(value: object, size: int) -> Tuple[int, int, int, str]:
+    """Work out which part of a document of `size` bytes a Range header asks for
+
+    Only a single "bytes=first-last" range is supported; anything else is
+    ignored, and the whole document is sent.  Returns the status, the offset
+    and length of the part to send, and the Content-Range header.
+    """
+    match = re.fullmatch(r'\s*bytes\s*=\s*(\d*)\s*-\s*(\d*)\s*', value) if isinstance(value, str) else None
+    if match is None or match.group(1) == match.group(2) == '':
+        return 200, 0, size, ''
+
+    first = int(match.group(1)) if match.group(1) else None
+    last = int(match.group(2)) if match.group(2) else None
+
+    if first is None:
+        # the last bytes of the document
+        assert last is not None
+        if last == 0 or size == 0:
+            return 416, 0, 0, f'bytes */{size}'
+        first = max(size - last, 0)
+        last = size - 1
+    elif last is not None and last < first:
+        return 200, 0, size, ''
+    elif first >= size:
+        return 416, 0, 0, f'bytes */{size}'
+    elif last is None or last >= size:
+        last = size - 1
+
+    return 206, first, last - first + 1, f'bytes {first}-{last}/{size}'
+
+
+class PartialReader(io.RawIOBase):
+    """Reads at most `length` bytes of `stream`, starting at `offset`"""
+
+    def __init__(self, stream: BinaryIO, offset: int, length: int):
+        super().__init__()
+        stream.seek(offset)
+        self.stream = stream
+        self.remaining = length
+
+    def readable(self) -> bool:
+        return True
+
+    def read(self, size: int = -1) -> bytes:
+        if size < 0 or size > self.remaining:
+            size = self.remaining
+        data = self.stream.read(size)
+        self.remaining -= len(data)
+        return data
+
+    def close(self) -> None:
+        self.stream.close()
+        super().close()
+
+
 class PackagesChannel(AsyncChannel):
     payload = 'http-stream1'
     restrictions = [("internal", "packages")]
@@ -97,5 +154,25 @@ class PackagesChannel(AsyncChannel):
             self.http_error(500, f'Internal error: {exc!s}')
 
         else:
-            self.send_json(status=200, reason='OK', headers=out_headers)
-            await self.sendfile(document.data)
+            # a Range is only forwarded to us when it applies to this document
+            if 'Range' in headers:
+                size = document.data.seek(0, io.SEEK_END)
+                status, offset, length, content_range = negotiate_range(headers['Range'], size)
+            else:
+                status, offset, length, content_range = 200, 0, -1, ''
+
+            if status == 416:
+                document.data.close()
+                out_headers.pop('Content-Encoding', None)
+                out_headers['Content-Range'] = content_range
+                self.send_json(status=416, reason='Range Not Satisfiable', headers=out_headers)
+                self.done()
+            elif status == 206:
+                out_headers['Content-Range'] = content_range
+                out_headers['Content-Length'] = f'{length}'
+                self.send_json(status=206, reason='Partial Content', headers=out_headers)
+                await self.sendfile(PartialReader(document.data, offset, length))  # type: ignore[arg-type]
+            else:
+                document.data.seek(0)
+                self.send_json(status=200, reason='OK', headers=out_headers)
+                await self.sendfile(document.data)
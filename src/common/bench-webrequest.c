@@ -0,0 +1,205 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bench-webrequest: request parsing microbenchmark
+ *
+ * Parses the same browser-like HTTP request over and over, once with
+ * web_socket_util_parse_headers() into a header hash table, as the web
+ * server used to, and once with the in-place CockpitWebHeaderIndex.
+ * After parsing, it looks up the headers that CockpitWebServer and
+ * CockpitWebResponse always need.  The "index+table" run also builds
+ * the table with cockpit_web_header_index_to_table(), as happens for
+ * every request that reaches a handle-resource handler; only requests
+ * that are claimed by a handle-stream handler, or that no handler
+ * wants, avoid that.  With --split, the request arrives in two reads,
+ * so it gets parsed one more time while still incomplete.
+ *
+ * This is not a test: it doesn't fail on bad numbers.  Compare the
+ * results of both parsers on the same machine.
+ */
+
+#include "config.h"
+
+#include "cockpitwebrequest-private.h"
+
+#include "websocket/websocket.h"
+
+#include <string.h>
+
+static const gchar request[] =
+  "GET /cockpit/@localhost/system/index.html HTTP/1.1\r\n"
+  "Host: localhost:9090\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: https://localhost:9090/system\r\n"
+  "Cookie: cockpit=dj0yO2k9MTI3LjAuMC4xO2g9ZmViMmRlYjM0NWE2ZjliOGFkZTIxMWQ0; machine-cockpit+localhost=yes\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Sec-Fetch-Dest: iframe\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "If-None-Match: \"$0a1b2c3d4e5f-c\"\r\n"
+  "Priority: u=4\r\n"
+  "\r\n";
+
+static const gchar *lookups[] = {
+  "Content-Length", "Host", "Connection", "Accept-Encoding",
+  "Range", "If-Range", "Cookie", "X-Forwarded-Proto",
+};
+
+static gint iterations = 1000000;
+static gboolean split = FALSE;
+
+static GOptionEntry entries[] = {
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of requests to parse", "N" },
+  { "split", 's', 0, G_OPTION_ARG_NONE, &split, "Let each request arrive in two reads", NULL },
+  { NULL }
+};
+
+static gsize
+parse_table (gchar *data,
+             gsize length)
+{
+  g_autoptr(GHashTable) headers = NULL;
+  g_autofree gchar *method = NULL;
+  g_autofree gchar *path = NULL;
+  gsize found = 0;
+  gssize off1;
+  gssize off2;
+  gsize i;
+
+  off1 = web_socket_util_parse_req_line (data, length, &method, &path);
+  g_assert (off1 > 0);
+  off2 = web_socket_util_parse_headers (data + off1, length - off1, &headers);
+  if (off2 == 0)
+    return 0;
+  g_assert (off2 > 0);
+
+  for (i = 0; i < G_N_ELEMENTS (lookups); i++)
+    found += g_hash_table_lookup (headers, lookups[i]) != NULL;
+
+  return found;
+}
+
+static gsize
+parse_index_full (gchar *data,
+                  gsize length,
+                  gboolean table)
+{
+  CockpitWebHeaderIndex index;
+  g_autofree gchar *method = NULL;
+  g_autofree gchar *path = NULL;
+  gsize found = 0;
+  gssize off1;
+  gssize off2;
+  gsize i;
+
+  off1 = web_socket_util_parse_req_line (data, length, &method, &path);
+  g_assert (off1 > 0);
+  off2 = cockpit_web_header_index_parse (&index, data + off1, length - off1);
+  if (off2 == 0)
+    return 0;
+  g_assert (off2 > 0);
+
+  cockpit_web_header_index_terminate (&index, data + off1);
+  for (i = 0; i < G_N_ELEMENTS (lookups); i++)
+    found += cockpit_web_header_index_lookup (&index, lookups[i]) != NULL;
+
+  if (table)
+    {
+      g_autoptr(GHashTable) headers = cockpit_web_header_index_to_table (&index);
+      g_assert (g_hash_table_lookup (headers, "Cookie") != NULL);
+    }
+
+  return found;
+}
+
+static gsize
+parse_index (gchar *data,
+             gsize length)
+{
+  return parse_index_full (data, length, FALSE);
+}
+
+static gsize
+parse_index_table (gchar *data,
+                   gsize length)
+{
+  return parse_index_full (data, length, TRUE);
+}
+
+static void
+run (const gchar *name,
+     gsize (* parse) (gchar *, gsize))
+{
+  gchar buffer[sizeof (request)];
+  gsize length = sizeof (request) - 1;
+  gsize found = 0;
+  gint64 start;
+  gint64 elapsed;
+  gint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      /* The index parser writes into the buffer, so always start afresh */
+      memcpy (buffer, request, sizeof (request));
+      if (split)
+        found += parse (buffer, length - length / 4);
+      found += parse (buffer, length);
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  g_assert (found == (gsize)iterations * 4);
+  g_print ("%-12s %8.1f ns/request  %8.0f requests/s\n", name,
+           elapsed * 1000.0 / iterations, iterations / (elapsed / (gdouble)G_USEC_PER_SEC));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+
+  context = g_option_context_new ("- benchmark HTTP request header parsing");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-webrequest: %s\n", error->message);
+      return 2;
+    }
+  if (iterations <= 0)
+    {
+      g_printerr ("bench-webrequest: --iterations must be positive\n");
+      return 2;
+    }
+
+  g_print ("%d requests of %d bytes%s\n", iterations, (gint)sizeof (request) - 1,
+           split ? ", in two reads each" : "");
+
+  run ("table", parse_table);
+  run ("index", parse_index);
+  run ("index+table", parse_index_table);
+
+  return 0;
+}
@@ -29,6 +29,83 @@
 
 #define VARCHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-"
 
+/**
+ * CockpitTemplate
+ *
+ * A template compiled into a list of segments: literal text, and
+ * variables to look up when rendering.  Compiling scans the input for
+ * the markers once; rendering the same template again and again then
+ * only calls the #CockpitTemplateFunc for each variable.  The literal
+ * segments are slices of the input, which is never copied.
+ */
+
+typedef struct {
+  /* The literal text, or the variable as written in the input */
+  GBytes *text;
+  /* NULL for literal text */
+  gchar *variable;
+} Segment;
+
+struct _CockpitTemplate {
+  gint refs;
+  GBytes *input;
+  GArray *segments;
+};
+
+static void
+segment_clear (gpointer data)
+{
+  Segment *segment = data;
+
+  if (segment->text)
+    g_bytes_unref (segment->text);
+  g_free (segment->variable);
+}
+
+static CockpitTemplate *
+template_new (GBytes *input)
+{
+  CockpitTemplate *self = g_new0 (CockpitTemplate, 1);
+
+  self->refs = 1;
+  self->input = g_bytes_ref (input);
+  self->segments = g_array_new (FALSE, FALSE, sizeof (Segment));
+  g_array_set_clear_func (self->segments, segment_clear);
+
+  return self;
+}
+
+static void
+template_add (CockpitTemplate *self,
+              const gchar *text,
+              gsize length,
+              gchar *variable)
+{
+  const gchar *base = g_bytes_get_data (self->input, NULL);
+  Segment segment = { NULL, variable };
+
+  /* Empty literals don't need to be sent */
+  if (length == 0 && variable == NULL)
+    return;
+
+  if (text)
+    segment.text = g_bytes_new_from_bytes (self->input, text - base, length);
+  g_array_append_val (self->segments, segment);
+}
+
+static gboolean
+is_variable_name (const gchar *name,
+                  const gchar *end)
+{
+  /* The input isn't necessarily nul terminated */
+  for (; name < end; name++)
+    {
+      if (!strchr (VARCHARS, *name) || *name == '\0')
+        return FALSE;
+    }
+  return TRUE;
+}
+
 static gchar *
 find_variable (const gchar *start_marker,
                const gchar *end_marker,
@@ -37,6 +114,8 @@ find_variable (const gchar *start_marker,
                const gchar **before,
                const gchar **after)
 {
+  gsize start_len = strlen (start_marker);
+  gsize end_len = strlen (end_marker);
   const gchar *a;
   const gchar *b;
   const gchar *c;
@@ -45,18 +124,18 @@ find_variable (const gchar *start_marker,
   for (;;)
     {
       /* Look for start_marker to end_marker */
-      a = memmem (data, strlen(data), start_marker, strlen (start_marker));
+      a = memmem (data, end - data, start_marker, start_len);
       if (a == NULL)
         return NULL;
 
-      data = a + strlen (start_marker);
+      data = a + start_len;
       b = data;
 
-      c = memmem (data, strlen(data), end_marker, strlen (end_marker));
+      c = memmem (data, end - data, end_marker, end_len);
       if (c == NULL)
         return NULL;
 
-      data = c + strlen (end_marker);
+      data = c + end_len;
       d = data;
 
       /*
@@ -67,7 +146,7 @@ find_variable (const gchar *start_marker,
        *
        * Check that the name makes sense.
        */
-      if (b != c && b + strspn (b, VARCHARS) == c)
+      if (b != c && is_variable_name (b, c))
         break;
     }
 
@@ -78,85 +157,263 @@ find_variable (const gchar *start_marker,
   return g_strndup (b, c - b);
 }
 
-GList *
-cockpit_template_expand (GBytes *input,
-                         const gchar *start_marker,
-                         const gchar *end_marker,
-                         CockpitTemplateFunc func,
-                         gpointer user_data)
+/**
+ * cockpit_template_compile:
+ * @input: the template text
+ * @start_marker: the marker before a variable name, like "${"
+ * @end_marker: the marker after a variable name, like "}"
+ *
+ * Compile @input, finding the variables in it.  A marker right after
+ * a backslash is not a variable, and the backslash is dropped.
+ *
+ * Returns: (transfer full): the compiled template
+ */
+CockpitTemplate *
+cockpit_template_compile (GBytes *input,
+                          const gchar *start_marker,
+                          const gchar *end_marker)
 {
-  GList *output = NULL;
+  CockpitTemplate *self;
   const gchar *data;
   const gchar *end;
   const gchar *before;
   const gchar *after;
-  GBytes *bytes;
   gchar *name;
-  gboolean escaped;
-  gint before_len;
+  gsize before_len;
 
-  g_return_val_if_fail (func != NULL, NULL);
+  self = template_new (input);
 
   data = g_bytes_get_data (input, NULL);
   end = data + g_bytes_get_size (input);
 
   for (;;)
     {
-      escaped = FALSE;
       name = find_variable (start_marker, end_marker, data, end, &before, &after);
       if (name == NULL)
         break;
 
-      if (before != data)
+      g_assert (before >= data);
+      g_assert (after > before && after <= end);
+
+      /* Check if the char before the match is the escape char '\' */
+      before_len = before - data;
+      if (before_len > 0 && data[before_len - 1] == '\\')
         {
-          g_assert (before > data);
-
-          /* Check if the char before the match is the escape char '/' */
-          before_len = before - data;
-          if (data[before_len - 1] == '\\')
-            {
-              escaped = TRUE;
-              before_len--;
-            }
-
-          bytes = g_bytes_new_with_free_func (data, before_len,
-                                              (GDestroyNotify)g_bytes_unref,
-                                              g_bytes_ref (input));
-          output = g_list_prepend (output, bytes);
+          template_add (self, data, before_len - 1, NULL);
+          template_add (self, before, after - before, NULL);
+          g_free (name);
         }
-
-      if (!escaped)
-        bytes = (func) (name, user_data);
       else
-        bytes = NULL; // Set bytes to null so it's treated as skipped
-      g_free (name);
+        {
+          template_add (self, data, before_len, NULL);
+          template_add (self, before, after - before, name);
+        }
+
+      data = after;
+    }
+
+  template_add (self, data, end - data, NULL);
+  return self;
+}
+
+typedef struct {
+  const gchar *marker;
+  const gchar *position;
+} Insertion;
+
+static gint
+compare_insertions (gconstpointer a,
+                    gconstpointer b)
+{
+  const Insertion *ia = a;
+  const Insertion *ib = b;
+
+  if (ia->position == ib->position)
+    return 0;
+  return ia->position < ib->position ? -1 : 1;
+}
+
+/**
+ * cockpit_template_compile_markers:
+ * @input: the template text
+ * @markers: (array zero-terminated=1): text to insert data after
+ *
+ * Compile @input with a variable right after the first occurrence
+ * of each of @markers, named like the marker.  When rendering, the
+ * markers stay in place, and variables without a value expand to
+ * nothing.  This does what a #CockpitWebInject filter for each marker
+ * does, without looking for the markers every time.
+ *
+ * Returns: (transfer full): the compiled template
+ */
+CockpitTemplate *
+cockpit_template_compile_markers (GBytes *input,
+                                  const gchar * const *markers)
+{
+  g_autoptr(GArray) insertions = NULL;
+  CockpitTemplate *self;
+  Insertion insertion;
+  const gchar *data;
+  const gchar *end;
+  const gchar *found;
+  guint i;
+
+  self = template_new (input);
+
+  data = g_bytes_get_data (input, NULL);
+  end = data + g_bytes_get_size (input);
 
-      if (!bytes)
+  insertions = g_array_new (FALSE, FALSE, sizeof (Insertion));
+  for (i = 0; markers[i] != NULL; i++)
+    {
+      found = memmem (data, end - data, markers[i], strlen (markers[i]));
+      if (found)
         {
-          g_assert (after > before);
-          bytes = g_bytes_new_with_free_func (before, after - before,
-                                              (GDestroyNotify)g_bytes_unref,
-                                              g_bytes_ref (input));
+          insertion.marker = markers[i];
+          insertion.position = found + strlen (markers[i]);
+          g_array_append_val (insertions, insertion);
         }
-      if (g_bytes_get_size (bytes) > 0)
+    }
+
+  g_array_sort (insertions, compare_insertions);
+
+  for (i = 0; i < insertions->len; i++)
+    {
+      insertion = g_array_index (insertions, Insertion, i);
+      template_add (self, data, insertion.position - data, NULL);
+      template_add (self, NULL, 0, g_strdup (insertion.marker));
+      data = insertion.position;
+    }
+
+  template_add (self, data, end - data, NULL);
+  return self;
+}
+
+CockpitTemplate *
+cockpit_template_ref (CockpitTemplate *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  self->refs++;
+  return self;
+}
+
+void
+cockpit_template_unref (CockpitTemplate *self)
+{
+  g_return_if_fail (self != NULL);
+
+  if (--self->refs > 0)
+    return;
+
+  g_array_unref (self->segments);
+  g_bytes_unref (self->input);
+  g_free (self);
+}
+
+/**
+ * cockpit_template_render:
+ * @self: the compiled template
+ * @func: called to look up the value of each variable
+ * @user_data: passed to @func
+ *
+ * Variables for which @func returns %NULL stay as they were written
+ * in the input.  Nothing is included for empty literals or values.
+ *
+ * Returns: (transfer full) (element-type GBytes): the expanded blocks
+ */
+GList *
+cockpit_template_render (CockpitTemplate *self,
+                         CockpitTemplateFunc func,
+                         gpointer user_data)
+{
+  GList *output = NULL;
+  Segment *segment;
+  GBytes *bytes;
+  guint i;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  for (i = 0; i < self->segments->len; i++)
+    {
+      segment = &g_array_index (self->segments, Segment, i);
+
+      bytes = NULL;
+      if (segment->variable)
+        bytes = (func) (segment->variable, user_data);
+      if (!bytes && segment->text)
+        bytes = g_bytes_ref (segment->text);
+
+      if (bytes && g_bytes_get_size (bytes) > 0)
         output = g_list_prepend (output, bytes);
-      else
+      else if (bytes)
         g_bytes_unref (bytes);
+    }
 
-      g_assert (after <= end);
-      data = after;
+  return g_list_reverse (output);
+}
+
+/**
+ * cockpit_template_render_bytes:
+ * @self: the compiled template
+ * @func: called to look up the value of each variable
+ * @user_data: passed to @func
+ *
+ * Like cockpit_template_render(), but gathers all of the output into
+ * a single block, which can go out with a single write.
+ *
+ * Returns: (transfer full): the expanded template
+ */
+GBytes *
+cockpit_template_render_bytes (CockpitTemplate *self,
+                               CockpitTemplateFunc func,
+                               gpointer user_data)
+{
+  GList *output;
+  GList *l;
+  gsize length = 0;
+  gsize size;
+  guint8 *data;
+  guint8 *pos;
+
+  output = cockpit_template_render (self, func, user_data);
+
+  /* A single block can be sent as it is */
+  if (output && !output->next)
+    {
+      GBytes *bytes = output->data;
+      g_list_free (output);
+      return bytes;
     }
 
-  if (data != end)
+  for (l = output; l != NULL; l = g_list_next (l))
+    length += g_bytes_get_size (l->data);
+
+  pos = data = g_malloc (length);
+  for (l = output; l != NULL; l = g_list_next (l))
     {
-      g_assert (end > data);
-      bytes = g_bytes_new_with_free_func (data, end - data,
-                                          (GDestroyNotify)g_bytes_unref,
-                                          g_bytes_ref (input));
-      output = g_list_prepend (output, bytes);
+      size = g_bytes_get_size (l->data);
+      memcpy (pos, g_bytes_get_data (l->data, NULL), size);
+      pos += size;
     }
 
-  return g_list_reverse (output);
+  g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
+  return g_bytes_new_take (data, length);
+}
+
+GList *
+cockpit_template_expand (GBytes *input,
+                         const gchar *start_marker,
+                         const gchar *end_marker,
+                         CockpitTemplateFunc func,
+                         gpointer user_data)
+{
+  g_autoptr(CockpitTemplate) template = NULL;
+
+  g_return_val_if_fail (func != NULL, NULL);
+
+  template = cockpit_template_compile (input, start_marker, end_marker);
+  return cockpit_template_render (template, func, user_data);
 }
 
 typedef struct
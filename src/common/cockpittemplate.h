@@ -26,6 +26,29 @@
 typedef GBytes * (* CockpitTemplateFunc)          (const gchar *variable,
                                                    gpointer user_data);
 
+typedef struct _CockpitTemplate CockpitTemplate;
+
+CockpitTemplate * cockpit_template_compile        (GBytes *input,
+                                                   const gchar *start_marker,
+                                                   const gchar *end_marker);
+
+CockpitTemplate * cockpit_template_compile_markers (GBytes *input,
+                                                    const gchar * const *markers);
+
+CockpitTemplate * cockpit_template_ref            (CockpitTemplate *self);
+
+void              cockpit_template_unref          (CockpitTemplate *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CockpitTemplate, cockpit_template_unref)
+
+GList *           cockpit_template_render         (CockpitTemplate *self,
+                                                   CockpitTemplateFunc func,
+                                                   gpointer user_data);
+
+GBytes *          cockpit_template_render_bytes   (CockpitTemplate *self,
+                                                   CockpitTemplateFunc func,
+                                                   gpointer user_data);
+
 GList *           cockpit_template_expand         (GBytes *input,
                                                    const gchar *start_marker,
                                                    const gchar *end_marker,
@@ -21,6 +21,18 @@
 
 #include "cockpitunicode.h"
 
+#include "cockpitutf8.h"
+
+static gboolean
+validate (const gchar *data,
+          gsize length,
+          const gchar **end)
+{
+  gsize valid = cockpit_utf8_validate (data, length);
+  *end = data + valid;
+  return valid == length;
+}
+
 gboolean
 cockpit_unicode_has_incomplete_ending (GBytes *input)
 {
@@ -29,7 +41,7 @@ cockpit_unicode_has_incomplete_ending (GBytes *input)
   gsize length;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  if (validate (data, length, &end))
     return FALSE;
 
   do
@@ -37,7 +49,7 @@ cockpit_unicode_has_incomplete_ending (GBytes *input)
       length -= (end - data) + 1;
       data = end + 1;
     }
-  while (!g_utf8_validate (data, length, &end));
+  while (!validate (data, length, &end));
 
   return length == 0;
 }
@@ -51,7 +63,7 @@ cockpit_unicode_force_utf8 (GBytes *input)
   GString *string;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  if (validate (data, length, &end))
     return g_bytes_ref (input);
 
   string = g_string_sized_new (length + 16);
@@ -66,7 +78,7 @@ cockpit_unicode_force_utf8 (GBytes *input)
       length -= (end - data) + 1;
       data = end + 1;
     }
-  while (!g_utf8_validate (data, length, &end));
+  while (!validate (data, length, &end));
 
   if (length)
     g_string_append_len (string, data, length);
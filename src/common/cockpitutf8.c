@@ -0,0 +1,275 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UTF-8 validation with the same rules as g_utf8_validate() when given
+ * a length: no overlong forms, no surrogates, nothing above U+10FFFF and
+ * no nul bytes. Most of what we validate is ASCII, so the kernels differ
+ * only in how quickly they skip over runs of it.
+ */
+
+#include "config.h"
+
+#include "cockpitutf8.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define COCKPIT_UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (* AsciiFunc) (const unsigned char *data,
+                              size_t length);
+
+/* Length of the valid sequence at the start of @data, or zero */
+static inline size_t
+validate_sequence (const unsigned char *data,
+                   size_t length)
+{
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xbf;
+  size_t n;
+  size_t i;
+
+  if (data[0] < 0x80)
+    return data[0] ? 1 : 0;
+  else if (data[0] < 0xc2)
+    return 0;
+  else if (data[0] < 0xe0)
+    n = 2;
+  else if (data[0] < 0xf0)
+    {
+      n = 3;
+      if (data[0] == 0xe0)
+        lo = 0xa0; /* overlong */
+      else if (data[0] == 0xed)
+        hi = 0x9f; /* surrogates */
+    }
+  else if (data[0] < 0xf5)
+    {
+      n = 4;
+      if (data[0] == 0xf0)
+        lo = 0x90; /* overlong */
+      else if (data[0] == 0xf4)
+        hi = 0x8f; /* above U+10FFFF */
+    }
+  else
+    {
+      return 0;
+    }
+
+  if (length < n || data[1] < lo || data[1] > hi)
+    return 0;
+  for (i = 2; i < n; i++)
+    {
+      if ((data[i] & 0xc0) != 0x80)
+        return 0;
+    }
+
+  return n;
+}
+
+static inline size_t
+validate_with (const unsigned char *data,
+               size_t length,
+               AsciiFunc skip_ascii)
+{
+  size_t at = 0;
+  size_t n;
+
+  while (at < length)
+    {
+      at += skip_ascii (data + at, length - at);
+      if (at == length)
+        break;
+
+      n = validate_sequence (data + at, length - at);
+      if (n == 0)
+        break;
+      at += n;
+    }
+
+  return at;
+}
+
+static inline size_t
+ascii_bytes (const unsigned char *data,
+             size_t length)
+{
+  size_t n;
+
+  for (n = 0; n < length && data[n] != 0 && data[n] < 0x80; n++);
+
+  return n;
+}
+
+static inline size_t
+ascii_words (const unsigned char *data,
+             size_t length)
+{
+  const uint64_t low = 0x0101010101010101ULL;
+  const uint64_t high = 0x8080808080808080ULL;
+  uint64_t word;
+  size_t n;
+
+  /* Stop at a word with a high bit set, or with a zero byte */
+  for (n = 0; n + sizeof (word) <= length; n += sizeof (word))
+    {
+      memcpy (&word, data + n, sizeof (word));
+      if ((word & high) || ((word - low) & ~word & high))
+        break;
+    }
+
+  return n + ascii_bytes (data + n, length - n);
+}
+
+static size_t
+validate_bytes (const char *data,
+                size_t length)
+{
+  return validate_with ((const unsigned char *)data, length, ascii_bytes);
+}
+
+static size_t
+validate_words (const char *data,
+                size_t length)
+{
+  return validate_with ((const unsigned char *)data, length, ascii_words);
+}
+
+#ifdef COCKPIT_UTF8_X86
+
+/* ASCII other than nul is exactly the bytes that are positive when signed */
+
+__attribute__ ((target ("sse2")))
+static inline size_t
+ascii_sse2 (const unsigned char *data,
+            size_t length)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  unsigned int bad;
+  size_t n;
+
+  for (n = 0; n + sizeof (__m128i) <= length; n += sizeof (__m128i))
+    {
+      bad = ~_mm_movemask_epi8 (_mm_cmpgt_epi8 (_mm_loadu_si128 ((const __m128i *)(data + n)), zero)) & 0xffff;
+      if (bad)
+        return n + __builtin_ctz (bad);
+    }
+
+  return n + ascii_bytes (data + n, length - n);
+}
+
+__attribute__ ((target ("avx2")))
+static inline size_t
+ascii_avx2 (const unsigned char *data,
+            size_t length)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  unsigned int bad;
+  size_t n;
+
+  for (n = 0; n + sizeof (__m256i) <= length; n += sizeof (__m256i))
+    {
+      bad = ~(unsigned int)_mm256_movemask_epi8 (_mm256_cmpgt_epi8 (_mm256_loadu_si256 ((const __m256i *)(data + n)), zero));
+      if (bad)
+        return n + __builtin_ctz (bad);
+    }
+
+  return n + ascii_bytes (data + n, length - n);
+}
+
+__attribute__ ((target ("sse2")))
+static size_t
+validate_sse2 (const char *data,
+               size_t length)
+{
+  return validate_with ((const unsigned char *)data, length, ascii_sse2);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t
+validate_avx2 (const char *data,
+               size_t length)
+{
+  return validate_with ((const unsigned char *)data, length, ascii_avx2);
+}
+
+#endif /* COCKPIT_UTF8_X86 */
+
+/**
+ * cockpit_utf8_kernel:
+ * @name: "bytes", "words", "sse2" or "avx2"
+ *
+ * Look up one of the validation implementations, so that tests can
+ * compare them with each other.
+ *
+ * Returns: the kernel, or NULL if the CPU doesn't support it
+ */
+CockpitUtf8Func
+cockpit_utf8_kernel (const char *name)
+{
+  if (strcmp (name, "bytes") == 0)
+    return validate_bytes;
+  if (strcmp (name, "words") == 0)
+    return validate_words;
+#ifdef COCKPIT_UTF8_X86
+  if (strcmp (name, "sse2") == 0 && __builtin_cpu_supports ("sse2"))
+    return validate_sse2;
+  if (strcmp (name, "avx2") == 0 && __builtin_cpu_supports ("avx2"))
+    return validate_avx2;
+#endif
+  return NULL;
+}
+
+/**
+ * cockpit_utf8_validate:
+ * @data: the text to validate
+ * @length: the length of @data
+ *
+ * Validate UTF-8 with the fastest implementation that the CPU
+ * supports. Unlike g_utf8_validate() this doesn't need GLib, but
+ * the rules are the same.
+ *
+ * Returns: the length of the valid part at the start of @data,
+ *          which is @length if all of it is valid
+ */
+size_t
+cockpit_utf8_validate (const char *data,
+                       size_t length)
+{
+  static CockpitUtf8Func kernel = NULL;
+  CockpitUtf8Func func;
+
+  /* Every thread picks the same one, so racing here is harmless */
+  func = __atomic_load_n (&kernel, __ATOMIC_RELAXED);
+  if (func == NULL)
+    {
+      func = cockpit_utf8_kernel ("avx2");
+      if (!func)
+        func = cockpit_utf8_kernel ("sse2");
+      if (!func)
+        func = validate_words;
+      __atomic_store_n (&kernel, func, __ATOMIC_RELAXED);
+    }
+
+  return func (data, length);
+}
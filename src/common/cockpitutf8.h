@@ -0,0 +1,33 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_UTF8_H__
+#define __COCKPIT_UTF8_H__
+
+#include <stddef.h>
+
+typedef size_t  (* CockpitUtf8Func)             (const char *data,
+                                                 size_t length);
+
+size_t          cockpit_utf8_validate          (const char *data,
+                                                size_t length);
+
+CockpitUtf8Func cockpit_utf8_kernel            (const char *name);
+
+#endif
@@ -0,0 +1,652 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebcache.h"
+
+#include "cockpitwebresponse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * CockpitWebCache
+ *
+ * A process-wide cache of the files in the static roots, so that the
+ * common requests (login page, branding, ...) don't touch the disk at
+ * all once it's warm.  Entries are keyed by the full path of the file.
+ * Paths which don't exist or can't be read get an entry too, since
+ * cockpit_web_response_negotiation() probes for lots of variants that
+ * usually aren't there; but only if their directory exists, so that
+ * requests for random paths can't make us watch arbitrary directories.
+ *
+ * Every directory with cached entries is watched with a GFileMonitor
+ * (inotify), and any change in it drops all of its entries.  The
+ * total size, including the directories, is bounded by
+ * cockpit_web_cache_set_limit(), and the least recently used entries
+ * get evicted first.  The limit starts
+ * out as 0, which disables the cache: every lookup then loads the file
+ * from disk, as before.
+ *
+ * Templates get compiled once per entry too, see
+ * cockpit_web_cache_entry_get_template(), so that they are dropped
+ * along with the file contents when they change.
+ *
+ * This is not thread-safe; only use it from the main thread.
+ */
+
+typedef struct _CacheDirectory CacheDirectory;
+
+struct _CockpitWebCacheEntry {
+  gint refs;
+  gchar *path;
+
+  /* set for paths which can't be loaded */
+  GError *error;
+  gboolean is_directory;
+
+  GBytes *body;
+  GBytes *identity; /* the decompressed body of a .gz file */
+  gchar *etag;
+  gint64 mtime;
+
+  /* the body compiled as a template, and how */
+  CockpitTemplate *template;
+  gchar *template_key;
+
+  /* kept open for files which are mapped rather than cached */
+  gint fd;
+
+  /* only for entries which are in the cache */
+  CacheDirectory *directory;
+  GList link;
+  gsize cost;
+};
+
+struct _CacheDirectory {
+  gchar *path;
+  GFileMonitor *monitor;
+  GPtrArray *entries;
+  gsize cost;
+};
+
+/* A rough estimate of what a GFileMonitor and its inotify watch take up */
+#define MONITOR_COST 512
+
+static struct {
+  gsize limit;
+  gsize size;
+  GHashTable *entries;      /* path → CockpitWebCacheEntry */
+  GHashTable *directories;  /* path → CacheDirectory */
+  GQueue lru;               /* most recently used first */
+} cache;
+
+static void
+cache_directory_free (gpointer data)
+{
+  CacheDirectory *dir = data;
+
+  g_assert (dir->entries->len == 0);
+
+  g_signal_handlers_disconnect_by_data (dir->monitor, dir);
+
+  /* HACK - It is not generally safe to just unref a GFileMonitor:
+   * https://gitlab.gnome.org/GNOME/glib/issues/1941
+   */
+  g_file_monitor_cancel (dir->monitor);
+  g_object_unref (dir->monitor);
+
+  g_ptr_array_free (dir->entries, TRUE);
+  g_free (dir->path);
+  cache.size -= dir->cost;
+  g_free (dir);
+}
+
+static void
+cache_remove (CockpitWebCacheEntry *entry)
+{
+  CacheDirectory *dir = entry->directory;
+
+  g_hash_table_remove (cache.entries, entry->path);
+  g_queue_unlink (&cache.lru, &entry->link);
+  cache.size -= entry->cost;
+
+  entry->directory = NULL;
+  entry->cost = 0;
+
+  g_ptr_array_remove_fast (dir->entries, entry);
+  if (dir->entries->len == 0)
+    g_hash_table_remove (cache.directories, dir->path);
+
+  cockpit_web_cache_entry_unref (entry);
+}
+
+static void
+cache_evict (void)
+{
+  while (cache.size > cache.limit && cache.lru.tail)
+    cache_remove (cache.lru.tail->data);
+}
+
+static void
+on_directory_changed (GFileMonitor *monitor,
+                      GFile *file,
+                      GFile *other_file,
+                      GFileMonitorEvent event_type,
+                      gpointer user_data)
+{
+  CacheDirectory *dir = user_data;
+  guint n = dir->entries->len;
+
+  g_debug ("%s: directory changed, dropping %u cached files", dir->path, n);
+
+  /* Always remove the last entry, so that nothing gets moved around;
+   * removing the final one frees @dir.
+   */
+  while (n-- > 0)
+    cache_remove (g_ptr_array_index (dir->entries, n));
+}
+
+static CacheDirectory *
+cache_ensure_directory (const gchar *path)
+{
+  g_autofree gchar *dirname = g_path_get_dirname (path);
+  g_autoptr(GError) error = NULL;
+  CacheDirectory *dir;
+
+  dir = g_hash_table_lookup (cache.directories, dirname);
+  if (dir)
+    return dir;
+
+  /* Monitoring a directory which doesn't exist would watch its parent */
+  if (!g_file_test (dirname, G_FILE_TEST_IS_DIR))
+    return NULL;
+
+  g_autoptr(GFile) file = g_file_new_for_path (dirname);
+  GFileMonitor *monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, &error);
+  if (monitor == NULL)
+    {
+      g_debug ("%s: couldn't monitor directory, not caching: %s", dirname, error->message);
+      return NULL;
+    }
+
+  dir = g_new0 (CacheDirectory, 1);
+  dir->path = g_steal_pointer (&dirname);
+  dir->monitor = monitor;
+  dir->entries = g_ptr_array_new ();
+  dir->cost = sizeof (CacheDirectory) + strlen (dir->path) + MONITOR_COST;
+  g_signal_connect (monitor, "changed", G_CALLBACK (on_directory_changed), dir);
+
+  g_hash_table_insert (cache.directories, dir->path, dir);
+  cache.size += dir->cost;
+  return dir;
+}
+
+static GBytes *
+read_contents (int fd,
+               gsize size,
+               const gchar *path,
+               GError **error)
+{
+  g_autofree gchar *data = g_malloc (size);
+  gsize done = 0;
+
+  /* the file might be shrinking under us: then we'll get a change
+   * notification soon, so just take what is there */
+  while (done < size)
+    {
+      ssize_t r = read (fd, data + done, size - done);
+      if (r < 0)
+        {
+          int errsv = errno;
+          if (errsv == EINTR)
+            continue;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                       "Failed to read from file “%s”: %s", path, g_strerror (errsv));
+          return NULL;
+        }
+      if (r == 0)
+        break;
+      done += r;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&data), done);
+}
+
+static CockpitWebCacheEntry *
+entry_load (const gchar *path,
+            gboolean cacheable)
+{
+  CockpitWebCacheEntry *entry = g_new0 (CockpitWebCacheEntry, 1);
+  struct stat buf;
+  int errsv;
+  int fd;
+
+  entry->refs = 1;
+  entry->path = g_strdup (path);
+  entry->link.data = entry;
+  entry->fd = -1;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    {
+      errsv = errno;
+      g_set_error (&entry->error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open file “%s”: %s", path, g_strerror (errsv));
+      return entry;
+    }
+
+  if (fstat (fd, &buf) < 0)
+    {
+      errsv = errno;
+      g_set_error (&entry->error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to get attributes of file “%s”: %s", path, g_strerror (errsv));
+      close (fd);
+      return entry;
+    }
+
+  entry->is_directory = S_ISDIR (buf.st_mode);
+
+  if (cacheable && S_ISREG (buf.st_mode) && (gsize) buf.st_size <= cache.limit)
+    {
+      entry->body = read_contents (fd, buf.st_size, path, &entry->error);
+    }
+  else
+    {
+      /* this also produces the right errors for directories and such */
+      GMappedFile *mapped = g_mapped_file_new_from_fd (fd, FALSE, &entry->error);
+      if (mapped)
+        {
+          entry->body = g_mapped_file_get_bytes (mapped);
+          g_mapped_file_unref (mapped);
+
+          /* Such entries are too large to be cached, so this won't pile up fds */
+          if (S_ISREG (buf.st_mode))
+            {
+              entry->fd = fd;
+              fd = -1;
+            }
+        }
+    }
+
+  if (entry->body)
+    {
+      entry->etag = g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x\"",
+                                     (guint64) buf.st_ino,
+                                     (guint64) buf.st_mtim.tv_sec * G_USEC_PER_SEC + buf.st_mtim.tv_nsec / 1000,
+                                     (guint64) buf.st_size);
+      entry->mtime = buf.st_mtim.tv_sec;
+    }
+
+  if (fd >= 0)
+    close (fd);
+  return entry;
+}
+
+static void
+cache_insert (CacheDirectory *dir,
+              CockpitWebCacheEntry *entry)
+{
+  gsize cost = sizeof (CockpitWebCacheEntry) + strlen (entry->path);
+
+  if (entry->body)
+    cost += g_bytes_get_size (entry->body);
+
+  /* too large to ever fit, along with its directory */
+  if (cost + (dir->entries->len == 0 ? dir->cost : 0) > cache.limit)
+    {
+      if (dir->entries->len == 0)
+        g_hash_table_remove (cache.directories, dir->path);
+      return;
+    }
+
+  entry->directory = dir;
+  entry->cost = cost;
+  g_ptr_array_add (dir->entries, entry);
+
+  g_hash_table_insert (cache.entries, entry->path, cockpit_web_cache_entry_ref (entry));
+  g_queue_push_head_link (&cache.lru, &entry->link);
+  cache.size += cost;
+
+  cache_evict ();
+}
+
+static CockpitWebCacheEntry *
+cache_get (const gchar *path)
+{
+  CockpitWebCacheEntry *entry;
+  CacheDirectory *dir;
+
+  if (cache.limit == 0)
+    return entry_load (path, FALSE);
+
+  if (cache.entries == NULL)
+    {
+      cache.entries = g_hash_table_new (g_str_hash, g_str_equal);
+      cache.directories = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_directory_free);
+    }
+
+  entry = g_hash_table_lookup (cache.entries, path);
+  if (entry)
+    {
+      g_queue_unlink (&cache.lru, &entry->link);
+      g_queue_push_head_link (&cache.lru, &entry->link);
+      return cockpit_web_cache_entry_ref (entry);
+    }
+
+  /* Start watching before loading: that way we can't miss a change */
+  dir = cache_ensure_directory (path);
+  entry = entry_load (path, dir != NULL);
+  if (dir)
+    cache_insert (dir, entry);
+
+  return entry;
+}
+
+/**
+ * cockpit_web_cache_set_limit:
+ * @limit: maximum size of the cache in bytes, or 0 to disable it
+ *
+ * Entries over the new limit are evicted right away.
+ */
+void
+cockpit_web_cache_set_limit (gsize limit)
+{
+  cache.limit = limit;
+  cache_evict ();
+}
+
+/**
+ * cockpit_web_cache_get_size:
+ *
+ * Returns: the number of bytes that the cached entries and their
+ *   directory monitors take up
+ */
+gsize
+cockpit_web_cache_get_size (void)
+{
+  return cache.size;
+}
+
+/**
+ * cockpit_web_cache_flush:
+ *
+ * Drop all cached entries.
+ */
+void
+cockpit_web_cache_flush (void)
+{
+  while (cache.lru.head)
+    cache_remove (cache.lru.head->data);
+}
+
+/**
+ * cockpit_web_cache_lookup:
+ * @path: full path of a file
+ * @error: location to return an error
+ *
+ * Get the contents of the file at @path, from the cache if possible.
+ * The errors are the same as for g_mapped_file_new().
+ *
+ * Returns: (transfer full): the entry, or %NULL on failure
+ */
+CockpitWebCacheEntry *
+cockpit_web_cache_lookup (const gchar *path,
+                          GError **error)
+{
+  CockpitWebCacheEntry *entry = cache_get (path);
+
+  if (entry->error)
+    {
+      g_propagate_error (error, g_error_copy (entry->error));
+      cockpit_web_cache_entry_unref (entry);
+      return NULL;
+    }
+
+  return entry;
+}
+
+/**
+ * cockpit_web_cache_is_directory:
+ * @path: full path of a file
+ *
+ * This is like g_file_test() with %G_FILE_TEST_IS_DIR, but with the
+ * answer from the cache if possible.
+ */
+gboolean
+cockpit_web_cache_is_directory (const gchar *path)
+{
+  if (cache.limit == 0)
+    return g_file_test (path, G_FILE_TEST_IS_DIR);
+
+  g_autoptr(CockpitWebCacheEntry) entry = cache_get (path);
+  return entry->is_directory;
+}
+
+CockpitWebCacheEntry *
+cockpit_web_cache_entry_ref (CockpitWebCacheEntry *entry)
+{
+  g_return_val_if_fail (entry != NULL, NULL);
+
+  entry->refs++;
+  return entry;
+}
+
+void
+cockpit_web_cache_entry_unref (CockpitWebCacheEntry *entry)
+{
+  g_return_if_fail (entry != NULL);
+
+  if (--entry->refs > 0)
+    return;
+
+  g_assert (entry->directory == NULL);
+
+  g_clear_error (&entry->error);
+  g_clear_pointer (&entry->body, g_bytes_unref);
+  g_clear_pointer (&entry->identity, g_bytes_unref);
+  g_clear_pointer (&entry->template, cockpit_template_unref);
+  g_free (entry->template_key);
+  g_free (entry->etag);
+  g_free (entry->path);
+  if (entry->fd >= 0)
+    close (entry->fd);
+  g_free (entry);
+}
+
+/**
+ * cockpit_web_cache_entry_get_body:
+ * @entry: a cache entry
+ *
+ * Returns: (transfer none): the contents of the file
+ */
+GBytes *
+cockpit_web_cache_entry_get_body (CockpitWebCacheEntry *entry)
+{
+  return entry->body;
+}
+
+/**
+ * cockpit_web_cache_entry_get_identity:
+ * @entry: a cache entry for a gzipped file
+ * @error: location to return an error
+ *
+ * The decompressed contents of a gzipped file, for clients which don't
+ * accept gzip.  This is kept along with the compressed body if it fits
+ * into the cache.
+ *
+ * Returns: (transfer full): the decompressed body, or %NULL on failure
+ */
+GBytes *
+cockpit_web_cache_entry_get_identity (CockpitWebCacheEntry *entry,
+                                      GError **error)
+{
+  GBytes *identity;
+  gsize size;
+
+  if (entry->identity)
+    return g_bytes_ref (entry->identity);
+
+  identity = cockpit_web_response_gunzip (entry->body, error);
+  if (identity == NULL || entry->directory == NULL)
+    return identity;
+
+  size = g_bytes_get_size (identity);
+  if (entry->cost + size <= cache.limit)
+    {
+      entry->identity = g_bytes_ref (identity);
+      entry->cost += size;
+      cache.size += size;
+      cache_evict ();
+    }
+
+  return identity;
+}
+
+/**
+ * cockpit_web_cache_entry_get_etag:
+ * @entry: a cache entry
+ *
+ * Returns: a strong ETag (including the quotes) made from the inode,
+ *   modification time and size of the file
+ */
+const gchar *
+cockpit_web_cache_entry_get_etag (CockpitWebCacheEntry *entry)
+{
+  return entry->etag;
+}
+
+/**
+ * cockpit_web_cache_entry_get_mtime:
+ * @entry: a cache entry
+ *
+ * Returns: the modification time of the file, in seconds since the
+ *   epoch, for the Last-Modified header
+ */
+gint64
+cockpit_web_cache_entry_get_mtime (CockpitWebCacheEntry *entry)
+{
+  return entry->mtime;
+}
+
+/**
+ * cockpit_web_cache_entry_get_fd:
+ * @entry: a cache entry
+ *
+ * Files which are too large for the cache (or all files, when it's
+ * disabled) are kept open, so that they can be sent with sendfile().
+ *
+ * Returns: a file descriptor owned by @entry, or -1
+ */
+gint
+cockpit_web_cache_entry_get_fd (CockpitWebCacheEntry *entry)
+{
+  return entry->fd;
+}
+
+static CockpitTemplate *
+entry_cached_template (CockpitWebCacheEntry *entry,
+                       const gchar *key)
+{
+  if (entry->template && g_str_equal (entry->template_key, key))
+    return cockpit_template_ref (entry->template);
+  return NULL;
+}
+
+static CockpitTemplate *
+entry_keep_template (CockpitWebCacheEntry *entry,
+                     gchar *key,
+                     CockpitTemplate *template)
+{
+  /* Uncached entries go away after the request anyway */
+  if (entry->directory == NULL)
+    {
+      g_free (key);
+      return template;
+    }
+
+  g_clear_pointer (&entry->template, cockpit_template_unref);
+  g_free (entry->template_key);
+  entry->template = cockpit_template_ref (template);
+  entry->template_key = key;
+  return template;
+}
+
+/**
+ * cockpit_web_cache_entry_get_template:
+ * @entry: a cache entry
+ * @start_marker: the marker before a variable name
+ * @end_marker: the marker after a variable name
+ *
+ * The body of @entry compiled with cockpit_template_compile().  This
+ * is done once, and kept until the file changes.
+ *
+ * Returns: (transfer full): the compiled template
+ */
+CockpitTemplate *
+cockpit_web_cache_entry_get_template (CockpitWebCacheEntry *entry,
+                                      const gchar *start_marker,
+                                      const gchar *end_marker)
+{
+  gchar *key = g_strconcat ("template\n", start_marker, "\n", end_marker, NULL);
+  CockpitTemplate *template;
+
+  template = entry_cached_template (entry, key);
+  if (template)
+    {
+      g_free (key);
+      return template;
+    }
+
+  template = cockpit_template_compile (entry->body, start_marker, end_marker);
+  return entry_keep_template (entry, key, template);
+}
+
+/**
+ * cockpit_web_cache_entry_get_injection:
+ * @entry: a cache entry
+ * @markers: (array zero-terminated=1): text to insert data after
+ *
+ * Like cockpit_web_cache_entry_get_template(), but compiled with
+ * cockpit_template_compile_markers().
+ *
+ * Returns: (transfer full): the compiled template
+ */
+CockpitTemplate *
+cockpit_web_cache_entry_get_injection (CockpitWebCacheEntry *entry,
+                                       const gchar * const *markers)
+{
+  g_autofree gchar *joined = g_strjoinv ("\n", (gchar **) markers);
+  gchar *key = g_strconcat ("inject\n", joined, NULL);
+  CockpitTemplate *template;
+
+  template = entry_cached_template (entry, key);
+  if (template)
+    {
+      g_free (key);
+      return template;
+    }
+
+  template = cockpit_template_compile_markers (entry->body, markers);
+  return entry_keep_template (entry, key, template);
+}
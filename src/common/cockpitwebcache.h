@@ -0,0 +1,68 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_WEB_CACHE_H__
+#define COCKPIT_WEB_CACHE_H__
+
+#include "cockpittemplate.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitWebCacheEntry CockpitWebCacheEntry;
+
+void                    cockpit_web_cache_set_limit             (gsize limit);
+
+gsize                   cockpit_web_cache_get_size              (void);
+
+void                    cockpit_web_cache_flush                 (void);
+
+CockpitWebCacheEntry *  cockpit_web_cache_lookup                (const gchar *path,
+                                                                 GError **error);
+
+gboolean                cockpit_web_cache_is_directory          (const gchar *path);
+
+CockpitWebCacheEntry *  cockpit_web_cache_entry_ref             (CockpitWebCacheEntry *entry);
+
+void                    cockpit_web_cache_entry_unref           (CockpitWebCacheEntry *entry);
+
+GBytes *                cockpit_web_cache_entry_get_body        (CockpitWebCacheEntry *entry);
+
+GBytes *                cockpit_web_cache_entry_get_identity    (CockpitWebCacheEntry *entry,
+                                                                 GError **error);
+
+const gchar *           cockpit_web_cache_entry_get_etag        (CockpitWebCacheEntry *entry);
+
+gint64                  cockpit_web_cache_entry_get_mtime       (CockpitWebCacheEntry *entry);
+
+gint                    cockpit_web_cache_entry_get_fd          (CockpitWebCacheEntry *entry);
+
+CockpitTemplate *       cockpit_web_cache_entry_get_template    (CockpitWebCacheEntry *entry,
+                                                                 const gchar *start_marker,
+                                                                 const gchar *end_marker);
+
+CockpitTemplate *       cockpit_web_cache_entry_get_injection   (CockpitWebCacheEntry *entry,
+                                                                 const gchar * const *markers);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CockpitWebCacheEntry, cockpit_web_cache_entry_unref)
+
+G_END_DECLS
+
+#endif /* COCKPIT_WEB_CACHE_H__ */
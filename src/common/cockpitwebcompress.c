@@ -0,0 +1,327 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebcompress.h"
+
+#include <gio/gio.h>
+
+#include <string.h>
+
+/**
+ * CockpitWebCompress
+ *
+ * This is a CockpitWebFilter which gzip compresses the data passing
+ * through it.  Every block that is pushed is flushed right away, so
+ * that the client can decompress it as it arrives: responses like
+ * journal exports are streamed, and shouldn't be held back until
+ * enough data has accumulated.
+ *
+ * The level and the minimum size that a response must have to be
+ * worth compressing are process-wide settings, and compression is
+ * disabled until cockpit_web_compress_set_level() is called.
+ *
+ * The same filter can also go the other way, see
+ * cockpit_web_decompress_new().
+ */
+
+struct _CockpitWebCompress {
+  GObject parent;
+  GConverter *converter;
+  gboolean decompress;
+  gboolean finished;
+};
+
+static gint compress_level = 0;
+static gsize compress_minimum = COCKPIT_WEB_COMPRESS_DEFAULT_MINIMUM;
+
+static void cockpit_web_filter_compress_iface (CockpitWebFilterInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitWebCompress, cockpit_web_compress, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_WEB_FILTER, cockpit_web_filter_compress_iface)
+)
+
+static void
+cockpit_web_compress_init (CockpitWebCompress *self)
+{
+
+}
+
+static void
+cockpit_web_compress_finalize (GObject *object)
+{
+  CockpitWebCompress *self = COCKPIT_WEB_COMPRESS (object);
+
+  g_clear_object (&self->converter);
+
+  G_OBJECT_CLASS (cockpit_web_compress_parent_class)->finalize (object);
+}
+
+static void
+cockpit_web_compress_class_init (CockpitWebCompressClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = cockpit_web_compress_finalize;
+}
+
+static void
+compress_convert (CockpitWebCompress *self,
+                  const guint8 *data,
+                  gsize length,
+                  GConverterFlags flags,
+                  void (* function) (gpointer, GBytes *),
+                  gpointer func_data)
+{
+  guint8 buffer[16 * 1024];
+  GConverterResult result;
+  gsize bytes_read;
+  gsize bytes_written;
+  GError *error = NULL;
+  GBytes *bytes;
+
+  g_return_if_fail (!self->finished);
+
+  for (;;)
+    {
+      result = g_converter_convert (self->converter, data, length, buffer, sizeof (buffer),
+                                    flags, &bytes_read, &bytes_written, &error);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          /* zlib says this when a flush had nothing left to write, and
+           * when a block ends in the middle of the compressed stream */
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE) ||
+              (self->decompress && !(flags & G_CONVERTER_INPUT_AT_END) &&
+               g_error_matches (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)))
+            {
+              g_error_free (error);
+              break;
+            }
+
+          if (self->decompress)
+            {
+              /* Corrupt input won't get any better */
+              g_message ("couldn't decompress response data: %s", error->message);
+              self->finished = TRUE;
+            }
+          else
+            {
+              g_critical ("couldn't compress response data: %s", error->message);
+            }
+
+          g_error_free (error);
+          break;
+        }
+
+      if (bytes_written > 0)
+        {
+          bytes = g_bytes_new (buffer, bytes_written);
+          function (func_data, bytes);
+          g_bytes_unref (bytes);
+        }
+
+      data += bytes_read;
+      length -= bytes_read;
+
+      if (result == G_CONVERTER_FINISHED)
+        {
+          self->finished = TRUE;
+          break;
+        }
+
+      /* A flush is complete once zlib stops filling the whole buffer */
+      if (result == G_CONVERTER_FLUSHED ||
+          (length == 0 && bytes_written < sizeof (buffer) && !(flags & G_CONVERTER_INPUT_AT_END)))
+        break;
+    }
+}
+
+static void
+cockpit_web_compress_push (CockpitWebFilter *filter,
+                           GBytes *block,
+                           void (* function) (gpointer, GBytes *),
+                           gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+  gconstpointer data;
+  gsize length;
+
+  data = g_bytes_get_data (block, &length);
+  if (length == 0)
+    return;
+
+  /* Anything after the end of the gzip stream is ignored */
+  if (self->decompress && self->finished)
+    return;
+
+  compress_convert (self, data, length, G_CONVERTER_FLUSH, function, func_data);
+}
+
+static void
+cockpit_web_compress_finish (CockpitWebFilter *filter,
+                             void (* function) (gpointer, GBytes *),
+                             gpointer func_data)
+{
+  CockpitWebCompress *self = (CockpitWebCompress *)filter;
+
+  if (!self->finished)
+    compress_convert (self, (const guint8 *)"", 0, G_CONVERTER_INPUT_AT_END, function, func_data);
+}
+
+static void
+cockpit_web_filter_compress_iface (CockpitWebFilterInterface *iface)
+{
+  iface->push = cockpit_web_compress_push;
+  iface->finish = cockpit_web_compress_finish;
+}
+
+/**
+ * cockpit_web_compress_new:
+ * @level: the zlib compression level, from 1 to 9, or -1 for the default
+ *
+ * Create a new CockpitWebFilter which gzip compresses the response.
+ * The caller is responsible for sending a matching Content-Encoding
+ * header; see cockpit_web_response_compress() which does both.
+ *
+ * Returns: A new CockpitWebFilter
+ */
+CockpitWebFilter *
+cockpit_web_compress_new (gint level)
+{
+  CockpitWebCompress *self;
+
+  g_return_val_if_fail (level >= -1 && level <= 9, NULL);
+
+  self = g_object_new (COCKPIT_TYPE_WEB_COMPRESS, NULL);
+  self->converter = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, level));
+
+  return COCKPIT_WEB_FILTER (self);
+}
+
+/**
+ * cockpit_web_decompress_new:
+ *
+ * Create a new CockpitWebFilter which undoes gzip compression, so
+ * that the filters after it (like a CockpitWebInject) see the real
+ * content.  Corrupt input is logged, and the rest of it is dropped.
+ * The caller is responsible for removing the Content-Encoding header.
+ *
+ * Returns: A new CockpitWebFilter
+ */
+CockpitWebFilter *
+cockpit_web_decompress_new (void)
+{
+  CockpitWebCompress *self;
+
+  self = g_object_new (COCKPIT_TYPE_WEB_COMPRESS, NULL);
+  self->converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  self->decompress = TRUE;
+
+  return COCKPIT_WEB_FILTER (self);
+}
+
+/**
+ * cockpit_web_compress_set_level:
+ * @level: the zlib compression level, or 0 to disable compression
+ *
+ * Sets the level used by cockpit_web_response_compress().
+ */
+void
+cockpit_web_compress_set_level (gint level)
+{
+  g_return_if_fail (level >= 0 && level <= 9);
+  compress_level = level;
+}
+
+gint
+cockpit_web_compress_get_level (void)
+{
+  return compress_level;
+}
+
+/**
+ * cockpit_web_compress_set_minimum:
+ * @minimum: size in bytes
+ *
+ * Responses with a known length that is smaller than this aren't
+ * compressed by cockpit_web_response_compress(): the gzip framing
+ * and the chunked encoding would eat up most of the savings.
+ */
+void
+cockpit_web_compress_set_minimum (gsize minimum)
+{
+  compress_minimum = minimum;
+}
+
+gsize
+cockpit_web_compress_get_minimum (void)
+{
+  return compress_minimum;
+}
+
+/**
+ * cockpit_web_compress_is_compressible:
+ * @content_type: a Content-Type header value, or %NULL
+ *
+ * Returns: Whether content of this type is worth compressing; images,
+ *          archives and the like are compressed already.
+ */
+gboolean
+cockpit_web_compress_is_compressible (const gchar *content_type)
+{
+  static const gchar *types[] = {
+    "application/javascript",
+    "application/json",
+    "application/x-ndjson",
+    "application/xml",
+    "application/wasm",
+    "image/svg+xml",
+  };
+  static const gchar *suffixes[] = { "+json", "+xml" };
+  g_autofree gchar *type = NULL;
+  gsize length;
+  gsize i;
+
+  if (content_type == NULL)
+    return FALSE;
+
+  /* Ignore any parameters, like charset */
+  length = strcspn (content_type, ";");
+  type = g_ascii_strdown (content_type, length);
+  g_strstrip (type);
+
+  if (g_str_has_prefix (type, "text/"))
+    return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (types); i++)
+    {
+      if (g_str_equal (type, types[i]))
+        return TRUE;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (suffixes); i++)
+    {
+      if (g_str_has_suffix (type, suffixes[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
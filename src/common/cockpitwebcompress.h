@@ -0,0 +1,48 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_WEB_COMPRESS_H__
+#define COCKPIT_WEB_COMPRESS_H__
+
+#include "common/cockpitwebfilter.h"
+
+G_BEGIN_DECLS
+
+#define COCKPIT_WEB_COMPRESS_DEFAULT_MINIMUM 1024
+
+#define COCKPIT_TYPE_WEB_COMPRESS       (cockpit_web_compress_get_type ())
+G_DECLARE_FINAL_TYPE(CockpitWebCompress, cockpit_web_compress, COCKPIT, WEB_COMPRESS, GObject)
+
+CockpitWebFilter *  cockpit_web_compress_new              (gint level);
+
+CockpitWebFilter *  cockpit_web_decompress_new            (void);
+
+void                cockpit_web_compress_set_level        (gint level);
+
+gint                cockpit_web_compress_get_level        (void);
+
+void                cockpit_web_compress_set_minimum      (gsize minimum);
+
+gsize               cockpit_web_compress_get_minimum      (void);
+
+gboolean            cockpit_web_compress_is_compressible  (const gchar *content_type);
+
+G_END_DECLS
+
+#endif /* COCKPIT_WEB_COMPRESS_H__ */
@@ -29,16 +29,24 @@
  * This is a CockpitWebFilter which looks for a marker data
  * and inject additional data after that point. The data is
  * not injected more than the specified number of times.
+ *
+ * The marker may be split across blocks.  The search looks at every
+ * byte at most once: whole matches within a block are found with
+ * memmem(), and a match spanning blocks is followed byte by byte
+ * with the Knuth-Morris-Pratt failure function of the marker.
  */
 struct _CockpitWebInject {
   GObject parent;
-  /* partial_matches stores the lengths of partial matches, size is (marker length) - 1
-   * e.g. "ABA" with marker "ABAC" will result in [TRUE, FALSE, TRUE]
-   */
-  GArray *partial_matches;
   GBytes *marker;
   GBytes *inject;
 
+  /* failure[i] is the length of the longest proper prefix of the
+   * marker that is also a suffix of its first i + 1 bytes */
+  gsize *failure;
+
+  /* how much of the marker the previous block ended with */
+  gsize matched;
+
   guint maximum;
   guint injected;
 };
@@ -60,8 +68,7 @@ cockpit_web_inject_finalize (GObject *object)
 {
   CockpitWebInject *self = COCKPIT_WEB_INJECT (object);
 
-  if (self->partial_matches)
-    g_array_unref (self->partial_matches);
+  g_free (self->failure);
   if (self->marker)
     g_bytes_unref (self->marker);
   if (self->inject)
@@ -78,6 +85,66 @@ cockpit_web_inject_class_init (CockpitWebInjectClass *klass)
   gobject_class->finalize = cockpit_web_inject_finalize;
 }
 
+static gsize
+match_step (CockpitWebInject *self,
+            const gchar *mark,
+            gsize matched,
+            gchar c)
+{
+  while (matched > 0 && mark[matched] != c)
+    matched = self->failure[matched - 1];
+  if (mark[matched] == c)
+    matched++;
+  return matched;
+}
+
+/*
+ * Looks for the end of the next marker in @data, from @at.  Returns
+ * FALSE and sets @at to the end of @data if there is none.
+ */
+static gboolean
+find_marker (CockpitWebInject *self,
+             const gchar *data,
+             gsize data_len,
+             gsize *at)
+{
+  const gchar *mark, *found;
+  gsize mark_len, i, tail;
+
+  mark = g_bytes_get_data (self->marker, &mark_len);
+  i = *at;
+
+  /* Continue a match that the previous block ended with */
+  while (self->matched > 0 && i < data_len)
+    {
+      self->matched = match_step (self, mark, self->matched, data[i++]);
+      if (self->matched == mark_len)
+        {
+          self->matched = 0;
+          *at = i;
+          return TRUE;
+        }
+    }
+
+  *at = data_len;
+  if (i >= data_len)
+    return FALSE;
+
+  found = memmem (data + i, data_len - i, mark, mark_len);
+  if (found)
+    {
+      *at = (found - data) + mark_len;
+      return TRUE;
+    }
+
+  /* Remember how much of the marker this block ends with */
+  tail = MIN (data_len - i, mark_len - 1);
+  for (i = data_len - tail; i < data_len; i++)
+    self->matched = match_step (self, mark, self->matched, data[i]);
+
+  return FALSE;
+}
+
 static void
 cockpit_web_inject_push (CockpitWebFilter *filter,
                          GBytes *block,
@@ -85,100 +152,39 @@ cockpit_web_inject_push (CockpitWebFilter *filter,
                          gpointer func_data)
 {
   CockpitWebInject *self = (CockpitWebInject *)filter;
-  const gchar *mark, *data, *pos = NULL;
-  gsize mark_len, data_len, at;
+  gsize data_len, at, written;
   GBytes *bytes;
-  gsize written;
-  gint partial_len, remaining_len;
 
-  mark = g_bytes_get_data (self->marker, &mark_len);
-  data = g_bytes_get_data (block, &data_len);
+  g_bytes_get_data (block, &data_len);
 
   if (data_len == 0)
     return;
 
   written = at = 0;
 
-  /* look at our partial matches first
-   * longest partial matches have precedence (they either get longer or don't pan out)
-   * only do this if we haven't reached the maximum yet
-   */
-  if (self->injected < self->maximum)
-    {
-      for (partial_len = self->partial_matches->len - 1; partial_len >= 0; --partial_len)
-        {
-          if (g_array_index (self->partial_matches, gboolean, partial_len))
-            {
-              /* our match can only grow longer */
-              g_array_index (self->partial_matches, gboolean, partial_len) = FALSE;
-              remaining_len = mark_len - partial_len;
-              /* our current block might be too short */
-              if (remaining_len > data_len)
-                {
-                  if (memcmp (mark + partial_len, data, data_len) == 0)
-                    g_array_index (self->partial_matches, gboolean, partial_len + data_len) = TRUE;
-                }
-              else if (memcmp (mark + partial_len, data, remaining_len) == 0)
-                {
-                  /* we have a match */
-                  at = remaining_len;
-                  pos = data + at;
-                  /* reset partials */
-                  g_array_set_size(self->partial_matches, 0);
-                  g_array_set_size(self->partial_matches, mark_len);
-                  break;
-                }
-            }
-        }
-    }
-
   /* keep searching until we have found the maximum number of allowed matches or reached the end */
-  for(;;)
-  {
-    if (at != written)
+  while (self->injected < self->maximum &&
+         find_marker (self, g_bytes_get_data (block, NULL), data_len, &at))
     {
+      /* write out the marker also before we inject */
       bytes = g_bytes_new_from_bytes (block, written, at - written);
       function (func_data, bytes);
       g_bytes_unref (bytes);
       written = at;
 
-      /* did we have a match? */
-      if (pos == (data + at) && self->injected < self->maximum)
-        {
-          function (func_data, self->inject);
-          self->injected++;
-        }
+      function (func_data, self->inject);
+      self->injected++;
     }
 
-    if (at >= data_len)
-      break;
-
-    /* if there are enough chars left, try to find a complete match */
-    if (self->injected < self->maximum &&
-        data_len >= (at + mark_len) &&
-        (pos = memmem (data + at, data_len - at, mark, mark_len)))
-      {
-        /* we found a match, but we want to write out the mark also before we inject */
-        pos += mark_len;
-        at = pos - data;
-      }
-    else
-      {
-        /* nothing found, forward */
-        at = data_len;
-        pos = NULL;
-      }
-  }
-
-  /* if we haven't reached our max number of injections, look for partial matches at the end */
-  partial_len = mark_len - 1;
-  if (partial_len > data_len)
-    partial_len = data_len;
-  while (partial_len > 0)
+  if (written == 0)
     {
-      if (memcmp (mark, data + data_len - partial_len, partial_len) == 0)
-        g_array_index (self->partial_matches, gboolean, partial_len) = TRUE;
-      partial_len--;
+      function (func_data, block);
+    }
+  else if (written < data_len)
+    {
+      bytes = g_bytes_new_from_bytes (block, written, data_len - written);
+      function (func_data, bytes);
+      g_bytes_unref (bytes);
     }
 }
 
@@ -205,7 +211,7 @@ cockpit_web_inject_new (const gchar *marker,
                         guint count)
 {
   CockpitWebInject *self;
-  gsize len;
+  gsize len, i, k;
 
   g_return_val_if_fail (marker != NULL, NULL);
   g_return_val_if_fail (inject != NULL, NULL);
@@ -215,8 +221,15 @@ cockpit_web_inject_new (const gchar *marker,
 
   self = g_object_new (COCKPIT_TYPE_WEB_INJECT, NULL);
   self->marker = g_bytes_new (marker, len);
-  self->partial_matches = g_array_sized_new(FALSE, TRUE, sizeof(gboolean), len);
-  g_array_set_size(self->partial_matches, len);
+  self->failure = g_new0 (gsize, len);
+  for (i = 1, k = 0; i < len; i++)
+    {
+      while (k > 0 && marker[k] != marker[i])
+        k = self->failure[k - 1];
+      if (marker[k] == marker[i])
+        k++;
+      self->failure[i] = k;
+    }
   self->inject = g_bytes_ref (inject);
   self->maximum = count;
 
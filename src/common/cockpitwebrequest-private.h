@@ -2,6 +2,63 @@
 
 #include "cockpitwebserver.h"
 
+/* Header names that get looked up without comparing strings */
+typedef enum {
+  COCKPIT_WEB_HEADER_OTHER,
+  COCKPIT_WEB_HEADER_ACCEPT_ENCODING,
+  COCKPIT_WEB_HEADER_ACCEPT_LANGUAGE,
+  COCKPIT_WEB_HEADER_AUTHORIZATION,
+  COCKPIT_WEB_HEADER_CONNECTION,
+  COCKPIT_WEB_HEADER_CONTENT_LENGTH,
+  COCKPIT_WEB_HEADER_COOKIE,
+  COCKPIT_WEB_HEADER_HOST,
+  COCKPIT_WEB_HEADER_IF_NONE_MATCH,
+  COCKPIT_WEB_HEADER_IF_RANGE,
+  COCKPIT_WEB_HEADER_ORIGIN,
+  COCKPIT_WEB_HEADER_RANGE,
+  COCKPIT_WEB_HEADER_UPGRADE,
+  COCKPIT_WEB_HEADER_N_KNOWN
+} CockpitWebHeaderName;
+
+#define COCKPIT_WEB_HEADER_INDEX_MAX 64
+
+/* Offsets of a header name and value, relative to CockpitWebHeaderIndex.data */
+typedef struct {
+  guint32 name_offset;
+  guint32 name_length;
+  guint32 value_offset;
+  guint32 value_length;
+} CockpitWebHeaderSpan;
+
+typedef struct {
+  /* Set once the spans are null terminated, and can be looked up */
+  const gchar *data;
+  CockpitWebHeaderSpan spans[COCKPIT_WEB_HEADER_INDEX_MAX];
+  guint n_spans;
+  /* One more than the index of the last span for each known header, or 0 */
+  guint8 known[COCKPIT_WEB_HEADER_N_KNOWN];
+} CockpitWebHeaderIndex;
+
+CockpitWebHeaderName
+cockpit_web_header_name_intern (const gchar *name,
+                                gsize length);
+
+gssize
+cockpit_web_header_index_parse (CockpitWebHeaderIndex *index,
+                                const gchar *data,
+                                gsize length);
+
+void
+cockpit_web_header_index_terminate (CockpitWebHeaderIndex *index,
+                                    gchar *data);
+
+const gchar *
+cockpit_web_header_index_lookup (CockpitWebHeaderIndex *index,
+                                 const gchar *name);
+
+GHashTable *
+cockpit_web_header_index_to_table (CockpitWebHeaderIndex *index);
+
 struct _CockpitWebRequest {
   int state;
   GIOStream *io;
@@ -13,7 +70,13 @@ struct _CockpitWebRequest {
   GSource *timeout;
   gboolean check_tls_redirect;
 
+  /* Parsed in place in the buffer; the table is only built on demand */
+  CockpitWebHeaderIndex header_index;
   GHashTable *headers;
+  /* What follows the headers in the buffer, for those taking over the stream */
+  gsize rest_offset;
+  GByteArray *rest;
+
   const gchar *original_path;
   const gchar *path;
   const gchar *host;
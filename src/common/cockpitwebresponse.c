@@ -33,10 +33,14 @@
 #include "common/cockpitflow.h"
 #include "common/cockpitlocale.h"
 #include "common/cockpittemplate.h"
+#include "common/cockpitwebcache.h"
+#include "common/cockpitwebcompress.h"
+#include "common/cockpitwebserver.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 
 /**
  * CockpitWebResponse:
@@ -63,6 +67,19 @@ struct _CockpitWebResponse {
   gchar *protocol;
   CockpitCacheType cache_type;
 
+  /* For compressing on the fly */
+  gchar *accept_encoding;
+  const gchar *content_encoding;
+  gboolean vary_encoding;
+
+  /* For partial content */
+  gchar *range;
+  gchar *if_range;
+
+  /* For conditional requests */
+  gchar *if_none_match;
+  gchar *if_modified_since;
+
   /* The output queue */
   GPollableOutputStream *out;
   GQueue *queue;
@@ -71,6 +88,11 @@ struct _CockpitWebResponse {
   gsize partial_offset;
   GSource *source;
 
+  /* Sent with sendfile() once the queue has drained */
+  CockpitWebCacheEntry *file;
+  off_t file_offset;
+  gsize file_remaining;
+
   /* Status flags */
   guint count;
   gboolean complete;
@@ -160,9 +182,15 @@ cockpit_web_response_finalize (GObject *object)
   g_free (self->url_root);
   g_free (self->method);
   g_free (self->origin);
+  g_free (self->accept_encoding);
+  g_free (self->range);
+  g_free (self->if_range);
+  g_free (self->if_none_match);
+  g_free (self->if_modified_since);
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
+  g_clear_pointer (&self->file, cockpit_web_cache_entry_unref);
   self->out_queued = 0;
 
   G_OBJECT_CLASS (cockpit_web_response_parent_class)->finalize (object);
@@ -182,6 +210,13 @@ cockpit_web_response_class_init (CockpitWebResponseClass *klass)
                                G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
 }
 
+static const gchar *
+lookup_table_header (gpointer source,
+                     const gchar *name)
+{
+  return g_hash_table_lookup (source, name);
+}
+
 /**
  * cockpit_web_response_new:
  * @io: the stream to send on
@@ -205,6 +240,34 @@ cockpit_web_response_new (GIOStream *io,
                           GHashTable *in_headers,
                           const gchar *method,
                           const gchar *protocol)
+{
+  return cockpit_web_response_new_with_lookup (io, original_path, path,
+                                               in_headers ? lookup_table_header : NULL, in_headers,
+                                               method, protocol);
+}
+
+/**
+ * cockpit_web_response_new_with_lookup:
+ * @io: the stream to send on
+ * @path: the path resource or NULL
+ * @lookup: function to look up input headers, or NULL
+ * @source: passed to @lookup
+ *
+ * Like cockpit_web_response_new(), but the few headers that the
+ * response looks at are fetched one by one with @lookup.  This is
+ * what cockpit_web_request_respond() uses, so that requests don't need
+ * a table of all their headers.
+ *
+ * Returns: (transfer full): the new response, unref when done with it
+ */
+CockpitWebResponse *
+cockpit_web_response_new_with_lookup (GIOStream *io,
+                                      const gchar *original_path,
+                                      const gchar *path,
+                                      CockpitWebHeaderLookup lookup,
+                                      gpointer source,
+                                      const gchar *method,
+                                      const gchar *protocol)
 {
   CockpitWebResponse *self;
   GOutputStream *out;
@@ -251,12 +314,17 @@ cockpit_web_response_new (GIOStream *io,
     self->logname = "response";
 
   self->keep_alive = TRUE;
-  if (in_headers)
+  if (lookup)
     {
-      connection = g_hash_table_lookup (in_headers, "Connection");
+      connection = lookup (source, "Connection");
       if (connection)
         self->keep_alive = g_str_equal (connection, "keep-alive");
-      host = g_hash_table_lookup (in_headers, "Host");
+      host = lookup (source, "Host");
+      self->accept_encoding = g_strdup (lookup (source, "Accept-Encoding"));
+      self->range = g_strdup (lookup (source, "Range"));
+      self->if_range = g_strdup (lookup (source, "If-Range"));
+      self->if_none_match = g_strdup (lookup (source, "If-None-Match"));
+      self->if_modified_since = g_strdup (lookup (source, "If-Modified-Since"));
     }
 
   self->protocol = g_strdup (protocol ?: "http");
@@ -355,6 +423,58 @@ on_output_flushed (GObject *stream,
   g_object_unref (self);
 }
 
+/* Largest amount to sendfile() in one go, so as not to starve the main loop */
+#define SENDFILE_MAX 1024UL * 1024UL
+
+static gboolean
+send_file_output (CockpitWebResponse *self)
+{
+  GSocket *socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->io));
+  gsize before = self->out_queued;
+  ssize_t count;
+
+  count = sendfile (g_socket_get_fd (socket), cockpit_web_cache_entry_get_fd (self->file),
+                    &self->file_offset, MIN (self->file_remaining, SENDFILE_MAX));
+
+  if (count < 0)
+    {
+      int errsv = errno;
+
+      if (errsv == EAGAIN || errsv == EINTR)
+        return TRUE;
+
+      if (errsv == EPIPE || errsv == ECONNRESET)
+        g_debug ("%s: couldn't send file: %s", self->logname, g_strerror (errsv));
+      else
+        g_message ("%s: couldn't send file: %s", self->logname, g_strerror (errsv));
+
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  /* The file shrank, and we already promised a Content-Length */
+  if (count == 0)
+    {
+      g_message ("%s: file was truncated while sending", self->logname);
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  g_debug ("%s: sent %d bytes from file", self->logname, (int)count);
+  self->file_remaining -= count;
+  self->out_queued -= count;
+
+  if (self->file_remaining == 0)
+    g_clear_pointer (&self->file, cockpit_web_cache_entry_unref);
+
+  if (before >= QUEUE_PRESSURE && self->out_queued < QUEUE_PRESSURE)
+    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
+
+  return TRUE;
+}
+
 static gboolean
 on_response_output (GObject *pollable,
                     gpointer user_data)
@@ -430,6 +550,10 @@ on_response_output (GObject *pollable,
 
       return TRUE;
     }
+  else if (self->file)
+    {
+      return send_file_output (self);
+    }
   else
     {
       g_source_destroy (self->source);
@@ -447,6 +571,17 @@ on_response_output (GObject *pollable,
     }
 }
 
+static void
+ensure_output_source (CockpitWebResponse *self)
+{
+  if (!self->source)
+    {
+      self->source = g_pollable_output_stream_create_source (self->out, NULL);
+      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
+      g_source_attach (self->source, NULL);
+    }
+}
+
 static void
 queue_bytes (CockpitWebResponse *self,
              GBytes *block)
@@ -462,12 +597,46 @@ queue_bytes (CockpitWebResponse *self,
 
   self->count++;
 
-  if (!self->source)
-    {
-      self->source = g_pollable_output_stream_create_source (self->out, NULL);
-      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
-      g_source_attach (self->source, NULL);
-    }
+  ensure_output_source (self);
+
+  if (before < QUEUE_PRESSURE && self->out_queued >= QUEUE_PRESSURE)
+    cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
+}
+
+static gboolean
+can_send_file (CockpitWebResponse *self,
+               CockpitWebCacheEntry *file)
+{
+  /* sendfile() needs the raw socket, and can't go through filters */
+  return cockpit_web_cache_entry_get_fd (file) >= 0 &&
+         g_bytes_get_size (cockpit_web_cache_entry_get_body (file)) > 0 &&
+         self->filters == NULL &&
+         !g_str_equal (self->method, "HEAD") &&
+         G_IS_SOCKET_CONNECTION (self->io);
+}
+
+static void
+queue_file (CockpitWebResponse *self,
+            CockpitWebCacheEntry *file,
+            gsize offset,
+            gsize length)
+{
+  gsize before = self->out_queued;
+
+  g_return_if_fail (self->file == NULL);
+  g_return_if_fail (self->chunked == FALSE);
+  g_return_if_fail (self->out_queueable >= length);
+
+  self->out_queueable -= length;
+  self->out_queued += length;
+
+  self->file = cockpit_web_cache_entry_ref (file);
+  self->file_offset = offset;
+  self->file_remaining = length;
+
+  self->count++;
+
+  ensure_output_source (self);
 
   if (before < QUEUE_PRESSURE && self->out_queued >= QUEUE_PRESSURE)
     cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
@@ -611,6 +780,16 @@ cockpit_web_response_complete (CockpitWebResponse *self)
   if (self->failed)
     return;
 
+  /* Let the filters pass on anything they held back, in order */
+  if (!g_str_equal (self->method, "HEAD"))
+    {
+      for (GList *l = self->filters; l != NULL; l = g_list_next (l))
+        {
+          QueueStep qn = { .response = self, .filters = l->next };
+          cockpit_web_filter_finish (l->data, queue_filter, &qn);
+        }
+    }
+
   /* Hold a reference until cockpit_web_response_done() */
   g_object_ref (self);
   self->complete = TRUE;
@@ -827,6 +1006,12 @@ finish_headers (CockpitWebResponse *self,
         g_string_append_printf (string, "Content-Type: %s\r\n", content_type);
     }
 
+  if (self->content_encoding && (seen & HEADER_CONTENT_ENCODING) == 0)
+    {
+      g_string_append_printf (string, "Content-Encoding: %s\r\n", self->content_encoding);
+      seen |= HEADER_CONTENT_ENCODING;
+    }
+
   if (status != 304)
     {
       if (length < 0 || seen & HEADER_CONTENT_ENCODING || self->filters)
@@ -842,18 +1027,30 @@ finish_headers (CockpitWebResponse *self,
         }
     }
 
-  if ((seen & HEADER_CACHE_CONTROL) == 0 && status >= 200 && status <= 299)
+  /* A 304 has to repeat these, or the browser forgets them */
+  if ((seen & HEADER_CACHE_CONTROL) == 0 && ((status >= 200 && status <= 299) || status == 304))
     {
       if (self->cache_type == COCKPIT_WEB_RESPONSE_NO_CACHE)
         g_string_append (string, "Cache-Control: no-cache, no-store\r\n");
       else if (self->cache_type == COCKPIT_WEB_RESPONSE_CACHE)
         g_string_append (string, "Cache-Control: max-age=86400, private\r\n");
+      else if (self->cache_type == COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE)
+        g_string_append (string, "Cache-Control: no-cache\r\n");
+      else if (self->cache_type == COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE)
+        g_string_append (string, "Cache-Control: max-age=31536000, private, immutable\r\n");
     }
 
-  if ((seen & HEADER_VARY) == 0 && status >= 200 && status <= 299 &&
-      self->cache_type == COCKPIT_WEB_RESPONSE_CACHE)
+  if ((seen & HEADER_VARY) == 0 && ((status >= 200 && status <= 299) || status == 304))
     {
-      g_string_append (string, "Vary: Cookie\r\n");
+      gboolean cookie = (self->cache_type == COCKPIT_WEB_RESPONSE_CACHE ||
+                         self->cache_type == COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE);
+
+      if (cookie && self->vary_encoding)
+        g_string_append (string, "Vary: Cookie, Accept-Encoding\r\n");
+      else if (cookie)
+        g_string_append (string, "Vary: Cookie\r\n");
+      else if (self->vary_encoding)
+        g_string_append (string, "Vary: Accept-Encoding\r\n");
     }
 
   if (!self->keep_alive)
@@ -883,6 +1080,11 @@ finish_headers (CockpitWebResponse *self,
  * @self: the response
  * @cache_type: Ensures the appropriate cache headers are returned for
    the given cache type.
+ *
+ * With %COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE the browser keeps files
+ * but asks each time whether they changed, which cockpit_web_response_file()
+ * answers with a 304 when they didn't.  %COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE
+ * is only for content that can never change under the same URL.
  */
 void
 cockpit_web_response_set_cache_type (CockpitWebResponse *self,
@@ -891,6 +1093,162 @@ cockpit_web_response_set_cache_type (CockpitWebResponse *self,
   self->cache_type = cache_type;
 }
 
+/**
+ * cockpit_web_response_set_vary_encoding:
+ * @self: the response
+ * @vary: whether the content depends on Accept-Encoding
+ *
+ * Call this when another Accept-Encoding could have gotten a
+ * different representation, so that caches don't mix them up.
+ * This adds Accept-Encoding to the Vary header.
+ */
+void
+cockpit_web_response_set_vary_encoding (CockpitWebResponse *self,
+                                        gboolean vary)
+{
+  self->vary_encoding = vary;
+}
+
+/**
+ * cockpit_web_response_compress:
+ * @self: the response
+ * @status: the HTTP status code that will be sent
+ * @content_type: the Content-Type that will be sent, or %NULL to guess from the path
+ * @length: the length of the content, or -1 if not known
+ *
+ * Compress the content of the response on the fly, if the client
+ * accepts gzip and the content is worth it. See
+ * cockpit_web_compress_set_level() and cockpit_web_compress_set_minimum().
+ *
+ * This must be called before the headers are queued, and after
+ * any other filters have been added. Don't call it for content that
+ * already has a Content-Encoding.
+ *
+ * Content that would be compressed for clients which accept gzip gets
+ * Accept-Encoding in its Vary header, whether this one does or not.
+ *
+ * Returns: Whether the response will be compressed
+ */
+gboolean
+cockpit_web_response_compress (CockpitWebResponse *self,
+                               guint status,
+                               const gchar *content_type,
+                               gssize length)
+{
+  const gchar *gzip[] = { "gzip", NULL };
+  g_auto(GStrv) accepted = NULL;
+  g_autoptr(CockpitWebFilter) filter = NULL;
+  gint level;
+
+  g_return_val_if_fail (COCKPIT_IS_WEB_RESPONSE (self), FALSE);
+  g_return_val_if_fail (self->count == 0, FALSE);
+
+  level = cockpit_web_compress_get_level ();
+  if (level == 0 || self->content_encoding)
+    return FALSE;
+
+  /* No body, or a range of the identity content */
+  if (status < 200 || status > 299 || status == 204 || status == 206)
+    return FALSE;
+
+  if (length >= 0 && (gsize) length < cockpit_web_compress_get_minimum ())
+    return FALSE;
+
+  if (content_type == NULL && self->full_path)
+    content_type = cockpit_web_response_content_type (self->full_path);
+  if (!cockpit_web_compress_is_compressible (content_type))
+    return FALSE;
+
+  /* From here on, it only depends on what the client accepts */
+  self->vary_encoding = TRUE;
+
+  /* Clients which don't send Accept-Encoding don't get gzip unasked */
+  if (self->accept_encoding == NULL)
+    return FALSE;
+  accepted = cockpit_web_server_parse_accept_encoding (self->accept_encoding, gzip);
+  if (accepted[0] == NULL)
+    return FALSE;
+
+  filter = cockpit_web_compress_new (level);
+  cockpit_web_response_add_filter (self, filter);
+  self->content_encoding = "gzip";
+  return TRUE;
+}
+
+/**
+ * cockpit_web_response_negotiate_range:
+ * @self: the response
+ * @size: the size of the whole content
+ * @etag: the ETag of the content, or %NULL if it has none
+ * @out_offset: location for the start of the part to send
+ * @out_length: location for the length of the part to send
+ * @out_content_range: (transfer full): location for the Content-Range header
+ *
+ * Looks at the Range and If-Range headers of a GET request, and works
+ * out which part of the content to send. An If-Range only matches
+ * @etag; dates are not supported, so the whole content is sent then.
+ *
+ * The caller should send @out_content_range as the Content-Range
+ * header, when it is set, with the returned status.
+ *
+ * Returns: 206 if only a part should be sent, 416 if the range can't
+ *          be satisfied, or 200 for the whole content
+ */
+guint
+cockpit_web_response_negotiate_range (CockpitWebResponse *self,
+                                      gsize size,
+                                      const gchar *etag,
+                                      gsize *out_offset,
+                                      gsize *out_length,
+                                      gchar **out_content_range)
+{
+  gint64 first;
+  gint64 last;
+
+  g_return_val_if_fail (COCKPIT_IS_WEB_RESPONSE (self), 200);
+
+  *out_offset = 0;
+  *out_length = size;
+  *out_content_range = NULL;
+
+  if (self->range == NULL || !g_str_equal (self->method, "GET"))
+    return 200;
+
+  /* Weak ETags can't be used for ranges */
+  if (self->if_range && (etag == NULL || g_str_has_prefix (etag, "W/") ||
+                         !g_str_equal (self->if_range, etag)))
+    return 200;
+
+  if (!cockpit_web_server_parse_range (self->range, &first, &last))
+    return 200;
+
+  if (first < 0)
+    {
+      /* The last bytes of the content */
+      if (last == 0 || size == 0)
+        goto unsatisfiable;
+      first = (guint64) last < size ? size - last : 0;
+      last = size - 1;
+    }
+  else
+    {
+      if ((guint64) first >= size)
+        goto unsatisfiable;
+      if (last < 0 || (guint64) last >= size)
+        last = size - 1;
+    }
+
+  *out_offset = first;
+  *out_length = last - first + 1;
+  *out_content_range = g_strdup_printf ("bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "/%" G_GSIZE_FORMAT,
+                                        first, last, size);
+  return 206;
+
+unsatisfiable:
+  *out_content_range = g_strdup_printf ("bytes */%" G_GSIZE_FORMAT, size);
+  return 416;
+}
+
 /**
  * cockpit_web_response_headers:
  * @self: the response
@@ -1281,12 +1639,90 @@ cockpit_web_response_resolve_roots (const gchar **input)
   return (gchar **)g_ptr_array_free (roots, FALSE);
 }
 
+/**
+ * cockpit_web_response_encodings:
+ *
+ * The content codings of precompressed files that we look for, in our
+ * order of preference: brotli and zstd usually beat gzip.  Pass this to
+ * cockpit_web_request_get_accepted_encodings().
+ */
+const gchar * const cockpit_web_response_encodings[] = { "br", "zstd", "gzip", NULL };
+
+static const struct {
+  const gchar *name;
+  const gchar *suffix;
+} content_encodings[] = {
+  { "br", ".br" },
+  { "zstd", ".zst" },
+  { "gzip", ".gz" },
+};
+
+static gint
+find_content_encoding (const gchar *name)
+{
+  for (gint i = 0; i < G_N_ELEMENTS (content_encodings); i++)
+    {
+      if (g_str_equal (content_encodings[i].name, name))
+        return i;
+    }
+
+  return -1;
+}
+
+static gboolean
+etag_list_matches (const gchar *list,
+                   const gchar *etag)
+{
+  g_auto(GStrv) tags = g_strsplit (list, ",", -1);
+
+  /* If-None-Match uses the weak comparison */
+  if (g_str_has_prefix (etag, "W/"))
+    etag += 2;
+
+  for (gint i = 0; tags[i]; i++)
+    {
+      const gchar *tag = g_strstrip (tags[i]);
+      if (g_str_equal (tag, "*"))
+        return TRUE;
+      if (g_str_has_prefix (tag, "W/"))
+        tag += 2;
+      if (g_str_equal (tag, etag))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * Whether a request for a file with these validators can be answered
+ * with a 304. An If-None-Match wins over If-Modified-Since, since
+ * the ETag also changes when a file is replaced by an older one.
+ */
+static gboolean
+is_not_modified (CockpitWebResponse *self,
+                 const gchar *etag,
+                 gint64 mtime)
+{
+  gint64 since;
+
+  if (g_strcmp0 (self->method, "GET") != 0 && g_strcmp0 (self->method, "HEAD") != 0)
+    return FALSE;
+
+  if (self->if_none_match)
+    return etag != NULL && etag_list_matches (self->if_none_match, etag);
+
+  if (cockpit_web_server_parse_http_date (self->if_modified_since, &since))
+    return mtime <= since;
+
+  return FALSE;
+}
+
 static void
 web_response_file (CockpitWebResponse *response,
                    const gchar *escaped,
                    const gchar **roots,
                    gboolean search_gzip,
-                   gboolean accept_gzip,
+                   const gchar * const *encodings,
                    CockpitTemplateFunc template_func,
                    gpointer user_data)
 {
@@ -1306,14 +1742,20 @@ web_response_file (CockpitWebResponse *response,
       return;
     }
 
-  gboolean is_gzip = FALSE;
-  g_autoptr(GMappedFile) file = NULL;
+  const gchar *encoding = NULL;
+  gboolean decompress = FALSE;
+  g_autoptr(CockpitWebCacheEntry) file = NULL;
+
+  /* Whether a precompressed variant gets picked depends on Accept-Encoding */
+  if (search_gzip)
+    response->vary_encoding = TRUE;
+
   for (gint i = 0; roots[i]; i++)
     {
       const gchar *root = roots[i];
       g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
 
-      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+      if (cockpit_web_cache_is_directory (path))
         {
           cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
           return;
@@ -1322,8 +1764,27 @@ web_response_file (CockpitWebResponse *response,
       /* As a double check of above behavior */
       g_assert (path_has_prefix (path, root));
 
+      /* Precompressed variants which the client accepts come first */
+      for (gint j = 0; encodings && encodings[j]; j++)
+        {
+          gint e = find_content_encoding (encodings[j]);
+          if (e < 0)
+            continue;
+
+          g_autofree gchar *encoded_path = g_strconcat (path, content_encodings[e].suffix, NULL);
+          file = cockpit_web_cache_lookup (encoded_path, NULL);
+          if (file != NULL)
+            {
+              encoding = content_encodings[e].name;
+              break;
+            }
+        }
+
+      if (file != NULL)
+        break;
+
       g_autoptr(GError) error = NULL;
-      file = g_mapped_file_new (path, FALSE, &error);
+      file = cockpit_web_cache_lookup (path, &error);
 
       if (file == NULL && search_gzip &&
           g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
@@ -1332,8 +1793,10 @@ web_response_file (CockpitWebResponse *response,
           g_clear_error (&error);
           g_autofree gchar *old_path = g_steal_pointer (&path);
           path = g_strconcat (old_path, ".gz", NULL);
-          file = g_mapped_file_new (path, FALSE, &error);
-          is_gzip = file != NULL;
+          file = cockpit_web_cache_lookup (path, &error);
+
+          /* if the client accepted gzip, we'd have found it above */
+          decompress = file != NULL;
         }
 
       if (file != NULL)
@@ -1365,40 +1828,100 @@ web_response_file (CockpitWebResponse *response,
       return;
     }
 
-  g_autoptr(GBytes) body = g_mapped_file_get_bytes (file);
+  g_autoptr(GBytes) body = NULL;
 
-  if (is_gzip && (!accept_gzip || template_func))
+  if (decompress)
     {
-      /* We have gzipped content, but the client won't accept it, or
-       * template expansion was requested.  Decompress.
-       */
+      /* We only have gzipped content, but the client won't accept it */
       g_autoptr(GError) error = NULL;
-      g_autoptr(GBytes) body_gz = g_steal_pointer (&body);
-      body = cockpit_web_response_gunzip (body_gz, &error);
+      body = cockpit_web_cache_entry_get_identity (file, &error);
       if (body == NULL)
         {
           g_warning ("%s", error->message);
           cockpit_web_response_error (response, 500, NULL, "Internal server error");
           return;
         }
-      is_gzip = FALSE;
     }
+  else
+    {
+      body = g_bytes_ref (cockpit_web_cache_entry_get_body (file));
+    }
+
+  /* Templates expand differently depending on the values, so they have no validators */
+  const gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+  if (!template_func)
+    {
+      /* The ETag of the .gz file doesn't describe its decompressed content */
+      if (!decompress)
+        etag = cockpit_web_cache_entry_get_etag (file);
+      last_modified = cockpit_web_server_format_http_date (cockpit_web_cache_entry_get_mtime (file));
 
-  GList *output;
+      if (is_not_modified (response, etag, cockpit_web_cache_entry_get_mtime (file)))
+        {
+          cockpit_web_response_headers (response, 304, "Not Modified", 0,
+                                        "ETag", etag,
+                                        "Last-Modified", last_modified,
+                                        NULL);
+          cockpit_web_response_complete (response);
+          return;
+        }
+    }
+
+  GList *output = NULL;
   gint content_length = -1;
+  gboolean send_file = FALSE;
+  guint status = 200;
+  gsize offset = 0;
+  gsize length = 0;
+  g_autofree gchar *content_range = NULL;
   if (template_func)
     {
-      output = cockpit_template_expand (body, "${", "}", template_func, user_data);
+      /* Compiled once per file, and a single block goes out */
+      g_autoptr(CockpitTemplate) template = NULL;
+      if (decompress)
+        template = cockpit_template_compile (body, "${", "}");
+      else
+        template = cockpit_web_cache_entry_get_template (file, "${", "}");
+
+      GBytes *expanded = cockpit_template_render_bytes (template, template_func, user_data);
+      content_length = g_bytes_get_size (expanded);
+      output = g_list_prepend (NULL, expanded);
     }
   else
     {
-      output = g_list_prepend (NULL, g_bytes_ref (body));
-      content_length = g_bytes_get_size (body);
+      status = cockpit_web_response_negotiate_range (response, g_bytes_get_size (body), etag,
+                                                     &offset, &length, &content_range);
+      if (status == 416)
+        {
+          cockpit_web_response_headers (response, 416, "Range Not Satisfiable", 0,
+                                        "Content-Range", content_range, NULL);
+          cockpit_web_response_complete (response);
+          return;
+        }
+
+      content_length = length;
+
+      /*
+       * Let the kernel copy the file straight to the socket if we can.
+       * A Content-Encoding makes the response chunked, and sendfile()
+       * can't add the chunk framing.
+       */
+      send_file = !decompress && !encoding && can_send_file (response, file);
+      if (!send_file)
+        output = g_list_prepend (NULL, g_bytes_new_from_bytes (body, offset, length));
     }
 
-  GString *string = begin_headers (response, 200, "OK");
+  GString *string = begin_headers (response, status, status == 206 ? "Partial Content" : "OK");
   guint seen = 0;
 
+  if (!template_func)
+    seen |= append_header (string, "Accept-Ranges", "bytes");
+  seen |= append_header (string, "ETag", etag);
+  seen |= append_header (string, "Last-Modified", last_modified);
+  if (content_range)
+    seen |= append_header (string, "Content-Range", content_range);
+
   if (response->origin)
     seen |= append_header (string, "Access-Control-Allow-Origin", response->origin);
 
@@ -1414,12 +1937,15 @@ web_response_file (CockpitWebResponse *response,
       seen |= append_header (string, "Content-Security-Policy", policy);
     }
 
-  if (is_gzip)
-    seen |= append_header (string, "Content-Encoding", "gzip");
+  if (encoding)
+    seen |= append_header (string, "Content-Encoding", encoding);
 
-  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, 200, seen);
+  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, status, seen);
   queue_bytes (response, headers_block);
 
+  if (send_file)
+    queue_file (response, file, offset, length);
+
   GList *l;
   for (l = output; l != NULL; l = g_list_next (l))
     {
@@ -1445,7 +1971,7 @@ cockpit_web_response_file (CockpitWebResponse *response,
                            const gchar *escaped,
                            const gchar **roots)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, NULL, NULL);
+  web_response_file (response, escaped, roots, FALSE, NULL, NULL, NULL);
 }
 
 void
@@ -1454,7 +1980,7 @@ cockpit_web_response_template (CockpitWebResponse *response,
                                    const gchar **roots,
                                    GHashTable *values)
 {
-  web_response_file (response, escaped, roots, FALSE, FALSE, substitute_hash_value, values);
+  web_response_file (response, escaped, roots, FALSE, NULL, substitute_hash_value, values);
 }
 
 void
@@ -1463,7 +1989,31 @@ cockpit_web_response_file_or_gz (CockpitWebResponse *response,
                                  const gchar *escaped,
                                  const gchar **roots)
 {
-  web_response_file (response, escaped, roots, TRUE, accepts_gzip, NULL, NULL);
+  const gchar *encodings[] = { accepts_gzip ? "gzip" : NULL, NULL };
+  web_response_file (response, escaped, roots, TRUE, encodings, NULL, NULL);
+}
+
+/**
+ * cockpit_web_response_file_encoded:
+ * @response: the response
+ * @encodings: content codings that the client accepts, best first
+ * @escaped: escaped path, or NULL to get from response
+ * @roots: directories to look for file in
+ *
+ * Serve a file from disk as an HTTP response, preferring precompressed
+ * variants of it (with a .br, .zst or .gz suffix) in the order of
+ * @encodings.  If there's only a .gz variant and the client doesn't
+ * accept gzip, it gets decompressed.  Get @encodings from
+ * cockpit_web_request_get_accepted_encodings() with
+ * cockpit_web_response_encodings.
+ */
+void
+cockpit_web_response_file_encoded (CockpitWebResponse *response,
+                                   const gchar * const *encodings,
+                                   const gchar *escaped,
+                                   const gchar **roots)
+{
+  web_response_file (response, escaped, roots, TRUE, encodings, NULL, NULL);
 }
 
 static gboolean
@@ -1614,11 +2164,11 @@ load_file (const gchar *filename,
 {
   GError *local_error = NULL;
 
-  g_autoptr(GMappedFile) mapped = g_mapped_file_new (filename, FALSE, &local_error);
+  g_autoptr(CockpitWebCacheEntry) entry = cockpit_web_cache_lookup (filename, &local_error);
 
-  if (mapped)
+  if (entry)
     /* success! */
-    return g_mapped_file_get_bytes (mapped);
+    return g_bytes_ref (cockpit_web_cache_entry_get_body (entry));
 
   if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
       g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_ISDIR) ||
@@ -1638,6 +2188,68 @@ load_file (const gchar *filename,
   return NULL;
 }
 
+typedef struct {
+  gchar *name;
+  gboolean is_language_specific;
+  const gchar *encoding;
+} Variant;
+
+static void
+variant_clear (gpointer data)
+{
+  Variant *variant = data;
+  g_free (variant->name);
+}
+
+/* Precompressed variants which the client accepts come first, then the
+ * uncompressed ones, and then .gz files which the caller has to
+ * decompress.
+ */
+static void
+add_variants (GArray *variants,
+              const gchar * const *stems,
+              gboolean is_language_specific,
+              const gchar * const *encodings)
+{
+  Variant variant = { .is_language_specific = is_language_specific };
+  gboolean accepts_gzip = FALSE;
+  gint i, j;
+
+  for (i = 0; encodings && encodings[i]; i++)
+    {
+      gint e = find_content_encoding (encodings[i]);
+      if (e < 0)
+        continue;
+
+      if (g_str_equal (content_encodings[e].name, "gzip"))
+        accepts_gzip = TRUE;
+
+      variant.encoding = content_encodings[e].name;
+      for (j = 0; stems[j]; j++)
+        {
+          variant.name = g_strconcat (stems[j], content_encodings[e].suffix, NULL);
+          g_array_append_val (variants, variant);
+        }
+    }
+
+  variant.encoding = NULL;
+  for (j = 0; stems[j]; j++)
+    {
+      variant.name = g_strdup (stems[j]);
+      g_array_append_val (variants, variant);
+    }
+
+  if (!accepts_gzip)
+    {
+      variant.encoding = "gzip";
+      for (j = 0; stems[j]; j++)
+        {
+          variant.name = g_strconcat (stems[j], ".gz", NULL);
+          g_array_append_val (variants, variant);
+        }
+    }
+}
+
 /**
  * cockpit_web_response_negotiation:
  * @path: likely filesystem path
@@ -1662,20 +2274,54 @@ cockpit_web_response_negotiation (const gchar *path,
                                   gboolean *out_is_language_specific,
                                   gboolean *out_is_compressed,
                                   GError **error)
+{
+  const gchar *encoding = NULL;
+  GBytes *bytes;
+
+  bytes = cockpit_web_response_negotiation_encoded (path, existing, language, NULL,
+                                                    out_is_language_specific, &encoding, error);
+  if (bytes && out_is_compressed)
+    *out_is_compressed = encoding != NULL;
+
+  return bytes;
+}
+
+/**
+ * cockpit_web_response_negotiation_encoded:
+ * @path: likely filesystem path
+ * @existing: a table of existing files
+ * @language: requested client language
+ * @encodings: content codings that the client accepts, best first
+ * @out_is_language_specific: a pointer to a gboolean whether the actual file is specific to @language
+ * @out_encoding: a pointer to the content coding of the actual file, or %NULL
+ * @error: a failure
+ *
+ * Like cockpit_web_response_negotiation(), but this also looks for
+ * files with the suffixes of @encodings (.br, .zst, .gz), and prefers
+ * those.  The result can still be gzipped when the client doesn't
+ * accept gzip, if that's the only variant we have.
+ */
+GBytes *
+cockpit_web_response_negotiation_encoded (const gchar *path,
+                                          GHashTable *existing,
+                                          const gchar *language,
+                                          const gchar * const *encodings,
+                                          gboolean *out_is_language_specific,
+                                          const gchar **out_encoding,
+                                          GError **error)
 {
   gchar *base = NULL;
   const gchar *ext;
   gchar *dot;
-  gchar *name = NULL;
   GBytes *bytes = NULL;
   GError *local_error = NULL;
   gchar *locale = NULL;
   gchar *shorter = NULL;
   gchar *lang = NULL;
   gchar *lang_region = NULL;
-  gboolean is_language_specific, is_compressed;
-
-  gint i;
+  Variant *found = NULL;
+  GArray *variants;
+  guint i;
 
   if (language)
       locale = cockpit_locale_from_language (language, NULL, &shorter);
@@ -1691,6 +2337,19 @@ cockpit_web_response_negotiation (const gchar *path,
       base = g_strdup (path);
     }
 
+  if (locale && shorter && g_strcmp0 (locale, shorter) != 0)
+    {
+      lang = shorter;
+      lang_region = locale;
+    }
+  else if (locale)
+    {
+      lang = locale;
+    }
+
+  variants = g_array_new (FALSE, FALSE, sizeof (Variant));
+  g_array_set_clear_func (variants, variant_clear);
+
   while (!bytes)
     {
       /* For a request for a file named "base.ext" and locale "lang_REGION", We try the following variants, in
@@ -1708,84 +2367,58 @@ cockpit_web_response_negotiation (const gchar *path,
          If no locale is requested, or a locale without region, those variants are left out by starting
          further down in the list.
 
+         Before each group of these, the variants in the @encodings that the client accepts are tried,
+         for example base.ext.br and base.min.ext.br.  If gzip is one of them, it moves up like that.
+
          If none of the variants are found, and the base of the file name has internal dots, these internal
          extensions are dropped one by one from the right.  For example, for a file named "foo.bar.js", we
          first try "foo.bar" with extension ".js", and then "foo" with extension ".js".
       */
 
-      if (locale && shorter && g_strcmp0 (locale, shorter) != 0) {
-        lang = shorter;
-        lang_region = locale;
-        i = 0;
-      } else if (locale) {
-        lang = locale;
-        i = 2;
-      } else {
-        i = 4;
-      }
-
-      for (; i < 8; i++)
+      g_array_set_size (variants, 0);
+
+      if (lang_region)
         {
-          g_free (name);
-          switch (i)
-            {
-            case 0:
-              name = g_strconcat (base, ".", lang_region, ext, NULL);
-              is_language_specific = TRUE;
-              is_compressed = FALSE;
-              break;
-            case 1:
-              name = g_strconcat (base, ".", lang_region, ext, ".gz", NULL);
-              is_language_specific = TRUE;
-              is_compressed = TRUE;
-              break;
-            case 2:
-              name = g_strconcat (base, ".", lang, ext, NULL);
-              is_language_specific = TRUE;
-              is_compressed = FALSE;
-              break;
-            case 3:
-              name = g_strconcat (base, ".", lang, ext, ".gz", NULL);
-              is_language_specific = TRUE;
-              is_compressed = TRUE;
-              break;
-            case 4:
-              name = g_strconcat (base, ext, NULL);
-              is_language_specific = FALSE;
-              is_compressed = FALSE;
-              break;
-            case 5:
-              name = g_strconcat (base, ".min", ext, NULL);
-              is_language_specific = FALSE;
-              is_compressed = FALSE;
-              break;
-            case 6:
-              name = g_strconcat (base, ext, ".gz", NULL);
-              is_language_specific = FALSE;
-              is_compressed = TRUE;
-              break;
-            case 7:
-              name = g_strconcat (base, ".min", ext, ".gz", NULL);
-              is_language_specific = FALSE;
-              is_compressed = TRUE;
-              break;
-            default:
-              g_assert_not_reached ();
-            }
+          g_autofree gchar *name = g_strconcat (base, ".", lang_region, ext, NULL);
+          const gchar *stems[] = { name, NULL };
+          add_variants (variants, stems, TRUE, encodings);
+        }
+
+      if (lang)
+        {
+          g_autofree gchar *name = g_strconcat (base, ".", lang, ext, NULL);
+          const gchar *stems[] = { name, NULL };
+          add_variants (variants, stems, TRUE, encodings);
+        }
+
+      g_autofree gchar *name = g_strconcat (base, ext, NULL);
+      g_autofree gchar *minified = g_strconcat (base, ".min", ext, NULL);
+      const gchar *stems[] = { name, minified, NULL };
+      add_variants (variants, stems, FALSE, encodings);
+
+      for (i = 0; i < variants->len; i++)
+        {
+          Variant *variant = &g_array_index (variants, Variant, i);
 
           if (existing)
             {
-              if (!g_hash_table_lookup (existing, name))
+              if (!g_hash_table_lookup (existing, variant->name))
                 continue;
             }
 
-          bytes = load_file (name, &local_error);
+          bytes = load_file (variant->name, &local_error);
           if (bytes)
-            break;
+            {
+              found = variant;
+              break;
+            }
           if (local_error)
             goto out;
         }
 
+      if (bytes)
+        break;
+
       /* Pop one level off the file name */
       dot = (gchar *)find_extension (base);
       if (!dot)
@@ -1800,11 +2433,11 @@ out:
   if (bytes)
     {
       if (out_is_language_specific)
-        *out_is_language_specific = is_language_specific;
-      if (out_is_compressed)
-        *out_is_compressed = is_compressed;
+        *out_is_language_specific = found->is_language_specific;
+      if (out_encoding)
+        *out_encoding = found->encoding;
     }
-  g_free (name);
+  g_array_free (variants, TRUE);
   g_free (base);
   g_free (locale);
   g_free (shorter);
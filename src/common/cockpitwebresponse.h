@@ -42,6 +42,8 @@ typedef enum {
   COCKPIT_WEB_RESPONSE_CACHE_UNSET,
   COCKPIT_WEB_RESPONSE_NO_CACHE,
   COCKPIT_WEB_RESPONSE_CACHE,
+  COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE,
+  COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE,
 } CockpitCacheType;
 
 #define COCKPIT_CHECKSUM_HEADER "X-Cockpit-Pkg-Checksum"
@@ -50,6 +52,8 @@ typedef struct _CockpitWebResponse        CockpitWebResponse;
 
 extern const gchar *  cockpit_web_exception_escape_root;
 
+extern const gchar * const cockpit_web_response_encodings[];
+
 CockpitWebResponse *  cockpit_web_response_new           (GIOStream *io,
                                                           const gchar *original_path,
                                                           const gchar *path,
@@ -57,6 +61,16 @@ CockpitWebResponse *  cockpit_web_response_new           (GIOStream *io,
                                                           const gchar *method,
                                                           const gchar *protocol);
 
+typedef const gchar * (* CockpitWebHeaderLookup)         (gpointer source,
+                                                          const gchar *name);
+
+CockpitWebResponse *  cockpit_web_response_new_with_lookup (GIOStream *io,
+                                                            const gchar *original_path,
+                                                            const gchar *path,
+                                                            CockpitWebHeaderLookup lookup,
+                                                            gpointer source,
+                                                            const gchar *method,
+                                                            const gchar *protocol);
 
 const gchar *         cockpit_web_response_get_path      (CockpitWebResponse *self);
 
@@ -71,6 +85,18 @@ gchar *               cockpit_web_response_pop_path      (CockpitWebResponse *se
 void                  cockpit_web_response_add_filter    (CockpitWebResponse *self,
                                                           CockpitWebFilter *filter);
 
+gboolean              cockpit_web_response_compress      (CockpitWebResponse *self,
+                                                          guint status,
+                                                          const gchar *content_type,
+                                                          gssize length);
+
+guint                 cockpit_web_response_negotiate_range (CockpitWebResponse *self,
+                                                            gsize size,
+                                                            const gchar *etag,
+                                                            gsize *out_offset,
+                                                            gsize *out_length,
+                                                            gchar **out_content_range);
+
 void                  cockpit_web_response_headers       (CockpitWebResponse *self,
                                                           guint status,
                                                           const gchar *reason,
@@ -122,6 +148,11 @@ void                  cockpit_web_response_file_or_gz    (CockpitWebResponse *re
                                                           const gchar *escaped,
                                                           const gchar **roots);
 
+void                  cockpit_web_response_file_encoded  (CockpitWebResponse *response,
+                                                          const gchar * const *encodings,
+                                                          const gchar *escaped,
+                                                          const gchar **roots);
+
 GBytes *              cockpit_web_response_gunzip        (GBytes *bytes,
                                                           GError **error);
 
@@ -132,6 +163,14 @@ GBytes *              cockpit_web_response_negotiation   (const gchar *path,
                                                           gboolean *out_is_compressed,
                                                           GError **error);
 
+GBytes *              cockpit_web_response_negotiation_encoded (const gchar *path,
+                                                                GHashTable *existing,
+                                                                const gchar *language,
+                                                                const gchar * const *encodings,
+                                                                gboolean *out_is_language_specific,
+                                                                const gchar **out_encoding,
+                                                                GError **error);
+
 const gchar *         cockpit_web_response_content_type  (const gchar *path);
 
 gboolean     cockpit_web_should_suppress_output_error    (const gchar *logname,
@@ -144,6 +183,9 @@ gboolean     cockpit_web_response_is_header_value        (const gchar *string);
 void         cockpit_web_response_set_cache_type         (CockpitWebResponse *self,
                                                           CockpitCacheType cache_type);
 
+void         cockpit_web_response_set_vary_encoding      (CockpitWebResponse *self,
+                                                          gboolean vary);
+
 const gchar *  cockpit_web_response_get_url_root         (CockpitWebResponse *response);
 
 const gchar *  cockpit_web_response_get_origin           (CockpitWebResponse *response);
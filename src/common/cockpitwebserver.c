@@ -316,17 +316,20 @@ cockpit_web_server_default_handle_stream (CockpitWebServer *self,
       detail = g_quark_try_string (buffer);
     }
 
-  /* See if we have any takers... */
-  g_signal_emit (self,
-                 sig_handle_resource, detail,
-                 request,
-                 request->path,
-                 request->headers,
-                 response,
-                 &claimed);
+  /* See if we have any takers... only they need the table of headers */
+  if (g_signal_has_handler_pending (self, sig_handle_resource, detail, FALSE))
+    {
+      g_signal_emit (self,
+                     sig_handle_resource, detail,
+                     request,
+                     request->path,
+                     cockpit_web_request_get_headers (request),
+                     response,
+                     &claimed);
+    }
 
   if (!claimed)
-    claimed = cockpit_web_server_default_handle_resource (self, request, request->path, request->headers, response);
+    claimed = cockpit_web_server_default_handle_resource (self, request, request->path, NULL, response);
 
   /* TODO: Here is where we would plug keep-alive into response */
   g_object_unref (response);
@@ -421,11 +424,10 @@ cockpit_web_server_new_table (void)
   return g_hash_table_new_full (cockpit_str_case_hash, cockpit_str_case_equal, g_free, g_free);
 }
 
-gchar *
-cockpit_web_server_parse_cookie (GHashTable *headers,
-                                 const gchar *name)
+static gchar *
+parse_cookie (const gchar *header,
+              const gchar *name)
 {
-  const gchar *header;
   const gchar *pos;
   const gchar *value;
   const gchar *end;
@@ -434,7 +436,6 @@ cockpit_web_server_parse_cookie (GHashTable *headers,
   gint diff;
   gint offset;
 
-  header = g_hash_table_lookup (headers, "Cookie");
   if (!header)
     return NULL;
 
@@ -482,6 +483,13 @@ cockpit_web_server_parse_cookie (GHashTable *headers,
     }
 }
 
+gchar *
+cockpit_web_server_parse_cookie (GHashTable *headers,
+                                 const gchar *name)
+{
+  return parse_cookie (g_hash_table_lookup (headers, "Cookie"), name);
+}
+
 typedef struct {
   double qvalue;
   const gchar *value;
@@ -588,14 +596,353 @@ cockpit_web_server_parse_accept_list (const gchar *accept,
   return (gchar **)g_ptr_array_free (ret, FALSE);
 }
 
+typedef struct {
+  double qvalue;
+  guint index;
+  const gchar *value;
+} Encoding;
+
+static gint
+sort_encoding (gconstpointer a,
+               gconstpointer b)
+{
+  const Encoding *ea = a;
+  const Encoding *eb = b;
+  if (ea->qvalue != eb->qvalue)
+    return eb->qvalue < ea->qvalue ? -1 : 1;
+  return (gint) ea->index - (gint) eb->index;
+}
+
+/**
+ * cockpit_web_server_parse_accept_encoding:
+ * @accept: value of the Accept-Encoding header, or %NULL
+ * @supported: the content codings that we have, in our order of preference
+ *
+ * Returns the codings in @supported which the client accepts, best
+ * first.  These are ordered by the client's q-values, and by our order
+ * where those are equal (as browsers don't rank their codings).  A
+ * missing header means that anything goes.
+ *
+ * Returns: (transfer full): a %NULL terminated array of codings
+ */
+gchar **
+cockpit_web_server_parse_accept_encoding (const gchar *accept,
+                                          const gchar * const *supported)
+{
+  g_auto(GStrv) items = NULL;
+  GArray *accepted;
+  GPtrArray *ret;
+  guint i, j;
+
+  if (accept == NULL)
+    return g_strdupv ((gchar **) supported);
+
+  items = g_strsplit (accept, ",", -1);
+
+  /* Each of these lists only has a handful of entries */
+  accepted = g_array_new (FALSE, FALSE, sizeof (Encoding));
+  for (i = 0; supported[i]; i++)
+    {
+      double qvalue = 0;
+      gboolean exact = FALSE;
+
+      for (j = 0; items[j]; j++)
+        {
+          g_auto(GStrv) params = g_strsplit (items[j], ";", -1);
+          const gchar *coding = g_strstrip (params[0]);
+          double q = 1;
+
+          if (g_ascii_strcasecmp (coding, supported[i]) == 0)
+            exact = TRUE;
+          else if (!g_str_equal (coding, "*"))
+            continue;
+
+          for (guint k = 1; params[k]; k++)
+            {
+              const gchar *param = g_strstrip (params[k]);
+              if (g_ascii_strncasecmp (param, "q=", 2) == 0)
+                q = CLAMP (g_ascii_strtod (param + 2, NULL), 0, 1);
+            }
+
+          qvalue = q;
+          if (exact)
+            break;
+        }
+
+      if (qvalue > 0)
+        {
+          Encoding encoding = { .qvalue = qvalue, .index = i, .value = supported[i] };
+          g_array_append_val (accepted, encoding);
+        }
+    }
+
+  g_array_sort (accepted, sort_encoding);
+
+  ret = g_ptr_array_new ();
+  for (i = 0; i < accepted->len; i++)
+    g_ptr_array_add (ret, g_strdup (g_array_index (accepted, Encoding, i).value));
+  g_ptr_array_add (ret, NULL);
+  g_array_free (accepted, TRUE);
+  return (gchar **)g_ptr_array_free (ret, FALSE);
+}
+
+static gboolean
+parse_range_number (const gchar *string,
+                    gint64 *out)
+{
+  gchar *endptr = NULL;
+  guint64 value;
+
+  if (!g_ascii_isdigit (string[0]))
+    return FALSE;
+
+  value = g_ascii_strtoull (string, &endptr, 10);
+  if (*endptr != '\0' || value > G_MAXINT64)
+    return FALSE;
+
+  *out = value;
+  return TRUE;
+}
+
+/**
+ * cockpit_web_server_parse_range:
+ * @range: value of the Range header, or %NULL
+ * @out_first: location for the first byte
+ * @out_last: location for the last byte
+ *
+ * Parses a single byte range, like "bytes=100-199". For an open ended
+ * range like "bytes=100-" @out_last is set to -1. For a suffix range
+ * like "bytes=-500" @out_first is set to -1 and @out_last to the number
+ * of bytes at the end.
+ *
+ * Ranges we don't understand, including several ranges at once, should
+ * be ignored, and the whole content sent instead.
+ *
+ * Returns: whether @range was a valid single byte range
+ */
+gboolean
+cockpit_web_server_parse_range (const gchar *range,
+                                gint64 *out_first,
+                                gint64 *out_last)
+{
+  g_autofree gchar *spec = NULL;
+  gchar *dash;
+
+  if (range == NULL)
+    return FALSE;
+
+  while (g_ascii_isspace (*range))
+    range++;
+  if (g_ascii_strncasecmp (range, "bytes=", 6) != 0)
+    return FALSE;
+
+  spec = g_strstrip (g_strdup (range + 6));
+  dash = strchr (spec, '-');
+  if (dash == NULL || strchr (spec, ',') != NULL)
+    return FALSE;
+  *dash = '\0';
+
+  if (spec[0] == '\0')
+    {
+      *out_first = -1;
+      return parse_range_number (dash + 1, out_last);
+    }
+
+  if (!parse_range_number (spec, out_first))
+    return FALSE;
+
+  if (dash[1] == '\0')
+    {
+      *out_last = -1;
+      return TRUE;
+    }
+
+  return parse_range_number (dash + 1, out_last) && *out_last >= *out_first;
+}
+
+static const gchar *const http_days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+static const gchar *const http_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/**
+ * cockpit_web_server_format_http_date:
+ * @seconds: seconds since the epoch
+ *
+ * Formats a date for headers like Last-Modified, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT". This doesn't depend on the locale,
+ * unlike g_date_time_format().
+ *
+ * Returns: (transfer full): the date, or %NULL if out of range
+ */
+gchar *
+cockpit_web_server_format_http_date (gint64 seconds)
+{
+  g_autoptr(GDateTime) date = g_date_time_new_from_unix_utc (seconds);
+
+  if (date == NULL || g_date_time_get_year (date) > 9999)
+    return NULL;
+
+  return g_strdup_printf ("%s, %02d %s %04d %02d:%02d:%02d GMT",
+                          http_days[g_date_time_get_day_of_week (date) - 1],
+                          g_date_time_get_day_of_month (date),
+                          http_months[g_date_time_get_month (date) - 1],
+                          g_date_time_get_year (date),
+                          g_date_time_get_hour (date),
+                          g_date_time_get_minute (date),
+                          g_date_time_get_second (date));
+}
+
+/**
+ * cockpit_web_server_parse_http_date:
+ * @value: value of a header like If-Modified-Since, or %NULL
+ * @out_seconds: location for the seconds since the epoch
+ *
+ * Only the fixed format that cockpit_web_server_format_http_date()
+ * produces is understood. All browsers send that, and the obsolete
+ * formats should be ignored.
+ *
+ * Returns: whether @value was a valid date
+ */
+gboolean
+cockpit_web_server_parse_http_date (const gchar *value,
+                                    gint64 *out_seconds)
+{
+  gchar day[4];
+  gchar month[4];
+  gint mday, year, hour, minute, second;
+  gint consumed = 0;
+  gint i;
+
+  if (value == NULL)
+    return FALSE;
+
+  if (sscanf (value, " %3[A-Za-z], %2d %3[A-Za-z] %4d %2d:%2d:%2d GMT%n",
+              day, &mday, month, &year, &hour, &minute, &second, &consumed) != 7 ||
+      consumed == 0)
+    return FALSE;
+
+  while (g_ascii_isspace (value[consumed]))
+    consumed++;
+  if (value[consumed] != '\0')
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (http_months); i++)
+    {
+      if (g_str_equal (http_months[i], month))
+        break;
+    }
+  if (i == G_N_ELEMENTS (http_months))
+    return FALSE;
+
+  /* Leap seconds aren't a thing for file times */
+  if (year < 1 || mday < 1 || !g_date_valid_dmy (mday, i + 1, year) ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59)
+    return FALSE;
+
+  g_autoptr(GDateTime) date = g_date_time_new_utc (year, i + 1, mday, hour, minute, second);
+  if (date == NULL)
+    return FALSE;
+
+  *out_seconds = g_date_time_to_unix (date);
+  return TRUE;
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
+static GSocket *
+create_reuse_port_socket (GInetAddress *inet_address,
+                          guint16 port,
+                          GError **error)
+{
+  g_autoptr(GSocket) socket = g_socket_new (g_inet_address_get_family (inet_address),
+                                            G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, error);
+  if (socket == NULL)
+    return NULL;
+
+  if (!g_socket_set_option (socket, SOL_SOCKET, SO_REUSEPORT, 1, error))
+    return NULL;
+
+  g_autoptr(GSocketAddress) socket_address = g_inet_socket_address_new (inet_address, port);
+  if (!g_socket_bind (socket, socket_address, TRUE, error) ||
+      !g_socket_listen (socket, error))
+    return NULL;
+
+  return g_steal_pointer (&socket);
+}
+
+/*
+ * Like the g_socket_listener_add_*() family, but sets SO_REUSEPORT
+ * before binding, so that several cockpit-ws processes can listen on the
+ * same port and have the kernel spread incoming connections between
+ * them.  Without an address, we prefer a dual-stack IPv6 socket and fall
+ * back to IPv4 if that's not available.
+ */
+static guint16
+add_reuse_port_listener (CockpitWebServer *self,
+                         GInetAddress *inet_address,
+                         guint16 port,
+                         GError **error)
+{
+  g_autoptr(GSocket) socket = NULL;
+
+  if (inet_address != NULL)
+    {
+      socket = create_reuse_port_socket (inet_address, port, error);
+    }
+  else
+    {
+      g_autoptr(GInetAddress) any6 = g_inet_address_new_any (G_SOCKET_FAMILY_IPV6);
+      g_autoptr(GError) error6 = NULL;
+
+      socket = create_reuse_port_socket (any6, port, &error6);
+      if (socket == NULL)
+        {
+          g_autoptr(GInetAddress) any4 = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+          g_debug ("Couldn't listen on IPv6, falling back to IPv4: %s", error6->message);
+          socket = create_reuse_port_socket (any4, port, error);
+        }
+    }
+
+  if (socket == NULL)
+    return 0;
+
+  g_autoptr(GSocketAddress) local_address = g_socket_get_local_address (socket, error);
+  if (local_address == NULL)
+    return 0;
+
+  if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->socket_service), socket, NULL, error))
+    return 0;
+
+  port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (local_address));
+  g_assert (port != 0);
+
+  return port;
+}
+
 guint16
 cockpit_web_server_add_inet_listener (CockpitWebServer *self,
                                       const gchar *address,
                                       guint16 port,
                                       GError **error)
 {
+  if (self->flags & COCKPIT_WEB_SERVER_REUSE_PORT)
+    {
+      g_autoptr(GInetAddress) inet_address = NULL;
+
+      if (address != NULL)
+        {
+          inet_address = g_inet_address_new_from_string (address);
+          if (inet_address == NULL)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Couldn't parse IP address from `%s`", address);
+              return 0;
+            }
+        }
+
+      return add_reuse_port_listener (self, inet_address, port, error);
+    }
+
   if (address != NULL)
     {
       g_autoptr(GSocketAddress) socket_address = g_inet_socket_address_new_from_string (address, port);
@@ -727,6 +1074,10 @@ cockpit_web_request_free (gpointer data)
    * clear it here. The buffer may still be in use.
    */
   g_byte_array_unref (self->buffer);
+  if (self->rest)
+    g_byte_array_unref (self->rest);
+  if (self->headers)
+    g_hash_table_unref (self->headers);
   g_object_unref (self->io);
   g_free (self);
 }
@@ -740,7 +1091,7 @@ cockpit_web_request_finish (CockpitWebRequest *self)
 static void
 cockpit_web_request_process_delayed_reply (CockpitWebRequest *self,
                                            const gchar *path,
-                                           GHashTable *headers)
+                                           const gchar *host)
 {
   g_assert (self->delayed_reply > 299);
 
@@ -750,7 +1101,6 @@ cockpit_web_request_process_delayed_reply (CockpitWebRequest *self,
 
   if (self->delayed_reply == 301)
     {
-      const gchar *host = g_hash_table_lookup (headers, "Host");
       g_autofree gchar *url = g_strdup_printf ("https://%s%s", host != NULL ? host : "", path);
       cockpit_web_response_headers (response, 301, "Moved Permanently", 0, "Location", url, NULL);
       cockpit_web_response_complete (response);
@@ -787,8 +1137,7 @@ static void
 cockpit_web_request_process (CockpitWebRequest *self,
                              const gchar *method,
                              const gchar *path,
-                             const gchar *host,
-                             GHashTable *headers)
+                             const gchar *host)
 {
   gboolean claimed = FALSE;
 
@@ -818,7 +1167,7 @@ cockpit_web_request_process (CockpitWebRequest *self,
 
   if (self->delayed_reply)
     {
-      cockpit_web_request_process_delayed_reply (self, path, headers);
+      cockpit_web_request_process_delayed_reply (self, path, host);
       return;
     }
 
@@ -826,7 +1175,6 @@ cockpit_web_request_process (CockpitWebRequest *self,
 
   self->original_path = path_copy;
   self->path = path_copy + self->web_server->url_root->len;
-  self->headers = headers;
   self->host = host;
 
   gchar *query = strchr (path_copy, '?');
@@ -852,18 +1200,290 @@ cockpit_web_request_process (CockpitWebRequest *self,
     g_critical ("no handler responded to request: %s", self->path);
 }
 
+/* ---------------------------------------------------------------------------------------------------- */
+
+#define KNOWN_HEADER(name) { name, sizeof (name) - 1 }
+
+static const struct {
+  const gchar *name;
+  gsize length;
+} known_headers[COCKPIT_WEB_HEADER_N_KNOWN] = {
+  [COCKPIT_WEB_HEADER_ACCEPT_ENCODING] = KNOWN_HEADER ("Accept-Encoding"),
+  [COCKPIT_WEB_HEADER_ACCEPT_LANGUAGE] = KNOWN_HEADER ("Accept-Language"),
+  [COCKPIT_WEB_HEADER_AUTHORIZATION] = KNOWN_HEADER ("Authorization"),
+  [COCKPIT_WEB_HEADER_CONNECTION] = KNOWN_HEADER ("Connection"),
+  [COCKPIT_WEB_HEADER_CONTENT_LENGTH] = KNOWN_HEADER ("Content-Length"),
+  [COCKPIT_WEB_HEADER_COOKIE] = KNOWN_HEADER ("Cookie"),
+  [COCKPIT_WEB_HEADER_HOST] = KNOWN_HEADER ("Host"),
+  [COCKPIT_WEB_HEADER_IF_NONE_MATCH] = KNOWN_HEADER ("If-None-Match"),
+  [COCKPIT_WEB_HEADER_IF_RANGE] = KNOWN_HEADER ("If-Range"),
+  [COCKPIT_WEB_HEADER_ORIGIN] = KNOWN_HEADER ("Origin"),
+  [COCKPIT_WEB_HEADER_RANGE] = KNOWN_HEADER ("Range"),
+  [COCKPIT_WEB_HEADER_UPGRADE] = KNOWN_HEADER ("Upgrade"),
+};
+
+/**
+ * cockpit_web_header_name_intern:
+ * @name: a header name, not necessarily null terminated
+ * @length: the length of @name
+ *
+ * Returns: the #CockpitWebHeaderName for @name, compared case
+ *          insensitively, or %COCKPIT_WEB_HEADER_OTHER
+ */
+CockpitWebHeaderName
+cockpit_web_header_name_intern (const gchar *name,
+                                gsize length)
+{
+  gint i;
+
+  /* The lengths tell almost all of these apart already */
+  for (i = COCKPIT_WEB_HEADER_OTHER + 1; i < COCKPIT_WEB_HEADER_N_KNOWN; i++)
+    {
+      if (known_headers[i].length == length &&
+          g_ascii_strncasecmp (known_headers[i].name, name, length) == 0)
+        return i;
+    }
+
+  return COCKPIT_WEB_HEADER_OTHER;
+}
+
+static gboolean
+is_valid_header_name (const gchar *name,
+                      gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      if (name[i] != '\t' && ((guchar)name[i] < ' ' || name[i] & 0x80))
+        return FALSE;
+    }
+
+  return length > 0;
+}
+
+/**
+ * cockpit_web_header_index_parse:
+ * @index: the index to fill in
+ * @data: (array length=length): the headers, after the request line
+ * @length: length of data
+ *
+ * Parse HTTP headers like web_socket_util_parse_headers() does, but
+ * without copying them anywhere: only the offsets of the names and
+ * values are recorded in @index. Nothing is allocated, and @data is
+ * not modified, so this can be called again when more data arrives.
+ *
+ * Once all the data has arrived, use cockpit_web_header_index_terminate()
+ * before looking up any headers.
+ *
+ * Return value: zero if truncated, negative if fails, or number of
+ *               characters parsed
+ */
+gssize
+cockpit_web_header_index_parse (CockpitWebHeaderIndex *index,
+                                const gchar *data,
+                                gsize length)
+{
+  const gchar *end = data + length;
+  const gchar *line = data;
+  const gchar *eol;
+  const gchar *colon;
+  const gchar *name;
+  const gchar *name_end;
+  const gchar *value;
+  const gchar *value_end;
+  CockpitWebHeaderSpan *span;
+  CockpitWebHeaderName known;
+
+  index->data = NULL;
+  index->n_spans = 0;
+  memset (index->known, 0, sizeof (index->known));
+
+  for (;;)
+    {
+      eol = memchr (line, '\n', end - line);
+
+      /* No line ending: need more data */
+      if (eol == NULL)
+        return 0;
+
+      /* An empty line, all done */
+      if (eol == line || (eol == line + 1 && line[0] == '\r'))
+        return eol + 1 - data;
+
+      colon = memchr (line, ':', eol - line);
+      if (!colon)
+        {
+          g_debug ("received invalid header line: %.*s", (gint)(eol - line), line);
+          return -1;
+        }
+
+      name = line;
+      name_end = colon;
+      while (name < name_end && g_ascii_isspace (*name))
+        name++;
+      while (name_end > name && g_ascii_isspace (name_end[-1]))
+        name_end--;
+
+      value = colon + 1;
+      value_end = eol;
+      while (value < value_end && g_ascii_isspace (*value))
+        value++;
+      while (value_end > value && g_ascii_isspace (value_end[-1]))
+        value_end--;
+
+      if (!is_valid_header_name (name, name_end - name) ||
+          !g_utf8_validate (value, value_end - value, NULL))
+        {
+          g_debug ("received invalid header");
+          return -1;
+        }
+
+      if (index->n_spans == COCKPIT_WEB_HEADER_INDEX_MAX)
+        {
+          g_debug ("received too many headers");
+          return -1;
+        }
+
+      span = &index->spans[index->n_spans++];
+      span->name_offset = name - data;
+      span->name_length = name_end - name;
+      span->value_offset = value - data;
+      span->value_length = value_end - value;
+
+      known = cockpit_web_header_name_intern (name, name_end - name);
+      if (known != COCKPIT_WEB_HEADER_OTHER)
+        index->known[known] = index->n_spans;
+
+      line = eol + 1;
+    }
+}
+
+/**
+ * cockpit_web_header_index_terminate:
+ * @index: the index filled in by cockpit_web_header_index_parse()
+ * @data: the same data that was parsed
+ *
+ * Null terminates all the names and values in place, by overwriting
+ * the colon or white space that follows them.  After this, @data can
+ * no longer be parsed again, but headers can be looked up.
+ */
+void
+cockpit_web_header_index_terminate (CockpitWebHeaderIndex *index,
+                                    gchar *data)
+{
+  CockpitWebHeaderSpan *span;
+  guint i;
+
+  for (i = 0; i < index->n_spans; i++)
+    {
+      span = &index->spans[i];
+      data[span->name_offset + span->name_length] = '\0';
+      data[span->value_offset + span->value_length] = '\0';
+    }
+
+  index->data = data;
+}
+
+/**
+ * cockpit_web_header_index_lookup:
+ * @index: a terminated index
+ * @name: the header name
+ *
+ * Well known headers are found without comparing any strings, others
+ * with a linear search. Like in a header hash table, the last of several
+ * headers with the same name wins.
+ *
+ * Returns: the value of the header, or %NULL
+ */
+const gchar *
+cockpit_web_header_index_lookup (CockpitWebHeaderIndex *index,
+                                 const gchar *name)
+{
+  CockpitWebHeaderName known;
+  CockpitWebHeaderSpan *span;
+  guint i;
+
+  if (!index->data)
+    return NULL;
+
+  known = cockpit_web_header_name_intern (name, strlen (name));
+  if (known != COCKPIT_WEB_HEADER_OTHER)
+    {
+      i = index->known[known];
+      return i ? index->data + index->spans[i - 1].value_offset : NULL;
+    }
+
+  for (i = index->n_spans; i > 0; i--)
+    {
+      span = &index->spans[i - 1];
+      if (g_ascii_strcasecmp (index->data + span->name_offset, name) == 0)
+        return index->data + span->value_offset;
+    }
+
+  return NULL;
+}
+
+/**
+ * cockpit_web_header_index_to_table:
+ * @index: a terminated index
+ *
+ * Returns: (transfer full): a header table as created by
+ *          cockpit_web_server_new_table()
+ */
+GHashTable *
+cockpit_web_header_index_to_table (CockpitWebHeaderIndex *index)
+{
+  GHashTable *headers = cockpit_web_server_new_table ();
+  CockpitWebHeaderSpan *span;
+  guint i;
+
+  g_return_val_if_fail (index->data != NULL, headers);
+
+  for (i = 0; i < index->n_spans; i++)
+    {
+      span = &index->spans[i];
+      g_hash_table_insert (headers, g_strdup (index->data + span->name_offset),
+                           g_strdup (index->data + span->value_offset));
+    }
+
+  return headers;
+}
+
+static gboolean
+parse_content_length (const gchar *data,
+                      gsize length,
+                      guint64 *result)
+{
+  gsize i;
+
+  if (length == 0)
+    return FALSE;
+
+  *result = 0;
+  for (i = 0; i < length; i++)
+    {
+      if (!g_ascii_isdigit (data[i]) || *result > (G_MAXUINT64 - 9) / 10)
+        return FALSE;
+      *result = *result * 10 + (data[i] - '0');
+    }
+
+  return TRUE;
+}
+
 static gboolean
 cockpit_web_request_parse_and_process (CockpitWebRequest *self)
 {
+  CockpitWebHeaderIndex *index = &self->header_index;
+  CockpitWebHeaderSpan *span;
   gboolean again = FALSE;
-  GHashTable *headers = NULL;
   gchar *method = NULL;
   gchar *path = NULL;
-  const gchar *str;
-  gchar *end = NULL;
+  gchar *headers;
   gssize off1;
   gssize off2;
   guint64 length;
+  guint i;
 
   /* The hard input limit, we just terminate the connection */
   if (self->buffer->len > cockpit_webserver_request_maximum * 2)
@@ -894,9 +1514,8 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       goto out;
     }
 
-  off2 = web_socket_util_parse_headers ((const gchar *)self->buffer->data + off1,
-                                        self->buffer->len - off1,
-                                        &headers);
+  headers = (gchar *)self->buffer->data + off1;
+  off2 = cockpit_web_header_index_parse (index, headers, self->buffer->len - off1);
   if (off2 == 0)
     {
       again = TRUE;
@@ -911,12 +1530,11 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
 
   /* If we get a Content-Length then verify it is zero */
   length = 0;
-  str = g_hash_table_lookup (headers, "Content-Length");
-  if (str != NULL)
+  i = index->known[COCKPIT_WEB_HEADER_CONTENT_LENGTH];
+  if (i)
     {
-      end = NULL;
-      length = g_ascii_strtoull (str, &end, 10);
-      if (!end || end[0])
+      span = &index->spans[i - 1];
+      if (!parse_content_length (headers + span->value_offset, span->value_length, &length))
         {
           g_message ("received invalid Content-Length");
           self->delayed_reply = 400;
@@ -944,19 +1562,20 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       self->delayed_reply = 405;
     }
 
-  str = g_hash_table_lookup (headers, "Host");
-  if (!str || g_str_equal (str, ""))
+  /* From here on the buffer isn't parsed again, and stays until we're done */
+  cockpit_web_header_index_terminate (index, headers);
+  self->rest_offset = off1 + off2;
+
+  i = index->known[COCKPIT_WEB_HEADER_HOST];
+  if (!i || index->spans[i - 1].value_length == 0)
     {
       g_message ("received HTTP request without Host header");
       self->delayed_reply = 400;
     }
 
-  g_byte_array_remove_range (self->buffer, 0, off1 + off2);
-  cockpit_web_request_process (self, method, path, str, headers);
+  cockpit_web_request_process (self, method, path, cockpit_web_header_index_lookup (index, "Host"));
 
 out:
-  if (headers)
-    g_hash_table_unref (headers);
   g_free (method);
   g_free (path);
   if (!again)
@@ -1265,11 +1884,19 @@ cockpit_web_request_start (CockpitWebServer *web_server,
   g_hash_table_add (web_server->requests, self);
 }
 
+static const gchar *
+lookup_request_header (gpointer source,
+                       const gchar *name)
+{
+  return cockpit_web_request_lookup_header (source, name);
+}
+
 CockpitWebResponse *
 cockpit_web_request_respond (CockpitWebRequest *self)
 {
-  return cockpit_web_response_new (self->io, self->original_path, self->path, self->headers,
-                                   self->method, cockpit_web_request_get_protocol (self));
+  return cockpit_web_response_new_with_lookup (self->io, self->original_path, self->path,
+                                               lookup_request_header, self,
+                                               self->method, cockpit_web_request_get_protocol (self));
 }
 
 const gchar *
@@ -1296,15 +1923,45 @@ cockpit_web_request_get_method (CockpitWebRequest *self)
   return self->method;
 }
 
+/**
+ * cockpit_web_request_get_buffer:
+ * @self: the request
+ *
+ * The headers of the request are parsed in place, so the buffer that
+ * they were read into can't be handed out. This copies whatever came
+ * after them, for those that take over the stream.
+ *
+ * Returns: (transfer none): the data read after the request headers
+ */
 GByteArray *
 cockpit_web_request_get_buffer (CockpitWebRequest *self)
 {
-  return self->buffer;
+  if (!self->rest)
+    {
+      self->rest = g_byte_array_new ();
+      if (self->buffer && self->buffer->len > self->rest_offset)
+        g_byte_array_append (self->rest, self->buffer->data + self->rest_offset,
+                             self->buffer->len - self->rest_offset);
+    }
+
+  return self->rest;
 }
 
+/**
+ * cockpit_web_request_get_headers:
+ * @self: the request
+ *
+ * Prefer cockpit_web_request_lookup_header(), which doesn't need to
+ * build a table of all the headers.
+ *
+ * Returns: (transfer none): the request headers
+ */
 GHashTable *
 cockpit_web_request_get_headers (CockpitWebRequest *self)
 {
+  if (!self->headers && self->header_index.data)
+    self->headers = cockpit_web_header_index_to_table (&self->header_index);
+
   return self->headers;
 }
 
@@ -1312,6 +1969,8 @@ const gchar *
 cockpit_web_request_lookup_header (CockpitWebRequest *self,
                                    const gchar *header)
 {
+  if (self->header_index.data)
+    return cockpit_web_header_index_lookup (&self->header_index, header);
   if (!self->headers)
     return NULL;
 
@@ -1322,10 +1981,7 @@ gchar *
 cockpit_web_request_parse_cookie (CockpitWebRequest *self,
                                   const gchar *name)
 {
-  if (!self->headers)
-    return NULL;
-
-  return cockpit_web_server_parse_cookie (self->headers, name);
+  return parse_cookie (cockpit_web_request_lookup_header (self, "Cookie"), name);
 }
 
 GIOStream *
@@ -1351,7 +2007,7 @@ cockpit_web_request_get_protocol (CockpitWebRequest *self)
 
   if (self->web_server && self->web_server->protocol_header)
     {
-      const gchar *protocol = g_hash_table_lookup (self->headers, self->web_server->protocol_header);
+      const gchar *protocol = cockpit_web_request_lookup_header (self, self->web_server->protocol_header);
       if (protocol)
         return protocol;
     }
@@ -1364,7 +2020,8 @@ cockpit_web_request_get_remote_address (CockpitWebRequest *self)
 {
   if (self->web_server && self->web_server->forwarded_for_header)
     {
-      const gchar *forwarded_header = g_hash_table_lookup (self->headers, self->web_server->forwarded_for_header);
+      const gchar *forwarded_header = cockpit_web_request_lookup_header (self,
+                                                                         self->web_server->forwarded_for_header);
       if (forwarded_header && forwarded_header[0])
         {
           /* This isn't really standardised, but in practice, it's a
@@ -1426,12 +2083,26 @@ gboolean
 cockpit_web_request_accepts_encoding (CockpitWebRequest *self,
                                       const gchar *encoding)
 {
-  const gchar *accept = g_hash_table_lookup (self->headers, "Accept-Encoding");
-  if (!accept)
-    return TRUE;
-  g_auto(GStrv) encodings = cockpit_web_server_parse_accept_list (accept, NULL);
-  return g_strv_contains ((const gchar **) encodings, encoding) ||
-         g_strv_contains ((const gchar **) encodings, "*");
+  const gchar *supported[] = { encoding, NULL };
+  g_auto(GStrv) encodings = cockpit_web_request_get_accepted_encodings (self, supported);
+  return encodings[0] != NULL;
+}
+
+/**
+ * cockpit_web_request_get_accepted_encodings:
+ * @self: the request
+ * @supported: the content codings that we have, in our order of preference
+ *
+ * See cockpit_web_server_parse_accept_encoding().
+ *
+ * Returns: (transfer full): the codings which the client accepts, best first
+ */
+gchar **
+cockpit_web_request_get_accepted_encodings (CockpitWebRequest *self,
+                                            const gchar * const *supported)
+{
+  const gchar *accept = cockpit_web_request_lookup_header (self, "Accept-Encoding");
+  return cockpit_web_server_parse_accept_encoding (accept, supported);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
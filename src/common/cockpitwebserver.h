@@ -83,6 +83,10 @@ gboolean
 cockpit_web_request_accepts_encoding (CockpitWebRequest *self,
                                       const gchar *encoding);
 
+gchar **
+cockpit_web_request_get_accepted_encodings (CockpitWebRequest *self,
+                                            const gchar * const *supported);
+
 #define COCKPIT_TYPE_WEB_SERVER  (cockpit_web_server_get_type ())
 G_DECLARE_FINAL_TYPE(CockpitWebServer, cockpit_web_server, COCKPIT, WEB_SERVER, GObject)
 
@@ -93,7 +97,9 @@ typedef enum {
   COCKPIT_WEB_SERVER_FOR_TLS_PROXY = 1 << 0,
   /* http → https redirection for non-localhost addresses */
   COCKPIT_WEB_SERVER_REDIRECT_TLS = 1 << 1,
-  COCKPIT_WEB_SERVER_FLAGS_MAX = 1 << 2
+  /* SO_REUSEPORT on inet listeners, so that several processes can share a port */
+  COCKPIT_WEB_SERVER_REUSE_PORT = 1 << 2,
+  COCKPIT_WEB_SERVER_FLAGS_MAX = 1 << 3
 } CockpitWebServerFlags;
 
 
@@ -110,6 +116,18 @@ gchar *            cockpit_web_server_parse_cookie    (GHashTable *headers,
 gchar **           cockpit_web_server_parse_accept_list   (const gchar *accept,
                                                            const gchar *first);
 
+gchar **           cockpit_web_server_parse_accept_encoding (const gchar *accept,
+                                                             const gchar * const *supported);
+
+gboolean           cockpit_web_server_parse_range       (const gchar *range,
+                                                         gint64 *out_first,
+                                                         gint64 *out_last);
+
+gchar *            cockpit_web_server_format_http_date  (gint64 seconds);
+
+gboolean           cockpit_web_server_parse_http_date   (const gchar *value,
+                                                         gint64 *out_seconds);
+
 CockpitWebServerFlags cockpit_web_server_get_flags         (CockpitWebServer *self);
 
 guint16
@@ -120,6 +120,84 @@ test_expand (TestCase *tc,
   g_list_free_full (output, (GDestroyNotify)g_bytes_unref);
 }
 
+static void
+test_render_bytes (TestCase *tc,
+                   gconstpointer data)
+{
+  const Fixture *fixture = data;
+  g_autoptr(CockpitTemplate) template = NULL;
+  g_autoptr(GBytes) input = NULL;
+  g_autoptr(GBytes) output = NULL;
+  g_autofree gchar *expected = NULL;
+
+  input = g_bytes_new_static (fixture->input, strlen (fixture->input));
+  template = cockpit_template_compile (input, fixture->start, fixture->end);
+
+  expected = g_strjoinv ("", (gchar **) fixture->output);
+  output = cockpit_template_render_bytes (template, lookup_table, tc->variables);
+  cockpit_assert_bytes_eq (output, expected, -1);
+}
+
+static void
+test_render_reuse (TestCase *tc,
+                   gconstpointer data)
+{
+  const gchar *input = "Test ${oh} says ${Scruffy}";
+  g_autoptr(CockpitTemplate) template = NULL;
+  g_autoptr(GHashTable) other = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GBytes) first = NULL;
+  g_autoptr(GBytes) second = NULL;
+
+  bytes = g_bytes_new_static (input, strlen (input));
+  template = cockpit_template_compile (bytes, "${", "}");
+
+  other = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (other, "oh", "hi");
+
+  first = cockpit_template_render_bytes (template, lookup_table, tc->variables);
+  cockpit_assert_bytes_eq (first, "Test marmalade says janitor", -1);
+
+  second = cockpit_template_render_bytes (template, lookup_table, other);
+  cockpit_assert_bytes_eq (second, "Test hi says ${Scruffy}", -1);
+}
+
+static void
+test_markers (TestCase *tc,
+              gconstpointer data)
+{
+  const gchar *input = "<head><meta /><meta /></head><script>/**/</script>";
+  const gchar *markers[] = { "/**/", "<meta />", "<missing>", NULL };
+  g_autoptr(CockpitTemplate) template = NULL;
+  g_autoptr(GHashTable) values = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GBytes) output = NULL;
+  GList *pieces;
+
+  bytes = g_bytes_new_static (input, strlen (input));
+  template = cockpit_template_compile_markers (bytes, markers);
+
+  /* Nothing is inserted without values */
+  output = cockpit_template_render_bytes (template, lookup_table, tc->variables);
+  cockpit_assert_bytes_eq (output, input, -1);
+  g_clear_pointer (&output, g_bytes_unref);
+
+  values = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (values, "<meta />", "<base>");
+  g_hash_table_insert (values, "/**/", "var x;");
+  g_hash_table_insert (values, "<missing>", "never");
+
+  /* Only after the first occurrence, in the order of the input */
+  pieces = cockpit_template_render (template, lookup_table, values);
+  g_assert_cmpuint (g_list_length (pieces), ==, 5);
+  cockpit_assert_bytes_eq (g_list_nth_data (pieces, 1), "<base>", -1);
+  cockpit_assert_bytes_eq (g_list_nth_data (pieces, 3), "var x;", -1);
+  g_list_free_full (pieces, (GDestroyNotify)g_bytes_unref);
+
+  output = cockpit_template_render_bytes (template, lookup_table, values);
+  cockpit_assert_bytes_eq (output, "<head><meta /><base><meta /></head><script>/**/var x;</script>", -1);
+}
+
 static void
 test_json (TestCase *tc,
            gconstpointer data)
@@ -192,8 +270,14 @@ main (int argc,
       name = g_strdup_printf ("/template/expand/%s", expand_fixtures[i].name);
       g_test_add (name, TestCase, expand_fixtures + i, setup, test_expand, teardown);
       g_free (name);
+
+      name = g_strdup_printf ("/template/render-bytes/%s", expand_fixtures[i].name);
+      g_test_add (name, TestCase, expand_fixtures + i, setup, test_render_bytes, teardown);
+      g_free (name);
     }
 
+  g_test_add ("/template/render/reuse", TestCase, NULL, setup, test_render_reuse, teardown);
+  g_test_add ("/template/markers", TestCase, NULL, setup, test_markers, teardown);
   g_test_add ("/template/expand/json", TestCase, NULL, setup, test_json, teardown);
 
   return g_test_run ();
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpitunicode.h"
+#include "cockpitutf8.h"
 
 #include "testlib/cockpittest.h"
 
@@ -83,6 +84,131 @@ static const Fixture fixtures[] = {
   { "Marmalaade!""\xe2\x94\x80", NULL, FALSE },
 };
 
+/* Pieces that random input is made of, to hit all the edge cases */
+static const gchar *fuzz_pieces[] = {
+  "a", "ascii text", "\303\244", "\342\224\200", "\360\237\230\200", "\357\277\277",
+  "\364\217\277\277", "\340\240\200", "\355\237\277",
+  "\300\257", "\340\200\257", "\355\240\200", "\360\217\277\277", "\364\220\200\200",
+  "\200", "\277", "\303", "\342\224", "\365", "\377",
+};
+
+static GBytes *
+build_fuzz_input (void)
+{
+  GByteArray *input;
+  const gchar *piece;
+  guint8 byte;
+  guint length;
+
+  input = g_byte_array_new ();
+  length = g_test_rand_int_range (0, 200);
+  while (input->len < length)
+    {
+      switch (g_test_rand_int_range (0, 4))
+        {
+        case 0:
+          byte = g_test_rand_int_range (0, 256);
+          g_byte_array_append (input, &byte, 1);
+          break;
+        case 1:
+          piece = fuzz_pieces[g_test_rand_int_range (0, G_N_ELEMENTS (fuzz_pieces))];
+          g_byte_array_append (input, (const guint8 *)piece, strlen (piece));
+          break;
+        default:
+          /* Long runs of ASCII, so that the vector loops get exercised */
+          while (input->len < length && g_test_rand_int_range (0, 64))
+            {
+              byte = g_test_rand_int_range (1, 128);
+              g_byte_array_append (input, &byte, 1);
+            }
+          break;
+        }
+    }
+
+  return g_byte_array_free_to_bytes (input);
+}
+
+static void
+test_validate_kernel (gconstpointer data)
+{
+  const gchar *name = data;
+  CockpitUtf8Func kernel;
+  const gchar *chars;
+  const gchar *end;
+  GBytes *input;
+  gsize length;
+  gsize offset;
+  gint i;
+
+  kernel = cockpit_utf8_kernel (name);
+  if (!kernel)
+    {
+      g_test_skip ("not supported by this CPU");
+      return;
+    }
+
+  for (i = 0; i < 10000; i++)
+    {
+      input = build_fuzz_input ();
+      chars = g_bytes_get_data (input, &length);
+
+      /* Each of the possible starting alignments */
+      for (offset = 0; offset < 32 && offset <= length; offset++)
+        {
+          g_utf8_validate (chars + offset, length - offset, &end);
+          g_assert_cmpuint (kernel (chars + offset, length - offset), ==, end - (chars + offset));
+        }
+
+      g_bytes_unref (input);
+    }
+}
+
+static GBytes *
+reference_force_utf8 (GBytes *input)
+{
+  const gchar *data;
+  const gchar *end;
+  gsize length;
+  GString *string;
+
+  data = g_bytes_get_data (input, &length);
+  string = g_string_sized_new (length + 16);
+  while (!g_utf8_validate (data, length, &end))
+    {
+      g_string_append_len (string, data, end - data);
+      g_string_append (string, "\357\277\275");
+      length -= (end - data) + 1;
+      data = end + 1;
+    }
+
+  g_string_append_len (string, data, length);
+  return g_string_free_to_bytes (string);
+}
+
+static void
+test_force_utf8_fuzz (void)
+{
+  GBytes *input;
+  GBytes *output;
+  GBytes *expect;
+  gint i;
+
+  for (i = 0; i < 10000; i++)
+    {
+      input = build_fuzz_input ();
+      output = cockpit_unicode_force_utf8 (input);
+      expect = reference_force_utf8 (input);
+
+      g_assert (g_bytes_equal (output, expect));
+      if (g_bytes_equal (input, expect))
+        g_assert (output == input);
+
+      g_bytes_unref (input);
+      g_bytes_unref (output);
+      g_bytes_unref (expect);
+    }
+}
+
 int
 main (int argc,
       char *argv[])
@@ -108,5 +234,11 @@ main (int argc,
       g_free (name2);
     }
 
+  g_test_add_data_func ("/unicode/validate/bytes", "bytes", test_validate_kernel);
+  g_test_add_data_func ("/unicode/validate/words", "words", test_validate_kernel);
+  g_test_add_data_func ("/unicode/validate/sse2", "sse2", test_validate_kernel);
+  g_test_add_data_func ("/unicode/validate/avx2", "avx2", test_validate_kernel);
+  g_test_add_func ("/unicode/force-utf8-fuzz", test_force_utf8_fuzz);
+
   return g_test_run ();
 }
@@ -0,0 +1,328 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitwebcache.h"
+
+#include "testlib/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+typedef struct {
+  gchar *dir;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->dir = g_dir_make_tmp ("test-webcache.XXXXXX", NULL);
+  g_assert (tc->dir != NULL);
+
+  cockpit_web_cache_set_limit (1024 * 1024);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  const gchar *name;
+  GDir *dir;
+
+  cockpit_web_cache_set_limit (0);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), ==, 0);
+
+  dir = g_dir_open (tc->dir, 0, NULL);
+  g_assert (dir != NULL);
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (tc->dir, name, NULL);
+      g_assert_cmpint (g_remove (path), ==, 0);
+    }
+  g_dir_close (dir);
+
+  g_assert_cmpint (g_rmdir (tc->dir), ==, 0);
+  g_free (tc->dir);
+}
+
+static gchar *
+write_file (TestCase *tc,
+            const gchar *name,
+            const gchar *contents)
+{
+  gchar *path = g_build_filename (tc->dir, name, NULL);
+  g_assert (g_file_set_contents (path, contents, -1, NULL));
+  return path;
+}
+
+static void
+assert_contents (const gchar *path,
+                 const gchar *expected)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(CockpitWebCacheEntry) entry = cockpit_web_cache_lookup (path, &error);
+
+  g_assert_no_error (error);
+  g_assert (entry != NULL);
+  cockpit_assert_bytes_eq (cockpit_web_cache_entry_get_body (entry), expected, -1);
+}
+
+/* the change notifications arrive through the main loop */
+static void
+wait_for_contents (const gchar *path,
+                   const gchar *expected)
+{
+  for (gint i = 0; i < 500; i++)
+    {
+      g_autoptr(CockpitWebCacheEntry) entry = cockpit_web_cache_lookup (path, NULL);
+      if (entry)
+        {
+          GBytes *body = cockpit_web_cache_entry_get_body (entry);
+          if (g_bytes_get_size (body) == strlen (expected) &&
+              memcmp (g_bytes_get_data (body, NULL), expected, strlen (expected)) == 0)
+            return;
+        }
+
+      while (g_main_context_iteration (NULL, FALSE));
+      g_usleep (10000);
+    }
+
+  g_assert_not_reached ();
+}
+
+static void
+test_hit (TestCase *tc,
+          gconstpointer data)
+{
+  g_autofree gchar *path = write_file (tc, "test.txt", "Hello");
+  g_autoptr(CockpitWebCacheEntry) first = NULL;
+  g_autoptr(CockpitWebCacheEntry) second = NULL;
+
+  first = cockpit_web_cache_lookup (path, NULL);
+  g_assert (first != NULL);
+  cockpit_assert_bytes_eq (cockpit_web_cache_entry_get_body (first), "Hello", -1);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), >, 5);
+
+  /* this doesn't even need the file anymore */
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  second = cockpit_web_cache_lookup (path, NULL);
+  g_assert (second == first);
+
+  cockpit_assert_strmatch (cockpit_web_cache_entry_get_etag (first), "\"*-*-5\"");
+}
+
+static void
+test_disabled (TestCase *tc,
+               gconstpointer data)
+{
+  g_autofree gchar *path = write_file (tc, "test.txt", "Hello");
+  g_autoptr(CockpitWebCacheEntry) first = NULL;
+  g_autoptr(CockpitWebCacheEntry) second = NULL;
+
+  cockpit_web_cache_set_limit (0);
+
+  first = cockpit_web_cache_lookup (path, NULL);
+  second = cockpit_web_cache_lookup (path, NULL);
+  g_assert (first != NULL);
+  g_assert (second != NULL);
+  g_assert (first != second);
+  cockpit_assert_bytes_eq (cockpit_web_cache_entry_get_body (second), "Hello", -1);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), ==, 0);
+}
+
+static void
+test_changed (TestCase *tc,
+              gconstpointer data)
+{
+  g_autofree gchar *path = write_file (tc, "test.txt", "Hello");
+
+  assert_contents (path, "Hello");
+
+  g_free (write_file (tc, "test.txt", "Goodbye"));
+  wait_for_contents (path, "Goodbye");
+}
+
+static void
+test_not_found (TestCase *tc,
+                gconstpointer data)
+{
+  g_autofree gchar *path = g_build_filename (tc->dir, "test.txt", NULL);
+  g_autoptr(GError) error = NULL;
+
+  g_assert (cockpit_web_cache_lookup (path, &error) == NULL);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+
+  /* the failure is cached as well, until the file appears */
+  g_assert_cmpuint (cockpit_web_cache_get_size (), >, 0);
+
+  g_free (write_file (tc, "test.txt", "Hello"));
+  wait_for_contents (path, "Hello");
+}
+
+static void
+test_no_directory (TestCase *tc,
+                   gconstpointer data)
+{
+  g_autofree gchar *path = g_build_filename (tc->dir, "subdir", "test.txt", NULL);
+  g_autoptr(GError) error = NULL;
+
+  g_assert (cockpit_web_cache_lookup (path, &error) == NULL);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+
+  /* neither cached nor monitored */
+  g_assert_cmpuint (cockpit_web_cache_get_size (), ==, 0);
+}
+
+static void
+test_directory (TestCase *tc,
+                gconstpointer data)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_assert (cockpit_web_cache_is_directory (tc->dir));
+  g_assert (cockpit_web_cache_lookup (tc->dir, &error) == NULL);
+  g_assert (error != NULL);
+
+  g_autofree gchar *path = write_file (tc, "test.txt", "Hello");
+  g_assert (!cockpit_web_cache_is_directory (path));
+}
+
+static void
+test_limit (TestCase *tc,
+            gconstpointer data)
+{
+  g_autofree gchar *large_data = g_strnfill (8000, 'x');
+  g_autofree gchar *large = write_file (tc, "large.txt", large_data);
+  g_autofree gchar *one = write_file (tc, "one.txt", "one");
+  g_autofree gchar *two = write_file (tc, "two.txt", "two");
+  g_autoptr(CockpitWebCacheEntry) entry = NULL;
+  g_autoptr(CockpitWebCacheEntry) again = NULL;
+
+  cockpit_web_cache_set_limit (4000);
+
+  /* too large to be cached, but still gets served */
+  assert_contents (large, large_data);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), ==, 0);
+
+  assert_contents (one, "one");
+  gsize size = cockpit_web_cache_get_size ();
+  g_assert_cmpuint (size, >, 0);
+  g_assert_cmpuint (size, <=, 2000);
+
+  /* only room for one of them */
+  cockpit_web_cache_set_limit (size + 1);
+  entry = cockpit_web_cache_lookup (two, NULL);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), <=, size + 1);
+  again = cockpit_web_cache_lookup (two, NULL);
+  g_assert (again == entry);
+
+  /* "one" got evicted, so this sees the new contents right away */
+  g_free (write_file (tc, "one.txt", "eins"));
+  assert_contents (one, "eins");
+}
+
+static void
+test_identity (TestCase *tc,
+               gconstpointer data)
+{
+  g_autoptr(CockpitWebCacheEntry) entry = NULL;
+  g_autoptr(GBytes) first = NULL;
+  g_autoptr(GBytes) second = NULL;
+  g_autoptr(GError) error = NULL;
+
+  entry = cockpit_web_cache_lookup (SRCDIR "/src/common/mock-content/test-file.txt.gz", &error);
+  g_assert_no_error (error);
+  gsize size = cockpit_web_cache_get_size ();
+
+  first = cockpit_web_cache_entry_get_identity (entry, &error);
+  g_assert_no_error (error);
+  cockpit_assert_bytes_eq (first, "A small test file\n", -1);
+  g_assert_cmpuint (cockpit_web_cache_get_size (), ==, size + g_bytes_get_size (first));
+
+  second = cockpit_web_cache_entry_get_identity (entry, &error);
+  g_assert (second == first);
+}
+
+static GBytes *
+lookup_name (const gchar *variable,
+             gpointer user_data)
+{
+  return g_bytes_new (user_data, strlen (user_data));
+}
+
+static void
+test_template (TestCase *tc,
+               gconstpointer data)
+{
+  const gchar *markers[] = { "<!---->", NULL };
+  g_autofree gchar *path = write_file (tc, "test.html", "<b>${name}</b><!---->");
+  g_autoptr(CockpitWebCacheEntry) entry = NULL;
+  g_autoptr(CockpitTemplate) first = NULL;
+  g_autoptr(CockpitTemplate) second = NULL;
+  g_autoptr(CockpitTemplate) injection = NULL;
+  g_autoptr(CockpitTemplate) changed = NULL;
+  g_autoptr(GBytes) output = NULL;
+
+  entry = cockpit_web_cache_lookup (path, NULL);
+  first = cockpit_web_cache_entry_get_template (entry, "${", "}");
+  second = cockpit_web_cache_entry_get_template (entry, "${", "}");
+  g_assert (first == second);
+
+  output = cockpit_template_render_bytes (first, lookup_name, "Scruffy");
+  cockpit_assert_bytes_eq (output, "<b>Scruffy</b><!---->", -1);
+  g_clear_pointer (&output, g_bytes_unref);
+
+  /* compiled differently, so this replaces the template */
+  injection = cockpit_web_cache_entry_get_injection (entry, markers);
+  g_assert (injection != first);
+  output = cockpit_template_render_bytes (injection, lookup_name, "x");
+  cockpit_assert_bytes_eq (output, "<b>${name}</b><!---->x", -1);
+  g_clear_pointer (&output, g_bytes_unref);
+
+  /* the template goes away along with the contents */
+  g_free (write_file (tc, "test.html", "<i>${name}</i>"));
+  wait_for_contents (path, "<i>${name}</i>");
+  g_clear_pointer (&entry, cockpit_web_cache_entry_unref);
+  entry = cockpit_web_cache_lookup (path, NULL);
+  changed = cockpit_web_cache_entry_get_template (entry, "${", "}");
+  output = cockpit_template_render_bytes (changed, lookup_name, "Scruffy");
+  cockpit_assert_bytes_eq (output, "<i>Scruffy</i>", -1);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/web-cache/hit", TestCase, NULL, setup, test_hit, teardown);
+  g_test_add ("/web-cache/disabled", TestCase, NULL, setup, test_disabled, teardown);
+  g_test_add ("/web-cache/changed", TestCase, NULL, setup, test_changed, teardown);
+  g_test_add ("/web-cache/not-found", TestCase, NULL, setup, test_not_found, teardown);
+  g_test_add ("/web-cache/no-directory", TestCase, NULL, setup, test_no_directory, teardown);
+  g_test_add ("/web-cache/directory", TestCase, NULL, setup, test_directory, teardown);
+  g_test_add ("/web-cache/limit", TestCase, NULL, setup, test_limit, teardown);
+  g_test_add ("/web-cache/identity", TestCase, NULL, setup, test_identity, teardown);
+  g_test_add ("/web-cache/template", TestCase, NULL, setup, test_template, teardown);
+
+  return g_test_run ();
+}
@@ -19,6 +19,7 @@
 
 #include "config.h"
 
+#include "cockpitwebcompress.h"
 #include "cockpitwebinject.h"
 #include "cockpitwebresponse.h"
 #include "cockpitwebserver.h"
@@ -29,8 +30,12 @@
 
 #include <glib/gstdio.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 /* headers that are present in every request */
 #define STATIC_HEADERS "X-DNS-Prefetch-Control: off\r\nReferrer-Policy: no-referrer\r\nX-Content-Type-Options: nosniff\r\nCross-Origin-Resource-Policy: same-origin\r\nX-Frame-Options: sameorigin\r\n\r\n"
@@ -228,6 +233,182 @@ test_return_gerror_headers (TestCase *tc,
     "\r\n");
 }
 
+static void
+on_done_set_flag (CockpitWebResponse *response,
+                  gboolean reusable,
+                  gpointer user_data)
+{
+  gboolean *flag = user_data;
+  g_assert (*flag == FALSE);
+  *flag = TRUE;
+}
+
+static void
+on_debug_count_sendfile (const gchar *log_domain,
+                         GLogLevelFlags log_level,
+                         const gchar *message,
+                         gpointer user_data)
+{
+  guint *count = user_data;
+  if (strstr (message, " bytes from file"))
+    (*count)++;
+}
+
+static GBytes *
+dechunk_data (const gchar *data,
+              gsize length,
+              gchar **headers)
+{
+  const gchar *end;
+  GByteArray *body;
+  gchar *endptr;
+  gsize size;
+
+  end = g_strstr_len (data, length, "\r\n\r\n");
+  g_assert (end != NULL);
+  end += 4;
+  *headers = g_strndup (data, end - data);
+  length -= end - data;
+  data = end;
+
+  body = g_byte_array_new ();
+  for (;;)
+    {
+      size = g_ascii_strtoull (data, &endptr, 16);
+      g_assert (endptr != data);
+      g_assert (g_str_has_prefix (endptr, "\r\n"));
+      endptr += 2;
+      if (size == 0)
+        break;
+      g_assert_cmpuint (size + 2, <=, length - (endptr - data));
+      g_byte_array_append (body, (guint8 *)endptr, size);
+      length -= (endptr - data) + size + 2;
+      data = endptr + size + 2;
+    }
+
+  return g_byte_array_free_to_bytes (body);
+}
+
+typedef struct {
+  const gchar *method;
+  gboolean accepts_gzip;
+} SendfileFixture;
+
+static void
+test_file_sendfile (gconstpointer data)
+{
+  const SendfileFixture *fixture = data;
+  const gchar *method = fixture->method;
+  const gchar *roots[] = { SRCDIR "/src/common/mock-content/", NULL };
+  GSocketConnection *connection;
+  CockpitWebResponse *response;
+  GError *error = NULL;
+  GSocket *socket;
+  GString *received;
+  GMappedFile *file;
+  gboolean done = FALSE;
+  gchar buffer[1024];
+  const gchar *body;
+  gssize count;
+  int sndbuf = 4096;
+  guint sendfiles = 0;
+  guint logid;
+  int sv[2];
+
+  /* A real socket, and a small buffer so that sendfile() only gets partway */
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+    g_assert_not_reached ();
+  g_assert_cmpint (setsockopt (sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf)), ==, 0);
+  g_assert_cmpint (fcntl (sv[1], F_SETFL, O_NONBLOCK), ==, 0);
+
+  socket = g_socket_new_from_fd (sv[0], &error);
+  g_assert_no_error (error);
+  connection = g_socket_connection_factory_create_connection (socket);
+  g_object_unref (socket);
+
+  if (fixture->accepts_gzip)
+    {
+      response = cockpit_web_response_new (G_IO_STREAM (connection), "/large.min.js", "/large.min.js",
+                                           NULL, method, "http");
+    }
+  else
+    {
+      response = cockpit_web_response_new (G_IO_STREAM (connection), "/large.min.js.gz", "/large.min.js.gz",
+                                           NULL, method, "http");
+    }
+  g_object_unref (connection);
+  g_signal_connect (response, "done", G_CALLBACK (on_done_set_flag), &done);
+
+  /* Each sendfile() call is logged, which shows that the path was taken */
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, on_debug_count_sendfile, &sendfiles);
+
+  if (fixture->accepts_gzip)
+    cockpit_web_response_file_or_gz (response, TRUE, NULL, roots);
+  else
+    cockpit_web_response_file (response, NULL, roots);
+
+  received = g_string_new ("");
+  for (;;)
+    {
+      while (g_main_context_iteration (NULL, FALSE));
+
+      count = read (sv[1], buffer, sizeof (buffer));
+      if (count > 0)
+        g_string_append_len (received, buffer, count);
+      else if (done)
+        break;
+      else
+        g_assert (count < 0 && errno == EAGAIN);
+    }
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+
+  file = g_mapped_file_new (SRCDIR "/src/common/mock-content/large.min.js.gz", FALSE, &error);
+  g_assert_no_error (error);
+
+  /* A precompressed variant is chunked, and the kernel can't frame that */
+  if (fixture->accepts_gzip)
+    {
+      g_autofree gchar *headers = NULL;
+      g_autoptr(GBytes) dechunked = dechunk_data (received->str, received->len, &headers);
+
+      cockpit_assert_strmatch (headers, "HTTP/1.1 200 OK\r\n*Content-Encoding: gzip\r\n*Transfer-Encoding: chunked\r\n*");
+      g_assert_cmpuint (sendfiles, ==, 0);
+      g_assert_cmpuint (g_bytes_get_size (dechunked), ==, g_mapped_file_get_length (file));
+      g_assert (memcmp (g_bytes_get_data (dechunked, NULL), g_mapped_file_get_contents (file),
+                        g_mapped_file_get_length (file)) == 0);
+    }
+  else
+    {
+      cockpit_assert_strmatch (received->str, "HTTP/1.1 200 OK\r\n*Content-Length: 29215\r\n*");
+      body = strstr (received->str, "\r\n\r\n");
+      g_assert (body != NULL);
+      body += 4;
+
+      if (g_str_equal (method, "HEAD"))
+        {
+          g_assert_cmpuint (received->len, ==, body - received->str);
+          g_assert_cmpuint (sendfiles, ==, 0);
+        }
+      else
+        {
+          /* The socket buffer is much smaller than the file */
+          g_assert_cmpuint (sendfiles, >, 1);
+          g_assert_cmpuint (received->len - (body - received->str), ==, g_mapped_file_get_length (file));
+          g_assert (memcmp (body, g_mapped_file_get_contents (file), g_mapped_file_get_length (file)) == 0);
+        }
+    }
+
+  g_mapped_file_unref (file);
+  g_string_free (received, TRUE);
+  g_object_unref (response);
+  close (sv[1]);
+}
+
+static const SendfileFixture sendfile_fixture_get = { .method = "GET" };
+static const SendfileFixture sendfile_fixture_head = { .method = "HEAD" };
+static const SendfileFixture sendfile_fixture_encoded = { .method = "GET", .accepts_gzip = TRUE };
+
 static void
 test_file_not_found (TestCase *tc,
                      gconstpointer user_data)
@@ -378,6 +559,115 @@ test_content_type (TestCase *tc,
   g_hash_table_unref (headers);
 }
 
+typedef struct {
+  TestFixture fixture;
+  const gchar *expected;
+} RangeFixture;
+
+static const RangeFixture range_fixtures[] = {
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=2-6" },
+    "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 2-6/18\r\n*Content-Length: 5\r\n*\r\n\r\nsmall" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=13-" },
+    "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 13-17/18\r\n*\r\n\r\nfile\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=-5" },
+    "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 13-17/18\r\n*\r\n\r\nfile\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=10-1000" },
+    "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 10-17/18\r\n*\r\n\r\nst file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=18-" },
+    "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */18\r\n*" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=0-1,4-5" },
+    "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n*Content-Length: 18\r\n*\r\n\r\nA small test file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "lines=1-2" },
+    "HTTP/1.1 200 OK\r\n*\r\n\r\nA small test file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-Range", .value = "\"something\"" },
+    "HTTP/1.1 200 OK\r\n*\r\n\r\nA small test file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "Range", .value = "bytes=2-6", .method = "HEAD" },
+    "HTTP/1.1 200 OK\r\n*Content-Length: 18\r\n*\r\n\r\n" },
+};
+
+static void
+test_file_range (TestCase *tc,
+                 gconstpointer user_data)
+{
+  const RangeFixture *fixture = user_data;
+  const gchar *roots[] = { srcdir, NULL };
+
+  cockpit_web_response_file (tc->response, NULL, roots);
+  cockpit_assert_strmatch (output_as_string (tc), fixture->expected);
+}
+
+static const RangeFixture conditional_fixtures[] = {
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-None-Match", .value = "*" },
+    "HTTP/1.1 304 Not Modified\r\nETag: \"*\"\r\nLast-Modified: *, * GMT\r\n*sameorigin\r\n\r\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-None-Match", .value = "*", .method = "HEAD" },
+    "HTTP/1.1 304 Not Modified\r\n*sameorigin\r\n\r\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-None-Match", .value = "\"other\", W/\"another\"" },
+    "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\nETag: \"*\"\r\nLast-Modified: *\r\n\r\nA small test file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-Modified-Since", .value = "Fri, 01 Jan 2100 00:00:00 GMT" },
+    "HTTP/1.1 304 Not Modified\r\n*sameorigin\r\n\r\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-Modified-Since", .value = "Thu, 01 Jan 1970 00:00:00 GMT" },
+    "HTTP/1.1 200 OK\r\n*\r\n\r\nA small test file\n" },
+  { { .path = "/src/common/mock-content/test-file.txt", .header = "If-Modified-Since", .value = "yesterday" },
+    "HTTP/1.1 200 OK\r\n*\r\n\r\nA small test file\n" },
+};
+
+static gchar *
+request_file (const gchar *path,
+              const gchar *header,
+              const gchar *value)
+{
+  const gchar *roots[] = { srcdir, NULL };
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autoptr(GInputStream) input = g_memory_input_stream_new ();
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  g_autoptr(GIOStream) io = g_simple_io_stream_new (input, output);
+  gboolean done = FALSE;
+
+  if (header)
+    g_hash_table_insert (headers, g_strdup (header), g_strdup (value));
+
+  g_autoptr(CockpitWebResponse) response = cockpit_web_response_new (io, path, path, headers, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_done_set_flag), &done);
+
+  cockpit_web_response_file (response, NULL, roots);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                    g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+}
+
+static void
+test_file_validators (void)
+{
+  const gchar *path = "/src/common/mock-content/test-file.txt";
+  g_autoptr(GHashTable) headers = NULL;
+  guint status;
+  gssize off;
+
+  g_autofree gchar *resp = request_file (path, NULL, NULL);
+  off = web_socket_util_parse_status_line (resp, strlen (resp), NULL, &status, NULL);
+  g_assert_cmpint (off, >, 0);
+  g_assert_cmpint (status, ==, 200);
+  g_assert_cmpint (web_socket_util_parse_headers (resp + off, strlen (resp) - off, &headers), >, 0);
+
+  const gchar *etag = g_hash_table_lookup (headers, "ETag");
+  const gchar *last_modified = g_hash_table_lookup (headers, "Last-Modified");
+  g_assert (etag != NULL);
+  g_assert (last_modified != NULL);
+
+  /* The validators that the browser got back, in either header */
+  g_autofree gchar *by_etag = request_file (path, "If-None-Match", etag);
+  g_assert (g_str_has_prefix (by_etag, "HTTP/1.1 304 Not Modified\r\n"));
+  g_autofree gchar *by_date = request_file (path, "If-Modified-Since", last_modified);
+  g_assert (g_str_has_prefix (by_date, "HTTP/1.1 304 Not Modified\r\n"));
+
+  /* A weak version of the tag also matches */
+  g_autofree gchar *weak = g_strconcat ("W/", etag, NULL);
+  g_autofree gchar *by_weak = request_file (path, "If-None-Match", weak);
+  g_assert (g_str_has_prefix (by_weak, "HTTP/1.1 304 Not Modified\r\n"));
+}
+
 static const TestFixture template_fixture = {
   .path = "/test.css"
 };
@@ -414,6 +704,16 @@ static const TestFixture cache_unset_fixture = {
   .cache = COCKPIT_WEB_RESPONSE_CACHE_UNSET
 };
 
+static const TestFixture cache_revalidate_fixture = {
+  .path = "/pkg/shell/index.html",
+  .cache = COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE
+};
+
+static const TestFixture cache_immutable_fixture = {
+  .path = "/pkg/shell/index.html",
+  .cache = COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE
+};
+
 static void
 test_cache (TestCase *tc,
             gconstpointer user_data)
@@ -439,7 +739,7 @@ test_cache (TestCase *tc,
   off = web_socket_util_parse_headers (resp + off, length - off, &headers);
   g_assert_cmpuint (off, >, 0);
 
-  if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE)
+  if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE || fixture->cache == COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE)
     g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Cookie");
   else
     g_assert_null (g_hash_table_lookup (headers, "Vary"));
@@ -448,11 +748,52 @@ test_cache (TestCase *tc,
     g_assert_cmpstr (g_hash_table_lookup (headers, "Cache-Control"), ==, "no-cache, no-store");
   else if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE)
     g_assert_cmpstr (g_hash_table_lookup (headers, "Cache-Control"), ==, "max-age=86400, private");
+  else if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE)
+    g_assert_cmpstr (g_hash_table_lookup (headers, "Cache-Control"), ==, "no-cache");
+  else if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE)
+    g_assert_cmpstr (g_hash_table_lookup (headers, "Cache-Control"), ==, "max-age=31536000, private, immutable");
   else
     g_assert_null (g_hash_table_lookup (headers, "Cache-Control"));
   g_hash_table_unref (headers);
 }
 
+static const TestFixture fixture_encoded_vary = {
+  .path = "/src/common/mock-content/test-file.txt",
+  .header = "Accept-Encoding",
+  .value = "gzip",
+  .cache = COCKPIT_WEB_RESPONSE_CACHE,
+};
+
+static void
+test_file_encoded_vary (TestCase *tc,
+                        gconstpointer user_data)
+{
+  const TestFixture *fixture = user_data;
+  const gchar *roots[] = { srcdir, NULL };
+  const gchar *encodings[] = { "gzip", NULL };
+  g_autoptr(GHashTable) headers = NULL;
+  const gchar *resp;
+  gsize length;
+  guint status;
+  gssize off;
+
+  cockpit_web_response_set_cache_type (tc->response, fixture->cache);
+  cockpit_web_response_file_encoded (tc->response, encodings, NULL, roots);
+
+  resp = output_as_string (tc);
+  length = strlen (resp);
+
+  off = web_socket_util_parse_status_line (resp, length, NULL, &status, NULL);
+  g_assert_cmpuint (off, >, 0);
+  g_assert_cmpint (status, ==, 200);
+
+  off = web_socket_util_parse_headers (resp + off, length - off, &headers);
+  g_assert_cmpuint (off, >, 0);
+
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Encoding"), ==, "gzip");
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Cookie, Accept-Encoding");
+}
+
 static void
 test_content_encoding (TestCase *tc,
                        gconstpointer data)
@@ -803,6 +1144,243 @@ test_web_filter_multiple (TestCase *tc,
                    "0\r\n\r\n");
 }
 
+static const TestFixture fixture_compress = {
+  .path = "/journal.json",
+  .header = "Accept-Encoding",
+  .value = "gzip, deflate, br",
+};
+
+static const TestFixture fixture_compress_refused = {
+  .path = "/journal.json",
+  .header = "Accept-Encoding",
+  .value = "br, gzip;q=0",
+};
+
+static GBytes *
+dechunk_body (TestCase *tc,
+              gchar **headers)
+{
+  while (!tc->response_done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return dechunk_data (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (tc->output)),
+                       g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (tc->output)),
+                       headers);
+}
+
+static void
+test_compress (TestCase *tc,
+               gconstpointer data)
+{
+  GError *error = NULL;
+  gchar *headers;
+  GString *expected;
+  GBytes *content;
+  GBytes *body;
+  GBytes *bytes;
+  gint i;
+
+  cockpit_web_compress_set_level (6);
+  cockpit_web_response_set_cache_type (tc->response, COCKPIT_WEB_RESPONSE_CACHE);
+  g_assert (cockpit_web_response_compress (tc->response, 200, NULL, -1));
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, NULL);
+
+  expected = g_string_new ("");
+  for (i = 0; i < 100; i++)
+    {
+      g_autofree gchar *line = g_strdup_printf ("{\"MESSAGE\": \"Line number %d\"}\n", i);
+      content = g_bytes_new (line, strlen (line));
+      cockpit_web_response_queue (tc->response, content);
+      g_bytes_unref (content);
+      g_string_append (expected, line);
+    }
+  cockpit_web_response_complete (tc->response);
+  cockpit_web_compress_set_level (0);
+
+  body = dechunk_body (tc, &headers);
+  g_assert (strstr (headers, "\r\nContent-Encoding: gzip\r\n") != NULL);
+  g_assert (strstr (headers, "\r\nTransfer-Encoding: chunked\r\n") != NULL);
+  g_assert (strstr (headers, "\r\nVary: Cookie, Accept-Encoding\r\n") != NULL);
+  g_assert_cmpuint (g_bytes_get_size (body), <, expected->len);
+
+  bytes = cockpit_web_response_gunzip (body, &error);
+  g_assert_no_error (error);
+  cockpit_assert_bytes_eq (bytes, expected->str, expected->len);
+
+  g_bytes_unref (bytes);
+  g_bytes_unref (body);
+  g_string_free (expected, TRUE);
+  g_free (headers);
+}
+
+static void
+test_compress_empty (TestCase *tc,
+                     gconstpointer data)
+{
+  GError *error = NULL;
+  gchar *headers;
+  GBytes *body;
+  GBytes *bytes;
+
+  cockpit_web_compress_set_level (1);
+  g_assert (cockpit_web_response_compress (tc->response, 200, "text/plain", -1));
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, NULL);
+  cockpit_web_response_complete (tc->response);
+  cockpit_web_compress_set_level (0);
+
+  /* Still a valid gzip stream */
+  body = dechunk_body (tc, &headers);
+  bytes = cockpit_web_response_gunzip (body, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 0);
+
+  g_bytes_unref (bytes);
+  g_bytes_unref (body);
+  g_free (headers);
+}
+
+static void
+test_compress_skipped (TestCase *tc,
+                       gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  const gchar *resp;
+  GBytes *content;
+
+  /* Disabled */
+  g_assert (!cockpit_web_response_compress (tc->response, 200, "text/plain", -1));
+
+  cockpit_web_compress_set_level (6);
+  cockpit_web_compress_set_minimum (20);
+
+  if (fixture == &fixture_compress)
+    {
+      g_assert (!cockpit_web_response_compress (tc->response, 200, "image/png", -1));
+      g_assert (!cockpit_web_response_compress (tc->response, 200, "text/plain", 19));
+      g_assert (!cockpit_web_response_compress (tc->response, 204, "text/plain", -1));
+      g_assert (!cockpit_web_response_compress (tc->response, 404, "text/plain", -1));
+    }
+  else
+    {
+      /* Not accepted */
+      g_assert (!cockpit_web_response_compress (tc->response, 200, "text/plain", -1));
+    }
+
+  cockpit_web_compress_set_minimum (COCKPIT_WEB_COMPRESS_DEFAULT_MINIMUM);
+  cockpit_web_compress_set_level (0);
+
+  content = g_bytes_new_static ("the content", 11);
+  cockpit_web_response_content (tc->response, NULL, content, NULL);
+  g_bytes_unref (content);
+
+  resp = output_as_string (tc);
+  g_assert (strstr (resp, "Content-Encoding") == NULL);
+  g_assert (g_str_has_suffix (resp, "\r\n\r\nthe content"));
+
+  /* Only a client that accepts gzip would have gotten something else */
+  if (fixture == &fixture_compress)
+    g_assert (strstr (resp, "\r\nVary:") == NULL);
+  else
+    g_assert (strstr (resp, "\r\nVary: Accept-Encoding\r\n") != NULL);
+}
+
+static GBytes *
+gzip_string (const gchar *data)
+{
+  g_autoptr(GConverter) compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+  g_autoptr(GOutputStream) memory = g_memory_output_stream_new_resizable ();
+  g_autoptr(GOutputStream) stream = g_converter_output_stream_new (memory, compressor);
+
+  g_assert (g_output_stream_write_all (stream, data, strlen (data), NULL, NULL, NULL));
+  g_assert (g_output_stream_close (stream, NULL, NULL));
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (memory));
+}
+
+static void
+test_decompress_inject (TestCase *tc,
+                        gconstpointer data)
+{
+  CockpitWebFilter *filter;
+  gchar *headers;
+  GBytes *compressed;
+  GBytes *inject;
+  GBytes *block;
+  GBytes *body;
+  gsize i, len;
+
+  filter = cockpit_web_decompress_new ();
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+
+  inject = bytes_static ("<meta inject>");
+  filter = cockpit_web_inject_new ("<head>", inject, 1);
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+  g_bytes_unref (inject);
+
+  cockpit_web_response_headers (tc->response, 200, "OK", -1, NULL);
+
+  /* The marker ends up split across the compressed blocks */
+  compressed = gzip_string ("<html><head><title>The Title</title></head></html>");
+  len = g_bytes_get_size (compressed);
+  for (i = 0; i < len; i += 3)
+    {
+      block = g_bytes_new_from_bytes (compressed, i, MIN (3, len - i));
+      g_assert (cockpit_web_response_queue (tc->response, block) == TRUE);
+      g_bytes_unref (block);
+    }
+  g_bytes_unref (compressed);
+
+  cockpit_web_response_complete (tc->response);
+
+  body = dechunk_body (tc, &headers);
+  g_assert (strstr (headers, "Content-Encoding") == NULL);
+  cockpit_assert_bytes_eq (body, "<html><head><meta inject><title>The Title</title></head></html>", -1);
+
+  g_bytes_unref (body);
+  g_free (headers);
+}
+
+static void
+test_decompress_corrupt (TestCase *tc,
+                         gconstpointer data)
+{
+  CockpitWebFilter *filter;
+  gchar *headers;
+  GBytes *body;
+
+  filter = cockpit_web_decompress_new ();
+  cockpit_web_response_add_filter (tc->response, filter);
+  g_object_unref (filter);
+
+  cockpit_expect_message ("couldn't decompress response data:*");
+
+  body = bytes_static ("this isn't gzip");
+  cockpit_web_response_content (tc->response, NULL, body, NULL);
+  g_bytes_unref (body);
+
+  body = dechunk_body (tc, &headers);
+  g_assert_cmpuint (g_bytes_get_size (body), ==, 0);
+
+  cockpit_assert_expected ();
+  g_bytes_unref (body);
+  g_free (headers);
+}
+
+static void
+test_compressible (void)
+{
+  g_assert (cockpit_web_compress_is_compressible ("text/html"));
+  g_assert (cockpit_web_compress_is_compressible ("text/plain; charset=utf-8"));
+  g_assert (cockpit_web_compress_is_compressible ("Application/JSON"));
+  g_assert (cockpit_web_compress_is_compressible ("application/manifest+json"));
+  g_assert (cockpit_web_compress_is_compressible ("image/svg+xml"));
+  g_assert (!cockpit_web_compress_is_compressible ("image/png"));
+  g_assert (!cockpit_web_compress_is_compressible ("application/octet-stream"));
+  g_assert (!cockpit_web_compress_is_compressible ("application/x-xz"));
+  g_assert (!cockpit_web_compress_is_compressible (NULL));
+}
+
 static void
 test_web_filter_split (TestCase *tc,
                        gconstpointer data)
@@ -1409,6 +1987,69 @@ test_negotiation_locale (void)
   g_assert (!is_compressed);
 }
 
+static void
+test_negotiation_encoded (void)
+{
+  const gchar *encodings[] = { "br", "zstd", "gzip", NULL };
+  const gchar *encoding = "invalid";
+  gboolean is_language_specific;
+  GError *error = NULL;
+  gchar *checksum;
+  GBytes *bytes;
+
+  /* There is no .br variant, so the next best is used */
+  bytes = cockpit_web_response_negotiation_encoded (SRCDIR "/src/common/mock-content/test-file.txt",
+                                                    NULL, NULL, encodings, &is_language_specific,
+                                                    &encoding, &error);
+  g_assert_no_error (error);
+  g_assert (!is_language_specific);
+  g_assert_cmpstr (encoding, ==, "zstd");
+
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_MD5, bytes);
+  g_assert_cmpstr (checksum, ==, "6c4a88452e39ed3e6595883618a7a25e");
+  g_free (checksum);
+  g_bytes_unref (bytes);
+
+  /* Only gzip accepted */
+  bytes = cockpit_web_response_negotiation_encoded (SRCDIR "/src/common/mock-content/test-file.txt",
+                                                    NULL, NULL, encodings + 2, &is_language_specific,
+                                                    &encoding, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (encoding, ==, "gzip");
+  g_bytes_unref (bytes);
+
+  /* Nothing accepted */
+  bytes = cockpit_web_response_negotiation_encoded (SRCDIR "/src/common/mock-content/test-file.txt",
+                                                    NULL, NULL, encodings + 3, &is_language_specific,
+                                                    &encoding, &error);
+  g_assert_no_error (error);
+  g_assert (encoding == NULL);
+  cockpit_assert_bytes_eq (bytes, "A small test file\n", -1);
+  g_bytes_unref (bytes);
+}
+
+static void
+test_negotiation_encoded_locale (void)
+{
+  const gchar *encodings[] = { "zstd", NULL };
+  const gchar *encoding = "invalid";
+  gboolean is_language_specific;
+  GError *error = NULL;
+  GBytes *bytes;
+
+  /* A translation wins over a compressed untranslated file */
+  bytes = cockpit_web_response_negotiation_encoded (SRCDIR "/src/common/mock-content/test-file.txt",
+                                                    NULL, "zh-cn", encodings, &is_language_specific,
+                                                    &encoding, &error);
+
+  cockpit_assert_bytes_eq (bytes, "A translated test file\n", -1);
+  g_assert_no_error (error);
+  g_bytes_unref (bytes);
+
+  g_assert (is_language_specific);
+  g_assert (encoding == NULL);
+}
+
 static void
 test_negotiation_notfound (void)
 {
@@ -1462,6 +2103,20 @@ main (int argc,
               setup, test_return_error_headers, teardown);
   g_test_add ("/web-response/return-gerror-headers", TestCase, NULL,
               setup, test_return_gerror_headers, teardown);
+  g_test_add_data_func ("/web-response/file/sendfile", &sendfile_fixture_get, test_file_sendfile);
+  g_test_add_data_func ("/web-response/file/sendfile-head", &sendfile_fixture_head, test_file_sendfile);
+  g_test_add_data_func ("/web-response/file/sendfile-encoded", &sendfile_fixture_encoded, test_file_sendfile);
+  for (gsize i = 0; i < G_N_ELEMENTS (range_fixtures); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("/web-response/file/range/%" G_GSIZE_FORMAT, i);
+      g_test_add (name, TestCase, &range_fixtures[i], setup, test_file_range, teardown);
+    }
+  for (gsize i = 0; i < G_N_ELEMENTS (conditional_fixtures); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("/web-response/file/conditional/%" G_GSIZE_FORMAT, i);
+      g_test_add (name, TestCase, &conditional_fixtures[i], setup, test_file_range, teardown);
+    }
+  g_test_add_func ("/web-response/file/validators", test_file_validators);
   g_test_add ("/web-response/file/not-found", TestCase, NULL,
               setup, test_file_not_found, teardown);
   g_test_add ("/web-response/file/directory-denied", TestCase, NULL,
@@ -1513,6 +2168,12 @@ main (int argc,
               setup, test_cache, teardown);
   g_test_add ("/web-response/cache-unset", TestCase, &cache_unset_fixture,
               setup, test_cache, teardown);
+  g_test_add ("/web-response/cache-revalidate", TestCase, &cache_revalidate_fixture,
+              setup, test_cache, teardown);
+  g_test_add ("/web-response/cache-immutable", TestCase, &cache_immutable_fixture,
+              setup, test_cache, teardown);
+  g_test_add ("/web-response/file-encoded-vary", TestCase, &fixture_encoded_vary,
+              setup, test_file_encoded_vary, teardown);
 
   g_test_add ("/web-response/filter/simple", TestCase, NULL,
               setup, test_web_filter_simple, teardown);
@@ -1520,6 +2181,19 @@ main (int argc,
               setup, test_web_filter_multiple, teardown);
   g_test_add ("/web-response/filter/passthrough", TestCase, NULL,
               setup, test_web_filter_passthrough, teardown);
+  g_test_add ("/web-response/compress/gzip", TestCase, &fixture_compress,
+              setup, test_compress, teardown);
+  g_test_add ("/web-response/compress/empty", TestCase, &fixture_compress,
+              setup, test_compress_empty, teardown);
+  g_test_add ("/web-response/compress/skipped", TestCase, &fixture_compress,
+              setup, test_compress_skipped, teardown);
+  g_test_add ("/web-response/compress/refused", TestCase, &fixture_compress_refused,
+              setup, test_compress_skipped, teardown);
+  g_test_add_func ("/web-response/compress/compressible", test_compressible);
+  g_test_add ("/web-response/compress/decompress-inject", TestCase, NULL,
+              setup, test_decompress_inject, teardown);
+  g_test_add ("/web-response/compress/decompress-corrupt", TestCase, NULL,
+              setup, test_decompress_corrupt, teardown);
   g_test_add ("/web-response/filter/split", TestCase, NULL,
               setup, test_web_filter_split, teardown);
   g_test_add ("/web-response/filter/shift", TestCase, NULL,
@@ -1545,6 +2219,8 @@ main (int argc,
   g_test_add_func ("/web-response/negotiation/first", test_negotiation_first);
   g_test_add_func ("/web-response/negotiation/last", test_negotiation_last);
   g_test_add_func ("/web-response/negotiation/locale", test_negotiation_locale);
+  g_test_add_func ("/web-response/negotiation/encoded", test_negotiation_encoded);
+  g_test_add_func ("/web-response/negotiation/encoded-locale", test_negotiation_encoded_locale);
   g_test_add_func ("/web-response/negotiation/prune", test_negotiation_prune);
   g_test_add_func ("/web-response/negotiation/with-listing", test_negotiation_with_listing);
   g_test_add_func ("/web-response/negotiation/notfound", test_negotiation_notfound);
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpitwebserver.h"
+#include "cockpitwebrequest-private.h"
 #include "cockpitwebresponse.h"
 
 #include "common/cockpitsystem.h"
@@ -360,6 +361,204 @@ test_accept_list_order (void)
   g_strfreev (result);
 }
 
+typedef struct {
+  const gchar *header;
+  const gchar *expected;
+} AcceptEncodingFixture;
+
+static const AcceptEncodingFixture accept_encoding_fixtures[] = {
+  { NULL, "br, zstd, gzip" },
+  { "", "" },
+  { "identity", "" },
+  { "gzip, deflate, br, zstd", "br, zstd, gzip" },
+  { "gzip;q=1.0, br;q=0.5", "gzip, br" },
+  { "GZIP , Br", "br, gzip" },
+  { "*;q=0.1, gzip", "gzip, br, zstd" },
+  { "br;q=0, *", "zstd, gzip" },
+  { "zstd;q=xx, gzip;q=0.001", "gzip" },
+};
+
+static void
+test_accept_encoding (gconstpointer data)
+{
+  const AcceptEncodingFixture *fixture = data;
+  const gchar *supported[] = { "br", "zstd", "gzip", NULL };
+  gchar **result;
+  gchar *string;
+
+  result = cockpit_web_server_parse_accept_encoding (fixture->header, supported);
+  g_assert (result != NULL);
+
+  string = g_strjoinv (", ", result);
+  g_assert_cmpstr (string, ==, fixture->expected);
+
+  g_free (string);
+  g_strfreev (result);
+}
+
+typedef struct {
+  const gchar *header;
+  gboolean valid;
+  gint64 first;
+  gint64 last;
+} RangeFixture;
+
+static const RangeFixture range_fixtures[] = {
+  { NULL, FALSE },
+  { "", FALSE },
+  { "bytes=0-499", TRUE, 0, 499 },
+  { " Bytes = 500-999", FALSE },
+  { "bytes=500-", TRUE, 500, -1 },
+  { "bytes=-500", TRUE, -1, 500 },
+  { "bytes= 7-7 ", TRUE, 7, 7 },
+  { "bytes=10-5", FALSE },
+  { "bytes=0-1,5-6", FALSE },
+  { "bytes=-", FALSE },
+  { "bytes=a-b", FALSE },
+  { "bytes=+1-2", FALSE },
+  { "bytes=99999999999999999999-", FALSE },
+  { "lines=1-2", FALSE },
+};
+
+static void
+test_parse_range (gconstpointer data)
+{
+  const RangeFixture *fixture = data;
+  gint64 first = G_MININT64;
+  gint64 last = G_MININT64;
+
+  g_assert_cmpint (cockpit_web_server_parse_range (fixture->header, &first, &last), ==, fixture->valid);
+  if (fixture->valid)
+    {
+      g_assert_cmpint (first, ==, fixture->first);
+      g_assert_cmpint (last, ==, fixture->last);
+    }
+}
+
+typedef struct {
+  const gchar *value;
+  gboolean valid;
+  gint64 seconds;
+} HttpDateFixture;
+
+static const HttpDateFixture http_date_fixtures[] = {
+  { NULL, FALSE },
+  { "", FALSE },
+  { "Sun, 06 Nov 1994 08:49:37 GMT", TRUE, 784111777 },
+  { " Sun, 06 Nov 1994 08:49:37 GMT ", TRUE, 784111777 },
+  { "Thu, 01 Jan 1970 00:00:00 GMT", TRUE, 0 },
+  { "Tue, 29 Feb 2000 12:00:00 GMT", TRUE, 951825600 },
+  { "Sunday, 06-Nov-94 08:49:37 GMT", FALSE },
+  { "Sun Nov  6 08:49:37 1994", FALSE },
+  { "Sun, 06 Nov 1994 08:49:37 UTC", FALSE },
+  { "Sun, 06 Nov 1994 08:49:37 GMT+1", FALSE },
+  { "Sun, 06 Foo 1994 08:49:37 GMT", FALSE },
+  { "Tue, 30 Feb 2000 12:00:00 GMT", FALSE },
+  { "Sun, 06 Nov 1994 24:49:37 GMT", FALSE },
+  { "Sun, 06 Nov 1994 08:49:60 GMT", FALSE },
+};
+
+static void
+test_parse_http_date (gconstpointer data)
+{
+  const HttpDateFixture *fixture = data;
+  gint64 seconds = G_MININT64;
+
+  g_assert_cmpint (cockpit_web_server_parse_http_date (fixture->value, &seconds), ==, fixture->valid);
+  if (fixture->valid)
+    {
+      g_assert_cmpint (seconds, ==, fixture->seconds);
+
+      /* And back again, without the extra spaces */
+      g_autofree gchar *formatted = cockpit_web_server_format_http_date (seconds);
+      g_autofree gchar *stripped = g_strstrip (g_strdup (fixture->value));
+      g_assert_cmpstr (formatted, ==, stripped);
+    }
+}
+
+static void
+test_header_index (void)
+{
+  const gchar *input = "Host: localhost:9090\r\n"
+                       "accept-encoding:gzip, br \r\n"
+                       "X-Custom:  one\r\n"
+                       "Empty:\r\n"
+                       "x-custom: two\r\n"
+                       "\r\n"
+                       "trailing data";
+  CockpitWebHeaderIndex index;
+  g_autofree gchar *data = g_strdup (input);
+  g_autoptr(GHashTable) expected = NULL;
+  g_autoptr(GHashTable) table = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  gssize ret;
+
+  ret = cockpit_web_header_index_parse (&index, data, strlen (data));
+  g_assert_cmpint (ret, ==, strlen (input) - strlen ("trailing data"));
+  g_assert_cmpuint (index.n_spans, ==, 5);
+
+  /* Nothing can be looked up, and the input is untouched */
+  g_assert_null (cockpit_web_header_index_lookup (&index, "Host"));
+  g_assert_cmpstr (data, ==, input);
+
+  cockpit_web_header_index_terminate (&index, data);
+  g_assert_cmpstr (cockpit_web_header_index_lookup (&index, "Host"), ==, "localhost:9090");
+  g_assert_cmpstr (cockpit_web_header_index_lookup (&index, "HOST"), ==, "localhost:9090");
+  g_assert_cmpstr (cockpit_web_header_index_lookup (&index, "Accept-Encoding"), ==, "gzip, br");
+  g_assert_cmpstr (cockpit_web_header_index_lookup (&index, "X-Custom"), ==, "two");
+  g_assert_cmpstr (cockpit_web_header_index_lookup (&index, "Empty"), ==, "");
+  g_assert_null (cockpit_web_header_index_lookup (&index, "Cookie"));
+  g_assert_null (cockpit_web_header_index_lookup (&index, "Missing"));
+
+  /* Same as the general purpose parser */
+  g_assert_cmpint (web_socket_util_parse_headers (input, strlen (input), &expected), ==, ret);
+  table = cockpit_web_header_index_to_table (&index);
+  g_assert_cmpuint (g_hash_table_size (table), ==, g_hash_table_size (expected));
+  g_hash_table_iter_init (&iter, expected);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_assert_cmpstr (g_hash_table_lookup (table, key), ==, value);
+}
+
+static void
+test_header_index_intern (void)
+{
+  g_assert_cmpint (cockpit_web_header_name_intern ("Host", 4), ==, COCKPIT_WEB_HEADER_HOST);
+  g_assert_cmpint (cockpit_web_header_name_intern ("CONTENT-LENGTH", 14), ==, COCKPIT_WEB_HEADER_CONTENT_LENGTH);
+  g_assert_cmpint (cockpit_web_header_name_intern ("Range: bytes", 5), ==, COCKPIT_WEB_HEADER_RANGE);
+  g_assert_cmpint (cockpit_web_header_name_intern ("Ranges", 6), ==, COCKPIT_WEB_HEADER_OTHER);
+  g_assert_cmpint (cockpit_web_header_name_intern ("", 0), ==, COCKPIT_WEB_HEADER_OTHER);
+}
+
+static void
+test_header_index_bad (void)
+{
+  const gchar *truncated = "Host: localhost\r\nAccept: */*\r\n";
+  const gchar *bad[] = {
+    "Host\r\n\r\n",
+    ": value\r\n\r\n",
+    "Na\x01me: value\r\n\r\n",
+    "Name: \xff\r\n\r\n",
+  };
+  CockpitWebHeaderIndex index;
+  GString *many;
+  gsize i;
+
+  g_assert_cmpint (cockpit_web_header_index_parse (&index, truncated, strlen (truncated)), ==, 0);
+  for (i = 0; i < G_N_ELEMENTS (bad); i++)
+    g_assert_cmpint (cockpit_web_header_index_parse (&index, bad[i], strlen (bad[i])), <, 0);
+
+  many = g_string_new ("");
+  for (i = 0; i < COCKPIT_WEB_HEADER_INDEX_MAX; i++)
+    g_string_append_printf (many, "X-Header-%" G_GSIZE_FORMAT ": %" G_GSIZE_FORMAT "\r\n", i, i);
+  g_string_append (many, "\r\n");
+  g_assert_cmpint (cockpit_web_header_index_parse (&index, many->str, many->len), ==, many->len);
+
+  g_string_insert (many, 0, "X-One-Too-Many: yes\r\n");
+  g_assert_cmpint (cockpit_web_header_index_parse (&index, many->str, many->len), <, 0);
+  g_string_free (many, TRUE);
+}
+
 static void
 on_ready_get_result (GObject *source,
                      GAsyncResult *result,
@@ -1016,6 +1215,42 @@ test_bad_address (Fixture *fixture,
                                 "Couldn't parse IP address from `bad`");
 }
 
+static void
+test_reuse_port (void)
+{
+  g_autoptr(CockpitWebServer) one = cockpit_web_server_new (NULL, COCKPIT_WEB_SERVER_REUSE_PORT);
+  g_autoptr(CockpitWebServer) two = cockpit_web_server_new (NULL, COCKPIT_WEB_SERVER_REUSE_PORT);
+  g_autoptr(CockpitWebServer) other = cockpit_web_server_new (NULL, COCKPIT_WEB_SERVER_NONE);
+  g_autoptr(GError) error = NULL;
+  guint16 port;
+
+  port = cockpit_web_server_add_inet_listener (one, "127.0.0.1", 0, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (port, !=, 0);
+
+  /* a second server with the flag can bind the very same port... */
+  g_assert_cmpuint (cockpit_web_server_add_inet_listener (two, "127.0.0.1", port, &error), ==, port);
+  g_assert_no_error (error);
+
+  /* ... but one without it can't */
+  g_assert_cmpuint (cockpit_web_server_add_inet_listener (other, "127.0.0.1", port, &error), ==, 0);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_ADDRESS_IN_USE);
+  g_clear_error (&error);
+
+  /* both servers serve requests */
+  cockpit_web_server_start (one);
+  cockpit_web_server_start (two);
+  g_signal_connect (one, "handle-resource", G_CALLBACK (on_shell_index_html), NULL);
+  g_signal_connect (two, "handle-resource", G_CALLBACK (on_shell_index_html), NULL);
+
+  g_autofree gchar *hostport = g_strdup_printf ("127.0.0.1:%u", port);
+  for (gint i = 0; i < 4; i++)
+    {
+      g_autofree gchar *resp = perform_http_request (hostport, "GET /shell/index.html HTTP/1.0\r\nHost:test\r\n\r\n", NULL);
+      cockpit_assert_strmatch (resp, "HTTP/* 200 *\r\n*");
+    }
+}
+
 static void
 test_webserver_for_tls_proxy (Fixture *fixture,
                               const TestCase *test_case)
@@ -1054,6 +1289,9 @@ main (int argc,
   cockpit_test_init (&argc, &argv);
 
   g_test_add_func ("/web-server/table", test_table);
+  g_test_add_func ("/web-server/header-index/parse", test_header_index);
+  g_test_add_func ("/web-server/header-index/intern", test_header_index_intern);
+  g_test_add_func ("/web-server/header-index/bad", test_header_index_bad);
 
   g_test_add_func ("/web-server/cookie/simple", test_cookie_simple);
   g_test_add_func ("/web-server/cookie/multiple", test_cookie_multiple);
@@ -1067,6 +1305,21 @@ main (int argc,
   g_test_add_func ("/web-server/accept-listlanguages/cookie", test_accept_list_cookie);
   g_test_add_func ("/web-server/accept-list/no-header", test_accept_list_no_header);
   g_test_add_func ("/web-server/accept-list/order", test_accept_list_order);
+  for (gsize i = 0; i < G_N_ELEMENTS (range_fixtures); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("/web-server/range/%" G_GSIZE_FORMAT, i);
+      g_test_add_data_func (name, &range_fixtures[i], test_parse_range);
+    }
+  for (gsize i = 0; i < G_N_ELEMENTS (http_date_fixtures); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("/web-server/http-date/%" G_GSIZE_FORMAT, i);
+      g_test_add_data_func (name, &http_date_fixtures[i], test_parse_http_date);
+    }
+  for (gsize i = 0; i < G_N_ELEMENTS (accept_encoding_fixtures); i++)
+    {
+      g_autofree gchar *name = g_strdup_printf ("/web-server/accept-encoding/%" G_GSIZE_FORMAT, i);
+      g_test_add_data_func (name, &accept_encoding_fixtures[i], test_accept_encoding);
+    }
 
   cockpit_test_add ("/web-server/query-string", test_with_query_string);
   cockpit_test_add ("/web-server/host-header", test_webserver_host_header);
@@ -1096,6 +1349,7 @@ main (int argc,
   cockpit_test_add ("/web-server/local-address-only", test_address, .local_only=TRUE);
   cockpit_test_add ("/web-server/inet-address-only", test_address, .inet_only=TRUE);
   cockpit_test_add ("/web-server/bad-address", test_bad_address);
+  g_test_add_func ("/web-server/reuse-port", test_reuse_port);
 
   cockpit_test_add ("/web-server/for-tls-proxy", test_webserver_for_tls_proxy,
                     .local_only=TRUE, .server_flags=COCKPIT_WEB_SERVER_FOR_TLS_PROXY, .expected_protocol="https");
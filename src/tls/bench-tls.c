@@ -0,0 +1,688 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bench-tls: load generator for cockpit-tls
+ *
+ * This runs the cockpit-tls server code in a child process, with echo
+ * servers in place of the cockpit-ws instances, and hammers it with
+ * concurrent TLS and plain HTTP clients.  Each client connects, sends
+ * the payload, and reads it back.  In the end, it reports the handshake
+ * rate and latency, the relay throughput, and how much memory the
+ * server needed.
+ *
+ * This is not a test: it doesn't fail on bad numbers.  Compare the
+ * results before and after a change, on the same machine.
+ */
+
+#include "config.h"
+
+#include <argp.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gnutls/gnutls.h>
+
+#include <common/cockpitmemory.h>
+
+#include "connection.h"
+#include "server.h"
+#include "socket-io.h"
+#include "utils.h"
+
+/* this has a corresponding mock-server.key */
+#define CERTFILE SRCDIR "/src/bridge/mock-server.crt"
+#define KEYFILE SRCDIR "/src/bridge/mock-server.key"
+
+#define CHUNK_SIZE (16u << 10)
+
+/* CLI arguments */
+static struct {
+  unsigned connections;
+  unsigned parallel;
+  unsigned plain_percent;
+  size_t payload;
+  const char *priority;
+  bool reuse_port;
+} arguments = {
+  .connections = 1000,
+  .parallel = 32,
+  .plain_percent = 25,
+  .payload = 64 << 10,
+};
+
+/* shared between the client threads */
+static struct {
+  uint16_t port;
+  gnutls_certificate_credentials_t credentials;
+  atomic_uint next_connection;
+  atomic_uint failures;
+  atomic_uint tls_connections;
+  atomic_ullong bytes;
+
+  /* handshake latencies in microseconds, one slot per connection */
+  uint64_t *latencies;
+} bench;
+
+#define OPT_PLAIN 1000
+#define OPT_PRIORITY 1001
+#define OPT_REUSE_PORT 1002
+
+static unsigned
+arg_parse_uint (char *arg, struct argp_state *state, unsigned long min, unsigned long max, const char *error_msg)
+{
+  char *endptr = NULL;
+  unsigned long num = strtoul (arg, &endptr, 10);
+
+  if (!*arg || *endptr != '\0' || num < min || num > max)
+    argp_error (state, "%s: %s", error_msg, arg);
+  return (unsigned) num;
+}
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+      case 'c':
+        arguments.connections = arg_parse_uint (arg, state, 1, 1000000, "Invalid number of connections");
+        break;
+      case 'j':
+        arguments.parallel = arg_parse_uint (arg, state, 1, 10000, "Invalid number of parallel clients");
+        break;
+      case 's':
+        arguments.payload = arg_parse_uint (arg, state, 0, 1u << 30, "Invalid payload size");
+        break;
+      case OPT_PLAIN:
+        arguments.plain_percent = arg_parse_uint (arg, state, 0, 100, "Invalid percentage");
+        break;
+      case OPT_PRIORITY:
+        arguments.priority = arg;
+        break;
+      case OPT_REUSE_PORT:
+        arguments.reuse_port = true;
+        break;
+      default:
+        return ARGP_ERR_UNKNOWN;
+    }
+  return 0;
+}
+
+static struct argp_option options[] = {
+  {"connections", 'c', "COUNT", 0, "Total number of connections (default: 1000)" },
+  {"parallel", 'j', "COUNT", 0, "Number of concurrent clients (default: 32)" },
+  {"payload", 's', "BYTES", 0, "Bytes to send and receive on each connection (default: 65536)" },
+  {"plain", OPT_PLAIN, "PERCENT", 0, "Share of unencrypted connections (default: 25)" },
+  {"priority", OPT_PRIORITY, "STRING", 0, "gnutls priority string for the clients, e. g. to pick a cipher" },
+  {"reuse-port", OPT_REUSE_PORT, 0, 0, "Let every server thread accept on its own socket" },
+  { 0 }
+};
+
+static const struct argp argp = {
+  .options = options,
+  .parser = parse_opt,
+  .doc = "bench-tls -- load generator for cockpit-tls",
+};
+
+static uint64_t
+get_monotonic_time (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/***********************************
+ *
+ * Mock cockpit-ws instances
+ *
+ ***********************************/
+
+/* Echo everything back, until EOF.  The first chunk from cockpit-tls
+ * comes with the metadata fd, which we just close.
+ */
+static void *
+echo_thread (void *data)
+{
+  int fd = (intptr_t) data;
+  char buffer[CHUNK_SIZE];
+
+  for (;;)
+    {
+      char control[CMSG_SPACE (sizeof (int))];
+      struct iovec iov = { buffer, sizeof buffer };
+      struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control };
+      ssize_t s;
+
+      do
+        s = recvmsg (fd, &msg, MSG_CMSG_CLOEXEC);
+      while (s == -1 && errno == EINTR);
+
+      if (s <= 0)
+        break;
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+          {
+            int metadata_fd;
+            memcpy (&metadata_fd, CMSG_DATA (cmsg), sizeof metadata_fd);
+            close (metadata_fd);
+          }
+
+      for (ssize_t sent = 0, w; sent < s; sent += w)
+        {
+          do
+            w = send (fd, buffer + sent, s - sent, MSG_NOSIGNAL);
+          while (w == -1 && errno == EINTR);
+
+          if (w == -1)
+            goto out;
+        }
+    }
+
+out:
+  shutdown (fd, SHUT_WR);
+  close (fd);
+  return NULL;
+}
+
+static void *
+echo_listener_thread (void *data)
+{
+  int listen_fd = (intptr_t) data;
+
+  for (;;)
+    {
+      pthread_t thread;
+      int fd;
+
+      fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          err (EXIT_FAILURE, "accept() on mock cockpit-ws socket");
+        }
+
+      if (pthread_create (&thread, NULL, echo_thread, (void *) (intptr_t) fd) != 0)
+        errx (EXIT_FAILURE, "failed to create echo thread");
+      pthread_detach (thread);
+    }
+
+  return NULL;
+}
+
+static int
+create_echo_listener (int         dirfd,
+                      const char *sockname)
+{
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+    err (EXIT_FAILURE, "socket");
+  if (af_unix_bindat (fd, dirfd, sockname) != 0 || listen (fd, 1024) != 0)
+    err (EXIT_FAILURE, "failed to listen on %s", sockname);
+
+  return fd;
+}
+
+static void
+start_echo_listener (int fd)
+{
+  pthread_t thread;
+
+  if (pthread_create (&thread, NULL, echo_listener_thread, (void *) (intptr_t) fd) != 0)
+    errx (EXIT_FAILURE, "failed to create echo listener thread");
+  pthread_detach (thread);
+}
+
+/***********************************
+ *
+ * Server process
+ *
+ ***********************************/
+
+static volatile sig_atomic_t terminated;
+
+static void
+term (int signum)
+{
+  terminated = 1;
+}
+
+static void
+run_server (const char *wsinstance_sockdir,
+            const char *runtime_dir,
+            int         port_fd)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof addr;
+  char *stats_path;
+
+  signal (SIGTERM, term);
+
+  server_init (wsinstance_sockdir, runtime_dir, 0, 0, arguments.reuse_port);
+  connection_crypto_init (CERTFILE, KEYFILE, true, GNUTLS_CERT_IGNORE);
+  server_start ();
+
+  asprintfx (&stats_path, "%s/stats.sock", runtime_dir);
+  server_listen_stats (stats_path);
+  free (stats_path);
+
+  if (getsockname (server_get_listener (), (struct sockaddr *) &addr, &addr_len) != 0)
+    err (EXIT_FAILURE, "getsockname");
+  if (write (port_fd, &addr.sin_port, sizeof addr.sin_port) != sizeof addr.sin_port)
+    err (EXIT_FAILURE, "failed to send port to parent");
+  close (port_fd);
+
+  while (!terminated)
+    server_poll_event (100);
+
+  /* let the workers notice the last disconnects */
+  for (int i = 0; i < 100 && server_num_connections () > 0; i++)
+    usleep (50000);
+
+  server_cleanup ();
+  exit (0);
+}
+
+/***********************************
+ *
+ * Clients
+ *
+ ***********************************/
+
+static bool
+wait_for (int   fd,
+          short events)
+{
+  struct pollfd pfd = { .fd = fd, .events = events };
+  int r;
+
+  do
+    r = poll (&pfd, 1, 30 * 1000);
+  while (r == -1 && errno == EINTR);
+
+  return r == 1;
+}
+
+static bool
+client_handshake (int               fd,
+                  gnutls_session_t *session)
+{
+  const char *error_pos;
+  int ret;
+
+  if (gnutls_init (session, GNUTLS_CLIENT | GNUTLS_NONBLOCK) != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "gnutls_init failed");
+
+  if (arguments.priority)
+    ret = gnutls_priority_set_direct (*session, arguments.priority, &error_pos);
+  else
+    ret = gnutls_set_default_priority (*session);
+  if (ret != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "invalid priority string: %s", gnutls_strerror (ret));
+
+  if (gnutls_credentials_set (*session, GNUTLS_CRD_CERTIFICATE, bench.credentials) != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "gnutls_credentials_set failed");
+  gnutls_transport_set_int (*session, fd);
+
+  while ((ret = gnutls_handshake (*session)) != GNUTLS_E_SUCCESS)
+    {
+      if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+        {
+          warnx ("handshake failed: %s", gnutls_strerror (ret));
+          return false;
+        }
+
+      if (!wait_for (fd, gnutls_record_get_direction (*session) ? POLLOUT : POLLIN))
+        {
+          warnx ("handshake timed out");
+          return false;
+        }
+    }
+
+  return true;
+}
+
+/* send the payload and read it back, at the same time */
+static bool
+client_echo (int              fd,
+             gnutls_session_t session,
+             const char      *payload)
+{
+  char buffer[CHUNK_SIZE];
+  size_t sent = 0, received = 0;
+
+  while (received < arguments.payload)
+    {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN | (sent < arguments.payload ? POLLOUT : 0) };
+      ssize_t s;
+
+      /* gnutls might already have decrypted records */
+      if (!session || gnutls_record_check_pending (session) == 0)
+        {
+          int r = poll (&pfd, 1, 30 * 1000);
+          if (r == 0)
+            {
+              warnx ("relay timed out");
+              return false;
+            }
+          if (r == -1)
+            {
+              if (errno == EINTR)
+                continue;
+              err (EXIT_FAILURE, "poll");
+            }
+        }
+      else
+        pfd.revents = POLLIN;
+
+      if (pfd.revents & POLLOUT)
+        {
+          size_t length = MIN (arguments.payload - sent, CHUNK_SIZE);
+
+          if (session)
+            s = gnutls_record_send (session, payload + sent, length);
+          else
+            s = send (fd, payload + sent, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+          if (s > 0)
+            sent += s;
+          else if (session ? (s != GNUTLS_E_AGAIN && s != GNUTLS_E_INTERRUPTED) : (errno != EAGAIN && errno != EINTR))
+            {
+              warnx ("failed to send payload");
+              return false;
+            }
+        }
+
+      if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+          if (session)
+            s = gnutls_record_recv (session, buffer, sizeof buffer);
+          else
+            s = recv (fd, buffer, sizeof buffer, MSG_DONTWAIT);
+
+          if (s > 0)
+            {
+              if (memcmp (buffer, payload + received, s) != 0)
+                {
+                  warnx ("received wrong data");
+                  return false;
+                }
+              received += s;
+            }
+          else if (s == 0)
+            {
+              warnx ("connection closed after %zu of %zu bytes", received, arguments.payload);
+              return false;
+            }
+          else if (session ? (s != GNUTLS_E_AGAIN && s != GNUTLS_E_INTERRUPTED) : (errno != EAGAIN && errno != EINTR))
+            {
+              warnx ("failed to receive payload");
+              return false;
+            }
+        }
+    }
+
+  atomic_fetch_add (&bench.bytes, received);
+  return true;
+}
+
+static bool
+client_run (unsigned    n,
+            const char *payload)
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = bench.port };
+  gnutls_session_t session = NULL;
+  bool tls = (n % 100) >= arguments.plain_percent;
+  bool ok = false;
+  uint64_t start;
+  int fd;
+
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    err (EXIT_FAILURE, "socket");
+
+  /* the latency includes the TCP connection setup */
+  start = get_monotonic_time ();
+  if (connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+      warn ("connect");
+      goto out;
+    }
+  if (fcntl (fd, F_SETFL, O_NONBLOCK) != 0)
+    err (EXIT_FAILURE, "fcntl");
+
+  if (tls)
+    {
+      if (!client_handshake (fd, &session))
+        goto out;
+
+      bench.latencies[atomic_fetch_add (&bench.tls_connections, 1)] = get_monotonic_time () - start;
+    }
+
+  ok = client_echo (fd, session, payload);
+
+out:
+  if (session)
+    gnutls_deinit (session);
+  close (fd);
+  return ok;
+}
+
+static void *
+client_thread (void *data)
+{
+  const char *payload = data;
+  unsigned n;
+
+  while ((n = atomic_fetch_add (&bench.next_connection, 1)) < arguments.connections)
+    if (!client_run (n, payload))
+      atomic_fetch_add (&bench.failures, 1);
+
+  return NULL;
+}
+
+/***********************************
+ *
+ * Report
+ *
+ ***********************************/
+
+static int
+compare_uint64 (const void *a,
+                const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile_ms (const uint64_t *sorted,
+               unsigned        n,
+               unsigned        percent)
+{
+  if (n == 0)
+    return 0;
+
+  return sorted[(n - 1) * percent / 100] / 1000.0;
+}
+
+static void
+print_server_stats (const char *runtime_dir)
+{
+  char path[PATH_MAX];
+  char buffer[4096];
+  ssize_t s;
+  int fd;
+
+  snprintf (path, sizeof path, "%s/stats.sock", runtime_dir);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || af_unix_connectat (fd, AT_FDCWD, path) != 0)
+    {
+      warn ("failed to connect to %s", path);
+      return;
+    }
+
+  printf ("server statistics: ");
+  fflush (stdout);
+  while ((s = read (fd, buffer, sizeof buffer)) > 0)
+    fwrite (buffer, 1, s, stdout);
+
+  close (fd);
+}
+
+int
+main (int argc, char **argv)
+{
+  char wsinstance_sockdir[] = "/tmp/bench-tls.ws.XXXXXX";
+  char runtime_dir[] = "/tmp/bench-tls.runtime.XXXXXX";
+  int http_fd, https_fd, dirfd;
+  int port_pipe[2];
+  pid_t server_pid;
+  char *payload;
+
+  argp_parse (&argp, argc, argv, 0, 0, NULL);
+
+  if (!mkdtemp (wsinstance_sockdir) || !mkdtemp (runtime_dir))
+    err (EXIT_FAILURE, "mkdtemp");
+
+  dirfd = open (wsinstance_sockdir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+    err (EXIT_FAILURE, "open %s", wsinstance_sockdir);
+  http_fd = create_echo_listener (dirfd, "http.sock");
+  https_fd = create_echo_listener (dirfd, "https@" SHA256_NIL ".sock");
+
+  if (pipe2 (port_pipe, O_CLOEXEC) != 0)
+    err (EXIT_FAILURE, "pipe2");
+
+  /* the server gets its own process, so that we can measure its memory */
+  server_pid = fork ();
+  if (server_pid == -1)
+    err (EXIT_FAILURE, "fork");
+
+  if (server_pid == 0)
+    {
+      close (http_fd);
+      close (https_fd);
+      close (port_pipe[0]);
+      run_server (wsinstance_sockdir, runtime_dir, port_pipe[1]);
+    }
+
+  close (port_pipe[1]);
+  if (read (port_pipe[0], &bench.port, sizeof bench.port) != sizeof bench.port)
+    errx (EXIT_FAILURE, "server failed to start");
+  close (port_pipe[0]);
+
+  start_echo_listener (http_fd);
+  start_echo_listener (https_fd);
+
+  if (gnutls_certificate_allocate_credentials (&bench.credentials) != GNUTLS_E_SUCCESS)
+    errx (EXIT_FAILURE, "gnutls_certificate_allocate_credentials failed");
+
+  /* a deterministic pattern, so that we notice misordered data */
+  payload = mallocx (arguments.payload + 1);
+  for (size_t i = 0; i < arguments.payload; i++)
+    payload[i] = 'a' + i % 23;
+
+  bench.latencies = callocx (arguments.connections, sizeof (uint64_t));
+
+  pthread_t *threads = callocx (arguments.parallel, sizeof (pthread_t));
+  uint64_t start = get_monotonic_time ();
+
+  for (unsigned i = 0; i < arguments.parallel; i++)
+    if (pthread_create (&threads[i], NULL, client_thread, payload) != 0)
+      errx (EXIT_FAILURE, "failed to create client thread");
+  for (unsigned i = 0; i < arguments.parallel; i++)
+    pthread_join (threads[i], NULL);
+
+  double elapsed = (get_monotonic_time () - start) / 1000000.0;
+  unsigned n_tls = atomic_load (&bench.tls_connections);
+
+  print_server_stats (runtime_dir);
+
+  /* ru_maxrss of the children only covers the ones we waited for */
+  struct rusage usage;
+  int status;
+  kill (server_pid, SIGTERM);
+  if (waitpid (server_pid, &status, 0) != server_pid)
+    err (EXIT_FAILURE, "waitpid");
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    warnx ("server process failed");
+  getrusage (RUSAGE_CHILDREN, &usage);
+
+  qsort (bench.latencies, n_tls, sizeof (uint64_t), compare_uint64);
+
+  printf ("connections: %u (%u TLS), %u parallel, %zu bytes payload, %u failed\n",
+          arguments.connections, n_tls, arguments.parallel, arguments.payload, atomic_load (&bench.failures));
+  printf ("elapsed: %.3f s\n", elapsed);
+  printf ("handshakes/sec: %.1f\n", n_tls / elapsed);
+  printf ("handshake latency: p50 %.3f ms, p99 %.3f ms\n",
+          percentile_ms (bench.latencies, n_tls, 50), percentile_ms (bench.latencies, n_tls, 99));
+  printf ("relay throughput: %.1f MB/s\n", atomic_load (&bench.bytes) / elapsed / 1000000);
+  printf ("peak RSS of the server: %li KiB\n", usage.ru_maxrss);
+
+  close (http_fd);
+  close (https_fd);
+  unlinkat (dirfd, "http.sock", 0);
+  unlinkat (dirfd, "https@" SHA256_NIL ".sock", 0);
+  close (dirfd);
+  rmdir (wsinstance_sockdir);
+
+  char *clients_dir;
+  asprintfx (&clients_dir, "%s/clients", runtime_dir);
+  rmdir (clients_dir);
+  free (clients_dir);
+  rmdir (runtime_dir);
+
+  gnutls_certificate_free_credentials (bench.credentials);
+  free (bench.latencies);
+  free (threads);
+  free (payload);
+
+  return atomic_load (&bench.failures) == 0 && WIFEXITED (status) && WEXITSTATUS (status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A process-wide pool of relay buffers, shared by all worker threads.
+ *
+ * Connections only hold a buffer while data is in flight, and give it
+ * back as soon as it drains, so idle connections cost no buffer memory.
+ * Buffers come in power-of-two size classes; recently released ones are
+ * kept on a free list per class, so that the common case doesn't go
+ * through malloc().
+ *
+ * Buffers of the smallest size are always handed out: a connection must
+ * be able to make progress.  Only buffers which grow beyond that (for
+ * bulk transfers) are subject to the global limit.
+ */
+
+#include "config.h"
+
+#include "bufferpool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <common/cockpitmemory.h>
+
+#include "utils.h"
+
+#define N_SIZE_CLASSES 5
+#define CACHE_BYTES_PER_CLASS (1u << 20) /* 1MiB */
+
+static_assert (BUFFER_POOL_MIN_SIZE << (N_SIZE_CLASSES - 1) == BUFFER_POOL_MAX_SIZE,
+               "size classes don't match the limits");
+
+/* kept in the first bytes of a cached buffer */
+typedef struct _FreeBuffer FreeBuffer;
+struct _FreeBuffer {
+  FreeBuffer *next;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  FreeBuffer *free_list[N_SIZE_CLASSES];
+  unsigned n_free[N_SIZE_CLASSES];
+  size_t in_use;
+  size_t limit;
+} pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .limit = BUFFER_POOL_DEFAULT_LIMIT,
+};
+
+static unsigned
+size_class (unsigned size)
+{
+  unsigned class = __builtin_ctz (size) - __builtin_ctz (BUFFER_POOL_MIN_SIZE);
+
+  assert ((size & (size - 1)) == 0);
+  assert (class < N_SIZE_CLASSES);
+
+  return class;
+}
+
+/**
+ * buffer_pool_acquire: Get a buffer
+ *
+ * @size: a power of two between %BUFFER_POOL_MIN_SIZE and
+ *   %BUFFER_POOL_MAX_SIZE
+ *
+ * Returns: a buffer of @size bytes, or %NULL if @size is bigger than
+ *   the minimum and handing it out would exceed the global limit.
+ */
+char *
+buffer_pool_acquire (unsigned size)
+{
+  unsigned class = size_class (size);
+  FreeBuffer *buffer;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  if (size > BUFFER_POOL_MIN_SIZE && pool.in_use + size > pool.limit)
+    {
+      pthread_mutex_unlock (&pool.mutex);
+      debug (BUFFER, "buffer_pool_acquire (%u): over the limit of %zu bytes", size, pool.limit);
+      return NULL;
+    }
+
+  pool.in_use += size;
+
+  buffer = pool.free_list[class];
+  if (buffer)
+    {
+      pool.free_list[class] = buffer->next;
+      pool.n_free[class]--;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  if (buffer == NULL)
+    buffer = mallocx (size);
+
+  return (char *) buffer;
+}
+
+/**
+ * buffer_pool_release: Give back a buffer
+ *
+ * @data: a buffer returned by buffer_pool_acquire()
+ * @size: the size that it was acquired with
+ */
+void
+buffer_pool_release (char     *data,
+                     unsigned  size)
+{
+  unsigned class = size_class (size);
+  FreeBuffer *buffer = (FreeBuffer *) data;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  assert (pool.in_use >= size);
+  pool.in_use -= size;
+
+  if ((pool.n_free[class] + 1) * size <= CACHE_BYTES_PER_CLASS)
+    {
+      buffer->next = pool.free_list[class];
+      pool.free_list[class] = buffer;
+      pool.n_free[class]++;
+      buffer = NULL;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  free (buffer);
+}
+
+/**
+ * buffer_pool_set_limit: Set the limit for buffers beyond the minimum size
+ *
+ * @limit: the maximum number of bytes in all buffers handed out at the
+ *   same time; 0 means that buffers never grow
+ */
+void
+buffer_pool_set_limit (size_t limit)
+{
+  pthread_mutex_lock (&pool.mutex);
+  pool.limit = limit;
+  pthread_mutex_unlock (&pool.mutex);
+}
+
+/**
+ * buffer_pool_get_in_use: Number of bytes in buffers which are handed out
+ */
+size_t
+buffer_pool_get_in_use (void)
+{
+  size_t in_use;
+
+  pthread_mutex_lock (&pool.mutex);
+  in_use = pool.in_use;
+  pthread_mutex_unlock (&pool.mutex);
+
+  return in_use;
+}
+
+/**
+ * buffer_pool_cleanup: Free all cached buffers, and reset the limit
+ */
+void
+buffer_pool_cleanup (void)
+{
+  pthread_mutex_lock (&pool.mutex);
+
+  for (unsigned i = 0; i < N_SIZE_CLASSES; i++)
+    {
+      while (pool.free_list[i])
+        {
+          FreeBuffer *buffer = pool.free_list[i];
+          pool.free_list[i] = buffer->next;
+          free (buffer);
+        }
+
+      pool.n_free[i] = 0;
+    }
+
+  pool.limit = BUFFER_POOL_DEFAULT_LIMIT;
+
+  pthread_mutex_unlock (&pool.mutex);
+}
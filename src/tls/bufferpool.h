@@ -0,0 +1,45 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+/* all buffer sizes are powers of two between these */
+#define BUFFER_POOL_MIN_SIZE (16u << 10)  /* 16KiB */
+#define BUFFER_POOL_MAX_SIZE (256u << 10) /* 256KiB */
+
+#define BUFFER_POOL_DEFAULT_LIMIT (64u << 20) /* 64MiB */
+
+char *
+buffer_pool_acquire (unsigned size);
+
+void
+buffer_pool_release (char     *data,
+                     unsigned  size);
+
+void
+buffer_pool_set_limit (size_t limit);
+
+size_t
+buffer_pool_get_in_use (void);
+
+void
+buffer_pool_cleanup (void);
@@ -28,8 +28,8 @@
 #include <fcntl.h>
 #include <net/if.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +40,7 @@
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <gnutls/gnutls.h>
@@ -52,38 +53,104 @@
 
 #include "certificate.h"
 #include "client-certificate.h"
+#include "bufferpool.h"
 #include "httpredirect.h"
+#include "ktls.h"
 #include "socket-io.h"
+#include "stats.h"
+#include "upstream.h"
 #include "utils.h"
+#include "worker.h"
 
 /* cockpit-tls TCP server state (singleton) */
 static struct {
   gnutls_certificate_request_t request_mode;
   Certificate *certificate;
   bool require_https;
+  bool kernel_tls;
+  unsigned ticket_key_lifetime; /* seconds; 0 disables session tickets */
+  unsigned handshake_timeout; /* seconds */
+  unsigned max_pending_handshakes; /* 0 for no limit */
   int wsinstance_sockdir;
   int cert_session_dir;
 } parameters = {
+  .handshake_timeout = CONNECTION_DEFAULT_HANDSHAKE_TIMEOUT,
+  .max_pending_handshakes = CONNECTION_DEFAULT_MAX_PENDING_HANDSHAKES,
   .wsinstance_sockdir = -1,
   .cert_session_dir = -1
 };
 
+/* connections which haven't finished their handshake yet, in all worker
+ * threads; see connection_handshake_done() */
+static atomic_uint pending_handshakes;
+
+/* The session ticket encryption key is shared between all connections,
+ * so that a ticket can be used on any of them; it gets replaced with a
+ * fresh one every parameters.ticket_key_lifetime seconds, which
+ * invalidates all the tickets encrypted with the old one.
+ */
+static struct {
+  pthread_mutex_t mutex;
+  gnutls_datum_t key;
+  time_t expires;
+} ticket_key = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* a ring buffer; the memory is only held while there is data in it */
 typedef struct
 {
-  char buffer[16u << 10]; /* 16KiB */
+  char *data;
+  unsigned size; /* a power of 2, or 0 without data */
   unsigned start, end;
   bool eof, shut_rd, shut_wr;
+
+  /* In splice mode, the data is in a kernel pipe instead of in buffer[],
+   * and start/end only count the bytes going in and out of it.  The
+   * kernel doesn't tell us how much room is left in a pipe, so it is
+   * considered full whenever splicing into it fails while it has data.
+   */
+  int pipe[2];
+  bool pipe_full;
+
+  /* what the data written out of this buffer counts as */
+  StatsCounter sent_counter;
 #ifdef DEBUG
   const char *name;
 #endif
 } Buffer;
 
-/* a single TCP connection between the client (browser) and cockpit-tls */
+/* how long we wait for the wsinstance factory, in seconds; the deadline
+ * for the handshake is in parameters */
+#define ACTIVATION_TIMEOUT 30
+
+typedef enum {
+  CONNECTION_STATE_FIRST_BYTE,  /* waiting to tell apart TLS from HTTP */
+  CONNECTION_STATE_HANDSHAKE,   /* TLS handshake in progress */
+  CONNECTION_STATE_ACTIVATION,  /* waiting for the wsinstance factory */
+  CONNECTION_STATE_RELAY,       /* connected to cockpit-ws */
+} ConnectionState;
+
+/* a single TCP connection between the client (browser) and cockpit-tls
+ *
+ * It lives entirely inside of one worker thread, and is driven by
+ * readiness events from the epoll set of that worker.
+ */
 typedef struct {
-  int client_fd;
-  int ws_fd;
+  Worker *worker;
+  ConnectionState state;
+  ConnectionClosedFunc closed_func;
+  bool handshake_pending;
+
+  Watch client;
+  Watch ws;
+  Watch factory;
+  Timeout timeout;
 
   gnutls_session_t tls;
+  bool ktls_rx;
+  bool ktls_tx;
+  bool splice_failed;
 
   Buffer client_to_ws_buffer;
   Buffer ws_to_client_buffer;
@@ -91,19 +158,33 @@ typedef struct {
   char *client_cert_filename;
   char *wsinstance;
   int metadata_fd;
+
+  char factory_reply[20];
+  unsigned factory_reply_len;
+
+  /* when the handshake or the connection to cockpit-ws started */
+  uint64_t stage_start;
 } Connection;
 
-#define BUFFER_SIZE (sizeof ((Buffer *) 0)->buffer)
-#define BUFFER_MASK (BUFFER_SIZE - 1)
+/* maximum size of a single splice(); same as the default pipe size */
+#define SPLICE_SIZE (64u << 10)
+
+static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_POOL_MAX_SIZE, "buffer is too big");
 
-static_assert (!(BUFFER_SIZE & BUFFER_MASK), "buffer size not a power of 2");
-static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_SIZE, "buffer is too big");
 
+static inline bool
+buffer_spliced (Buffer *self)
+{
+  return self->pipe[0] != -1;
+}
 
 static inline bool
 buffer_full (Buffer *self)
 {
-  return self->end - self->start == BUFFER_SIZE;
+  if (buffer_spliced (self))
+    return self->pipe_full;
+
+  return self->size != 0 && self->end - self->start == self->size;
 }
 
 static inline bool
@@ -160,51 +241,128 @@ buffer_eof (Buffer *self)
   self->eof = true;
 }
 
+static inline bool
+buffer_valid (Buffer *self)
+{
+  return buffer_spliced (self) || self->end - self->start <= self->size;
+}
+
+/* get memory before reading */
+static void
+buffer_reserve (Buffer *self)
+{
+  if (self->data == NULL)
+    {
+      self->data = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+      self->size = BUFFER_POOL_MIN_SIZE;
+      self->start = self->end = 0;
+    }
+}
+
+/* give back the memory once everything was written */
+static void
+buffer_release (Buffer *self)
+{
+  if (self->data && buffer_empty (self))
+    {
+      buffer_pool_release (self->data, self->size);
+      self->data = NULL;
+      self->size = 0;
+      self->start = self->end = 0;
+    }
+}
+
 static void
 buffer_epipe (Buffer *self)
 {
   self->start = self->end;
+  self->pipe_full = false;
   self->eof = true;
+  buffer_release (self);
 }
 
-static inline bool
-buffer_valid (Buffer *self)
+static void
+buffer_init (Buffer       *self,
+             StatsCounter  sent_counter)
+{
+  self->pipe[0] = self->pipe[1] = -1;
+  self->sent_counter = sent_counter;
+}
+
+static void
+buffer_clear (Buffer *self)
+{
+  if (self->data)
+    {
+      self->start = self->end;
+      buffer_release (self);
+    }
+
+  if (buffer_spliced (self))
+    {
+      close (self->pipe[0]);
+      close (self->pipe[1]);
+      self->pipe[0] = self->pipe[1] = -1;
+    }
+}
+
+/**
+ * buffer_enable_splice: Switch an empty buffer to splice mode
+ *
+ * From now on, data gets moved with splice() through a pipe instead of
+ * being copied through user space.  The buffer must be empty; it stays
+ * in copy mode if the pipe can't be created.
+ */
+static bool
+buffer_enable_splice (Buffer *self)
 {
-  return self->end - self->start <= BUFFER_SIZE;
+  assert (buffer_empty (self));
+  assert (!buffer_spliced (self));
+
+  if (pipe2 (self->pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      debug (BUFFER, "buffer_enable_splice (%s): pipe2 failed: %m", self->name);
+      self->pipe[0] = self->pipe[1] = -1;
+      return false;
+    }
+
+  debug (BUFFER, "buffer_enable_splice (%s): pipe %i/%i", self->name, self->pipe[0], self->pipe[1]);
+  return true;
 }
 
-static short
+static uint32_t
 calculate_events (Buffer *reader,
                   Buffer *writer)
 {
-  return buffer_can_read (reader) * POLLIN | buffer_can_write (writer) * POLLOUT;
+  return buffer_can_read (reader) * EPOLLIN | buffer_can_write (writer) * EPOLLOUT;
 }
 
-static short
+static uint32_t
 calculate_revents (Buffer *reader,
                    Buffer *writer)
 {
-  return buffer_needs_shut_rd (reader) * POLLIN | buffer_needs_shut_wr (writer) * POLLOUT;
+  return buffer_needs_shut_rd (reader) * EPOLLIN | buffer_needs_shut_wr (writer) * EPOLLOUT;
 }
 
 static int
 get_iovecs (struct iovec *iov,
             int           iov_length,
             char         *buffer,
+            unsigned      size,
             unsigned      start,
             unsigned      end)
 {
   int i = 0;
 
-  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x)", iov, iov_length, buffer, start, end);
-  assert (end - start <= BUFFER_SIZE);
+  debug (IOVEC, "  get_iovecs (%p, %i, %p, 0x%x, 0x%x, 0x%x)", iov, iov_length, buffer, size, start, end);
+  assert (end - start <= size);
 
   for (i = 0; i < iov_length && start != end; i++)
     {
-      unsigned start_offset = start & BUFFER_MASK;
+      unsigned start_offset = start & (size - 1);
 
       iov[i].iov_base = &buffer[start_offset];
-      iov[i].iov_len = MIN(BUFFER_SIZE - start_offset, end - start);
+      iov[i].iov_len = MIN(size - start_offset, end - start);
       start += iov[i].iov_len;
 
       debug (IOVEC, "    iov[%i] = { 0x%zx, 0x%zx };  start = 0x%x;", i,
@@ -216,18 +374,85 @@ get_iovecs (struct iovec *iov,
   return i;
 }
 
+/**
+ * buffer_grow: Move the data into a bigger buffer
+ *
+ * Called when a read filled up the buffer: this is a bulk transfer, and
+ * the reader is faster than the writer.  Doubling the size (up to the
+ * maximum, and as long as the pool allows it) means fewer, bigger reads
+ * and writes.  The buffer shrinks back when it drains.
+ *
+ * If it can't grow, reading stops until the writer catches up; that
+ * gets counted as a stall.
+ */
+static void
+buffer_grow (Buffer *self)
+{
+  struct iovec iov[2];
+  unsigned size = self->size * 2;
+  unsigned length = 0;
+  char *data;
+
+  if (size > BUFFER_POOL_MAX_SIZE || (data = buffer_pool_acquire (size)) == NULL)
+    {
+      stats_add (STATS_BUFFER_FULL_STALLS, 1);
+      return;
+    }
+
+  int iovcnt = get_iovecs (iov, 2, self->data, self->size, self->start, self->end);
+  for (int i = 0; i < iovcnt; i++)
+    {
+      memcpy (data + length, iov[i].iov_base, iov[i].iov_len);
+      length += iov[i].iov_len;
+    }
+
+  debug (BUFFER, "buffer_grow (%s): 0x%x -> 0x%x", self->name, self->size, size);
+
+  buffer_pool_release (self->data, self->size);
+  self->data = data;
+  self->size = size;
+  self->start = 0;
+  self->end = length;
+}
+
 static void
-buffer_write_to_fd (Buffer *self,
-                    int     fd,
-                    int    *fd_to_send)
+buffer_send_to_fd (Buffer *self,
+                   int     fd,
+                   int    *fd_to_send)
 {
   struct iovec iov[2];
   ssize_t s;
 
-  debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+  if (buffer_spliced (self))
+    {
+      assert (fd_to_send == NULL || *fd_to_send == -1);
+
+      if (buffer_empty (self))
+        return;
+
+      do
+        s = splice (self->pipe[0], NULL, fd, NULL, self->end - self->start, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      while (s == -1 && errno == EINTR);
+
+      debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+      if (s == -1)
+        {
+          if (errno != EAGAIN)
+            buffer_epipe (self);
+        }
+      else
+        {
+          self->start += s;
+          self->pipe_full = false;
+          stats_add (self->sent_counter, s);
+        }
+
+      return;
+    }
 
   struct msghdr msg = { .msg_iov = iov };
-  msg.msg_iovlen = get_iovecs (iov, 2, self->buffer, self->start, self->end);
+  msg.msg_iovlen = get_iovecs (iov, 2, self->data, self->size, self->start, self->end);
 
   if (msg.msg_iovlen)
     {
@@ -255,9 +480,24 @@ buffer_write_to_fd (Buffer *self,
             buffer_epipe (self);
         }
       else
-        self->start += s;
+        {
+          self->start += s;
+          stats_add (self->sent_counter, s);
+        }
     }
 
+  buffer_release (self);
+}
+
+static void
+buffer_write_to_fd (Buffer *self,
+                    int     fd,
+                    int    *fd_to_send)
+{
+  debug (BUFFER, "buffer_write_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  buffer_send_to_fd (self, fd, fd_to_send);
+
   if (buffer_needs_shut_wr (self))
     {
       shutdown (fd, SHUT_WR);
@@ -268,11 +508,29 @@ buffer_write_to_fd (Buffer *self,
 }
 
 static void
-buffer_read_from_fd (Buffer *self,
-                     int     fd)
+buffer_write_to_ktls (Buffer *self,
+                      int     fd)
 {
-  debug (BUFFER, "buffer_read_from_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+  debug (BUFFER, "buffer_write_to_ktls (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  buffer_send_to_fd (self, fd, NULL);
+
+  if (buffer_needs_shut_wr (self))
+    {
+      /* the equivalent of gnutls_bye (GNUTLS_SHUT_WR) */
+      ktls_send_close_notify (fd);
+      shutdown (fd, SHUT_WR);
+      buffer_shut_wr (self);
+    }
 
+  assert (buffer_valid (self));
+}
+
+static void
+buffer_readv_from_fd (Buffer  *self,
+                      int      fd,
+                      ssize_t (*readv_func) (int, const struct iovec *, int))
+{
   if (buffer_needs_shut_rd (self))
     {
       shutdown (fd, SHUT_RD);
@@ -282,11 +540,46 @@ buffer_read_from_fd (Buffer *self,
 
   struct iovec iov[2];
   ssize_t s;
-  int iovcnt = get_iovecs (iov, 2, self->buffer, self->end, self->start + BUFFER_SIZE);
+
+  if (buffer_spliced (self))
+    {
+      do
+        s = splice (fd, NULL, self->pipe[1], NULL, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      while (s == -1 && errno == EINTR);
+
+      debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+      /* EAGAIN means that either the socket or the pipe is exhausted, and
+       * we can't tell which.  If the pipe has data, assume it's full, and
+       * stop reading until some of it was written out.  Anything else
+       * (including EINVAL for a non-data record with kTLS) ends the stream.
+       */
+      if (s == -1)
+        {
+          if (errno == EAGAIN)
+            {
+              self->pipe_full = !buffer_empty (self);
+              if (self->pipe_full)
+                stats_add (STATS_BUFFER_FULL_STALLS, 1);
+            }
+          else
+            buffer_eof (self);
+        }
+      else if (s == 0)
+        buffer_eof (self);
+      else
+        self->end += s;
+
+      return;
+    }
+
+  buffer_reserve (self);
+
+  int iovcnt = get_iovecs (iov, 2, self->data, self->size, self->end, self->start + self->size);
   assert (iovcnt > 0);
 
   do
-    s = readv (fd, iov, iovcnt);
+    s = readv_func (fd, iov, iovcnt);
   while (s == -1 && errno == EINTR);
 
   debug (BUFFER, "  readv returns %zi %s", s, (s == -1) ? strerror (errno) : "");
@@ -301,9 +594,32 @@ buffer_read_from_fd (Buffer *self,
   else
     self->end += s;
 
+  if (buffer_full (self))
+    buffer_grow (self);
+  else
+    buffer_release (self);
+
   assert (buffer_valid (self));
 }
 
+static void
+buffer_read_from_fd (Buffer *self,
+                     int     fd)
+{
+  debug (BUFFER, "buffer_read_from_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  buffer_readv_from_fd (self, fd, readv);
+}
+
+static void
+buffer_read_from_ktls (Buffer *self,
+                       int     fd)
+{
+  debug (BUFFER, "buffer_read_from_ktls (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  buffer_readv_from_fd (self, fd, ktls_readv);
+}
+
 static void
 buffer_write_to_tls (Buffer           *self,
                      gnutls_session_t  tls)
@@ -313,7 +629,7 @@ buffer_write_to_tls (Buffer           *self,
 
   debug (BUFFER, "buffer_write_to_tls (%s/0x%x/0x%x, %p)", self->name, self->start, self->end, tls);
 
-  if (get_iovecs (&iov, 1, self->buffer, self->start, self->end))
+  if (get_iovecs (&iov, 1, self->data, self->size, self->start, self->end))
     {
       do
         s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
@@ -327,9 +643,14 @@ buffer_write_to_tls (Buffer           *self,
             buffer_epipe (self);
         }
       else
-        self->start += s;
+        {
+          self->start += s;
+          stats_add (self->sent_counter, s);
+        }
     }
 
+  buffer_release (self);
+
   if (buffer_needs_shut_wr (self))
     {
       gnutls_bye (tls, GNUTLS_SHUT_WR);
@@ -358,7 +679,9 @@ buffer_read_from_tls (Buffer           *self,
       return;
     }
 
-  int iovcnt = get_iovecs (&iov, 1, self->buffer, self->end, self->start + BUFFER_SIZE);
+  buffer_reserve (self);
+
+  int iovcnt = get_iovecs (&iov, 1, self->data, self->size, self->end, self->start + self->size);
   assert (iovcnt == 1);
 
   do
@@ -375,346 +698,425 @@ buffer_read_from_tls (Buffer           *self,
   else
     self->end += s;
 
+  if (buffer_full (self))
+    buffer_grow (self);
+  else
+    buffer_release (self);
+
   assert (buffer_valid (self));
 }
 
-static bool
-request_dynamic_wsinstance (const char *fingerprint)
+/* the connection got through its handshake (or is being closed), so it
+ * doesn't count against parameters.max_pending_handshakes anymore */
+static void
+connection_handshake_done (Connection *self)
 {
-  bool status = false;
-  char reply[20];
-  int fd;
-
-  debug (CONNECTION, "requesting dynamic wsinstance for %s:\n", fingerprint);
-
-  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-  if (fd == -1)
-    {
-      warn ("socket() failed");
-      goto out;
-    }
-
-  debug (CONNECTION, "  -> connecting to https-factory.sock");
-  if (af_unix_connectat (fd, parameters.wsinstance_sockdir, "https-factory.sock") != 0)
+  if (self->handshake_pending)
     {
-      warn ("connect(https-factory.sock) failed");
-      goto out;
+      atomic_fetch_sub (&pending_handshakes, 1);
+      self->handshake_pending = false;
     }
+}
 
-  /* send the fingerprint */
-  debug (CONNECTION, "  -> success; sending fingerprint...");
-  if (!send_all (fd, fingerprint, strlen (fingerprint), 5 * 1000000))
-    goto out;
+static void
+connection_close (Connection *self)
+{
+  debug (CONNECTION, "Closing connection for fd %i", self->client.fd);
 
-  debug (CONNECTION, "  -> success; waiting for reply...");
+  connection_handshake_done (self);
 
-  /* wait for the systemd job status reply */
-  if (!recv_alnum (fd, reply, sizeof reply, 30 * 1000000))
-    goto out;
+  worker_remove_timeout (self->worker, &self->timeout);
+  worker_unwatch (self->worker, &self->client);
+  worker_unwatch (self->worker, &self->ws);
+  worker_unwatch (self->worker, &self->factory);
 
-  debug (CONNECTION, "  -> got reply '%s'...", reply);
-  status = strcmp (reply, "done") == 0;
+  free (self->wsinstance);
 
-out:
-  debug (CONNECTION, "  -> %s.", status ? "success" : "fail");
+  if (self->client_cert_filename)
+    client_certificate_unlink_and_free (parameters.cert_session_dir, self->client_cert_filename);
 
-  if (fd != -1)
-    close (fd);
+  if (self->tls)
+    gnutls_deinit (self->tls);
 
-  return status;
-}
+  if (self->client.fd != -1)
+    close (self->client.fd);
 
-static bool
-connection_connect_to_dynamic_wsinstance (Connection *self)
-{
-  char sockname[80];
-  int r;
+  if (self->ws.fd != -1)
+    close (self->ws.fd);
 
-  assert (self->tls != NULL);
+  if (self->factory.fd != -1)
+    close (self->factory.fd);
 
-  r = snprintf (sockname, sizeof sockname, "https@%s.sock", self->wsinstance);
-  assert (0 < r && r < sizeof sockname);
+  if (self->metadata_fd != -1)
+    close (self->metadata_fd);
 
-  debug (CONNECTION, "Connecting to dynamic https instance %s...", sockname);
+  buffer_clear (&self->client_to_ws_buffer);
+  buffer_clear (&self->ws_to_client_buffer);
 
-  /* fast path: the socket already exists, so we can just connect to it */
-  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) == 0)
-    return true;
+  self->closed_func ();
 
-  if (errno != ENOENT && errno != ECONNREFUSED)
-    warn ("connect(%s) failed on the first attempt", sockname);
+  free (self);
+}
 
-  debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
-  /* otherwise, ask for the instance to be started */
-  if (!request_dynamic_wsinstance (self->wsinstance))
-    return false;
+static void
+connection_timed_out (Timeout *timeout)
+{
+  Connection *self = container_of (timeout, Connection, timeout);
 
-  /* ... and try one more time. */
-  debug (CONNECTION, "  -> trying again");
-  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) != 0)
+  switch (self->state)
     {
-      warn ("connect(%s) failed on the second attempt", sockname);
-      return false;
+    case CONNECTION_STATE_FIRST_BYTE:
+      debug (CONNECTION, "client sent no data in %u seconds, dropping connection.", parameters.handshake_timeout);
+      stats_add (STATS_HANDSHAKE_TIMEOUTS, 1);
+      break;
+
+    case CONNECTION_STATE_HANDSHAKE:
+      warnx ("TLS handshake timed out");
+      stats_add (STATS_HANDSHAKE_TIMEOUTS, 1);
+      break;
+
+    case CONNECTION_STATE_ACTIVATION:
+      warnx ("timed out waiting for wsinstance %s to start", self->wsinstance);
+      break;
+
+    case CONNECTION_STATE_RELAY:
+      assert (false); /* not reached */
     }
 
-  /* otherwise, we're now connected */
-  debug (CONNECTION, "  -> success!");
-  return true;
+  connection_close (self);
 }
 
-static bool
-connection_is_to_localhost (Connection *self)
+/* Move data with splice() in the directions where we see plaintext on
+ * both ends: everything for unencrypted connections, and the offloaded
+ * directions for kTLS.  The first chunk towards cockpit-ws has to be
+ * copied, as it carries the metadata fd.
+ */
+static void
+connection_enable_splice (Connection *self)
 {
-  struct sockaddr_storage address;
-  socklen_t address_len = sizeof address;
+  Buffer *client_to_ws = &self->client_to_ws_buffer;
+  Buffer *ws_to_client = &self->ws_to_client_buffer;
 
-  /* NB: We check our own socket name, not the peer.  That lets us find
-   * out if the connection was made to 127.0.0.1, or some other address.
-   *
-   * In the case that the client connects to 127.0.0.2, for example, the
-   * peer socket is still 127.0.0.1.
-   */
-  if (getsockname (self->client_fd, (struct sockaddr *) &address, &address_len) != 0)
-    return false;
+  if (self->splice_failed)
+    return;
 
-  switch (address.ss_family)
+  if (!buffer_spliced (ws_to_client) && (!self->tls || self->ktls_tx) &&
+      !ws_to_client->eof && buffer_empty (ws_to_client))
+    self->splice_failed = !buffer_enable_splice (ws_to_client);
+
+  if (!buffer_spliced (client_to_ws) && (!self->tls || self->ktls_rx) && self->metadata_fd == -1 &&
+      !client_to_ws->eof && buffer_empty (client_to_ws) && !self->splice_failed)
+    self->splice_failed = !buffer_enable_splice (client_to_ws);
+}
+
+static bool
+connection_relay (Connection *self,
+                  uint32_t    client_revents,
+                  uint32_t    ws_revents)
+{
+  for (;;)
     {
-    case AF_UNIX:
-      return true;
+      connection_enable_splice (self);
 
-    case AF_INET:
+      debug (POLL, "relay | client %d/x%x | ws %d/x%x |",
+             self->client.fd, client_revents, self->ws.fd, ws_revents);
+
+      if (self->tls)
         {
-          struct in_addr *addr4 = &((struct sockaddr_in *) &address)->sin_addr;
-          return addr4->s_addr == htonl (INADDR_LOOPBACK);
+          if (client_revents & EPOLLIN)
+            {
+              if (self->ktls_rx)
+                buffer_read_from_ktls (&self->client_to_ws_buffer, self->client.fd);
+              else
+                buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
+            }
+
+          if (client_revents & EPOLLOUT)
+            {
+              if (self->ktls_tx)
+                buffer_write_to_ktls (&self->ws_to_client_buffer, self->client.fd);
+              else
+                buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
+            }
         }
-
-    case AF_INET6:
+      else
         {
-          struct in6_addr *addr6 = &((struct sockaddr_in6 *) &address)->sin6_addr;
+          if (client_revents & EPOLLIN)
+            buffer_read_from_fd (&self->client_to_ws_buffer, self->client.fd);
 
-          /* Need to handle both ::ffff:127.0.0.1 as well as ::1
-           * This is ugly, but there doesn't seem to be a better (static) way... */
-          const struct in6_addr v4_loopback = { { { 0,0,0,0,0,0,0,0,0,0,0xff,0xff,127,0,0,1 } } };
-          return IN6_IS_ADDR_LOOPBACK (addr6) || IN6_ARE_ADDR_EQUAL(addr6, &v4_loopback);
+          if (client_revents & EPOLLOUT)
+            buffer_write_to_fd (&self->ws_to_client_buffer, self->client.fd, NULL);
         }
 
-    default:
-      return false;
-    }
-}
+      if (ws_revents & EPOLLIN)
+        buffer_read_from_fd (&self->ws_to_client_buffer, self->ws.fd);
 
-static bool
-connection_connect_to_wsinstance (Connection *self)
-{
-  if (self->tls == NULL && parameters.require_https && !connection_is_to_localhost (self))
-    {
-      /* server is expecting https connections */
-      self->ws_fd = http_redirect_connect ();
-      if (self->ws_fd == -1)
-        {
-          warn ("failed to connect to httpredirect");
-          return false;
-        }
+      if (ws_revents & EPOLLOUT)
+        buffer_write_to_fd (&self->client_to_ws_buffer, self->ws.fd, &self->metadata_fd);
 
-      return true;
+      if (!buffer_alive (&self->client_to_ws_buffer) && !buffer_alive (&self->ws_to_client_buffer))
+        return false;
+
+      /* Some work can be done without waiting for the fds: shutdowns,
+       * and data which gnutls already decrypted into its own buffer.
+       */
+      client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+      ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+
+      if (self->tls && !self->ktls_rx && buffer_can_read (&self->client_to_ws_buffer))
+        client_revents |= EPOLLIN * gnutls_record_check_pending (self->tls);
+
+      if (!client_revents && !ws_revents)
+        break;
     }
 
-  self->ws_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-  if (self->ws_fd == -1)
+  worker_update (self->worker, &self->client,
+                 calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer));
+  worker_update (self->worker, &self->ws,
+                 calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer));
+
+  return true;
+}
+
+static bool
+connection_start_relay (Connection *self)
+{
+  debug (CONNECTION, "Connection fd %i is connected to ws fd %i", self->client.fd, self->ws.fd);
+
+  if (fcntl (self->ws.fd, F_SETFL, fcntl (self->ws.fd, F_GETFL) | O_NONBLOCK) != 0)
     {
-      warn ("failed to create cockpit-ws client socket");
+      warn ("failed to make cockpit-ws client socket non-blocking");
       return false;
     }
 
-  if (self->tls == NULL)
-    {
-      /* server is expecting http connections, or localhost is exempt */
-      if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, "http.sock") != 0)
-        {
-          warn ("connect(http.sock) failed");
-          return false;
-        }
+  worker_remove_timeout (self->worker, &self->timeout);
+  self->state = CONNECTION_STATE_RELAY;
 
-      return true;
-    }
-  else
-    return connection_connect_to_dynamic_wsinstance (self);
+  return connection_relay (self, 0, 0);
 }
 
-/**
- * connection_handshake: Handle first event on client fd
- *
- * Check the very first byte of a new connection to tell apart TLS from plain
- * HTTP. Initialize TLS.
- */
+/* for connections to a cockpit-ws instance, as opposed to httpredirect */
 static bool
-connection_handshake (Connection *self)
+connection_start_relay_to (Connection *self,
+                           const char *sockname)
 {
-  char b;
-  int ret;
+  bool ret;
 
-  assert (self->ws_fd == -1);
+  stats_add_latency (STATS_WSINSTANCE_CONNECT_LATENCY, self->stage_start);
+  ret = connection_start_relay (self);
 
-  /* Wait for up to 30 seconds to receive the first byte before shutting
-   * down the connection.
-   */
-  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
-  do
-    ret = poll (&pfd, 1, 30000); /* timeout is wrong on syscall restart, but it's fine */
-  while (ret == -1 && errno == EINTR);
+  /* now that this connection is going, get one ready for the next client */
+  upstream_refill (parameters.wsinstance_sockdir, sockname);
 
-  if (ret < 0)
-    err (EXIT_FAILURE, "poll() failed on client connection");
+  return ret;
+}
 
-  if (ret == 0)
+static bool
+request_dynamic_wsinstance (Connection *self)
+{
+  int fd;
+
+  debug (CONNECTION, "requesting dynamic wsinstance for %s:\n", self->wsinstance);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
     {
-      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
+      warn ("socket() failed");
       return false;
     }
 
-  /* peek the first byte and see if it's a TLS connection (starting with 22).
-     We can assume that there is some data to read, as this is called in response
-     to an epoll event. */
-  ret = recv (self->client_fd, &b, 1, MSG_PEEK);
+  self->factory.fd = fd;
 
-  if (ret < 0)
+  debug (CONNECTION, "  -> connecting to https-factory.sock");
+  if (af_unix_connectat (fd, parameters.wsinstance_sockdir, "https-factory.sock") != 0)
     {
-      debug (CONNECTION, "could not read first byte: %s", strerror (errno));
+      warn ("connect(https-factory.sock) failed");
       return false;
     }
 
-  if (ret == 0) /* EOF */
+  /* send the fingerprint: this fits easily into the socket buffer */
+  debug (CONNECTION, "  -> success; sending fingerprint...");
+  if (!send_all (fd, self->wsinstance, strlen (self->wsinstance), 5 * 1000000))
+    return false;
+
+  /* wait for the systemd job status reply without blocking the worker */
+  debug (CONNECTION, "  -> success; waiting for reply...");
+  self->state = CONNECTION_STATE_ACTIVATION;
+  worker_update (self->worker, &self->factory, EPOLLIN);
+  worker_add_timeout (self->worker, &self->timeout, ACTIVATION_TIMEOUT, connection_timed_out);
+
+  return true;
+}
+
+static bool
+connection_connect_to_dynamic_wsinstance (Connection *self)
+{
+  char sockname[80];
+  int r;
+
+  assert (self->tls != NULL);
+
+  r = snprintf (sockname, sizeof sockname, "https@%s.sock", self->wsinstance);
+  assert (0 < r && r < sizeof sockname);
+
+  debug (CONNECTION, "Connecting to dynamic https instance %s...", sockname);
+
+  /* fast path: the instance is already running, so we can just connect to it */
+  self->ws.fd = upstream_connect (parameters.wsinstance_sockdir, sockname);
+  if (self->ws.fd != -1)
+    return connection_start_relay_to (self, sockname);
+
+  if (errno != ENOENT && errno != ECONNREFUSED)
+    warn ("connect(%s) failed on the first attempt", sockname);
+
+  debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
+  /* otherwise, ask for the instance to be started */
+  return request_dynamic_wsinstance (self);
+}
+
+/**
+ * connection_activation_done: Handle reply from the wsinstance factory
+ *
+ * The factory sends a short alphanumeric systemd job status, followed by
+ * EOF.
+ */
+static bool
+connection_activation_done (Connection *self)
+{
+  char sockname[80];
+  ssize_t s;
+  int r;
+
+  s = recv (self->factory.fd, self->factory_reply + self->factory_reply_len,
+            sizeof self->factory_reply - self->factory_reply_len, MSG_DONTWAIT);
+
+  if (s == -1)
     {
-      debug (CONNECTION, "client disconnected without sending any data");
+      if (errno == EAGAIN || errno == EINTR)
+        return true;
+
+      warn ("recv() from https-factory.sock failed");
       return false;
     }
 
-  if (b == 22)
+  if (s > 0)
     {
-      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+      self->factory_reply_len += s;
 
-      if (parameters.certificate == NULL)
+      /* we need to have space for the nul terminator */
+      if (self->factory_reply_len == sizeof self->factory_reply)
         {
-          warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
-          return false;
-        }
-
-      ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
-          return false;
-        }
-
-      ret = gnutls_set_default_priority (self->tls);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
+          warnx ("reply from https-factory.sock is too long");
           return false;
         }
 
-      ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
-                                    certificate_get_credentials (parameters.certificate));
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
-          return false;
-        }
-
-      gnutls_session_set_verify_function (self->tls, client_certificate_verify);
-      gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
-      gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
-      gnutls_transport_set_int (self->tls, self->client_fd);
+      return true;
+    }
 
-      debug (CONNECTION, "TLS is initialised; doing handshake");
+  /* EOF */
+  self->factory_reply[self->factory_reply_len] = '\0';
+  debug (CONNECTION, "  -> got reply '%s'...", self->factory_reply);
 
-      do
-        ret = gnutls_handshake (self->tls);
-      while (ret == GNUTLS_E_INTERRUPTED);
+  worker_unwatch (self->worker, &self->factory);
+  close (self->factory.fd);
+  self->factory.fd = -1;
 
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  if (strcmp (self->factory_reply, "done") != 0)
+    {
+      debug (CONNECTION, "  -> fail.");
+      return false;
+    }
 
-      debug (CONNECTION, "TLS handshake completed");
+  r = snprintf (sockname, sizeof sockname, "https@%s.sock", self->wsinstance);
+  assert (0 < r && r < sizeof sockname);
 
-      if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
-                                      &self->wsinstance, &self->client_cert_filename))
-        return false;
+  /* ... and try one more time. */
+  debug (CONNECTION, "  -> trying again");
+  self->ws.fd = upstream_connect (parameters.wsinstance_sockdir, sockname);
+  if (self->ws.fd == -1)
+    {
+      warn ("connect(%s) failed on the second attempt", sockname);
+      return false;
     }
 
-  return true;
+  /* otherwise, we're now connected */
+  debug (CONNECTION, "  -> success!");
+  return connection_start_relay_to (self, sockname);
 }
 
-static void
-connection_thread_loop (Connection *self)
+static bool
+connection_is_to_localhost (Connection *self)
 {
-  while (buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer))
-    {
-      short client_events, ws_events;
-      short client_revents, ws_revents;
-      int n_ready;
-
-      client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-      client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof address;
 
-      if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
-        client_revents |= POLLIN * gnutls_record_check_pending (self->tls);
+  /* NB: We check our own socket name, not the peer.  That lets us find
+   * out if the connection was made to 127.0.0.1, or some other address.
+   *
+   * In the case that the client connects to 127.0.0.2, for example, the
+   * peer socket is still 127.0.0.1.
+   */
+  if (getsockname (self->client.fd, (struct sockaddr *) &address, &address_len) != 0)
+    return false;
 
-      debug (POLL, "poll | client %d/x%x/x%x | ws %d/x%x/x%x |",
-             self->client_fd, client_events, client_revents,
-             self->ws_fd, ws_events, ws_revents);
+  switch (address.ss_family)
+    {
+    case AF_UNIX:
+      return true;
 
-      do
+    case AF_INET:
         {
-          /* don't poll for no events, we'd spin in a POLLHUP loop otherwise */
-          struct pollfd fds[] = { { client_events ? self->client_fd : -1, client_events },
-                                  { ws_events ? self->ws_fd : -1, ws_events }};
-
-          n_ready = poll (fds, N_ELEMENTS (fds), (client_revents | ws_revents) ? 0 : -1);
-
-          client_revents |= fds[0].revents;
-          ws_revents |= fds[1].revents;
+          struct in_addr *addr4 = &((struct sockaddr_in *) &address)->sin_addr;
+          return addr4->s_addr == htonl (INADDR_LOOPBACK);
         }
-      while (n_ready == -1 && errno == EINTR);
 
-      if (n_ready == -1)
+    case AF_INET6:
         {
-          if (errno == EINVAL) /* ran out of fds */
-            return;
-          err (EXIT_FAILURE, "poll failed");
+          struct in6_addr *addr6 = &((struct sockaddr_in6 *) &address)->sin6_addr;
+
+          /* Need to handle both ::ffff:127.0.0.1 as well as ::1
+           * This is ugly, but there doesn't seem to be a better (static) way... */
+          const struct in6_addr v4_loopback = { { { 0,0,0,0,0,0,0,0,0,0,0xff,0xff,127,0,0,1 } } };
+          return IN6_IS_ADDR_LOOPBACK (addr6) || IN6_ARE_ADDR_EQUAL(addr6, &v4_loopback);
         }
 
-      debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
-             self->client_fd, client_revents, self->ws_fd, ws_revents);
+    default:
+      return false;
+    }
+}
 
-      if (self->tls)
-        {
-          if (client_revents & POLLIN)
-            buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
+static bool
+connection_connect_to_wsinstance (Connection *self)
+{
+  self->stage_start = stats_now ();
 
-          if (client_revents & POLLOUT)
-            buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
-        }
-      else
+  if (self->tls == NULL && parameters.require_https && !connection_is_to_localhost (self))
+    {
+      /* server is expecting https connections */
+      self->ws.fd = http_redirect_connect ();
+      if (self->ws.fd == -1)
         {
-          if (client_revents & POLLIN)
-            buffer_read_from_fd (&self->client_to_ws_buffer, self->client_fd);
-
-          if (client_revents & POLLOUT)
-            buffer_write_to_fd (&self->ws_to_client_buffer, self->client_fd, NULL);
+          warn ("failed to connect to httpredirect");
+          return false;
         }
 
-      if (ws_revents & POLLIN)
-        buffer_read_from_fd (&self->ws_to_client_buffer, self->ws_fd);
+      return connection_start_relay (self);
+    }
 
-      if (ws_revents & POLLOUT)
-        buffer_write_to_fd (&self->client_to_ws_buffer, self->ws_fd, &self->metadata_fd);
+  if (self->tls == NULL)
+    {
+      /* server is expecting http connections, or localhost is exempt */
+      self->ws.fd = upstream_connect (parameters.wsinstance_sockdir, "http.sock");
+      if (self->ws.fd == -1)
+        {
+          warn ("connect(http.sock) failed");
+          return false;
+        }
+
+      return connection_start_relay_to (self, "http.sock");
     }
+  else
+    return connection_connect_to_dynamic_wsinstance (self);
 }
 
 static bool
@@ -722,9 +1124,9 @@ connection_create_metadata (Connection *self)
 {
   struct sockaddr_storage addr;
   socklen_t addrsize = sizeof addr;
-  if (getpeername (self->client_fd, (struct sockaddr *) &addr, &addrsize))
+  if (getpeername (self->client.fd, (struct sockaddr *) &addr, &addrsize))
     {
-      debug (CONNECTION, "getpeername(%i) failed: %m.  Disconnecting.", self->client_fd);
+      debug (CONNECTION, "getpeername(%i) failed: %m.  Disconnecting.", self->client.fd);
       return false;
     }
 
@@ -779,11 +1181,11 @@ connection_create_metadata (Connection *self)
 
     default:
       debug (CONNECTION, "Connection fd %i had unknown peer address family %d.  Disconnecting.",
-             self->client_fd, (int) addr.ss_family);
+             self->client.fd, (int) addr.ss_family);
       return false;
     }
 
-  debug (CONNECTION, "Connection fd %i is from %s:%d", self->client_fd, ip, port);
+  debug (CONNECTION, "Connection fd %i is from %s:%d", self->client.fd, ip, port);
 
   FILE *stream = cockpit_json_print_open_memfd ("cockpit-tls metadata", 1);
 
@@ -798,53 +1200,368 @@ connection_create_metadata (Connection *self)
   return true;
 }
 
-void
-connection_thread_main (int fd)
+static void
+connection_enable_ktls (Connection *self)
 {
-  Connection self = { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1 };
+  unsigned directions = ktls_enable (self->tls, self->client.fd);
 
-  assert (!buffer_can_write (&self.client_to_ws_buffer));
-  assert (!buffer_can_write (&self.ws_to_client_buffer));
-  assert (!self.tls);
+  self->ktls_rx = (directions & KTLS_RX) != 0;
+  self->ktls_tx = (directions & KTLS_TX) != 0;
 
-#ifdef DEBUG
-  self.client_to_ws_buffer.name = "client-to-ws";
-  self.ws_to_client_buffer.name = "ws-to-client";
-#endif
+  if (directions)
+    {
+      stats_add (STATS_KTLS_CONNECTIONS, 1);
+      debug (CONNECTION, "kTLS enabled for fd %i (rx: %i, tx: %i)",
+             self->client.fd, self->ktls_rx, self->ktls_tx);
+    }
+  else
+    {
+      debug (CONNECTION, "kTLS not available for fd %i (%s, %s); using gnutls", self->client.fd,
+             gnutls_protocol_get_name (gnutls_protocol_get_version (self->tls)),
+             gnutls_cipher_get_name (gnutls_cipher_get (self->tls)));
+    }
+}
+
+static time_t
+get_monotonic_seconds (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return now.tv_sec;
+}
+
+static void
+ticket_key_clear (void)
+{
+  if (ticket_key.key.data)
+    {
+      cockpit_memory_clear (ticket_key.key.data, ticket_key.key.size);
+      gnutls_free (ticket_key.key.data);
+      ticket_key.key.data = NULL;
+      ticket_key.key.size = 0;
+    }
+}
+
+/**
+ * connection_enable_session_tickets: Allow the client to resume the session
+ *
+ * This uses the process-wide ticket key, and rotates it first if it's
+ * due.  With client certificates, every connection needs to go through
+ * the full verification, so we don't issue tickets at all then.
+ */
+static void
+connection_enable_session_tickets (Connection *self)
+{
+  time_t now = get_monotonic_seconds ();
+  int ret;
+
+  if (parameters.ticket_key_lifetime == 0 || parameters.request_mode != GNUTLS_CERT_IGNORE)
+    return;
+
+  pthread_mutex_lock (&ticket_key.mutex);
+
+  if (ticket_key.key.data == NULL || now >= ticket_key.expires)
+    {
+      ticket_key_clear ();
+
+      ret = gnutls_session_ticket_key_generate (&ticket_key.key);
+      if (ret == GNUTLS_E_SUCCESS)
+        {
+          ticket_key.expires = now + parameters.ticket_key_lifetime;
+          debug (CONNECTION, "generated new session ticket key, valid for %u seconds",
+                 parameters.ticket_key_lifetime);
+        }
+      else
+        warnx ("gnutls_session_ticket_key_generate failed: %s", gnutls_strerror (ret));
+    }
+
+  /* this copies the key, so it's fine to replace it later */
+  ret = ticket_key.key.data ? gnutls_session_ticket_enable_server (self->tls, &ticket_key.key) : GNUTLS_E_INVALID_REQUEST;
+
+  pthread_mutex_unlock (&ticket_key.mutex);
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      debug (CONNECTION, "not enabling session tickets: %s", gnutls_strerror (ret));
+      return;
+    }
+
+  /* don't let clients hold on to tickets that outlive the key */
+  gnutls_db_set_cache_expiration (self->tls, parameters.ticket_key_lifetime);
+}
+
+/**
+ * connection_tls_handshake: Drive the TLS handshake
+ *
+ * Called when the client fd becomes ready in the direction that gnutls
+ * asked for.  Once the handshake is complete, connect to cockpit-ws.
+ */
+static bool
+connection_tls_handshake (Connection *self)
+{
+  int ret;
+
+  ret = gnutls_handshake (self->tls);
+
+  if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+    {
+      /* gnutls_record_get_direction() is 1 when blocked on writing */
+      worker_update (self->worker, &self->client,
+                     gnutls_record_get_direction (self->tls) ? EPOLLOUT : EPOLLIN);
+      return true;
+    }
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+      return false;
+    }
+
+  stats_add_latency (STATS_HANDSHAKE_LATENCY, self->stage_start);
+  connection_handshake_done (self);
+
+  if (gnutls_session_is_resumed (self->tls))
+    {
+      stats_add (STATS_RESUMED_HANDSHAKES, 1);
+      debug (CONNECTION, "TLS handshake completed (resumed session)");
+    }
+  else
+    {
+      stats_add (STATS_FULL_HANDSHAKES, 1);
+      debug (CONNECTION, "TLS handshake completed");
+    }
+
+  worker_update (self->worker, &self->client, 0);
+
+  if (parameters.kernel_tls)
+    connection_enable_ktls (self);
+
+  if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
+                                  &self->wsinstance, &self->client_cert_filename))
+    return false;
+
+  return connection_create_metadata (self) &&
+         connection_connect_to_wsinstance (self);
+}
+
+/**
+ * connection_handshake: Handle first event on client fd
+ *
+ * Check the very first byte of a new connection to tell apart TLS from plain
+ * HTTP. Initialize TLS.
+ */
+static bool
+connection_handshake (Connection *self)
+{
+  char b;
+  int ret;
+
+  assert (self->ws.fd == -1);
+
+  /* peek the first byte and see if it's a TLS connection (starting with 22).
+     We can assume that there is some data to read, as this is called in response
+     to an epoll event. */
+  ret = recv (self->client.fd, &b, 1, MSG_PEEK);
+
+  if (ret < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        return true;
+
+      debug (CONNECTION, "could not read first byte: %s", strerror (errno));
+      return false;
+    }
+
+  if (ret == 0) /* EOF */
+    {
+      debug (CONNECTION, "client disconnected without sending any data");
+      return false;
+    }
+
+  worker_update (self->worker, &self->client, 0);
+
+  if (b == 22)
+    {
+      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+
+      if (parameters.certificate == NULL)
+        {
+          warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
+          return false;
+        }
+
+      ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL | GNUTLS_NONBLOCK);
+      if (ret != GNUTLS_E_SUCCESS)
+        {
+          warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
+          return false;
+        }
+
+      ret = gnutls_set_default_priority (self->tls);
+      if (ret != GNUTLS_E_SUCCESS)
+        {
+          warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
+          return false;
+        }
+
+      ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
+                                    certificate_get_credentials (parameters.certificate));
+      if (ret != GNUTLS_E_SUCCESS)
+        {
+          warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
+          return false;
+        }
+
+      gnutls_session_set_verify_function (self->tls, client_certificate_verify);
+      gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
+      connection_enable_session_tickets (self);
+      gnutls_handshake_set_timeout (self->tls, parameters.handshake_timeout * 1000);
+      gnutls_transport_set_int (self->tls, self->client.fd);
+
+      debug (CONNECTION, "TLS is initialised; doing handshake");
+
+      /* the deadline from connection_start() keeps running */
+      self->state = CONNECTION_STATE_HANDSHAKE;
+      self->stage_start = stats_now ();
+
+      return connection_tls_handshake (self);
+    }
+
+  connection_handshake_done (self);
+
+  return connection_create_metadata (self) &&
+         connection_connect_to_wsinstance (self);
+}
+
+static void
+connection_client_ready (Watch    *watch,
+                         uint32_t  events)
+{
+  Connection *self = container_of (watch, Connection, client);
+  bool alive;
+
+  switch (self->state)
+    {
+    case CONNECTION_STATE_FIRST_BYTE:
+      alive = connection_handshake (self);
+      break;
+
+    case CONNECTION_STATE_HANDSHAKE:
+      alive = connection_tls_handshake (self);
+      break;
+
+    case CONNECTION_STATE_RELAY:
+      alive = connection_relay (self, events, 0);
+      break;
+
+    default:
+      assert (false); /* not reached */
+      return;
+    }
+
+  if (!alive)
+    connection_close (self);
+}
+
+static void
+connection_ws_ready (Watch    *watch,
+                     uint32_t  events)
+{
+  Connection *self = container_of (watch, Connection, ws);
+
+  assert (self->state == CONNECTION_STATE_RELAY);
+
+  if (!connection_relay (self, 0, events))
+    connection_close (self);
+}
+
+static void
+connection_factory_ready (Watch    *watch,
+                          uint32_t  events)
+{
+  Connection *self = container_of (watch, Connection, factory);
 
-  debug (CONNECTION, "New thread for fd %i", fd);
+  assert (self->state == CONNECTION_STATE_ACTIVATION);
+
+  if (!connection_activation_done (self))
+    connection_close (self);
+}
+
+/**
+ * connection_start: Handle a new connection
+ *
+ * @worker: the worker thread which will own the connection; must be the
+ *          calling thread
+ * @fd: the accepted client socket; ownership is taken
+ * @closed_func: called when the connection is closed
+ */
+void
+connection_start (Worker               *worker,
+                  int                   fd,
+                  ConnectionClosedFunc  closed_func)
+{
+  Connection *self = callocx (1, sizeof (Connection));
 
-  if (connection_handshake (&self) &&
-      connection_create_metadata (&self) &&
-      connection_connect_to_wsinstance (&self))
-    connection_thread_loop (&self);
+  self->worker = worker;
+  self->closed_func = closed_func;
+  self->metadata_fd = -1;
+  buffer_init (&self->client_to_ws_buffer, STATS_BYTES_FROM_CLIENT);
+  buffer_init (&self->ws_to_client_buffer, STATS_BYTES_TO_CLIENT);
 
-  debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
+  worker_watch (worker, &self->client, fd, connection_client_ready);
+  worker_watch (worker, &self->ws, -1, connection_ws_ready);
+  worker_watch (worker, &self->factory, -1, connection_factory_ready);
 
-  free (self.wsinstance);
+  assert (!buffer_can_write (&self->client_to_ws_buffer));
+  assert (!buffer_can_write (&self->ws_to_client_buffer));
+  assert (!self->tls);
 
-  if (self.client_cert_filename)
-    client_certificate_unlink_and_free (parameters.cert_session_dir, self.client_cert_filename);
+#ifdef DEBUG
+  self->client_to_ws_buffer.name = "client-to-ws";
+  self->ws_to_client_buffer.name = "ws-to-client";
+#endif
 
-  if (self.tls)
-    gnutls_deinit (self.tls);
+  debug (CONNECTION, "New connection for fd %i in worker %p", fd, worker);
 
-  if (self.client_fd != -1)
-    close (self.client_fd);
+  /* Slow or malicious clients can keep lots of connections in the
+   * handshake; don't let them take up unlimited resources.  This only
+   * affects new connections: established ones keep going.
+   */
+  unsigned pending = atomic_fetch_add (&pending_handshakes, 1);
+  self->handshake_pending = true;
+  if (parameters.max_pending_handshakes && pending >= parameters.max_pending_handshakes)
+    {
+      debug (CONNECTION, "%u handshakes in progress already; dropping connection", pending);
+      stats_add (STATS_HANDSHAKES_REJECTED, 1);
+      connection_close (self);
+      return;
+    }
 
-  if (self.ws_fd != -1)
-    close (self.ws_fd);
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) != 0)
+    {
+      warn ("failed to make client socket non-blocking");
+      connection_close (self);
+      return;
+    }
 
-  if (self.metadata_fd != -1)
-    close (self.metadata_fd);
+  /* This is the deadline for both the first byte and the TLS handshake,
+   * so that trickling in the handshake data doesn't extend it.
+   */
+  self->state = CONNECTION_STATE_FIRST_BYTE;
+  worker_update (worker, &self->client, EPOLLIN);
+  worker_add_timeout (worker, &self->timeout, parameters.handshake_timeout, connection_timed_out);
 }
 
 /**
  * connection_crypto_init: Initialise TLS support
  *
- * This should be called after server_init() in order to enable TLS
- * support for connections. If this function is not called, the server
- * will only be able to handle http requests.
+ * This should be called between server_init() and server_start() in order
+ * to enable TLS support for connections. If this function is not called,
+ * the server will only be able to handle http requests.
  *
  * The certificate file must either contain the key as well, or end with
  * "*.crt" or "*.cert" and have a corresponding "*.key" file.
@@ -864,6 +1581,63 @@ connection_crypto_init (const char *certificate_filename,
   parameters.require_https = !allow_unencrypted;
 }
 
+/**
+ * connection_set_kernel_tls: Enable kernel TLS offload
+ *
+ * If enabled, the record encryption of TLS connections is handed over to
+ * the kernel after the handshake, if the kernel supports the negotiated
+ * cipher.  Connections fall back to gnutls otherwise.
+ */
+void
+connection_set_kernel_tls (bool enable)
+{
+  parameters.kernel_tls = enable;
+}
+
+/**
+ * connection_set_handshake_limits: Protect against slow handshakes
+ *
+ * @timeout: how many seconds a client gets from connecting until the end
+ *   of the TLS handshake (or the first byte of an unencrypted request)
+ * @max_pending: how many connections may be in that phase at the same
+ *   time; connections beyond that are closed right away.  0 means no
+ *   limit.
+ */
+void
+connection_set_handshake_limits (unsigned timeout,
+                                 unsigned max_pending)
+{
+  assert (timeout > 0);
+
+  parameters.handshake_timeout = timeout;
+  parameters.max_pending_handshakes = max_pending;
+}
+
+/**
+ * connection_get_pending_handshakes: Number of connections in the handshake
+ */
+unsigned
+connection_get_pending_handshakes (void)
+{
+  return atomic_load (&pending_handshakes);
+}
+
+/**
+ * connection_set_session_tickets: Configure TLS session resumption
+ *
+ * @key_lifetime: how long (in seconds) to use a session ticket key
+ *   before replacing it with a new one; 0 disables session tickets
+ *
+ * Session tickets let returning clients skip the expensive part of the
+ * handshake.  They are only issued when client certificates are not
+ * requested.
+ */
+void
+connection_set_session_tickets (unsigned key_lifetime)
+{
+  parameters.ticket_key_lifetime = key_lifetime;
+}
+
 void
 connection_set_directories (const char *wsinstance_sockdir,
                             const char *runtime_directory)
@@ -905,6 +1679,17 @@ connection_cleanup (void)
     }
 
   parameters.require_https = false;
+  parameters.kernel_tls = false;
+  parameters.ticket_key_lifetime = 0;
+  parameters.handshake_timeout = CONNECTION_DEFAULT_HANDSHAKE_TIMEOUT;
+  parameters.max_pending_handshakes = CONNECTION_DEFAULT_MAX_PENDING_HANDSHAKES;
+
+  pthread_mutex_lock (&ticket_key.mutex);
+  ticket_key_clear ();
+  pthread_mutex_unlock (&ticket_key.mutex);
+
+  buffer_pool_cleanup ();
+  upstream_cleanup ();
 
   close (parameters.cert_session_dir);
   parameters.cert_session_dir = -1;
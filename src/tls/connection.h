@@ -24,6 +24,14 @@
 
 #include <gnutls/gnutls.h>
 
+#include "worker.h"
+
+/* seconds from accept() until the end of the TLS handshake */
+#define CONNECTION_DEFAULT_HANDSHAKE_TIMEOUT 30
+#define CONNECTION_DEFAULT_MAX_PENDING_HANDSHAKES 512
+
+typedef void (* ConnectionClosedFunc) (void);
+
 /* init/teardown */
 void
 connection_set_directories (const char *wsinstance_sockdir,
@@ -35,9 +43,24 @@ connection_crypto_init (const char *certificate_filename,
                         bool allow_unencrypted,
                         gnutls_certificate_request_t request_mode);
 
+void
+connection_set_kernel_tls (bool enable);
+
+void
+connection_set_session_tickets (unsigned key_lifetime);
+
+void
+connection_set_handshake_limits (unsigned timeout,
+                                 unsigned max_pending);
+
 void
 connection_cleanup (void);
 
+unsigned
+connection_get_pending_handshakes (void);
+
 /* handle a new connection */
 void
-connection_thread_main (int fd);
+connection_start (Worker               *worker,
+                  int                   fd,
+                  ConnectionClosedFunc  closed_func);
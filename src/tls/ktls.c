@@ -0,0 +1,346 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kernel TLS offload: after the handshake, the record layer keys are
+ * handed to the kernel with setsockopt(SOL_TLS), and the socket can then
+ * be used with plain read()/write() for the plaintext.
+ *
+ * If GnuTLS already enabled kTLS on its own (when configured to do so
+ * in the system-wide GnuTLS configuration), we just use that.
+ * Otherwise, we extract the keys with gnutls_record_get_state() and
+ * install them ourselves.
+ *
+ * Receive offload is set up first: once the kernel decrypts incoming
+ * records, gnutls never reads from the socket again, so it's fine to
+ * keep using gnutls for sending.  The opposite is not true: gnutls might
+ * send alerts or key updates in response to incoming records, and those
+ * would get encrypted a second time.
+ */
+
+#include "config.h"
+
+#include "ktls.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_TLS_H
+#include <linux/tls.h>
+#endif
+
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
+
+#include <common/cockpitmemory.h>
+
+#include "utils.h"
+
+#define TLS_RECORD_TYPE_ALERT 21
+#define TLS_RECORD_TYPE_APPLICATION_DATA 23
+
+#ifdef HAVE_LINUX_TLS_H
+
+typedef union {
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+} CryptoInfo;
+
+/* For AES-GCM, the 12 byte nonce is a 4 byte salt plus 8 bytes of IV.
+ * With TLS 1.3, gnutls gives us the full 12 bytes; with TLS 1.2 we only
+ * get the salt, and the explicit part of the nonce is the sequence
+ * number.
+ */
+#define FILL_AES_GCM(crypto, iv_datum, key_datum, seq) \
+  do { \
+    if ((iv_datum)->size == sizeof (crypto).salt + sizeof (crypto).iv) \
+      memcpy ((crypto).iv, (iv_datum)->data + sizeof (crypto).salt, sizeof (crypto).iv); \
+    else if ((iv_datum)->size == sizeof (crypto).salt) \
+      memcpy ((crypto).iv, (seq), sizeof (crypto).iv); \
+    else \
+      return 0; \
+    if ((key_datum)->size != sizeof (crypto).key) \
+      return 0; \
+    memcpy ((crypto).salt, (iv_datum)->data, sizeof (crypto).salt); \
+    memcpy ((crypto).key, (key_datum)->data, sizeof (crypto).key); \
+    memcpy ((crypto).rec_seq, (seq), sizeof (crypto).rec_seq); \
+  } while (0)
+
+/**
+ * ktls_get_crypto_info:
+ * @session: a gnutls session which completed its handshake
+ * @read: whether to get the receive or transmit state
+ * @crypto: the result
+ *
+ * Returns: the size of the filled-in part of @crypto, or 0 if the cipher
+ *   or protocol version are not supported by kTLS.
+ */
+static size_t
+ktls_get_crypto_info (gnutls_session_t  session,
+                      bool              read,
+                      CryptoInfo       *crypto)
+{
+  gnutls_datum_t iv;
+  gnutls_datum_t key;
+  unsigned char seq[8];
+  int ret;
+
+  memset (crypto, 0, sizeof *crypto);
+
+  switch (gnutls_protocol_get_version (session))
+    {
+    case GNUTLS_TLS1_2:
+      crypto->info.version = TLS_1_2_VERSION;
+      break;
+
+    case GNUTLS_TLS1_3:
+      crypto->info.version = TLS_1_3_VERSION;
+      break;
+
+    default:
+      return 0;
+    }
+
+  ret = gnutls_record_get_state (session, read, NULL, &iv, &key, seq);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      debug (CONNECTION, "gnutls_record_get_state failed: %s", gnutls_strerror (ret));
+      return 0;
+    }
+
+  switch (gnutls_cipher_get (session))
+    {
+    case GNUTLS_CIPHER_AES_128_GCM:
+      crypto->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      FILL_AES_GCM (crypto->aes_gcm_128, &iv, &key, seq);
+      return sizeof crypto->aes_gcm_128;
+
+    case GNUTLS_CIPHER_AES_256_GCM:
+      crypto->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+      FILL_AES_GCM (crypto->aes_gcm_256, &iv, &key, seq);
+      return sizeof crypto->aes_gcm_256;
+
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+      if (iv.size != sizeof crypto->chacha20_poly1305.iv ||
+          key.size != sizeof crypto->chacha20_poly1305.key)
+        return 0;
+      crypto->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      memcpy (crypto->chacha20_poly1305.iv, iv.data, iv.size);
+      memcpy (crypto->chacha20_poly1305.key, key.data, key.size);
+      memcpy (crypto->chacha20_poly1305.rec_seq, seq, sizeof seq);
+      return sizeof crypto->chacha20_poly1305;
+
+    default:
+      debug (CONNECTION, "cipher %s is not supported by kTLS",
+             gnutls_cipher_get_name (gnutls_cipher_get (session)));
+      return 0;
+    }
+}
+
+static bool
+ktls_install (gnutls_session_t  session,
+              int               fd,
+              bool              read)
+{
+  CryptoInfo crypto;
+  size_t size;
+  int r;
+
+  size = ktls_get_crypto_info (session, read, &crypto);
+  if (size == 0)
+    return false;
+
+  r = setsockopt (fd, SOL_TLS, read ? TLS_RX : TLS_TX, &crypto, size);
+  if (r != 0)
+    {
+      debug (CONNECTION, "setsockopt(SOL_TLS, %s) failed: %m", read ? "TLS_RX" : "TLS_TX");
+    }
+
+  cockpit_memory_clear (&crypto, sizeof crypto);
+
+  return r == 0;
+}
+
+#endif /* HAVE_LINUX_TLS_H */
+
+/**
+ * ktls_enable:
+ * @session: a server session which just completed its handshake
+ * @fd: the TCP socket of @session
+ *
+ * Tries to hand the record encryption of @session over to the kernel.
+ *
+ * Returns: a combination of %KTLS_RX and %KTLS_TX, for the directions
+ *   in which the plaintext is now read from or written to @fd directly.
+ *   For the others, gnutls must still be used.
+ */
+unsigned
+ktls_enable (gnutls_session_t session,
+             int              fd)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+  gnutls_transport_ktls_enable_flags_t enabled = gnutls_transport_is_ktls_enabled (session);
+
+  if (enabled == GNUTLS_KTLS_DUPLEX)
+    {
+      debug (CONNECTION, "gnutls enabled kTLS itself");
+      return KTLS_RX | KTLS_TX;
+    }
+  else if (enabled != 0)
+    {
+      /* half-enabled by gnutls: leave it to gnutls */
+      return 0;
+    }
+#endif
+
+#ifdef HAVE_LINUX_TLS_H
+  unsigned result = 0;
+
+  /* anything that gnutls already read off the socket would be lost */
+  if (gnutls_record_check_pending (session) != 0)
+    return 0;
+
+  if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") != 0)
+    {
+      debug (CONNECTION, "setsockopt(TCP_ULP, tls) failed: %m");
+      return 0;
+    }
+
+  if (ktls_install (session, fd, true))
+    {
+      result |= KTLS_RX;
+
+      if (ktls_install (session, fd, false))
+        result |= KTLS_TX;
+    }
+
+  return result;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * ktls_readv:
+ * @fd: a socket with kTLS receive offload
+ * @iov: buffers to read into
+ * @iovcnt: the number of elements in @iov
+ *
+ * Like readv(), but deals with non-data TLS records, which the kernel
+ * hands to us as-is: a close_notify alert is reported as EOF, and any
+ * other alert or handshake message (which we cannot process) as EPROTO.
+ */
+ssize_t
+ktls_readv (int                 fd,
+            const struct iovec *iov,
+            int                 iovcnt)
+{
+#ifdef HAVE_LINUX_TLS_H
+  char control[CMSG_SPACE (sizeof (unsigned char))];
+  struct msghdr msg = {
+    .msg_iov = (struct iovec *) iov,
+    .msg_iovlen = iovcnt,
+    .msg_control = control,
+    .msg_controllen = sizeof control,
+  };
+  ssize_t s;
+
+  s = recvmsg (fd, &msg, 0);
+  if (s <= 0)
+    return s;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+    {
+      unsigned char record_type = *(unsigned char *) CMSG_DATA (cmsg);
+
+      if (record_type != TLS_RECORD_TYPE_APPLICATION_DATA)
+        {
+          /* An alert is a level and a description (close_notify is 0).
+           * The two bytes might be split over the end of a ring buffer.
+           */
+          if (record_type == TLS_RECORD_TYPE_ALERT && s == 2)
+            {
+              const unsigned char *description = iov[0].iov_len > 1 ?
+                (const unsigned char *) iov[0].iov_base + 1 : iov[1].iov_base;
+
+              if (*description == 0)
+                return 0;
+            }
+
+          debug (CONNECTION, "unexpected TLS record type %u with kTLS", (unsigned) record_type);
+          errno = EPROTO;
+          return -1;
+        }
+    }
+
+  return s;
+#else
+  assert (false); /* not reached: ktls_enable() never enables KTLS_RX */
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/**
+ * ktls_send_close_notify:
+ * @fd: a socket with kTLS transmit offload
+ *
+ * Sends a close_notify alert record.  This is the equivalent of
+ * gnutls_bye (GNUTLS_SHUT_WR); the caller should shutdown() the socket
+ * afterwards.
+ */
+bool
+ktls_send_close_notify (int fd)
+{
+#ifdef HAVE_LINUX_TLS_H
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  char control[CMSG_SPACE (sizeof (unsigned char))] = { 0, };
+  struct iovec iov = { alert, sizeof alert };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof control,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  ssize_t s;
+
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *(unsigned char *) CMSG_DATA (cmsg) = TLS_RECORD_TYPE_ALERT;
+
+  do
+    s = sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  while (s == -1 && errno == EINTR);
+
+  return s == sizeof alert;
+#else
+  assert (false); /* not reached: ktls_enable() never enables KTLS_TX */
+  return false;
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <gnutls/gnutls.h>
+
+/* directions in which record encryption was handed to the kernel */
+enum {
+  KTLS_RX = 1 << 0,
+  KTLS_TX = 1 << 1,
+};
+
+unsigned
+ktls_enable (gnutls_session_t session,
+             int              fd);
+
+ssize_t
+ktls_readv (int                 fd,
+            const struct iovec *iov,
+            int                 iovcnt);
+
+bool
+ktls_send_close_notify (int fd);
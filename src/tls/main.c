@@ -26,7 +26,9 @@
 #include <unistd.h>
 
 #include <common/cockpitconf.h>
+#include <common/cockpitmemory.h>
 #include <common/cockpitwebcertificate.h>
+#include "bufferpool.h"
 #include "utils.h"
 #include "server.h"
 #include "connection.h"
@@ -106,7 +108,22 @@ main (int argc, char **argv)
   if (!runtimedir)
     errx (EXIT_FAILURE, "$RUNTIME_DIRECTORY environment variable must be set to a private directory");
 
-  server_init ("/run/cockpit/wsinstance", runtimedir, arguments.idle_timeout, arguments.port);
+  server_init ("/run/cockpit/wsinstance", runtimedir, arguments.idle_timeout, arguments.port,
+               cockpit_conf_bool ("WebService", "ReusePort", false));
+
+  char *stats_path;
+  asprintfx (&stats_path, "%s/stats.sock", runtimedir);
+  server_listen_stats (stats_path);
+  free (stats_path);
+
+  /* in MiB */
+  buffer_pool_set_limit ((size_t) cockpit_conf_uint ("WebService", "BufferMemoryLimit",
+                                                     BUFFER_POOL_DEFAULT_LIMIT >> 20, 4096, 0) << 20);
+
+  connection_set_handshake_limits (cockpit_conf_uint ("WebService", "HandshakeTimeout",
+                                                      CONNECTION_DEFAULT_HANDSHAKE_TIMEOUT, 300, 1),
+                                   cockpit_conf_uint ("WebService", "MaxPendingHandshakes",
+                                                      CONNECTION_DEFAULT_MAX_PENDING_HANDSHAKES, 100000, 0));
 
   if (!arguments.no_tls)
     {
@@ -124,6 +141,12 @@ main (int argc, char **argv)
                               "/run/cockpit/tls/server/key",
                               allow_unencrypted, client_cert_mode);
 
+      connection_set_kernel_tls (cockpit_conf_bool ("WebService", "KernelTLS", false));
+
+      /* in minutes; at most a week, as recommended by RFC 8446 */
+      connection_set_session_tickets (60 * cockpit_conf_uint ("WebService", "SessionTicketKeyRotation",
+                                                              360, 7 * 24 * 60, 0));
+
       /* There's absolutely no need to keep these around */
       if (unlink ("/run/cockpit/tls/server/cert") != 0)
         err (EXIT_FAILURE, "unlink: /run/cockpit/tls/server/cert");
@@ -132,6 +155,8 @@ main (int argc, char **argv)
         err (EXIT_FAILURE, "unlink: /run/cockpit/tls/server/key");
     }
 
+  /* only now that everything is configured */
+  server_start ();
   server_run ();
   server_cleanup ();
 
@@ -24,8 +24,11 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
-#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,22 +37,50 @@
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <common/cockpitjsonprint.h>
+#include <common/cockpitmemory.h>
+
+#include "bufferpool.h"
 #include "connection.h"
+#include "stats.h"
 #include "utils.h"
+#include "worker.h"
+
+/* a listening socket watched by a worker, with sharded listeners */
+typedef struct {
+  Watch watch;
+  Worker *worker;
+} Listener;
 
 /* cockpit-tls TCP server state (singleton) */
 static struct {
   /* only used from main thread */
   bool initialized;
-  int first_listener;
-  int last_listener;
+  int *listen_fds;
+  unsigned n_listen_fds;
   int epollfd;
-
-  /* rw, protected by mutex */
-  pthread_mutex_t connection_mutex;
-  unsigned int connection_count;
+  Worker **workers;
+  unsigned n_workers;
+  unsigned next_worker;
+
+  /* with sharding, the workers accept on their own */
+  bool shard_listeners;
+  bool socket_activated;
+  Listener *listeners;
+  unsigned n_listeners;
+
+  /* the statistics socket, and what it reported the last time */
+  int stats_fd;
+  char *stats_path;
+  uint64_t start_time;
+  uint64_t stats_time;
+  uint64_t stats_accepted;
+
+  /* shared with the worker threads */
+  atomic_uint connection_count;
   int idle_timerfd;
   struct itimerspec idle_timeout;
 } server;
@@ -84,44 +115,59 @@ check_sd_listen_pid (void)
   return true;
 }
 
-static void *
-server_connection_thread_start_routine (void *data)
+/* called from the worker threads */
+static void
+server_connection_closed (void)
 {
-  int fd = (uintptr_t) data;
+  unsigned count = atomic_fetch_sub (&server.connection_count, 1) - 1;
 
-  connection_thread_main (fd);
+  debug (CONNECTION, "Server.connection_count decreased to %u", count);
 
-  /* teardown */
-  {
-    pthread_mutex_lock (&server.connection_mutex);
+  /* This can race with handle_accept() clearing the timeout again, so
+   * server_poll_event() double-checks the count when the timer fires.
+   */
+  if (count == 0 && server.idle_timerfd != -1)
+    {
+      debug (CONNECTION, "  -> setting idle timeout");
+      timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+    }
+}
 
-    server.connection_count--;
+static void
+server_worker_handle_fd (Worker *worker,
+                         int     fd)
+{
+  connection_start (worker, fd, server_connection_closed);
+}
 
-    debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
+/* may be called from the worker threads */
+static void
+server_connection_accepted (int fd)
+{
+  debug (CONNECTION, "New connection accepted, fd %i", fd);
 
-    if (server.connection_count == 0 && server.idle_timerfd != -1)
-      {
-        debug (CONNECTION, "  -> setting idle timeout");
-        timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
-      }
+  stats_add (STATS_ACCEPTED, 1);
 
-    pthread_mutex_unlock (&server.connection_mutex);
-  }
+  if (atomic_fetch_add (&server.connection_count, 1) == 0 && server.idle_timerfd != -1)
+    {
+      const struct itimerspec zero = { { 0 }, };
+      debug (CONNECTION, "  -> clearing idle timeout.");
+      timerfd_settime (server.idle_timerfd, 0, &zero, NULL);
+    }
 
-  return NULL;
+  debug (CONNECTION, "  -> server.connection_count is now %u", atomic_load (&server.connection_count));
 }
 
 /**
  * handle_accept: Handle event on listening fd
  *
- * I. e. accepting new connections
+ * I. e. accepting new connections, and handing them over to the workers
+ * in turn.
  */
 static void
 handle_accept (int listen_fd)
 {
   int fd;
-  pthread_attr_t attr;
-  pthread_t thread;
 
   debug (CONNECTION, "epoll_wait event on server listen fd %i", listen_fd);
 
@@ -134,40 +180,189 @@ handle_accept (int listen_fd)
       return;
     }
 
-  debug (CONNECTION, "New connection accepted, fd %i", fd);
+  server_connection_accepted (fd);
+
+  worker_dispatch_fd (server.workers[server.next_worker++ % server.n_workers], fd);
+}
+
+static void
+print_histogram (FILE           *stream,
+                 const char     *name,
+                 const Stats    *stats,
+                 StatsHistogram  histogram)
+{
+  static const unsigned limits_ms[] = { STATS_BUCKET_LIMITS_MS };
+  const uint64_t *buckets = stats->buckets[histogram];
+  uint64_t count = 0;
+  char key[20];
+
+  for (unsigned i = 0; i < STATS_N_BUCKETS; i++)
+    count += buckets[i];
+
+  fprintf (stream, ", \"%s\": {\"count\": %"PRIu64, name, count);
+  cockpit_json_print_integer_property (stream, "sum-us", stats->latency_sum[histogram]);
+
+  /* each bucket has the ones which took longer than the previous limit */
+  for (unsigned i = 0; i < N_ELEMENTS (limits_ms); i++)
+    {
+      snprintf (key, sizeof key, "%ums", limits_ms[i]);
+      cockpit_json_print_integer_property (stream, key, buckets[i]);
+    }
+  cockpit_json_print_integer_property (stream, "more", buckets[STATS_N_BUCKETS - 1]);
+
+  fputc ('}', stream);
+}
+
+static void
+print_stats (FILE *stream)
+{
+  uint64_t now = stats_now ();
+  Stats stats;
+
+  stats_collect (&stats);
+
+  /* the rate is over the time since the previous query */
+  uint64_t accepted = stats.counters[STATS_ACCEPTED];
+  uint64_t accepted_per_second = (accepted - server.stats_accepted) * 1000000 / MAX (now - server.stats_time, 1);
+  server.stats_accepted = accepted;
+  server.stats_time = now;
+
+  fprintf (stream, "{\"version\": 1");
+  cockpit_json_print_integer_property (stream, "uptime", (now - server.start_time) / 1000000);
+  cockpit_json_print_integer_property (stream, "active-connections", atomic_load (&server.connection_count));
+  cockpit_json_print_integer_property (stream, "accepted", accepted);
+  cockpit_json_print_integer_property (stream, "accepted-per-second", accepted_per_second);
+  cockpit_json_print_integer_property (stream, "full-handshakes", stats.counters[STATS_FULL_HANDSHAKES]);
+  cockpit_json_print_integer_property (stream, "resumed-handshakes", stats.counters[STATS_RESUMED_HANDSHAKES]);
+  cockpit_json_print_integer_property (stream, "ktls-connections", stats.counters[STATS_KTLS_CONNECTIONS]);
+  cockpit_json_print_integer_property (stream, "pending-handshakes", connection_get_pending_handshakes ());
+  cockpit_json_print_integer_property (stream, "handshake-timeouts", stats.counters[STATS_HANDSHAKE_TIMEOUTS]);
+  cockpit_json_print_integer_property (stream, "handshakes-rejected", stats.counters[STATS_HANDSHAKES_REJECTED]);
+  cockpit_json_print_integer_property (stream, "bytes-from-client", stats.counters[STATS_BYTES_FROM_CLIENT]);
+  cockpit_json_print_integer_property (stream, "bytes-to-client", stats.counters[STATS_BYTES_TO_CLIENT]);
+  cockpit_json_print_integer_property (stream, "buffer-full-stalls", stats.counters[STATS_BUFFER_FULL_STALLS]);
+  cockpit_json_print_integer_property (stream, "buffer-memory", buffer_pool_get_in_use ());
+  cockpit_json_print_integer_property (stream, "upstream-pool-hits", stats.counters[STATS_UPSTREAM_HITS]);
+  cockpit_json_print_integer_property (stream, "upstream-pool-misses", stats.counters[STATS_UPSTREAM_MISSES]);
+  print_histogram (stream, "handshake-latency", &stats, STATS_HANDSHAKE_LATENCY);
+  print_histogram (stream, "wsinstance-connect-latency", &stats, STATS_WSINSTANCE_CONNECT_LATENCY);
+  fputs ("}\n", stream);
+}
 
-  {
-    pthread_mutex_lock (&server.connection_mutex);
+/**
+ * handle_stats_request: Handle event on the statistics socket
+ *
+ * Every client gets the current statistics as a JSON object, and EOF.
+ */
+static void
+handle_stats_request (void)
+{
+  char *json = NULL;
+  size_t length = 0;
+  FILE *stream;
+  ssize_t s;
+  int fd;
 
-    if (server.connection_count == 0 && server.idle_timerfd != -1)
-      {
-        const struct itimerspec zero = { { 0 }, };
-        debug (CONNECTION, "  -> clearing idle timeout.");
-        timerfd_settime (server.idle_timerfd, 0, &zero, NULL);
-      }
+  fd = accept4 (server.stats_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        warn ("failed to accept statistics connection");
+      return;
+    }
 
-    server.connection_count++;
+  stream = open_memstream (&json, &length);
+  if (stream == NULL)
+    err (EXIT_FAILURE, "open_memstream");
+  print_stats (stream);
+  if (fclose (stream) != 0)
+    err (EXIT_FAILURE, "failed to format statistics");
 
-    debug (CONNECTION, "  -> server.connection_count is now %i", server.connection_count);
+  /* this easily fits into the socket buffer, so don't wait for the client */
+  s = send (fd, json, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (s != length)
+    {
+      debug (SERVER, "failed to send statistics: %s", s == -1 ? strerror (errno) : "short write");
+    }
 
-    pthread_mutex_unlock (&server.connection_mutex);
-  }
+  free (json);
+  close (fd);
+}
 
-  pthread_attr_init (&attr);
-  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+/* how many connections a worker accepts in one go, before it goes back
+ * to serving the ones it already has */
+#define ACCEPT_BATCH 16
 
-  int r = pthread_create (&thread, &attr,
-                          server_connection_thread_start_routine,
-                          (void *) (uintptr_t) fd);
+/**
+ * listener_ready: Handle event on a sharded listening fd
+ *
+ * Called in the worker thread which owns the Listener; the connections
+ * stay in that worker.
+ */
+static void
+listener_ready (Watch    *watch,
+                uint32_t  events)
+{
+  Listener *self = container_of (watch, Listener, watch);
 
-  if (r != 0)
+  for (int i = 0; i < ACCEPT_BATCH; i++)
     {
-      errno = r;
-      warn ("pthread_create() failed.  dropping connection");
-      close (fd);
+      int fd = accept4 (watch->fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          /* with EPOLLEXCLUSIVE, another worker might have been faster */
+          if (errno != EAGAIN && errno != EINTR)
+            warn ("failed to accept connection");
+          return;
+        }
+
+      server_connection_accepted (fd);
+      connection_start (self->worker, fd, server_connection_closed);
     }
+}
+
+static int
+create_listener (uint16_t port,
+                 bool     reuse_port)
+{
+  struct sockaddr_in sa_serv;
+  int optval = 1;
+  int fd;
 
-  pthread_attr_destroy (&attr);
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    err (EXIT_FAILURE, "failed to create server listening fd");
+
+  memset (&sa_serv, '\0', sizeof (sa_serv));
+  sa_serv.sin_family = AF_INET;
+  sa_serv.sin_addr.s_addr = INADDR_ANY;
+  sa_serv.sin_port = htons (port);
+
+  if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (void *) &optval, sizeof (int)) < 0)
+    err (EXIT_FAILURE, "failed to set socket option");
+  if (reuse_port && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (void *) &optval, sizeof (int)) < 0)
+    err (EXIT_FAILURE, "failed to set SO_REUSEPORT");
+  if (bind (fd, (struct sockaddr *) &sa_serv, sizeof (sa_serv)) < 0)
+    err (EXIT_FAILURE, "failed to bind to port %hu", port);
+  if (listen (fd, 1024) < 0)
+    err (EXIT_FAILURE, "failed to listen to server port");
+
+  return fd;
+}
+
+static void
+server_add_listener (Worker *worker,
+                     int     fd,
+                     bool    exclusive)
+{
+  Listener *listener = &server.listeners[server.n_listeners++];
+
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) != 0)
+    err (EXIT_FAILURE, "failed to make listening fd %i non-blocking", fd);
+
+  listener->worker = worker;
+  worker_watch (worker, &listener->watch, fd, listener_ready);
+  worker_update (worker, &listener->watch, EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0));
 }
 
 /***********************************
@@ -188,12 +383,22 @@ handle_accept (int listen_fd)
  *                no connections
  * @port: Port to listen to; ignored when the listening socket is handed over
  *        through the systemd socket activation protocol
+ * @shard_listeners: Let each worker thread accept connections on its own,
+ *        instead of accepting in the main thread and handing them out.  Each
+ *        worker gets its own SO_REUSEPORT listening socket, so that the kernel
+ *        spreads the connections.  Sockets from socket activation can't be
+ *        duplicated like that; then all workers wait for them with
+ *        EPOLLEXCLUSIVE, which wakes up only one of them per connection.
+ *
+ * The listening sockets are set up, but no connection gets handled until
+ * server_start() is called.
  */
 void
 server_init (const char *wsinstance_sockdir,
              const char *cert_session_dir,
              int idle_timeout,
-             uint16_t port)
+             uint16_t port,
+             bool shard_listeners)
 {
   const char *env_listen_fds;
   struct epoll_event ev = { .events = EPOLLIN };
@@ -201,10 +406,20 @@ server_init (const char *wsinstance_sockdir,
   assert (!server.initialized);
   server.initialized = true;
   server.idle_timerfd = -1;
+  server.stats_fd = -1;
+  server.start_time = server.stats_time = stats_now ();
 
   connection_set_directories (wsinstance_sockdir, cert_session_dir);
 
-  pthread_mutex_init (&server.connection_mutex, NULL);
+  /* splice() to a socket has no equivalent of MSG_NOSIGNAL */
+  signal (SIGPIPE, SIG_IGN);
+
+  /* one event loop per CPU; they multiplex all connections between them */
+  long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  server.n_workers = MAX (n_cpus, 1);
+  server.workers = callocx (server.n_workers, sizeof (Worker *));
+  for (unsigned i = 0; i < server.n_workers; i++)
+    server.workers[i] = worker_new (server_worker_handle_fd);
 
   /* systemd socket activated? */
   env_listen_fds = secure_getenv ("LISTEN_FDS");
@@ -216,49 +431,62 @@ server_init (const char *wsinstance_sockdir,
       if (n < 1 || n > INT_MAX || *endptr != '\0')
         errx (EXIT_FAILURE, "Invalid $LISTEN_FDS value '%s'", env_listen_fds);
 
-      server.first_listener = SD_LISTEN_FDS_START;
-      server.last_listener = SD_LISTEN_FDS_START + (n - 1);
+      server.n_listen_fds = n;
+      server.listen_fds = callocx (n, sizeof (int));
+      for (unsigned i = 0; i < n; i++)
+        server.listen_fds[i] = SD_LISTEN_FDS_START + i;
+
+      server.socket_activated = true;
     }
-  else
+  else if (shard_listeners)
     {
-      struct sockaddr_in sa_serv;
-      int optval = 1;
+      server.n_listen_fds = server.n_workers;
+      server.listen_fds = callocx (server.n_workers, sizeof (int));
 
+      for (unsigned i = 0; i < server.n_workers; i++)
+        {
+          server.listen_fds[i] = create_listener (port, true);
+
+          /* with port 0, the kernel picked one for the first socket */
+          if (i == 0 && port == 0)
+            {
+              struct sockaddr_in sa;
+              socklen_t sa_len = sizeof sa;
+
+              if (getsockname (server.listen_fds[0], (struct sockaddr *) &sa, &sa_len) != 0)
+                err (EXIT_FAILURE, "failed to get listening port");
+              port = ntohs (sa.sin_port);
+            }
+        }
+
+      debug (SERVER, "Server ready. Listening on port %hu with %u sockets", port, server.n_listen_fds);
+    }
+  else
+    {
       /* Listen to our port; on the command line and our API we just support one */
-      server.first_listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-      if (server.first_listener < 0)
-        err (EXIT_FAILURE, "failed to create server listening fd");
-      server.last_listener = server.first_listener;
-
-      memset (&sa_serv, '\0', sizeof (sa_serv));
-      sa_serv.sin_family = AF_INET;
-      sa_serv.sin_addr.s_addr = INADDR_ANY;
-      sa_serv.sin_port = htons (port);
-
-      if (setsockopt (server.first_listener, SOL_SOCKET, SO_REUSEADDR, (void *) &optval, sizeof (int)) < 0)
-        err (EXIT_FAILURE, "failed to set socket option");
-      if (bind (server.first_listener, (struct sockaddr *) &sa_serv, sizeof (sa_serv)) < 0)
-        err (EXIT_FAILURE, "failed to bind to port %hu", port);
-      if (listen (server.first_listener, 1024) < 0)
-        err (EXIT_FAILURE, "failed to listen to server port");
-      debug (SERVER, "Server ready. Listening on port %hu, fd %i", port, server.first_listener);
+      server.n_listen_fds = 1;
+      server.listen_fds = callocx (1, sizeof (int));
+      server.listen_fds[0] = create_listener (port, false);
+      debug (SERVER, "Server ready. Listening on port %hu, fd %i", port, server.listen_fds[0]);
     }
 
-  /* epoll the listening fds */
+  server.shard_listeners = shard_listeners;
+
+  /* epoll the listening fds, unless the workers do that */
   server.epollfd = epoll_create1 (EPOLL_CLOEXEC);
   if (server.epollfd < 0)
     err (EXIT_FAILURE, "Failed to create epoll fd");
-  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
+  for (unsigned i = 0; i < server.n_listen_fds && !shard_listeners; i++)
     {
-      ev.data.fd = fd;
-      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      ev.data.fd = server.listen_fds[i];
+      if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.listen_fds[i], &ev) < 0)
         err (EXIT_FAILURE, "Failed to epoll server listening fd");
     }
 
   /* we use timerfd for idle timeout.  epoll that too. */
   if (idle_timeout > 0)
     {
-      server.idle_timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+      server.idle_timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
       if (server.idle_timerfd == -1)
         err (EXIT_FAILURE, "Failed to create timerfd");
 
@@ -272,11 +500,93 @@ server_init (const char *wsinstance_sockdir,
     }
 }
 
+/**
+ * server_start: Start the worker threads
+ *
+ * This must be called after server_init() and after all of the
+ * connection_*() configuration, since with sharded listeners the
+ * workers start accepting connections right away.  The connections
+ * that are already waiting, like the one that activated the service,
+ * must see the complete configuration.
+ */
+void
+server_start (void)
+{
+  assert (server.initialized);
+  assert (server.n_listeners == 0);
+
+  if (server.shard_listeners && server.socket_activated)
+    {
+      server.listeners = callocx (server.n_workers * server.n_listen_fds, sizeof (Listener));
+      for (unsigned i = 0; i < server.n_workers; i++)
+        for (unsigned j = 0; j < server.n_listen_fds; j++)
+          server_add_listener (server.workers[i], server.listen_fds[j], true);
+    }
+  else if (server.shard_listeners)
+    {
+      server.listeners = callocx (server.n_workers, sizeof (Listener));
+      for (unsigned i = 0; i < server.n_workers; i++)
+        server_add_listener (server.workers[i], server.listen_fds[i], false);
+    }
+
+  for (unsigned i = 0; i < server.n_workers; i++)
+    worker_start (server.workers[i]);
+  debug (SERVER, "Started %u worker threads", server.n_workers);
+}
+
+/**
+ * server_listen_stats: Serve statistics on a unix socket
+ *
+ * @path: where to create the socket; a stale one gets replaced
+ *
+ * Clients get a JSON object with counters and latency histograms about
+ * the connections since startup.  This is handled in the main thread;
+ * the worker threads only count into their own memory.
+ */
+void
+server_listen_stats (const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  assert (server.initialized);
+  assert (server.stats_fd == -1);
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    errx (EXIT_FAILURE, "statistics socket path %s is too long", path);
+  strcpy (addr.sun_path, path);
+
+  server.stats_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (server.stats_fd < 0)
+    err (EXIT_FAILURE, "failed to create statistics socket");
+
+  if (unlink (path) != 0 && errno != ENOENT)
+    err (EXIT_FAILURE, "failed to remove stale statistics socket %s", path);
+  if (bind (server.stats_fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    err (EXIT_FAILURE, "failed to bind statistics socket %s", path);
+  if (listen (server.stats_fd, 16) != 0)
+    err (EXIT_FAILURE, "failed to listen to statistics socket");
+
+  server.stats_path = strdupx (path);
+
+  ev.data.fd = server.stats_fd;
+  if (epoll_ctl (server.epollfd, EPOLL_CTL_ADD, server.stats_fd, &ev) < 0)
+    err (EXIT_FAILURE, "Failed to epoll statistics socket");
+
+  debug (SERVER, "Serving statistics on %s", path);
+}
+
+/**
+ * server_get_listener: Get the listening socket
+ *
+ * With sharded listeners, there are several, which are all bound to the
+ * same address; this returns the first one.
+ */
 int
 server_get_listener (void)
 {
-  assert (server.first_listener == server.last_listener);
-  return server.first_listener;
+  assert (server.n_listen_fds == 1 || server.shard_listeners);
+  return server.listen_fds[0];
 }
 
 /**
@@ -294,12 +604,27 @@ server_cleanup (void)
   if (server.idle_timerfd != -1)
     close (server.idle_timerfd);
 
-  for (int fd = server.first_listener; fd <= server.last_listener; fd++)
-    close (fd);
+  if (server.stats_fd != -1)
+    {
+      close (server.stats_fd);
+      unlink (server.stats_path);
+      free (server.stats_path);
+    }
 
   close (server.epollfd);
 
-  pthread_mutex_destroy (&server.connection_mutex);
+  /* the workers might still be watching the listeners */
+  for (unsigned i = 0; i < server.n_workers; i++)
+    {
+      worker_stop (server.workers[i]);
+      worker_free (server.workers[i]);
+    }
+  free (server.workers);
+  free (server.listeners);
+
+  for (unsigned i = 0; i < server.n_listen_fds; i++)
+    close (server.listen_fds[i]);
+  free (server.listen_fds);
 
   connection_cleanup ();
 
@@ -312,8 +637,8 @@ server_cleanup (void)
  * @timeout: number of milliseconds to wait for an event to happen; after that,
  * the function will return false. -1 will to block until an event occurs.
  *
- * This can be an event on a listening socket, or the idle timeout if no
- * clients are connected.
+ * This can be an event on a listening socket, a statistics request, or the
+ * idle timeout if no clients are connected.
  *
  * Returns: false on timeout, true if some (other) event was handled.
  */
@@ -335,14 +660,26 @@ server_poll_event (int timeout)
 
       if (fd == server.idle_timerfd)
         {
+          uint64_t expirations;
+
+          /* a connection might have been accepted in the meantime */
+          if (atomic_load (&server.connection_count) != 0)
+            {
+              debug (SERVER, "server_poll_event(): idle timer elapsed, but we have connections");
+              if (read (server.idle_timerfd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+                err (EXIT_FAILURE, "Failed to read idle timerfd");
+              return true;
+            }
+
           /* hit the idle timeout */
           debug (SERVER, "server_poll_event(): idle timer elapsed, returning immediately");
           return false;
         }
 
-      assert (server.first_listener <= fd && fd <= server.last_listener);
-
-      handle_accept (fd);
+      if (fd == server.stats_fd)
+        handle_stats_request ();
+      else
+        handle_accept (fd);
     }
   else if (errno != EINTR)
     err (EXIT_FAILURE, "Failed to epoll_wait");
@@ -365,11 +702,5 @@ server_run (void)
 unsigned
 server_num_connections (void)
 {
-  unsigned count;
-
-  pthread_mutex_lock (&server.connection_mutex);
-  count = server.connection_count;
-  pthread_mutex_unlock (&server.connection_mutex);
-
-  return count;
+  return atomic_load (&server.connection_count);
 }
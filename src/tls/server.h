@@ -28,7 +28,14 @@ void
 server_init (const char *wsinstance_sockdir,
              const char *cert_session_dir,
              int idle_timeout,
-             uint16_t port);
+             uint16_t port,
+             bool shard_listeners);
+
+void
+server_start (void);
+
+void
+server_listen_stats (const char *path);
 
 void
 server_run (void);
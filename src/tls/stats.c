@@ -0,0 +1,223 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Counters and latency histograms of what cockpit-tls is doing.
+ *
+ * Every thread counts into its own block, and is the only one which
+ * writes to it, so counting is a plain thread-local increment: no locked
+ * instructions, and no cache lines bouncing between CPUs.  Only
+ * stats_collect() takes a lock, to walk all the blocks and add them up.
+ *
+ * Blocks are never freed.  When a thread exits, its block gets handed to
+ * the next thread which starts counting, so nothing counted gets lost.
+ */
+
+#include "config.h"
+
+#include "stats.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/cockpitmemory.h>
+
+#include "utils.h"
+
+typedef struct _ThreadStats ThreadStats;
+struct _ThreadStats {
+  /* Only ever written by the owning thread.  These are atomics just so
+   * that stats_collect() can read them from other threads; all accesses
+   * are relaxed, which compiles to plain loads and stores.
+   */
+  _Atomic uint64_t counters[STATS_N_COUNTERS];
+  _Atomic uint64_t buckets[STATS_N_HISTOGRAMS][STATS_N_BUCKETS];
+  _Atomic uint64_t latency_sum[STATS_N_HISTOGRAMS];
+
+  /* protected by the mutex */
+  bool in_use;
+  ThreadStats *next;
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_once_t key_once;
+  pthread_key_t key;
+  ThreadStats *blocks;
+} stats = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .key_once = PTHREAD_ONCE_INIT,
+};
+
+static _Thread_local ThreadStats *thread_stats;
+
+static const uint64_t bucket_limits_ms[] = { STATS_BUCKET_LIMITS_MS };
+static_assert (N_ELEMENTS (bucket_limits_ms) == STATS_N_BUCKETS - 1,
+               "the last bucket has no limit");
+
+/* pthread key destructor, called when a thread exits */
+static void
+thread_stats_release (void *data)
+{
+  ThreadStats *block = data;
+
+  pthread_mutex_lock (&stats.mutex);
+  block->in_use = false;
+  pthread_mutex_unlock (&stats.mutex);
+}
+
+static void
+stats_create_key (void)
+{
+  int r = pthread_key_create (&stats.key, thread_stats_release);
+  if (r != 0)
+    {
+      errno = r;
+      err (EXIT_FAILURE, "Failed to create statistics thread key");
+    }
+}
+
+static ThreadStats *
+get_thread_stats (void)
+{
+  ThreadStats *block;
+
+  if (thread_stats)
+    return thread_stats;
+
+  pthread_once (&stats.key_once, stats_create_key);
+
+  pthread_mutex_lock (&stats.mutex);
+
+  for (block = stats.blocks; block; block = block->next)
+    if (!block->in_use)
+      break;
+
+  if (block == NULL)
+    {
+      block = callocx (1, sizeof (ThreadStats));
+      block->next = stats.blocks;
+      stats.blocks = block;
+    }
+
+  block->in_use = true;
+
+  pthread_mutex_unlock (&stats.mutex);
+
+  pthread_setspecific (stats.key, block);
+  thread_stats = block;
+
+  return block;
+}
+
+static inline void
+counter_add (_Atomic uint64_t *counter,
+             uint64_t          value)
+{
+  /* we are the only writer, so this doesn't need to be a locked add */
+  atomic_store_explicit (counter, atomic_load_explicit (counter, memory_order_relaxed) + value,
+                         memory_order_relaxed);
+}
+
+/**
+ * stats_now: The current time, for measuring latencies
+ *
+ * Returns: microseconds on the CLOCK_MONOTONIC clock
+ */
+uint64_t
+stats_now (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * stats_add: Increase a counter
+ *
+ * This only touches memory of the calling thread.
+ */
+void
+stats_add (StatsCounter counter,
+           uint64_t     value)
+{
+  counter_add (&get_thread_stats ()->counters[counter], value);
+}
+
+/**
+ * stats_add_latency: Record the time that something took
+ *
+ * @start: when it started, as returned by stats_now()
+ */
+void
+stats_add_latency (StatsHistogram histogram,
+                   uint64_t       start)
+{
+  ThreadStats *block = get_thread_stats ();
+  uint64_t elapsed = stats_now () - start;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (bucket_limits_ms); i++)
+    if (elapsed <= bucket_limits_ms[i] * 1000)
+      break;
+
+  counter_add (&block->buckets[histogram][i], 1);
+  counter_add (&block->latency_sum[histogram], elapsed);
+}
+
+/**
+ * stats_collect: Add up the statistics of all threads
+ *
+ * The result is not an atomic snapshot: other threads keep counting
+ * while we go through their blocks.
+ */
+void
+stats_collect (Stats *result)
+{
+  memset (result, 0, sizeof *result);
+
+  pthread_mutex_lock (&stats.mutex);
+
+  for (ThreadStats *block = stats.blocks; block; block = block->next)
+    {
+      for (int i = 0; i < STATS_N_COUNTERS; i++)
+        result->counters[i] += atomic_load_explicit (&block->counters[i], memory_order_relaxed);
+
+      for (int i = 0; i < STATS_N_HISTOGRAMS; i++)
+        {
+          for (int j = 0; j < STATS_N_BUCKETS; j++)
+            result->buckets[i][j] += atomic_load_explicit (&block->buckets[i][j], memory_order_relaxed);
+
+          result->latency_sum[i] += atomic_load_explicit (&block->latency_sum[i], memory_order_relaxed);
+        }
+    }
+
+  pthread_mutex_unlock (&stats.mutex);
+}
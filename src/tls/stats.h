@@ -0,0 +1,68 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Counters of things which happened since startup; these only ever grow */
+typedef enum {
+  STATS_ACCEPTED,
+  STATS_FULL_HANDSHAKES,
+  STATS_RESUMED_HANDSHAKES,
+  STATS_KTLS_CONNECTIONS,
+  STATS_UPSTREAM_HITS,
+  STATS_UPSTREAM_MISSES,
+  STATS_BYTES_FROM_CLIENT,
+  STATS_BYTES_TO_CLIENT,
+  STATS_BUFFER_FULL_STALLS,
+  STATS_HANDSHAKE_TIMEOUTS,
+  STATS_HANDSHAKES_REJECTED,
+  STATS_N_COUNTERS
+} StatsCounter;
+
+typedef enum {
+  STATS_HANDSHAKE_LATENCY,
+  STATS_WSINSTANCE_CONNECT_LATENCY,
+  STATS_N_HISTOGRAMS
+} StatsHistogram;
+
+/* histogram buckets, by upper bound in milliseconds; the last one has none */
+#define STATS_BUCKET_LIMITS_MS 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000
+#define STATS_N_BUCKETS 12
+
+typedef struct {
+  uint64_t counters[STATS_N_COUNTERS];
+  uint64_t buckets[STATS_N_HISTOGRAMS][STATS_N_BUCKETS];
+  uint64_t latency_sum[STATS_N_HISTOGRAMS]; /* microseconds */
+} Stats;
+
+uint64_t
+stats_now (void);
+
+void
+stats_add (StatsCounter counter,
+           uint64_t     value);
+
+void
+stats_add_latency (StatsHistogram histogram,
+                   uint64_t       start);
+
+void
+stats_collect (Stats *stats);
@@ -0,0 +1,120 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include "bufferpool.h"
+
+#include <string.h>
+
+#include "testlib/cockpittest.h"
+
+static void
+assert_all_released (void)
+{
+  g_assert_cmpuint (buffer_pool_get_in_use (), ==, 0);
+  buffer_pool_cleanup ();
+}
+
+static void
+test_reuse (void)
+{
+  char *first = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+  g_assert (first != NULL);
+  g_assert_cmpuint (buffer_pool_get_in_use (), ==, BUFFER_POOL_MIN_SIZE);
+
+  /* the whole buffer is usable */
+  memset (first, 'x', BUFFER_POOL_MIN_SIZE);
+  buffer_pool_release (first, BUFFER_POOL_MIN_SIZE);
+  g_assert_cmpuint (buffer_pool_get_in_use (), ==, 0);
+
+  /* comes back from the free list */
+  char *second = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+  g_assert (second == first);
+  buffer_pool_release (second, BUFFER_POOL_MIN_SIZE);
+
+  /* but not for other sizes */
+  char *big = buffer_pool_acquire (BUFFER_POOL_MAX_SIZE);
+  g_assert (big != NULL);
+  g_assert (big != first);
+  memset (big, 'y', BUFFER_POOL_MAX_SIZE);
+  buffer_pool_release (big, BUFFER_POOL_MAX_SIZE);
+
+  assert_all_released ();
+}
+
+static void
+test_limit (void)
+{
+  buffer_pool_set_limit (3 * BUFFER_POOL_MIN_SIZE);
+
+  char *small = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+  char *medium = buffer_pool_acquire (2 * BUFFER_POOL_MIN_SIZE);
+  g_assert (small != NULL);
+  g_assert (medium != NULL);
+  g_assert_cmpuint (buffer_pool_get_in_use (), ==, 3 * BUFFER_POOL_MIN_SIZE);
+
+  /* over the limit */
+  g_assert (buffer_pool_acquire (2 * BUFFER_POOL_MIN_SIZE) == NULL);
+
+  /* the minimum size is always handed out */
+  char *extra = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+  g_assert (extra != NULL);
+  g_assert_cmpuint (buffer_pool_get_in_use (), ==, 4 * BUFFER_POOL_MIN_SIZE);
+
+  buffer_pool_release (extra, BUFFER_POOL_MIN_SIZE);
+  buffer_pool_release (medium, 2 * BUFFER_POOL_MIN_SIZE);
+
+  /* fits again */
+  medium = buffer_pool_acquire (2 * BUFFER_POOL_MIN_SIZE);
+  g_assert (medium != NULL);
+
+  buffer_pool_release (medium, 2 * BUFFER_POOL_MIN_SIZE);
+  buffer_pool_release (small, BUFFER_POOL_MIN_SIZE);
+
+  assert_all_released ();
+}
+
+static void
+test_no_growth (void)
+{
+  buffer_pool_set_limit (0);
+
+  g_assert (buffer_pool_acquire (2 * BUFFER_POOL_MIN_SIZE) == NULL);
+
+  char *small = buffer_pool_acquire (BUFFER_POOL_MIN_SIZE);
+  g_assert (small != NULL);
+  buffer_pool_release (small, BUFFER_POOL_MIN_SIZE);
+
+  assert_all_released ();
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/bufferpool/reuse", test_reuse);
+  g_test_add_func ("/bufferpool/limit", test_limit);
+  g_test_add_func ("/bufferpool/no-growth", test_no_growth);
+
+  return g_test_run ();
+}
@@ -25,18 +25,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gnutls/x509.h>
 
+#ifdef HAVE_LINUX_TLS_H
+#include <linux/tls.h>
+#endif
+
 #include "connection.h"
+#include "stats.h"
 #include "testing.h"
 #include "server.h"
 #include "utils.h"
+#include "common/cockpitjson.h"
 #include "testlib/cockpittest.h"
 #include "common/cockpithacks-glib.h"
 
@@ -66,9 +74,15 @@ typedef struct {
   const char *keyfile;
   int cert_request_mode;
   int idle_timeout;
+  bool kernel_tls;
+  unsigned ticket_key_lifetime;
+  bool shard_listeners;
+  unsigned handshake_timeout;
+  unsigned max_pending_handshakes;
   const char *client_crt;
   const char *client_key;
   const char *client_fingerprint;
+  const char *client_priority;
 } TestFixture;
 
 static const TestFixture fixture_separate_crt_key = {
@@ -103,6 +117,44 @@ static const TestFixture fixture_alternate_client_cert = {
   .client_fingerprint = ALTERNATE_FINGERPRINT,
 };
 
+static const TestFixture fixture_kernel_tls = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .kernel_tls = true,
+  /* a cipher which every kernel with TLS offload supports; TLS 1.2 also
+   * ends the handshake on the server side, so no record can be pending */
+  .client_priority = "NORMAL:-VERS-ALL:+VERS-TLS1.2:-CIPHER-ALL:+AES-128-GCM",
+};
+
+static const TestFixture fixture_session_tickets = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .ticket_key_lifetime = 60,
+};
+
+static const TestFixture fixture_session_tickets_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .ticket_key_lifetime = 60,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+};
+
+static const TestFixture fixture_sharded = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .shard_listeners = true,
+};
+
+static const TestFixture fixture_handshake_limits = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .handshake_timeout = 1,
+  .max_pending_handshakes = 2,
+};
+
 static const TestFixture fixture_run_idle = {
   .idle_timeout = 1,
 };
@@ -257,7 +309,10 @@ assert_https_outcome (TestCase *tc,
 
       g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
       gnutls_transport_set_int (session, fd);
-      g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+      if (fixture && fixture->client_priority)
+        g_assert_cmpint (gnutls_priority_set_direct (session, fixture->client_priority, NULL), ==, GNUTLS_E_SUCCESS);
+      else
+        g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
       gnutls_handshake_set_timeout(session, 5000);
       g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
       g_assert_cmpint (gnutls_certificate_set_x509_system_trust (xcred), >=, 0);
@@ -392,11 +447,23 @@ setup (TestCase *tc, gconstpointer data)
   close (socket_dir_fd);
 
   /* Let the kernel assign a port */
-  server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, 0);
+  server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, 0,
+               fixture ? fixture->shard_listeners : false);
 
   if (fixture && fixture->certfile)
     connection_crypto_init (fixture->certfile, fixture->keyfile, false, fixture->cert_request_mode);
 
+  if (fixture && fixture->kernel_tls)
+    connection_set_kernel_tls (true);
+
+  if (fixture && fixture->ticket_key_lifetime)
+    connection_set_session_tickets (fixture->ticket_key_lifetime);
+
+  if (fixture && fixture->handshake_timeout)
+    connection_set_handshake_limits (fixture->handshake_timeout, fixture->max_pending_handshakes);
+
+  server_start ();
+
   /* Figure out the socket address we ought to connect to */
   socklen_t addrlen = sizeof tc->server_addr;
   int r = getsockname (server_get_listener (), (struct sockaddr *) &tc->server_addr, &addrlen);
@@ -467,6 +534,24 @@ test_no_tls_many_serial (TestCase *tc, gconstpointer data)
     assert_http (tc);
 }
 
+static void
+test_no_tls_upstream_pool (TestCase *tc, gconstpointer data)
+{
+  Stats before, after;
+
+  stats_collect (&before);
+
+  for (int i = 0; i < 20; ++i)
+    assert_http (tc);
+
+  /* all but the first one can use a pre-connected cockpit-ws socket */
+  stats_collect (&after);
+  uint64_t hits = after.counters[STATS_UPSTREAM_HITS] - before.counters[STATS_UPSTREAM_HITS];
+  uint64_t misses = after.counters[STATS_UPSTREAM_MISSES] - before.counters[STATS_UPSTREAM_MISSES];
+  g_assert_cmpuint (hits + misses, ==, 20);
+  g_assert_cmpuint (hits, >, 0);
+}
+
 static void
 test_tls_blocked_handshake (TestCase *tc, gconstpointer data)
 {
@@ -510,6 +595,94 @@ test_tls_blocked_handshake (TestCase *tc, gconstpointer data)
     }
 }
 
+/* runs in a subprocess; returns whether the session was resumed */
+static bool
+do_tls_request_with_session (TestCase *tc,
+                             const TestFixture *fixture,
+                             gnutls_datum_t *session_data)
+{
+  const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+  char buf[4096];
+  gnutls_session_t session;
+  gnutls_certificate_credentials_t xcred;
+  bool resumed;
+  int fd = do_connect (tc);
+
+  g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+  gnutls_transport_set_int (session, fd);
+  g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+  gnutls_handshake_set_timeout (session, 5000);
+  g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+  if (fixture->client_crt)
+    g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred, fixture->client_crt, fixture->client_key,
+                                                           GNUTLS_X509_FMT_PEM), ==, GNUTLS_E_SUCCESS);
+  g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+
+  if (session_data->data)
+    g_assert_cmpint (gnutls_session_set_data (session, session_data->data, session_data->size), ==, GNUTLS_E_SUCCESS);
+
+  g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+  resumed = gnutls_session_is_resumed (session);
+
+  g_assert_cmpint (gnutls_record_send (session, request, sizeof request), ==, sizeof request);
+  g_assert_cmpint (gnutls_record_recv (session, buf, sizeof buf), >, 0);
+
+  /* with TLS 1.3, the ticket arrives after the handshake */
+  if (!session_data->data)
+    g_assert_cmpint (gnutls_session_get_data2 (session, session_data), ==, GNUTLS_E_SUCCESS);
+
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  gnutls_deinit (session);
+  gnutls_certificate_free_credentials (xcred);
+  close (fd);
+
+  return resumed;
+}
+
+static void
+test_tls_session_resumption (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  Stats before, after;
+  int status;
+
+  stats_collect (&before);
+
+  block_sigchld ();
+
+  pid_t pid = fork ();
+  if (pid == -1)
+    g_error ("fork failed: %m");
+
+  if (pid == 0)
+    {
+      gnutls_datum_t session_data = { NULL, 0 };
+      bool expect_resumed = fixture->cert_request_mode == GNUTLS_CERT_IGNORE;
+
+      g_assert_false (do_tls_request_with_session (tc, fixture, &session_data));
+      g_assert_cmpint (do_tls_request_with_session (tc, fixture, &session_data), ==, expect_resumed);
+      exit (0);
+    }
+
+  while (waitpid (pid, &status, WNOHANG) <= 0)
+    server_poll_event (50);
+  g_assert_cmpint (status, ==, 0);
+
+  stats_collect (&after);
+  uint64_t full = after.counters[STATS_FULL_HANDSHAKES] - before.counters[STATS_FULL_HANDSHAKES];
+  uint64_t resumed = after.counters[STATS_RESUMED_HANDSHAKES] - before.counters[STATS_RESUMED_HANDSHAKES];
+  if (fixture->cert_request_mode == GNUTLS_CERT_IGNORE)
+    {
+      g_assert_cmpuint (full, ==, 1);
+      g_assert_cmpuint (resumed, ==, 1);
+    }
+  else
+    {
+      g_assert_cmpuint (full, ==, 2);
+      g_assert_cmpuint (resumed, ==, 0);
+    }
+}
+
 static void
 test_no_tls_many_parallel (TestCase *tc, gconstpointer data)
 {
@@ -584,6 +757,217 @@ test_tls_no_client_cert (TestCase *tc, gconstpointer data)
   assert_https (tc, data, 1);
 }
 
+/* Checks whether the kernel accepts TLS 1.2 AES-GCM-128 keys on a
+ * connected TCP socket, which is what test_tls_kernel() negotiates */
+static bool
+kernel_tls_available (void)
+{
+  bool available = false;
+#ifdef HAVE_LINUX_TLS_H
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl (INADDR_LOOPBACK) };
+  socklen_t addrlen = sizeof addr;
+  int listener, client, accepted = -1;
+
+  listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (listener, >=, 0);
+  g_assert_cmpint (bind (listener, (struct sockaddr *) &addr, sizeof addr), ==, 0);
+  g_assert_cmpint (listen (listener, 1), ==, 0);
+  g_assert_cmpint (getsockname (listener, (struct sockaddr *) &addr, &addrlen), ==, 0);
+
+  client = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_cmpint (client, >=, 0);
+  g_assert_cmpint (connect (client, (struct sockaddr *) &addr, sizeof addr), ==, 0);
+  accepted = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+  g_assert_cmpint (accepted, >=, 0);
+
+  if (setsockopt (accepted, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == 0)
+    {
+      struct tls12_crypto_info_aes_gcm_128 info = {
+        .info.version = TLS_1_2_VERSION,
+        .info.cipher_type = TLS_CIPHER_AES_GCM_128,
+      };
+
+      available = setsockopt (accepted, SOL_TLS, TLS_RX, &info, sizeof info) == 0 &&
+                  setsockopt (accepted, SOL_TLS, TLS_TX, &info, sizeof info) == 0;
+    }
+
+  close (accepted);
+  close (client);
+  close (listener);
+#endif
+  return available;
+}
+
+static void
+test_tls_kernel (TestCase *tc, gconstpointer data)
+{
+  Stats before, after;
+
+  if (!kernel_tls_available ())
+    {
+      g_test_skip ("kernel TLS not available");
+      return;
+    }
+
+  stats_collect (&before);
+
+  /* assert_https() checks the response relayed through the offloaded socket */
+  for (int i = 0; i < 3; i++)
+    assert_https (tc, data, 1);
+  assert_http (tc);
+
+  stats_collect (&after);
+  g_assert_cmpuint (after.counters[STATS_KTLS_CONNECTIONS] - before.counters[STATS_KTLS_CONNECTIONS], ==, 3);
+}
+
+static JsonObject *
+query_stats (const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  g_autoptr(GString) reply = g_string_new ("");
+  g_autoptr(GError) error = NULL;
+  char buf[1024];
+  ssize_t len;
+
+  g_assert_cmpuint (strlen (path), <, sizeof addr.sun_path);
+  strcpy (addr.sun_path, path);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_no_errno (fd);
+  g_assert_no_errno (connect (fd, (struct sockaddr *) &addr, sizeof addr));
+
+  /* the server answers from its main loop */
+  g_assert_true (server_poll_event (1000));
+
+  while ((len = read (fd, buf, sizeof buf)) > 0)
+    g_string_append_len (reply, buf, len);
+  g_assert_no_errno (len);
+  close (fd);
+
+  JsonObject *object = cockpit_json_parse_object (reply->str, reply->len, &error);
+  g_assert_no_error (error);
+  return object;
+}
+
+static gint64
+get_stat (JsonObject *object,
+          const char *name)
+{
+  gint64 value = -1;
+
+  g_assert_true (cockpit_json_get_int (object, name, -1, &value));
+  g_assert_cmpint (value, >=, 0);
+  return value;
+}
+
+static void
+test_stats (TestCase *tc, gconstpointer data)
+{
+  g_autofree gchar *path = g_build_filename (tc->runtime_dir, "stats.sock", NULL);
+  JsonObject *before, *after, *latency;
+
+  server_listen_stats (path);
+  before = query_stats (path);
+  g_assert_cmpint (get_stat (before, "version"), ==, 1);
+
+  for (int i = 0; i < 3; i++)
+    assert_https (tc, data, 1);
+  assert_http (tc);
+
+  /* the workers close their connections asynchronously */
+  for (int retry = 0; retry < 100 && server_num_connections () > 0; ++retry)
+    g_usleep (100000);
+  g_assert_cmpuint (server_num_connections (), ==, 0);
+
+  after = query_stats (path);
+  g_assert_cmpint (get_stat (after, "active-connections"), ==, 0);
+  g_assert_cmpint (get_stat (after, "accepted") - get_stat (before, "accepted"), ==, 4);
+  g_assert_cmpint (get_stat (after, "full-handshakes") - get_stat (before, "full-handshakes"), ==, 3);
+  g_assert_cmpint (get_stat (after, "bytes-from-client"), >, get_stat (before, "bytes-from-client"));
+  g_assert_cmpint (get_stat (after, "bytes-to-client"), >, get_stat (before, "bytes-to-client"));
+  get_stat (after, "accepted-per-second");
+  get_stat (after, "buffer-full-stalls");
+
+  g_assert_true (cockpit_json_get_object (after, "handshake-latency", NULL, &latency));
+  g_assert_nonnull (latency);
+  g_assert_cmpint (get_stat (latency, "count"), >=, 3);
+  get_stat (latency, "1ms");
+  get_stat (latency, "more");
+
+  g_assert_true (cockpit_json_get_object (after, "wsinstance-connect-latency", NULL, &latency));
+  g_assert_nonnull (latency);
+  g_assert_cmpint (get_stat (latency, "count"), >=, 4);
+
+  json_object_unref (before);
+  json_object_unref (after);
+}
+
+/* wait until the server closes @fd, without sending anything */
+static void
+assert_closed_by_server (int fd)
+{
+  char c;
+  ssize_t res = -1;
+
+  for (int retry = 0; retry < 50; ++retry)
+    {
+      res = recv (fd, &c, 1, MSG_DONTWAIT);
+      if (res != -1 || errno != EAGAIN)
+        break;
+      server_poll_event (100);
+    }
+
+  g_assert_cmpint (res, ==, 0);
+  close (fd);
+}
+
+static void
+test_handshake_limits (TestCase *tc, gconstpointer data)
+{
+  g_autofree gchar *path = g_build_filename (tc->runtime_dir, "stats.sock", NULL);
+  JsonObject *before, *after;
+  int idle[2];
+
+  server_listen_stats (path);
+  before = query_stats (path);
+
+  /* clients which connect, but never start a handshake */
+  for (int i = 0; i < G_N_ELEMENTS (idle); i++)
+    {
+      idle[i] = do_connect (tc);
+      g_assert_cmpint (idle[i], >, 0);
+      server_poll_event (1000);
+    }
+  for (int retry = 0; retry < 100 && connection_get_pending_handshakes () < 2; ++retry)
+    g_usleep (10000);
+  g_assert_cmpuint (connection_get_pending_handshakes (), ==, 2);
+
+  /* that's the limit, so the next one gets closed right away */
+  int fd = do_connect (tc);
+  g_assert_cmpint (fd, >, 0);
+  server_poll_event (1000);
+  assert_closed_by_server (fd);
+
+  /* and the idle ones only get until the deadline */
+  for (int i = 0; i < G_N_ELEMENTS (idle); i++)
+    assert_closed_by_server (idle[i]);
+  for (int retry = 0; retry < 100 && server_num_connections () > 0; ++retry)
+    g_usleep (10000);
+  g_assert_cmpuint (connection_get_pending_handshakes (), ==, 0);
+
+  after = query_stats (path);
+  g_assert_cmpint (get_stat (after, "pending-handshakes"), ==, 0);
+  g_assert_cmpint (get_stat (after, "handshakes-rejected") - get_stat (before, "handshakes-rejected"), ==, 1);
+  g_assert_cmpint (get_stat (after, "handshake-timeouts") - get_stat (before, "handshake-timeouts"), ==, 2);
+
+  /* normal connections work again */
+  assert_https (tc, data, 1);
+  assert_http (tc);
+
+  json_object_unref (before);
+  json_object_unref (after);
+}
+
 static void
 test_tls_no_server_cert (TestCase *tc, gconstpointer data)
 {
@@ -796,6 +1180,8 @@ main (int argc, char *argv[])
               setup, test_no_tls_single, teardown);
   g_test_add ("/server/no-tls/many-serial", TestCase, NULL,
               setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/no-tls/upstream-pool", TestCase, NULL,
+              setup, test_no_tls_upstream_pool, teardown);
   g_test_add ("/server/no-tls/many-parallel", TestCase, NULL,
               setup, test_no_tls_many_parallel, teardown);
   g_test_add ("/server/no-tls/redirect", TestCase, NULL,
@@ -814,12 +1200,26 @@ main (int argc, char *argv[])
               setup, test_tls_client_cert_parallel, teardown);
   g_test_add ("/server/tls/no-server-cert", TestCase, NULL,
               setup, test_tls_no_server_cert, teardown);
+  g_test_add ("/server/tls/kernel", TestCase, &fixture_kernel_tls,
+              setup, test_tls_kernel, teardown);
+  g_test_add ("/server/tls/session-resumption", TestCase, &fixture_session_tickets,
+              setup, test_tls_session_resumption, teardown);
+  g_test_add ("/server/tls/session-resumption/client-cert", TestCase, &fixture_session_tickets_client_cert,
+              setup, test_tls_session_resumption, teardown);
   g_test_add ("/server/tls/redirect", TestCase, &fixture_separate_crt_key,
               setup, test_tls_redirect, teardown);
   g_test_add ("/server/tls/blocked-handshake", TestCase, &fixture_separate_crt_key,
               setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/stats", TestCase, &fixture_separate_crt_key,
+              setup, test_stats, teardown);
+  g_test_add ("/server/handshake-limits", TestCase, &fixture_handshake_limits,
+              setup, test_handshake_limits, teardown);
   g_test_add ("/server/mixed-protocols", TestCase, &fixture_separate_crt_key,
               setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/sharded/mixed-protocols", TestCase, &fixture_sharded,
+              setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/sharded/many-parallel", TestCase, &fixture_sharded,
+              setup, test_no_tls_many_parallel, teardown);
   g_test_add ("/server/run-idle", TestCase, &fixture_run_idle,
               setup, test_run_idle, teardown);
 
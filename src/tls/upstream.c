@@ -0,0 +1,333 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A cache of idle connections to cockpit-ws instances, shared by all
+ * worker threads.
+ *
+ * There is one entry per wsinstance socket (http.sock, or
+ * https@<fingerprint>.sock for a certificate-specific instance) that we
+ * recently connected to, which also records that this instance is
+ * running.  Each entry holds a few sockets which are already connected,
+ * so that a new client connection doesn't need to wait for connect().
+ * A socket is taken out of the pool when it's used, and the pool is
+ * topped up again after the client connection got going.
+ *
+ * cockpit-ws closes connections which don't send a request in time, and
+ * instances exit when they are idle, so pooled sockets go stale.  They
+ * only get used if they are younger than POOL_MAX_AGE, and the kernel
+ * has not reported EOF or an error on them.  When connecting to an
+ * instance fails, its entry is dropped.
+ */
+
+#include "config.h"
+
+#include "upstream.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socket-io.h"
+#include "stats.h"
+#include "utils.h"
+
+#define POOL_SIZE 4       /* idle sockets per instance */
+#define POOL_ENTRIES 32   /* instances */
+#define POOL_MAX_AGE 10   /* seconds; cockpit-ws waits 30 for a request */
+
+typedef struct {
+  int fd;
+  time_t connected;
+} PooledSocket;
+
+typedef struct {
+  char sockname[80];
+  time_t last_used;
+  PooledSocket sockets[POOL_SIZE];
+  unsigned n_sockets;
+} PoolEntry;
+
+static struct {
+  pthread_mutex_t mutex;
+  PoolEntry entries[POOL_ENTRIES];
+  unsigned n_entries;
+} pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static time_t
+get_monotonic_seconds (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return now.tv_sec;
+}
+
+/* with pool.mutex held */
+static PoolEntry *
+pool_lookup (const char *sockname)
+{
+  for (unsigned i = 0; i < pool.n_entries; i++)
+    if (strcmp (pool.entries[i].sockname, sockname) == 0)
+      return &pool.entries[i];
+
+  return NULL;
+}
+
+/* with pool.mutex held; the sockets are closed by the caller */
+static unsigned
+pool_remove (PoolEntry *entry,
+             int       *fds)
+{
+  unsigned n_fds = entry->n_sockets;
+
+  for (unsigned i = 0; i < n_fds; i++)
+    fds[i] = entry->sockets[i].fd;
+
+  /* keep the array dense */
+  *entry = pool.entries[--pool.n_entries];
+
+  return n_fds;
+}
+
+static void
+close_all (int      *fds,
+           unsigned  n_fds)
+{
+  for (unsigned i = 0; i < n_fds; i++)
+    close (fds[i]);
+}
+
+/* A socket which cockpit-ws has closed, or which has an error pending,
+ * polls readable; one which is still waiting for our request doesn't.
+ */
+static bool
+socket_is_usable (int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+  return poll (&pfd, 1, 0) == 0;
+}
+
+/**
+ * upstream_connect: Get a connection to a wsinstance socket
+ *
+ * @dirfd: the directory with the wsinstance sockets
+ * @sockname: the socket to connect to
+ *
+ * Takes a pooled connection if a usable one is available, and otherwise
+ * connects a new socket.
+ *
+ * Returns: the connected socket, or -1 (with errno set) if connecting
+ *   failed.  In that case, the instance is forgotten.
+ */
+int
+upstream_connect (int         dirfd,
+                  const char *sockname)
+{
+  int stale_fds[POOL_SIZE];
+  unsigned n_stale = 0;
+  time_t now = get_monotonic_seconds ();
+  PoolEntry *entry;
+  int fd = -1;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  entry = pool_lookup (sockname);
+  if (entry)
+    {
+      entry->last_used = now;
+
+      /* take the newest socket first: it's the least likely to be stale */
+      while (fd == -1 && entry->n_sockets > 0)
+        {
+          PooledSocket *pooled = &entry->sockets[--entry->n_sockets];
+
+          if (now - pooled->connected < POOL_MAX_AGE && socket_is_usable (pooled->fd))
+            fd = pooled->fd;
+          else
+            stale_fds[n_stale++] = pooled->fd;
+        }
+
+      /* the rest are older than the stale one */
+      if (n_stale > 0)
+        while (entry->n_sockets > 0)
+          stale_fds[n_stale++] = entry->sockets[--entry->n_sockets].fd;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  if (n_stale > 0)
+    {
+      debug (CONNECTION, "dropping %u stale pooled connections to %s", n_stale, sockname);
+    }
+  close_all (stale_fds, n_stale);
+
+  if (fd != -1)
+    {
+      stats_add (STATS_UPSTREAM_HITS, 1);
+      debug (CONNECTION, "using pooled connection %i to %s", fd, sockname);
+      return fd;
+    }
+
+  stats_add (STATS_UPSTREAM_MISSES, 1);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  if (af_unix_connectat (fd, dirfd, sockname) != 0)
+    {
+      int saved_errno = errno;
+      close (fd);
+      upstream_forget (sockname);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return fd;
+}
+
+/**
+ * upstream_refill: Prepare a connection for the next client
+ *
+ * @dirfd: the directory with the wsinstance sockets
+ * @sockname: a socket which was just successfully connected to
+ *
+ * Call this after a client connection to @sockname got started, so that
+ * the extra connect() doesn't delay it.  This records @sockname as a
+ * running instance, evicting the least recently used one if necessary.
+ */
+void
+upstream_refill (int         dirfd,
+                 const char *sockname)
+{
+  int evicted_fds[POOL_SIZE];
+  unsigned n_evicted = 0;
+  PoolEntry *entry;
+  int fd;
+
+  assert (strlen (sockname) < sizeof pool.entries[0].sockname);
+
+  /* don't wait if cockpit-ws has a backlog */
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1)
+    return;
+
+  if (af_unix_connectat (fd, dirfd, sockname) != 0)
+    {
+      debug (CONNECTION, "could not pre-connect to %s: %m", sockname);
+      close (fd);
+      return;
+    }
+
+  time_t now = get_monotonic_seconds ();
+
+  pthread_mutex_lock (&pool.mutex);
+
+  entry = pool_lookup (sockname);
+  if (entry == NULL)
+    {
+      if (pool.n_entries == POOL_ENTRIES)
+        {
+          PoolEntry *oldest = &pool.entries[0];
+
+          for (unsigned i = 1; i < pool.n_entries; i++)
+            if (pool.entries[i].last_used < oldest->last_used)
+              oldest = &pool.entries[i];
+
+          n_evicted = pool_remove (oldest, evicted_fds);
+        }
+
+      entry = &pool.entries[pool.n_entries++];
+      strcpy (entry->sockname, sockname);
+      entry->n_sockets = 0;
+    }
+
+  entry->last_used = now;
+
+  if (entry->n_sockets < POOL_SIZE)
+    {
+      entry->sockets[entry->n_sockets++] = (PooledSocket) { .fd = fd, .connected = now };
+      fd = -1;
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  close_all (evicted_fds, n_evicted);
+  if (fd != -1)
+    close (fd);
+}
+
+/**
+ * upstream_forget: Drop a wsinstance from the cache
+ *
+ * For when an instance is known to be gone.
+ */
+void
+upstream_forget (const char *sockname)
+{
+  int fds[POOL_SIZE];
+  unsigned n_fds = 0;
+  PoolEntry *entry;
+
+  pthread_mutex_lock (&pool.mutex);
+
+  entry = pool_lookup (sockname);
+  if (entry)
+    n_fds = pool_remove (entry, fds);
+
+  pthread_mutex_unlock (&pool.mutex);
+
+  if (entry)
+    {
+      debug (CONNECTION, "forgetting wsinstance %s", sockname);
+    }
+
+  close_all (fds, n_fds);
+}
+
+/**
+ * upstream_cleanup: Close all pooled connections
+ */
+void
+upstream_cleanup (void)
+{
+  pthread_mutex_lock (&pool.mutex);
+
+  while (pool.n_entries > 0)
+    {
+      int fds[POOL_SIZE];
+      unsigned n_fds = pool_remove (&pool.entries[0], fds);
+      close_all (fds, n_fds);
+    }
+
+  pthread_mutex_unlock (&pool.mutex);
+}
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdio.h>
 
 /* define to 1 to enable debug messages; very verbose! */
@@ -30,6 +31,7 @@
 #define DEBUG_IOVEC 0
 #define DEBUG_CONNECTION 1
 #define DEBUG_SERVER 1
+#define DEBUG_WORKER 1
 #define DEBUG_FACTORY 1
 #define DEBUG_SOCKET_IO 1
 
@@ -50,6 +52,8 @@
 
 #define N_ELEMENTS(arr) (sizeof (arr) / sizeof ((arr)[0]))
 
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof (type, member)))
+
 #define SD_LISTEN_FDS_START 3   /* sd_listen_fds(3) */
 
 #define SHA256_NIL "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
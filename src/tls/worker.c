@@ -0,0 +1,450 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A worker is a thread running a small epoll-based event loop.  All of
+ * the objects that it dispatches (watches, timeouts) are only ever
+ * touched from that one thread, so they need no locking.  The only way
+ * for other threads to interact with a worker is worker_dispatch_fd(),
+ * which hands over a file descriptor through a pipe.
+ */
+
+#include "config.h"
+
+#include "worker.h"
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common/cockpitmemory.h>
+
+#include "utils.h"
+
+#define MAX_EVENTS 64
+
+struct _Worker {
+  int epollfd;
+  WorkerFdFunc fd_func;
+
+  /* fds handed over from other threads */
+  int pipe_write_fd;
+  Watch pipe_watch;
+
+  /* pending timeouts, sorted by deadline */
+  Watch timer_watch;
+  Timeout *first_timeout;
+  Timeout *last_timeout;
+
+  /* the batch of events currently being dispatched */
+  struct epoll_event events[MAX_EVENTS];
+  int n_events;
+
+  pthread_t thread;
+  pid_t pid;
+  bool quit;
+};
+
+static uint64_t
+get_monotonic_time (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+worker_arm_timer (Worker *self)
+{
+  struct itimerspec spec = { { 0 }, };
+
+  if (self->first_timeout)
+    {
+      /* an all-zero it_value disarms the timer, so make sure we never pass one */
+      spec.it_value.tv_sec = self->first_timeout->deadline / 1000000;
+      spec.it_value.tv_nsec = (self->first_timeout->deadline % 1000000) * 1000 + 1;
+    }
+
+  if (timerfd_settime (self->timer_watch.fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+    err (EXIT_FAILURE, "Failed to set worker timerfd");
+}
+
+static void
+worker_timer_ready (Watch    *watch,
+                    uint32_t  events)
+{
+  Worker *self = container_of (watch, Worker, timer_watch);
+  uint64_t expirations;
+  uint64_t now;
+
+  if (read (watch->fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+    err (EXIT_FAILURE, "Failed to read worker timerfd");
+
+  now = get_monotonic_time ();
+
+  /* the callback might add or remove other timeouts, so start over each time */
+  while (self->first_timeout && self->first_timeout->deadline <= now)
+    {
+      Timeout *timeout = self->first_timeout;
+
+      worker_remove_timeout (self, timeout);
+      timeout->func (timeout);
+    }
+
+  worker_arm_timer (self);
+}
+
+static void
+worker_pipe_ready (Watch    *watch,
+                   uint32_t  events)
+{
+  Worker *self = container_of (watch, Worker, pipe_watch);
+  int fd;
+  ssize_t s;
+
+  /* writes of an int are atomic on a pipe, so we never see a partial one */
+  while ((s = read (watch->fd, &fd, sizeof fd)) == sizeof fd)
+    {
+      if (fd == -1)
+        {
+          debug (WORKER, "worker %p: asked to quit", self);
+          self->quit = true;
+          return;
+        }
+
+      debug (WORKER, "worker %p: got fd %i", self, fd);
+      self->fd_func (self, fd);
+    }
+
+  if (s == -1 && errno != EAGAIN && errno != EINTR)
+    err (EXIT_FAILURE, "Failed to read worker pipe");
+}
+
+static void
+worker_iterate (Worker *self)
+{
+  int n_events;
+
+  do
+    n_events = epoll_wait (self->epollfd, self->events, N_ELEMENTS (self->events), -1);
+  while (n_events == -1 && errno == EINTR);
+
+  if (n_events == -1)
+    err (EXIT_FAILURE, "Failed to epoll_wait in worker");
+
+  self->n_events = n_events;
+
+  for (int i = 0; i < n_events; i++)
+    {
+      Watch *watch = self->events[i].data.ptr;
+      uint32_t events = self->events[i].events;
+
+      /* unwatched by an earlier callback in this same batch */
+      if (watch == NULL)
+        continue;
+
+      /* Errors and hangups are reported even if we didn't ask for them;
+       * turn them into the events we're interested in, so that the
+       * following read() or write() sees the condition.
+       */
+      if (events & (EPOLLERR | EPOLLHUP))
+        events |= watch->events;
+
+      watch->func (watch, events);
+    }
+
+  self->n_events = 0;
+}
+
+static void *
+worker_thread_main (void *data)
+{
+  Worker *self = data;
+
+  debug (WORKER, "worker %p: started", self);
+
+  while (!self->quit)
+    worker_iterate (self);
+
+  debug (WORKER, "worker %p: exiting", self);
+
+  return NULL;
+}
+
+/**
+ * worker_new: Create a worker event loop
+ *
+ * @fd_func: called in the worker thread for each file descriptor handed
+ *           over with worker_dispatch_fd()
+ *
+ * The thread itself is only started with worker_start().
+ */
+Worker *
+worker_new (WorkerFdFunc fd_func)
+{
+  Worker *self = callocx (1, sizeof (Worker));
+  int fds[2];
+
+  self->fd_func = fd_func;
+
+  self->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (self->epollfd < 0)
+    err (EXIT_FAILURE, "Failed to create worker epoll fd");
+
+  if (pipe2 (fds, O_CLOEXEC) != 0)
+    err (EXIT_FAILURE, "Failed to create worker pipe");
+  if (fcntl (fds[0], F_SETFL, O_NONBLOCK) != 0)
+    err (EXIT_FAILURE, "Failed to make worker pipe non-blocking");
+
+  self->pipe_write_fd = fds[1];
+  worker_watch (self, &self->pipe_watch, fds[0], worker_pipe_ready);
+  worker_update (self, &self->pipe_watch, EPOLLIN);
+
+  int timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timerfd == -1)
+    err (EXIT_FAILURE, "Failed to create worker timerfd");
+
+  worker_watch (self, &self->timer_watch, timerfd, worker_timer_ready);
+  worker_update (self, &self->timer_watch, EPOLLIN);
+
+  return self;
+}
+
+/**
+ * worker_free: Free all resources of a worker
+ *
+ * The worker must be stopped, and must not have any watches or timeouts
+ * left.
+ */
+void
+worker_free (Worker *self)
+{
+  close (self->timer_watch.fd);
+  close (self->pipe_watch.fd);
+  close (self->pipe_write_fd);
+  close (self->epollfd);
+
+  free (self);
+}
+
+void
+worker_start (Worker *self)
+{
+  int r;
+
+  self->pid = getpid ();
+
+  r = pthread_create (&self->thread, NULL, worker_thread_main, self);
+  if (r != 0)
+    {
+      errno = r;
+      err (EXIT_FAILURE, "Failed to start worker thread");
+    }
+}
+
+/**
+ * worker_stop: Ask the worker thread to quit, and wait for it
+ *
+ * After a fork(), the thread only exists in the parent process, and
+ * this does nothing in the child.
+ */
+void
+worker_stop (Worker *self)
+{
+  if (self->pid != getpid ())
+    return;
+
+  worker_dispatch_fd (self, -1);
+
+  int r = pthread_join (self->thread, NULL);
+  if (r != 0)
+    {
+      errno = r;
+      err (EXIT_FAILURE, "Failed to join worker thread");
+    }
+
+  self->pid = 0;
+}
+
+/**
+ * worker_dispatch_fd: Hand over a file descriptor to a worker
+ *
+ * This is the only worker function that may be called from another
+ * thread.  Ownership of @fd passes to the worker's fd_func.
+ */
+void
+worker_dispatch_fd (Worker *self,
+                    int     fd)
+{
+  ssize_t s;
+
+  do
+    s = write (self->pipe_write_fd, &fd, sizeof fd);
+  while (s == -1 && errno == EINTR);
+
+  if (s != sizeof fd)
+    err (EXIT_FAILURE, "Failed to write to worker pipe");
+}
+
+/**
+ * worker_watch: Initialise a watch
+ *
+ * The watch starts out without any events; the fd is only added to the
+ * epoll set by the first worker_update() with a non-zero event mask.
+ */
+void
+worker_watch (Worker    *self,
+              Watch     *watch,
+              int        fd,
+              WatchFunc  func)
+{
+  watch->func = func;
+  watch->fd = fd;
+  watch->events = 0;
+}
+
+/**
+ * worker_update: Change the events that a watch is interested in
+ *
+ * An fd without any events is removed from the epoll set entirely:
+ * otherwise we'd keep getting EPOLLHUP for it.
+ */
+void
+worker_update (Worker   *self,
+               Watch    *watch,
+               uint32_t  events)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = watch };
+  int op;
+
+  if (events == watch->events)
+    return;
+
+  if (watch->events == 0)
+    op = EPOLL_CTL_ADD;
+  else if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  debug (POLL, "worker %p: fd %i events 0x%x -> 0x%x", self, watch->fd, watch->events, events);
+
+  if (epoll_ctl (self->epollfd, op, watch->fd, &ev) != 0)
+    err (EXIT_FAILURE, "Failed to update epoll set for fd %i", watch->fd);
+
+  watch->events = events;
+}
+
+/**
+ * worker_unwatch: Stop watching an fd
+ *
+ * The watch will not be dispatched anymore after this call, even if it
+ * is in the batch of events currently being processed, so the memory
+ * holding it can be freed right away.  The fd is not closed.
+ */
+void
+worker_unwatch (Worker *self,
+                Watch  *watch)
+{
+  worker_update (self, watch, 0);
+
+  for (int i = 0; i < self->n_events; i++)
+    if (self->events[i].data.ptr == watch)
+      self->events[i].data.ptr = NULL;
+}
+
+/**
+ * worker_add_timeout: Call a function after a number of seconds
+ *
+ * If @timeout is already pending, it is rescheduled.
+ */
+void
+worker_add_timeout (Worker      *self,
+                    Timeout     *timeout,
+                    unsigned     seconds,
+                    TimeoutFunc  func)
+{
+  Timeout *prev;
+
+  worker_remove_timeout (self, timeout);
+
+  timeout->func = func;
+  timeout->deadline = get_monotonic_time () + (uint64_t) seconds * 1000000;
+
+  /* almost all timeouts get appended, so search from the end */
+  for (prev = self->last_timeout; prev && prev->deadline > timeout->deadline; prev = prev->prev)
+    ;
+
+  timeout->prev = prev;
+  timeout->next = prev ? prev->next : self->first_timeout;
+
+  if (timeout->next)
+    timeout->next->prev = timeout;
+  else
+    self->last_timeout = timeout;
+
+  if (prev)
+    prev->next = timeout;
+  else
+    {
+      self->first_timeout = timeout;
+      worker_arm_timer (self);
+    }
+}
+
+/**
+ * worker_remove_timeout: Cancel a timeout
+ *
+ * It's fine to call this on a timeout that isn't pending.
+ */
+void
+worker_remove_timeout (Worker  *self,
+                       Timeout *timeout)
+{
+  if (timeout->deadline == 0)
+    return;
+
+  if (timeout->prev)
+    timeout->prev->next = timeout->next;
+  else
+    self->first_timeout = timeout->next;
+
+  if (timeout->next)
+    timeout->next->prev = timeout->prev;
+  else
+    self->last_timeout = timeout->prev;
+
+  timeout->prev = timeout->next = NULL;
+  timeout->deadline = 0;
+
+  /* a stale expiry just results in a spurious wakeup, so don't bother
+   * re-arming the timer here: worker_timer_ready() does that */
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct _Worker Worker;
+typedef struct _Watch Watch;
+typedef struct _Timeout Timeout;
+
+typedef void (* WatchFunc) (Watch *watch, uint32_t events);
+typedef void (* TimeoutFunc) (Timeout *timeout);
+typedef void (* WorkerFdFunc) (Worker *worker, int fd);
+
+/* an fd registered with the epoll set of a worker; embed this */
+struct _Watch {
+  WatchFunc func;
+  int fd;
+  uint32_t events;
+};
+
+/* a deadline on the CLOCK_MONOTONIC clock; embed this */
+struct _Timeout {
+  TimeoutFunc func;
+  uint64_t deadline;
+  Timeout *prev;
+  Timeout *next;
+};
+
+Worker *
+worker_new (WorkerFdFunc fd_func);
+
+void
+worker_free (Worker *self);
+
+void
+worker_start (Worker *self);
+
+void
+worker_stop (Worker *self);
+
+void
+worker_dispatch_fd (Worker *self,
+                    int     fd);
+
+void
+worker_watch (Worker    *self,
+              Watch     *watch,
+              int        fd,
+              WatchFunc  func);
+
+void
+worker_update (Worker   *self,
+               Watch    *watch,
+               uint32_t  events);
+
+void
+worker_unwatch (Worker *self,
+                Watch  *watch);
+
+void
+worker_add_timeout (Worker      *self,
+                    Timeout     *timeout,
+                    unsigned     seconds,
+                    TimeoutFunc  func);
+
+void
+worker_remove_timeout (Worker  *self,
+                       Timeout *timeout);
@@ -0,0 +1,111 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bench-websocket: frame masking microbenchmark
+ *
+ * Masks the same payload over and over with each of the masking
+ * implementations that this CPU supports, starting with the scalar
+ * byte loop that the others are compared to.  Use --offset to start
+ * the payload at an unaligned address, and --size for the small
+ * frames that most channel messages are.
+ *
+ * This is not a test: it doesn't fail on bad numbers.  Compare the
+ * results of the implementations on the same machine.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+#include "websocketprivate.h"
+
+static gint iterations = 10000;
+static gint size = 64 * 1024;
+static gint offset = 0;
+
+static GOptionEntry entries[] = {
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of payloads to mask", "N" },
+  { "size", 's', 0, G_OPTION_ARG_INT, &size, "Size of the payload in bytes", "BYTES" },
+  { "offset", 'o', 0, G_OPTION_ARG_INT, &offset, "Offset of the payload from an aligned address", "BYTES" },
+  { NULL }
+};
+
+static void
+run (const gchar *name,
+     guint8 *data)
+{
+  const guint8 mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+  WebSocketMaskFunc kernel;
+  gint64 start;
+  gint64 elapsed;
+  gint i;
+
+  kernel = _web_socket_util_mask_kernel (name);
+  if (kernel == NULL)
+    {
+      g_print ("%-6s not supported\n", name);
+      return;
+    }
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    kernel (mask, data, size);
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  g_print ("%-6s %8.1f ns/payload  %8.2f GB/s\n", name,
+           elapsed * 1000.0 / iterations,
+           (gdouble)size * iterations / (elapsed * 1000.0));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guint8 *buffer = NULL;
+  gint i;
+
+  context = g_option_context_new ("- benchmark WebSocket frame masking");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("bench-websocket: %s\n", error->message);
+      return 2;
+    }
+  if (iterations <= 0 || size < 0 || offset < 0 || offset >= 64)
+    {
+      g_printerr ("bench-websocket: --iterations must be positive, and --offset less than 64\n");
+      return 2;
+    }
+
+  /* g_malloc() alignment is good enough for us to add the offset to */
+  buffer = g_malloc (size + 64);
+  for (i = 0; i < size + 64; i++)
+    buffer[i] = i;
+
+  g_print ("%d payloads of %d bytes at offset %d\n", iterations, size, offset);
+
+  run ("bytes", buffer + offset);
+  run ("words", buffer + offset);
+  run ("sse2", buffer + offset);
+  run ("avx2", buffer + offset);
+
+  return 0;
+}
@@ -26,6 +26,10 @@
 #include "common/cockpitsocket.h"
 #include "testlib/mock-pressure.h"
 
+#include <glib-unix.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+
 #include <string.h>
 
 typedef struct {
@@ -447,6 +451,98 @@ test_header_empty (void)
   g_hash_table_unref (headers);
 }
 
+typedef struct {
+  const gchar *extension;
+  gboolean valid;
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits;
+  gint client_max_window_bits;
+} DeflateFixture;
+
+static const DeflateFixture deflate_fixtures[] = {
+  { "permessage-deflate", TRUE, FALSE, FALSE, 0, 0 },
+  { " Permessage-Deflate ", TRUE, FALSE, FALSE, 0, 0 },
+  { "permessage-deflate; client_max_window_bits", TRUE, FALSE, FALSE, 0, -1 },
+  { "permessage-deflate;server_no_context_takeover; client_no_context_takeover", TRUE, TRUE, TRUE, 0, 0 },
+  { "permessage-deflate; server_max_window_bits=10; client_max_window_bits=\"15\"", TRUE, FALSE, FALSE, 10, 15 },
+  { "permessage-deflate; server_max_window_bits", FALSE },
+  { "permessage-deflate; server_max_window_bits=7", FALSE },
+  { "permessage-deflate; server_max_window_bits=16", FALSE },
+  { "permessage-deflate; server_max_window_bits=+9", FALSE },
+  { "permessage-deflate; client_max_window_bits=9x", FALSE },
+  { "permessage-deflate; server_no_context_takeover=1", FALSE },
+  { "permessage-deflate; client_no_context_takeover; client_no_context_takeover", FALSE },
+  { "permessage-deflate; unknown", FALSE },
+  { "x-webkit-deflate-frame", FALSE },
+  { "", FALSE },
+};
+
+static void
+test_parse_deflate (gconstpointer data)
+{
+  const DeflateFixture *fixture = data;
+  WebSocketDeflateParams params;
+  guint logid;
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+  g_assert_cmpint (_web_socket_util_parse_deflate (fixture->extension, &params), ==, fixture->valid);
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+
+  if (fixture->valid)
+    {
+      g_assert_cmpint (params.server_no_context_takeover, ==, fixture->server_no_context_takeover);
+      g_assert_cmpint (params.client_no_context_takeover, ==, fixture->client_no_context_takeover);
+      g_assert_cmpint (params.server_max_window_bits, ==, fixture->server_max_window_bits);
+      g_assert_cmpint (params.client_max_window_bits, ==, fixture->client_max_window_bits);
+    }
+}
+
+static void
+test_mask (gconstpointer data)
+{
+  const gchar *name = data;
+  const guint8 mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+  WebSocketMaskFunc scalar;
+  WebSocketMaskFunc kernel;
+  guint8 expect[1100];
+  guint8 buffer[1100];
+  gsize offset;
+  gsize len;
+  gsize i;
+
+  kernel = _web_socket_util_mask_kernel (name);
+  if (kernel == NULL)
+    {
+      g_test_skip ("not supported on this CPU");
+      return;
+    }
+
+  scalar = _web_socket_util_mask_kernel ("bytes");
+  g_assert (scalar != NULL);
+
+  /* Every alignment, and lengths around each of the register sizes */
+  for (offset = 0; offset < 64; offset++)
+    {
+      for (len = 0; len < 1000; len += (len < 100 ? 1 : 37))
+        {
+          for (i = 0; i < sizeof (buffer); i++)
+            expect[i] = buffer[i] = g_test_rand_int ();
+
+          scalar (mask, expect + offset, len);
+          kernel (mask, buffer + offset, len);
+          g_assert (memcmp (expect, buffer, sizeof (buffer)) == 0);
+        }
+    }
+
+  /* Masking twice gets the original back */
+  memcpy (expect, buffer, sizeof (buffer));
+  _web_socket_util_mask (mask, buffer + 3, 1000);
+  g_assert (memcmp (expect, buffer, sizeof (buffer)) != 0);
+  _web_socket_util_mask (mask, buffer + 3, 1000);
+  g_assert (memcmp (expect, buffer, sizeof (buffer)) == 0);
+}
+
 static gboolean
 on_error_not_reached (WebSocketConnection *ws,
                       GError *error,
@@ -486,6 +582,17 @@ setup_pair (Test *test,
   g_object_unref (ios);
 }
 
+static void
+setup_deflate_pair (Test *test,
+                    gconstpointer data)
+{
+  WebSocketDeflateFlags flags = GPOINTER_TO_INT (data);
+
+  setup_pair (test, data);
+  web_socket_connection_set_deflate (test->client, flags);
+  web_socket_connection_set_deflate (test->server, flags);
+}
+
 static void
 teardown (Test *test,
           gconstpointer data)
@@ -664,6 +771,148 @@ test_send_big_packets (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+test_send_prefixed_big (Test *test,
+                        gconstpointer data)
+{
+  GByteArray *received;
+  GByteArray *expect;
+  GBytes *prefix;
+  GBytes *payload;
+  gint i;
+
+  received = g_byte_array_new ();
+  expect = g_byte_array_new ();
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_append), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* More than the socket buffer, so that frames get written in pieces */
+  prefix = g_bytes_new_static ("channel\n", 8);
+  for (i = 0; i < 10; i++)
+    {
+      payload = g_bytes_new_take (g_strnfill (100 * 1000, 'a' + i), 100 * 1000);
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, prefix, payload);
+      g_byte_array_append (expect, g_bytes_get_data (prefix, NULL), 8);
+      g_byte_array_append (expect, g_bytes_get_data (payload, NULL), 100 * 1000);
+      g_bytes_unref (payload);
+    }
+
+  WAIT_UNTIL (received->len >= expect->len);
+  g_assert_cmpuint (received->len, ==, expect->len);
+  g_assert (memcmp (received->data, expect->data, expect->len) == 0);
+
+  g_bytes_unref (prefix);
+  g_byte_array_unref (received);
+  g_byte_array_unref (expect);
+}
+
+static void
+test_send_many_small (Test *test,
+                      gconstpointer data)
+{
+  GByteArray *received;
+  GString *expect;
+  GBytes *payload;
+  gchar *line;
+  gint i;
+
+  received = g_byte_array_new ();
+  expect = g_string_new ("");
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_append), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* All of these get queued before the first write, and go out together */
+  for (i = 0; i < 5000; i++)
+    {
+      line = g_strdup_printf ("%d\n", i);
+      payload = g_bytes_new_take (line, strlen (line));
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, payload);
+      g_string_append (expect, line);
+      g_bytes_unref (payload);
+    }
+
+  WAIT_UNTIL (received->len >= expect->len);
+  g_assert_cmpuint (received->len, ==, expect->len);
+  g_assert (memcmp (received->data, expect->str, expect->len) == 0);
+
+  g_byte_array_unref (received);
+  g_string_free (expect, TRUE);
+}
+
+static GIOStream *
+pipe_io_stream (gint in_fd,
+                gint out_fd)
+{
+  GInputStream *input;
+  GOutputStream *output;
+  GIOStream *io;
+
+  g_assert (g_unix_set_fd_nonblocking (in_fd, TRUE, NULL));
+  g_assert (g_unix_set_fd_nonblocking (out_fd, TRUE, NULL));
+
+  input = g_unix_input_stream_new (in_fd, TRUE);
+  output = g_unix_output_stream_new (out_fd, TRUE);
+  io = g_simple_io_stream_new (input, output);
+  g_object_unref (input);
+  g_object_unref (output);
+
+  return io;
+}
+
+static void
+test_send_over_pipes (void)
+{
+  WebSocketConnection *client;
+  WebSocketConnection *server;
+  GBytes *received = NULL;
+  GBytes *prefix;
+  GBytes *payload;
+  GIOStream *ioc;
+  GIOStream *ios;
+  gint one[2];
+  gint two[2];
+
+  /* These aren't sockets, so frames are copied together before writing */
+  g_assert (g_unix_open_pipe (one, FD_CLOEXEC, NULL));
+  g_assert (g_unix_open_pipe (two, FD_CLOEXEC, NULL));
+  ioc = pipe_io_stream (one[0], two[1]);
+  ios = pipe_io_stream (two[0], one[1]);
+
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, ioc);
+  g_signal_connect (server, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (server), ==, WEB_SOCKET_STATE_OPEN);
+
+  prefix = g_bytes_new_static ("funny ", 6);
+  payload = g_bytes_new_take (g_strnfill (100 * 1000, 'x'), 100 * 1000);
+  web_socket_connection_send (server, WEB_SOCKET_DATA_TEXT, prefix, payload);
+
+  WAIT_UNTIL (received != NULL);
+  g_assert_cmpuint (g_bytes_get_size (received), ==, 6 + 100 * 1000);
+  g_assert (memcmp (g_bytes_get_data (received, NULL), "funny xxx", 9) == 0);
+
+  g_bytes_unref (received);
+  g_bytes_unref (prefix);
+  g_bytes_unref (payload);
+
+  web_socket_connection_close (client, 0, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (server) == WEB_SOCKET_STATE_CLOSED);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_CLOSED);
+
+  g_object_unref (client);
+  g_object_unref (server);
+  g_object_unref (ioc);
+  g_object_unref (ios);
+}
+
 static void
 on_pressure_set_throttle (WebSocketConnection *socket,
                           gboolean throttle,
@@ -922,6 +1171,167 @@ test_protocol_client_any (Test *test,
   g_clear_error (&error);
 }
 
+static void
+test_deflate_negotiate (Test *test,
+                        gconstpointer data)
+{
+  WebSocketDeflateFlags flags = GPOINTER_TO_INT (data);
+  const gchar *expected;
+
+  if (flags & WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER)
+    expected = "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+  else
+    expected = "permessage-deflate";
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, expected);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, expected);
+}
+
+static void
+test_deflate_server_disabled (Test *test,
+                              gconstpointer data)
+{
+  GBytes *sent = NULL;
+  GBytes *received = NULL;
+
+  web_socket_connection_set_deflate (test->client, WEB_SOCKET_DEFLATE_ENABLED);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->client), ==, NULL);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, NULL);
+
+  sent = g_bytes_new_take (g_strnfill (1000, 'x'), 1000);
+  web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->client), ==, 1000);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+}
+
+static void
+test_deflate_send (Test *test,
+                   gconstpointer data)
+{
+  GBytes *prefix = NULL;
+  GBytes *sent = NULL;
+  GBytes *received = NULL;
+  gint i;
+
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message), &received);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->client), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Several times, so that the compression state gets reused, or not */
+  for (i = 0; i < 3; i++)
+    {
+      sent = g_bytes_new_take (g_strnfill (100 * 1000, '?'), 100 * 1000);
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), <, 1000);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (sent, received));
+      g_bytes_unref (sent);
+      g_bytes_unref (received);
+      received = NULL;
+
+      prefix = g_bytes_new_static ("funny ", 6);
+      sent = g_bytes_new_static ("thing", 5);
+      web_socket_connection_send (test->client, WEB_SOCKET_DATA_TEXT, prefix, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert_cmpstr (g_bytes_get_data (received, NULL), ==, "funny thing");
+      g_assert_cmpint (g_bytes_get_size (received), ==, 11);
+      g_bytes_unref (prefix);
+      g_bytes_unref (sent);
+      g_bytes_unref (received);
+      received = NULL;
+    }
+}
+
+static void
+test_deflate_skip_binary (Test *test,
+                          gconstpointer data)
+{
+  GByteArray *received;
+  GBytes *sent;
+
+  received = g_byte_array_new ();
+  g_signal_connect (test->client, "message", G_CALLBACK (on_message_append), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  sent = g_bytes_new_take (g_strnfill (1000, '!'), 1000);
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_BINARY, NULL, sent);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 1000);
+  WAIT_UNTIL (received->len == 1000);
+  g_assert (memcmp (received->data, g_bytes_get_data (sent, NULL), 1000) == 0);
+
+  g_bytes_unref (sent);
+  g_byte_array_unref (received);
+}
+
+static void
+test_deflate_bad_data (Test *test,
+                       gconstpointer data)
+{
+  GError *error = NULL;
+  gsize written;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* A compressed text frame with an invalid block type */
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (web_socket_connection_get_io_stream (test->client)),
+                                  "\xC1\x02\xFF\xFF", 4, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_BAD_DATA);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
+static void
+test_deflate_unexpected (Test *test,
+                         gconstpointer data)
+{
+  GError *error = NULL;
+  gsize written;
+  guint logid;
+
+  g_signal_handlers_disconnect_by_func (test->server, on_error_not_reached, NULL);
+  g_signal_connect (test->server, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpstr (web_socket_connection_get_extensions (test->server), ==, NULL);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  /* A compressed frame, but nothing was negotiated */
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (web_socket_connection_get_io_stream (test->client)),
+                                  "\xC1\x02\x03\x00", 4, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_PROTOCOL);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+}
+
 static void
 test_close_clean_client (Test *test,
                          gconstpointer data)
@@ -1272,6 +1682,8 @@ main (int argc,
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_prefixed_big, "send-prefixed-big" },
+      { test_send_many_small, "send-many-small" },
       { test_send_bad_data, "send-bad-data" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
@@ -1281,6 +1693,18 @@ main (int argc,
       { test_protocol_client_any, "protocol-client-any" },
       { test_close_clean_client, "close-clean-client" },
       { test_close_clean_server, "close-clean-server" },
+      { test_deflate_server_disabled, "deflate-server-disabled" },
+      { test_deflate_unexpected, "deflate-unexpected" },
+  };
+
+  struct {
+    void (* func) (Test *, gconstpointer);
+    const gchar *name;
+  } tests_with_deflate_pair[] = {
+      { test_deflate_negotiate, "negotiate" },
+      { test_deflate_send, "send" },
+      { test_deflate_skip_binary, "skip-binary" },
+      { test_deflate_bad_data, "bad-data" },
   };
 
   signal (SIGPIPE, SIG_IGN);
@@ -1314,6 +1738,16 @@ main (int argc,
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
+  g_test_add_data_func ("/web-socket/mask/words", "words", test_mask);
+  g_test_add_data_func ("/web-socket/mask/sse2", "sse2", test_mask);
+  g_test_add_data_func ("/web-socket/mask/avx2", "avx2", test_mask);
+
+  for (j = 0; j < G_N_ELEMENTS (deflate_fixtures); j++)
+    {
+      name = g_strdup_printf ("/web-socket/parse-deflate/%d", j);
+      g_test_add_data_func (name, deflate_fixtures + j, test_parse_deflate);
+      g_free (name);
+    }
 
   for (j = 0; j < G_N_ELEMENTS (tests_with_client_server_pair); j++)
     {
@@ -1322,10 +1756,24 @@ main (int argc,
       g_free (name);
     }
 
+  for (j = 0; j < G_N_ELEMENTS (tests_with_deflate_pair); j++)
+    {
+      name = g_strdup_printf ("/web-socket/deflate/%s", tests_with_deflate_pair[j].name);
+      g_test_add (name, Test, GINT_TO_POINTER (WEB_SOCKET_DEFLATE_ENABLED),
+                  setup_deflate_pair, tests_with_deflate_pair[j].func, teardown);
+      g_free (name);
+
+      name = g_strdup_printf ("/web-socket/deflate-no-context-takeover/%s", tests_with_deflate_pair[j].name);
+      g_test_add (name, Test, GINT_TO_POINTER (WEB_SOCKET_DEFLATE_ENABLED | WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER),
+                  setup_deflate_pair, tests_with_deflate_pair[j].func, teardown);
+      g_free (name);
+    }
+
   g_test_add_func ("/web-socket/close-immediately", test_close_immediately);
   if (g_test_slow ())
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
+  g_test_add_func ("/web-socket/send-over-pipes", test_send_over_pipes);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
 
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define WEB_SOCKET_MASK_X86 1
+#include <immintrin.h>
+#endif
+
 /**
  * WebSocketState:
  * @WEB_SOCKET_STATE_CONNECTING: the WebSocket is not yet ready to send messages
@@ -440,6 +445,103 @@ _web_socket_util_header_empty (GHashTable *headers,
   return FALSE;
 }
 
+static gboolean
+parse_window_bits (const gchar *value,
+                   gint *bits)
+{
+  guint64 number;
+  gchar *end;
+
+  if (!g_ascii_isdigit (value[0]))
+    return FALSE;
+
+  number = g_ascii_strtoull (value, &end, 10);
+  if (*end != '\0' || number < 8 || number > 15)
+    return FALSE;
+
+  *bits = number;
+  return TRUE;
+}
+
+/*
+ * _web_socket_util_parse_deflate:
+ * @extension: a single element of a Sec-WebSocket-Extensions header
+ * @params: (out): location to place the parameters
+ *
+ * Parse a permessage-deflate extension offer or response, as
+ * described in RFC 7692. A client_max_window_bits parameter without a
+ * value is returned as -1, absent window sizes as zero.
+ *
+ * Returns: %FALSE if this is another extension, or if the
+ *          parameters are unknown, duplicated or invalid.
+ */
+gboolean
+_web_socket_util_parse_deflate (const gchar *extension,
+                                WebSocketDeflateParams *params)
+{
+  gboolean valid = TRUE;
+  gchar **parts;
+  gchar *name;
+  gchar *value;
+  gsize len;
+  guint i;
+
+  memset (params, 0, sizeof (WebSocketDeflateParams));
+
+  parts = g_strsplit (extension, ";", -1);
+  if (parts[0] == NULL || g_ascii_strcasecmp (g_strstrip (parts[0]), "permessage-deflate") != 0)
+    {
+      g_strfreev (parts);
+      return FALSE;
+    }
+
+  for (i = 1; valid && parts[i] != NULL; i++)
+    {
+      name = g_strstrip (parts[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *(value++) = '\0';
+          g_strchomp (name);
+          g_strchug (value);
+
+          /* The value may also be a quoted-string */
+          len = strlen (value);
+          if (len >= 2 && value[0] == '"' && value[len - 1] == '"')
+            {
+              value[len - 1] = '\0';
+              value++;
+            }
+        }
+
+      if (g_ascii_strcasecmp (name, "server_no_context_takeover") == 0 &&
+          !value && !params->server_no_context_takeover)
+        params->server_no_context_takeover = TRUE;
+      else if (g_ascii_strcasecmp (name, "client_no_context_takeover") == 0 &&
+               !value && !params->client_no_context_takeover)
+        params->client_no_context_takeover = TRUE;
+      else if (g_ascii_strcasecmp (name, "server_max_window_bits") == 0 &&
+               value && !params->server_max_window_bits)
+        valid = parse_window_bits (value, &params->server_max_window_bits);
+      else if (g_ascii_strcasecmp (name, "client_max_window_bits") == 0 &&
+               !params->client_max_window_bits)
+        {
+          if (value)
+            valid = parse_window_bits (value, &params->client_max_window_bits);
+          else
+            params->client_max_window_bits = -1;
+        }
+      else
+        valid = FALSE;
+    }
+
+  if (!valid)
+    g_message ("received invalid permessage-deflate parameters: %s", extension);
+
+  g_strfreev (parts);
+  return valid;
+}
+
 /**
  * web_socket_util_parse_status_line:
  * @data: (array length=length): the input data
@@ -515,3 +617,173 @@ web_socket_util_parse_status_line (const gchar *data,
     *status = (guint)num;
   return (end - data) + 1;
 }
+
+/*
+ * Masking XORs every payload byte with one of the four mask bytes, in
+ * turn. The kernels below all do the same thing, but work through the
+ * middle of the payload a register at a time: they start with single
+ * bytes until the data is aligned, and then rotate the mask to match
+ * the position where the aligned part begins.
+ */
+
+static void
+mask_bytes (const guint8 *mask,
+            guint8 *data,
+            gsize len)
+{
+  for (gsize n = 0; n < len; n++)
+    data[n] ^= mask[n & 3];
+}
+
+static gsize
+mask_align (const guint8 *mask,
+            guint8 *data,
+            gsize len,
+            gsize alignment,
+            guint8 *key,
+            gsize key_len)
+{
+  gsize n;
+  gsize i;
+
+  for (n = 0; n < len && ((guintptr)(data + n) & (alignment - 1)) != 0; n++)
+    data[n] ^= mask[n & 3];
+
+  for (i = 0; i < key_len; i++)
+    key[i] = mask[(n + i) & 3];
+
+  return n;
+}
+
+static void
+mask_words (const guint8 *mask,
+            guint8 *data,
+            gsize len)
+{
+  guint8 key[sizeof (guint64)];
+  guint64 word_key;
+  guint64 word;
+  gsize n;
+
+  n = mask_align (mask, data, len, sizeof (guint64), key, sizeof (key));
+  memcpy (&word_key, key, sizeof (word_key));
+
+  for (; n + sizeof (guint64) <= len; n += sizeof (guint64))
+    {
+      memcpy (&word, data + n, sizeof (word));
+      word ^= word_key;
+      memcpy (data + n, &word, sizeof (word));
+    }
+
+  for (; n < len; n++)
+    data[n] ^= mask[n & 3];
+}
+
+#ifdef WEB_SOCKET_MASK_X86
+
+__attribute__ ((target ("sse2")))
+static void
+mask_sse2 (const guint8 *mask,
+           guint8 *data,
+           gsize len)
+{
+  guint8 key[16];
+  __m128i vector_key;
+  __m128i *at;
+  gsize n;
+
+  n = mask_align (mask, data, len, sizeof (key), key, sizeof (key));
+  vector_key = _mm_loadu_si128 ((const __m128i *)key);
+
+  for (; n + sizeof (key) <= len; n += sizeof (key))
+    {
+      at = (__m128i *)(data + n);
+      _mm_store_si128 (at, _mm_xor_si128 (_mm_load_si128 (at), vector_key));
+    }
+
+  for (; n < len; n++)
+    data[n] ^= mask[n & 3];
+}
+
+__attribute__ ((target ("avx2")))
+static void
+mask_avx2 (const guint8 *mask,
+           guint8 *data,
+           gsize len)
+{
+  guint8 key[32];
+  __m256i vector_key;
+  __m256i *at;
+  gsize n;
+
+  n = mask_align (mask, data, len, sizeof (key), key, sizeof (key));
+  vector_key = _mm256_loadu_si256 ((const __m256i *)key);
+
+  for (; n + sizeof (key) <= len; n += sizeof (key))
+    {
+      at = (__m256i *)(data + n);
+      _mm256_store_si256 (at, _mm256_xor_si256 (_mm256_load_si256 (at), vector_key));
+    }
+
+  for (; n < len; n++)
+    data[n] ^= mask[n & 3];
+}
+
+#endif /* WEB_SOCKET_MASK_X86 */
+
+/*
+ * _web_socket_util_mask_kernel:
+ * @name: "bytes", "words", "sse2" or "avx2"
+ *
+ * Look up one of the masking implementations, so that tests and
+ * benchmarks can compare them with each other.
+ *
+ * Returns: the kernel, or %NULL if the CPU doesn't support it
+ */
+WebSocketMaskFunc
+_web_socket_util_mask_kernel (const gchar *name)
+{
+  if (g_str_equal (name, "bytes"))
+    return mask_bytes;
+  if (g_str_equal (name, "words"))
+    return mask_words;
+#ifdef WEB_SOCKET_MASK_X86
+  if (g_str_equal (name, "sse2") && __builtin_cpu_supports ("sse2"))
+    return mask_sse2;
+  if (g_str_equal (name, "avx2") && __builtin_cpu_supports ("avx2"))
+    return mask_avx2;
+#endif
+  return NULL;
+}
+
+/*
+ * _web_socket_util_mask:
+ * @mask: the four byte masking key
+ * @data: the payload to mask or unmask in place
+ * @len: the length of the payload
+ *
+ * Apply a RFC 6455 masking key to a payload, with the fastest
+ * implementation that the CPU supports.
+ */
+void
+_web_socket_util_mask (const guint8 *mask,
+                       guint8 *data,
+                       gsize len)
+{
+  static WebSocketMaskFunc kernel = NULL;
+  WebSocketMaskFunc func;
+
+  /* Every thread picks the same one, so racing here is harmless */
+  func = __atomic_load_n (&kernel, __ATOMIC_RELAXED);
+  if (func == NULL)
+    {
+      func = _web_socket_util_mask_kernel ("avx2");
+      if (!func)
+        func = _web_socket_util_mask_kernel ("sse2");
+      if (!func)
+        func = mask_words;
+      __atomic_store_n (&kernel, func, __ATOMIC_RELAXED);
+    }
+
+  func (mask, data, len);
+}
@@ -72,6 +72,13 @@ typedef enum {
   WEB_SOCKET_STATE_CLOSED = 3,
 } WebSocketState;
 
+typedef enum {
+  WEB_SOCKET_DEFLATE_NONE = 0,
+  WEB_SOCKET_DEFLATE_ENABLED = 1 << 0,
+  WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER = 1 << 1,
+  WEB_SOCKET_DEFLATE_BINARY = 1 << 2,
+} WebSocketDeflateFlags;
+
 typedef struct _WebSocketConnection       WebSocketConnection;
 typedef struct _WebSocketConnectionClass  WebSocketConnectionClass;
 typedef struct _WebSocketClient           WebSocketClient;
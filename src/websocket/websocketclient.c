@@ -82,7 +82,7 @@ verify_handshake_rfc6455 (WebSocketClient *self,
       !_web_socket_util_header_contains (headers, "Connection", "upgrade") ||
       !_web_socket_connection_choose_protocol (conn, (const gchar **)self->possible_protocols,
                                                g_hash_table_lookup (headers, "Sec-Websocket-Protocol")) ||
-      !_web_socket_util_header_empty (headers, "Sec-WebSocket-Extensions"))
+      !_web_socket_connection_accept_deflate (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions")))
     {
       protocol_error_and_close (conn);
       return FALSE;
@@ -216,6 +216,7 @@ request_handshake_rfc6455 (WebSocketClient *self,
                            const gchar *host,
                            const gchar *path)
 {
+  const gchar *extensions;
   gchar *key;
   gchar *protocols;
   GString *handshake;
@@ -252,6 +253,10 @@ request_handshake_rfc6455 (WebSocketClient *self,
       g_free (protocols);
     }
 
+  extensions = _web_socket_connection_offer_deflate (conn);
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+
   include_custom_headers (self, handshake);
   g_string_append (handshake, "\r\n");
 
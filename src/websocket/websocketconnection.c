@@ -23,8 +23,12 @@
 #include "websocketprivate.h"
 
 #include "common/cockpitflow.h"
+#include "common/cockpitutf8.h"
 
+#include <errno.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 /*
  * SECTION:websocketconnection
@@ -98,8 +102,15 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * A frame is a header followed by references to its contents, which
+ * are written out together with a single sendmsg() when possible, so
+ * that payloads don't get copied.
+ */
 typedef struct {
-  GBytes *data;
+  GBytes *parts[3];
+  guint n_parts;
+  gsize length;
   gboolean last;
   gsize sent;
   gsize amount;
@@ -138,14 +149,25 @@ typedef struct
   GByteArray *incoming;
 
   GPollableOutputStream *output;
+  GSocket *socket;
   GSource *output_source;
   gsize output_queued;
   GQueue outgoing;
 
   /* Current message being assembled */
   guint8 message_opcode;
+  gboolean message_compressed;
   GByteArray *message_data;
 
+  /* The permessage-deflate extension, if negotiated */
+  WebSocketDeflateFlags deflate_flags;
+  gchar *extensions;
+  gboolean deflate;
+  gboolean deflate_reset_out;
+  gboolean deflate_reset_in;
+  GConverter *compressor;
+  GConverter *decompressor;
+
   /* Pressure which throttles input on this web socket */
   CockpitFlow *pressure;
   gulong pressure_sig;
@@ -156,8 +178,19 @@ typedef struct
 /* The queue size above which we consider applying back pressure */
 #define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
 
+/* How much of the queue goes out in one write */
+#define OUTPUT_BUDGET        256 * 1024
+#define MAX_GATHER           64
+
+/* Small frames are copied together up to this size when we can't gather */
+#define GATHER_BUFFER        16 * 1024
+
 static void    web_socket_connection_flow_iface_init        (CockpitFlowInterface *iface);
 
+static void    queue_frame                                  (WebSocketConnection *self,
+                                                             WebSocketQueueFlags flags,
+                                                             Frame *frame);
+
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT,
                                   G_ADD_PRIVATE(WebSocketConnection)
                                   G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, web_socket_connection_flow_iface_init));
@@ -168,9 +201,12 @@ static void
 frame_free (gpointer data)
 {
   Frame *frame = data;
+  guint i;
+
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      for (i = 0; i < frame->n_parts; i++)
+        g_bytes_unref (frame->parts[i]);
       g_slice_free (Frame, frame);
     }
 }
@@ -352,36 +388,40 @@ xor_with_mask_rfc6455 (const guint8 *mask,
   g_assert (mask != NULL);
   g_assert (data != NULL);
 
-  /* Do the masking */
-  for (gsize n = 0; n < len; n++)
-    data[n] ^= mask[n & 3];
+  _web_socket_util_mask (mask, data, len);
 }
 
 static void
 send_prefixed_message_rfc6455 (WebSocketConnection *self,
                                WebSocketQueueFlags flags,
                                guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+                               gboolean compressed,
+                               GBytes *prefix,
+                               GBytes *payload)
 {
   gsize amount;
   GByteArray *bytes;
-  gsize frame_len;
-  guint8 *outer;
+  guint8 outer[14];
+  gsize outer_len;
   guint8 *mask = 0;
-  guint8 *at;
+  Frame *frame;
+  gsize prefix_len;
+  gsize payload_len;
   gsize len;
   guint64 size;
 
+  prefix_len = prefix ? g_bytes_get_size (prefix) : 0;
+  payload_len = g_bytes_get_size (payload);
+
   len = payload_len + prefix_len;
   amount = len;
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
   outer[0] = 0x80 | opcode;
 
+  /* RSV1 marks a message compressed with permessage-deflate */
+  if (compressed)
+    outer[0] |= 0x40;
+
   /* If control message, truncate payload */
   if (opcode & 0x08)
     {
@@ -402,14 +442,14 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
   if (size < 126)
     {
       outer[1] = (0xFF & size); /* mask | 7-bit-len */
-      bytes->len = 2;
+      outer_len = 2;
     }
   else if (size < 65536)
     {
       outer[1] = 126; /* mask | 16-bit-len */
       outer[2] = (size >> 8) & 0xFF;
       outer[3] = (size >> 0) & 0xFF;
-      bytes->len = 4;
+      outer_len = 4;
     }
   else
     {
@@ -422,9 +462,12 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
       outer[7] = (size >> 16) & 0xFF;
       outer[8] = (size >> 8) & 0xFF;
       outer[9] = (size >> 0) & 0xFF;
-      bytes->len = 10;
+      outer_len = 10;
     }
 
+  frame = g_slice_new0 (Frame);
+  frame->amount = amount;
+
   /*
    * The server side doesn't need to mask, so we don't. There's
    * probably a client somewhere that's not expecting it.
@@ -434,22 +477,31 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
     {
       guint32 rand = g_random_int ();
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
+      mask = outer + outer_len;
       memcpy (mask, &rand, sizeof (guint32));
-      bytes->len += 4;
+      outer_len += 4;
+
+      /* Masking changes the contents, so here we have to copy them */
+      bytes = g_byte_array_sized_new (outer_len + len);
+      g_byte_array_append (bytes, outer, outer_len);
+      if (prefix_len > 0)
+        g_byte_array_append (bytes, g_bytes_get_data (prefix, NULL), prefix_len);
+      g_byte_array_append (bytes, g_bytes_get_data (payload, NULL), payload_len);
+      xor_with_mask_rfc6455 (mask, bytes->data + outer_len, len);
+      frame->parts[frame->n_parts++] = g_byte_array_free_to_bytes (bytes);
+    }
+  else
+    {
+      frame->parts[frame->n_parts++] = g_bytes_new (outer, outer_len);
+      if (prefix_len > 0)
+        frame->parts[frame->n_parts++] = g_bytes_new_from_bytes (prefix, 0, prefix_len);
+      if (payload_len > 0)
+        frame->parts[frame->n_parts++] = g_bytes_new_from_bytes (payload, 0, payload_len);
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
-
-  if (is_client_side)
-    xor_with_mask_rfc6455 (mask, at, len);
-
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+  frame->length = outer_len + len;
+  queue_frame (self, flags, frame);
+  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->length);
 }
 
 static void
@@ -459,7 +511,9 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, opcode, FALSE, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -652,7 +706,7 @@ receive_close_rfc6455 (WebSocketConnection *self,
     {
       data += 2;
       len -= 2;
-      if (g_utf8_validate ((gchar *)data, len, NULL))
+      if (cockpit_utf8_validate ((gchar *)data, len) == len)
         pv->peer_close_data = g_strndup ((gchar *)data, len);
       else
         g_message ("received non-UTF8 close data: %d '%.*s' %d", (int)len, (int)len, (gchar *)data, (int)data[0]);
@@ -683,10 +737,150 @@ receive_ping_rfc6455 (WebSocketConnection *self,
   send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
 }
 
+/* The empty stored block that a sync flush ends with, see RFC 7692 */
+static const guint8 deflate_trailer[] = { 0x00, 0x00, 0xff, 0xff };
+
+static GConverterResult
+convert_deflate (GConverter *converter,
+                 const guint8 *data,
+                 gsize length,
+                 GConverterFlags flags,
+                 GByteArray *output,
+                 gsize max_length)
+{
+  guint8 buffer[16 * 1024];
+  GConverterResult result;
+  gsize bytes_read;
+  gsize bytes_written;
+  GError *error = NULL;
+
+  for (;;)
+    {
+      result = g_converter_convert (converter, data, length, buffer, sizeof (buffer),
+                                    flags, &bytes_read, &bytes_written, &error);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          /* zlib says this when there was nothing left to do */
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE) ||
+              g_error_matches (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+            result = G_CONVERTER_FLUSHED;
+          else
+            g_message ("couldn't convert WebSocket message: %s", error->message);
+          g_error_free (error);
+          return result;
+        }
+
+      g_byte_array_append (output, buffer, bytes_written);
+      if (output->len >= max_length)
+        return G_CONVERTER_ERROR;
+
+      data += bytes_read;
+      length -= bytes_read;
+
+      if (result == G_CONVERTER_FINISHED)
+        return result;
+
+      /* Done once zlib stops filling the whole buffer */
+      if (result == G_CONVERTER_FLUSHED ||
+          (length == 0 && bytes_written < sizeof (buffer)))
+        return G_CONVERTER_FLUSHED;
+    }
+}
+
+static GByteArray *
+deflate_message (WebSocketConnection *self,
+                 const guint8 *prefix,
+                 gsize prefix_len,
+                 const guint8 *payload,
+                 gsize payload_len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *output;
+  gboolean valid;
+
+  if (!pv->compressor)
+    pv->compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+
+  output = g_byte_array_new ();
+
+  valid = (prefix_len == 0 ||
+           convert_deflate (pv->compressor, prefix, prefix_len, G_CONVERTER_NO_FLAGS,
+                            output, G_MAXSIZE) != G_CONVERTER_ERROR) &&
+          convert_deflate (pv->compressor, payload, payload_len, G_CONVERTER_FLUSH,
+                           output, G_MAXSIZE) != G_CONVERTER_ERROR;
+
+  if (!valid || output->len < sizeof (deflate_trailer) ||
+      memcmp (output->data + output->len - sizeof (deflate_trailer),
+              deflate_trailer, sizeof (deflate_trailer)) != 0)
+    {
+      /* The peer doesn't care if we start over, so send this one as is */
+      g_critical ("couldn't compress WebSocket message");
+      g_clear_object (&pv->compressor);
+      g_byte_array_unref (output);
+      return NULL;
+    }
+
+  g_byte_array_set_size (output, output->len - sizeof (deflate_trailer));
+
+  if (pv->deflate_reset_out)
+    g_clear_object (&pv->compressor);
+
+  return output;
+}
+
+static gboolean
+inflate_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GConverterResult result;
+  GByteArray *output;
+
+  if (!pv->decompressor)
+    pv->decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+
+  g_byte_array_append (pv->message_data, deflate_trailer, sizeof (deflate_trailer));
+
+  /* Stop inflating before the message gets past our limit */
+  output = g_byte_array_sized_new (MIN (pv->message_data->len * 4, MAX_PAYLOAD));
+  result = convert_deflate (pv->decompressor, pv->message_data->data, pv->message_data->len,
+                            G_CONVERTER_NO_FLAGS, output, MAX_PAYLOAD);
+
+  g_byte_array_unref (pv->message_data);
+  pv->message_data = output;
+
+  /* The peer may end the deflate stream, and start a new one */
+  if (result != G_CONVERTER_FLUSHED || pv->deflate_reset_in)
+    g_clear_object (&pv->decompressor);
+
+  if (result != G_CONVERTER_ERROR &&
+      (pv->message_opcode != 0x01 || cockpit_utf8_validate ((gchar *)output->data, output->len) == output->len))
+    return TRUE;
+
+  /* Discard the entire message */
+  pv->message_data = NULL;
+  pv->message_opcode = 0;
+
+  if (output->len >= MAX_PAYLOAD)
+    {
+      too_big_error_and_close (self, output->len);
+    }
+  else
+    {
+      if (result != G_CONVERTER_ERROR)
+        g_message ("received invalid non-UTF8 text data");
+      bad_data_error_and_close (self);
+    }
+
+  g_byte_array_unref (output);
+  return FALSE;
+}
+
 static void
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
+                          gboolean compressed,
                           guint8 opcode,
                           gconstpointer payload,
                           gsize payload_len)
@@ -704,6 +898,14 @@ process_contents_rfc6455 (WebSocketConnection *self,
           return;
         }
 
+      /* Nor compressed */
+      if (compressed)
+        {
+          g_message ("received compressed control frame");
+          protocol_error_and_close (self);
+          return;
+        }
+
       g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
 
       switch (opcode)
@@ -730,6 +932,14 @@ process_contents_rfc6455 (WebSocketConnection *self,
   /* A message frame */
   else
     {
+      /* Only the first frame of a message says whether it's compressed */
+      if (compressed && (!pv->deflate || !opcode))
+        {
+          g_message ("received unexpected compressed frame");
+          protocol_error_and_close (self);
+          return;
+        }
+
       /* Initial fragment of a message */
       if (!fin && opcode)
         {
@@ -782,13 +992,16 @@ process_contents_rfc6455 (WebSocketConnection *self,
       if (opcode)
         {
           pv->message_opcode = opcode;
+          pv->message_compressed = compressed;
           pv->message_data = g_byte_array_sized_new (payload_len);
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text is validated once it's inflated */
+          if (!pv->message_compressed &&
+              cockpit_utf8_validate ((gchar *)payload, payload_len) != payload_len)
             {
               g_message ("received invalid non-UTF8 text data");
 
@@ -812,6 +1025,9 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Actually deliver the message? */
       if (fin)
         {
+          if (pv->message_compressed && !inflate_message (self))
+            return;
+
           /* Always null terminate, as a convenience */
           g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
@@ -839,6 +1055,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   guint8 *mask;
   gboolean fin;
   gboolean control;
+  gboolean compressed;
   gboolean masked;
   guint8 opcode;
   gsize len;
@@ -851,6 +1068,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   header = GET_PRIV(self)->incoming->data;
   fin = ((header[0] & 0x80) != 0);
   control = header[0] & 0x08;
+  compressed = ((header[0] & 0x40) != 0);
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
 
@@ -910,7 +1128,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, compressed, opcode, payload, payload_len);
 
   /* Move past the parsed frame */
   g_byte_array_remove_range (GET_PRIV(self)->incoming, 0, at + payload_len);
@@ -1019,18 +1237,116 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+static gssize
+write_frames (WebSocketConnection *self,
+              GError **error)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  struct iovec iov[MAX_GATHER];
+  struct msghdr msg = { NULL, };
+  guint8 buffer[GATHER_BUFFER];
+  gsize budget = OUTPUT_BUDGET;
+  gboolean more;
+  const guint8 *data;
+  Frame *frame;
+  GList *l;
+  gsize skip;
+  gssize count;
+  gsize len;
+  gsize at;
+  guint i;
+  int errsv;
+
+  /*
+   * Gather as many queued frames as fit in the budget, so that lots of
+   * small messages go out in one write. The queue is already in priority
+   * order, and only the head can have been partially sent.
+   */
+  for (l = pv->outgoing.head; l != NULL; l = g_list_next (l))
+    {
+      frame = l->data;
+      if (budget == 0 || msg.msg_iovlen + frame->n_parts > G_N_ELEMENTS (iov))
+        break;
+
+      skip = frame->sent;
+      for (i = 0; i < frame->n_parts && budget > 0; i++)
+        {
+          data = g_bytes_get_data (frame->parts[i], &len);
+          if (skip >= len)
+            {
+              skip -= len;
+              continue;
+            }
+          iov[msg.msg_iovlen].iov_base = (guint8 *)data + skip;
+          iov[msg.msg_iovlen].iov_len = MIN (len - skip, budget);
+          budget -= iov[msg.msg_iovlen].iov_len;
+          msg.msg_iovlen++;
+          skip = 0;
+        }
+
+      /* Nothing goes out after the closing frame */
+      if (frame->last)
+        break;
+    }
+
+  g_assert (msg.msg_iovlen > 0);
+
+  frame = g_queue_peek_head (&pv->outgoing);
+  more = pv->output_queued - frame->sent > OUTPUT_BUDGET - budget;
+
+  /*
+   * Other streams, like TLS connections, have no vectored write. Copy
+   * small frames together, so that they don't each become a record.
+   */
+  if (!pv->socket)
+    {
+      if (msg.msg_iovlen == 1 || iov[0].iov_len >= sizeof (buffer))
+        {
+          return g_pollable_output_stream_write_nonblocking (pv->output, iov[0].iov_base,
+                                                             iov[0].iov_len, NULL, error);
+        }
+
+      for (at = 0, i = 0; i < msg.msg_iovlen && at < sizeof (buffer); i++)
+        {
+          len = MIN (iov[i].iov_len, sizeof (buffer) - at);
+          memcpy (buffer + at, iov[i].iov_base, len);
+          at += len;
+        }
+
+      return g_pollable_output_stream_write_nonblocking (pv->output, buffer, at, NULL, error);
+    }
+
+  /*
+   * While more is queued than fits in one write, tell the kernel, so that
+   * TCP doesn't push out a partial segment. On other sockets this does
+   * nothing. The write without the flag that follows flushes it all.
+   */
+  msg.msg_iov = iov;
+  do
+    count = sendmsg (g_socket_get_fd (pv->socket), &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+  while (count < 0 && errno == EINTR);
+
+  if (count < 0)
+    {
+      errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Error sending data: %s", g_strerror (errsv));
+    }
+
+  return count;
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  const guint8 *data;
   GError *error = NULL;
   gsize before;
   Frame *frame;
   gssize count;
-  gsize len;
+  gsize left;
 
   frame = g_queue_peek_head (&pv->outgoing);
 
@@ -1041,14 +1357,9 @@ on_web_socket_output (GObject *pollable_stream,
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
+  g_assert (frame->length > frame->sent);
 
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+  count = write_frames (self, &error);
 
   if (count < 0)
     {
@@ -1066,16 +1377,28 @@ on_web_socket_output (GObject *pollable_stream,
 
   before = pv->output_queued;
 
-  frame->sent += count;
-  if (frame->sent >= len)
+  /* Retire all the frames that were written completely */
+  while (count > 0)
     {
+      frame = g_queue_peek_head (&pv->outgoing);
+      g_assert (frame != NULL);
+
+      left = frame->length - frame->sent;
+      if ((gsize)count < left)
+        {
+          frame->sent += count;
+          break;
+        }
+
+      count -= left;
       g_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
-      g_assert (len <= pv->output_queued);
-      pv->output_queued -= len;
+      g_assert (frame->length <= pv->output_queued);
+      pv->output_queued -= frame->length;
 
       if (frame->last)
         {
+          g_assert (count == 0);
           if (pv->server_side)
             {
               close_io_stream (self);
@@ -1113,26 +1436,22 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   gsize before;
-  Frame *frame;
   Frame *prev;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
-  g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  if (pv->close_sent)
+    {
+      g_critical ("WebSocket frame queued after close was sent");
+      frame_free (frame);
+      return;
+    }
 
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
 
   /* If urgent put at front of queue */
@@ -1161,8 +1480,8 @@ _web_socket_connection_queue (WebSocketConnection *self,
     }
 
   before = pv->output_queued;
-  g_return_if_fail (G_MAXSIZE - len > pv->output_queued);
-  pv->output_queued += len;
+  g_return_if_fail (G_MAXSIZE - frame->length > pv->output_queued);
+  pv->output_queued += frame->length;
 
   /*
    * If we have two much data queued, and are controlling another flow
@@ -1174,6 +1493,26 @@ _web_socket_connection_queue (WebSocketConnection *self,
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  frame = g_slice_new0 (Frame);
+  frame->parts[frame->n_parts++] = g_bytes_new_take (data, len);
+  frame->length = len;
+  frame->amount = amount;
+  queue_frame (self, flags, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1243,6 +1582,10 @@ _web_socket_connection_take_io_stream (WebSocketConnection *self,
   if (G_IS_POLLABLE_OUTPUT_STREAM (os))
     pv->output = G_POLLABLE_OUTPUT_STREAM (os);
 
+  /* We write straight to the socket, so a frame can go out in one piece */
+  if (G_IS_SOCKET_CONNECTION (io_stream))
+    pv->socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (io_stream));
+
   pv->io_open = TRUE;
   g_object_notify (G_OBJECT (self), "io-stream");
 
@@ -1364,6 +1707,7 @@ web_socket_connection_finalize (GObject *object)
   g_free (pv->url);
   g_free (pv->chosen_protocol);
   g_free (pv->peer_close_data);
+  g_free (pv->extensions);
 
   g_main_context_unref (pv->main_context);
 
@@ -1384,6 +1728,8 @@ web_socket_connection_finalize (GObject *object)
     g_source_unref (pv->start_idle);
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
+  g_clear_object (&pv->compressor);
+  g_clear_object (&pv->decompressor);
 
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
@@ -1651,6 +1997,51 @@ web_socket_connection_get_io_stream (WebSocketConnection *self)
   return GET_PRIV(self)->io_stream;
 }
 
+/**
+ * web_socket_connection_set_deflate:
+ * @self: the WebSocket
+ * @flags: whether and how to compress messages
+ *
+ * Use the permessage-deflate extension from RFC 7692 when
+ * %WEB_SOCKET_DEFLATE_ENABLED is set. Clients offer it in their
+ * handshake request, and servers accept such an offer. Since this
+ * happens during the handshake, call this before running the main
+ * loop for the first time.
+ *
+ * The compression state lives as long as the connection, unless
+ * %WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER is set: then both peers
+ * start over with each message. This costs some compression, but
+ * caps the memory used by each connection to that of the message
+ * being processed.
+ *
+ * Binary messages are often compressed already, and are only
+ * compressed when %WEB_SOCKET_DEFLATE_BINARY is set.
+ */
+void
+web_socket_connection_set_deflate (WebSocketConnection *self,
+                                   WebSocketDeflateFlags flags)
+{
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (web_socket_connection_get_ready_state (self) == WEB_SOCKET_STATE_CONNECTING);
+  GET_PRIV(self)->deflate_flags = flags;
+}
+
+/**
+ * web_socket_connection_get_extensions:
+ * @self: the WebSocket
+ *
+ * Get the extensions negotiated with the peer, as they appear in
+ * the Sec-WebSocket-Extensions header of the handshake response.
+ *
+ * Returns: the extensions or %NULL if none
+ */
+const gchar *
+web_socket_connection_get_extensions (WebSocketConnection *self)
+{
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), NULL);
+  return GET_PRIV(self)->extensions;
+}
+
 /**
  * web_socket_connection_get_close_code:
  * @self: the WebSocket
@@ -1714,6 +2105,9 @@ web_socket_connection_send (WebSocketConnection *self,
                             GBytes *prefix,
                             GBytes *message)
 {
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *deflated = NULL;
+  GBytes *compressed;
   gconstpointer pref = NULL;
   gsize prefix_len = 0;
   gconstpointer payload;
@@ -1737,8 +2131,8 @@ web_socket_connection_send (WebSocketConnection *self,
     {
     case WEB_SOCKET_DATA_TEXT:
       opcode = 0x01;
-      if (!g_utf8_validate (pref, prefix_len, NULL) ||
-          !g_utf8_validate (payload, payload_len, NULL))
+      if (cockpit_utf8_validate (pref, prefix_len) != prefix_len ||
+          cockpit_utf8_validate (payload, payload_len) != payload_len)
         {
           g_critical ("invalid non-UTF8 @data passed as text to web_socket_connection_send()");
           return;
@@ -1752,8 +2146,22 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                 pref, prefix_len, payload, payload_len);
+  if (pv->deflate && prefix_len + payload_len > 0 &&
+      (type == WEB_SOCKET_DATA_TEXT || (pv->deflate_flags & WEB_SOCKET_DEFLATE_BINARY)))
+    deflated = deflate_message (self, pref, prefix_len, payload, payload_len);
+
+  if (deflated)
+    {
+      compressed = g_byte_array_free_to_bytes (deflated);
+      send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, TRUE,
+                                     NULL, compressed);
+      g_bytes_unref (compressed);
+    }
+  else
+    {
+      send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, FALSE,
+                                     prefix, message);
+    }
 
   g_object_notify (G_OBJECT (self), "buffered-amount");
 }
@@ -1915,6 +2323,102 @@ _web_socket_connection_choose_protocol (WebSocketConnection *self,
   return chosen;
 }
 
+const gchar *
+_web_socket_connection_negotiate_deflate (WebSocketConnection *self,
+                                          const gchar *offers)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  WebSocketDeflateParams params;
+  GString *response = NULL;
+  gchar **values;
+  gint i;
+
+  if (!offers || !(pv->deflate_flags & WEB_SOCKET_DEFLATE_ENABLED))
+    return NULL;
+
+  /* Offers are listed in order of preference */
+  values = g_strsplit (offers, ",", -1);
+  for (i = 0; response == NULL && values[i] != NULL; i++)
+    {
+      if (!_web_socket_util_parse_deflate (values[i], &params))
+        continue;
+
+      /* Our compressor always uses the largest window */
+      if (params.server_max_window_bits && params.server_max_window_bits < 15)
+        {
+          g_debug ("declining permessage-deflate with a smaller server window");
+          continue;
+        }
+
+      pv->deflate = TRUE;
+      pv->deflate_reset_out = params.server_no_context_takeover ||
+                              (pv->deflate_flags & WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER);
+      pv->deflate_reset_in = params.client_no_context_takeover ||
+                             (pv->deflate_flags & WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER);
+
+      response = g_string_new ("permessage-deflate");
+      if (pv->deflate_reset_out)
+        g_string_append (response, "; server_no_context_takeover");
+      if (pv->deflate_reset_in)
+        g_string_append (response, "; client_no_context_takeover");
+      if (params.server_max_window_bits)
+        g_string_append (response, "; server_max_window_bits=15");
+    }
+  g_strfreev (values);
+
+  if (!response)
+    return NULL;
+
+  g_free (pv->extensions);
+  pv->extensions = g_string_free (response, FALSE);
+  g_debug ("agreed on extensions: %s", pv->extensions);
+  return pv->extensions;
+}
+
+const gchar *
+_web_socket_connection_offer_deflate (WebSocketConnection *self)
+{
+  WebSocketDeflateFlags flags = GET_PRIV(self)->deflate_flags;
+
+  if (!(flags & WEB_SOCKET_DEFLATE_ENABLED))
+    return NULL;
+  else if (flags & WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER)
+    return "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+  else
+    return "permessage-deflate";
+}
+
+gboolean
+_web_socket_connection_accept_deflate (WebSocketConnection *self,
+                                       const gchar *response)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  WebSocketDeflateParams params;
+
+  if (response == NULL || response[0] == '\0')
+    return TRUE;
+
+  /* We never offer client_max_window_bits, so the server can't ask for it */
+  if (!(pv->deflate_flags & WEB_SOCKET_DEFLATE_ENABLED) ||
+      strchr (response, ',') != NULL ||
+      !_web_socket_util_parse_deflate (response, &params) ||
+      params.client_max_window_bits != 0)
+    {
+      g_message ("received unsupported Sec-WebSocket-Extensions header: %s", response);
+      return FALSE;
+    }
+
+  pv->deflate = TRUE;
+  pv->deflate_reset_out = params.client_no_context_takeover ||
+                          (pv->deflate_flags & WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER);
+  pv->deflate_reset_in = params.server_no_context_takeover;
+
+  g_free (pv->extensions);
+  pv->extensions = g_strdup (response);
+  g_debug ("agreed on extensions: %s", pv->extensions);
+  return TRUE;
+}
+
 GMainContext *
 _web_socket_connection_get_main_context (WebSocketConnection *self)
 {
@@ -70,6 +70,11 @@ const gchar *   web_socket_connection_get_close_data      (WebSocketConnection *
 
 GIOStream *     web_socket_connection_get_io_stream       (WebSocketConnection *self);
 
+void            web_socket_connection_set_deflate         (WebSocketConnection *self,
+                                                           WebSocketDeflateFlags flags);
+
+const gchar *   web_socket_connection_get_extensions      (WebSocketConnection *self);
+
 void            web_socket_connection_send                (WebSocketConnection *self,
                                                            WebSocketDataType type,
                                                            GBytes *prefix,
@@ -41,6 +41,26 @@ gboolean     _web_socket_util_header_contains   (GHashTable *headers,
 gboolean     _web_socket_util_header_empty      (GHashTable *headers,
                                                  const gchar *name);
 
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits;
+  gint client_max_window_bits;
+} WebSocketDeflateParams;
+
+gboolean     _web_socket_util_parse_deflate     (const gchar *extension,
+                                                 WebSocketDeflateParams *params);
+
+typedef void (* WebSocketMaskFunc) (const guint8 *mask,
+                                    guint8 *data,
+                                    gsize len);
+
+WebSocketMaskFunc _web_socket_util_mask_kernel  (const gchar *name);
+
+void         _web_socket_util_mask              (const guint8 *mask,
+                                                 guint8 *data,
+                                                 gsize len);
+
 typedef enum {
   WEB_SOCKET_QUEUE_NORMAL = 0,
   WEB_SOCKET_QUEUE_URGENT = 1 << 0,
@@ -72,6 +92,14 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+const gchar *    _web_socket_connection_negotiate_deflate (WebSocketConnection *self,
+                                                           const gchar *offers);
+
+const gchar *    _web_socket_connection_offer_deflate     (WebSocketConnection *self);
+
+gboolean         _web_socket_connection_accept_deflate    (WebSocketConnection *self,
+                                                           const gchar *response);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
 G_END_DECLS
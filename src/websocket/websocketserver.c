@@ -141,6 +141,7 @@ respond_handshake_rfc6455 (WebSocketServer *self,
                            WebSocketConnection *conn,
                            GHashTable *headers)
 {
+  const gchar *extensions;
   const gchar *protocol;
   const gchar *origin;
   const gchar *host;
@@ -221,6 +222,10 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = _web_socket_connection_negotiate_deflate (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"));
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
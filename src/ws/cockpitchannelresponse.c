@@ -20,10 +20,12 @@
 #include "config.h"
 
 #include "cockpitchannelresponse.h"
+#include "cockpitpackagecache.h"
 
 #include "common/cockpitchannel.h"
 #include "common/cockpitconf.h"
 #include "common/cockpitflow.h"
+#include "common/cockpitwebcompress.h"
 #include "common/cockpitwebinject.h"
 #include "common/cockpitwebserver.h"
 #include "common/cockpitwebresponse.h"
@@ -77,18 +79,35 @@ cockpit_channel_inject_update_checksum (CockpitChannelInject *inject,
   g_hash_table_remove (headers, COCKPIT_CHECKSUM_HEADER);
 }
 
-static void
+static gboolean
 cockpit_channel_inject_perform (CockpitChannelInject *inject,
                                 CockpitWebResponse *response,
-                                CockpitTransport *transport)
+                                GHashTable *headers)
 {
   static const gchar *marker = "<head>";
   g_autofree gchar *prefixed_application = NULL;
+  gboolean decompressed = FALSE;
 
   const gchar *url_root = cockpit_web_response_get_url_root (response);
 
   if (!url_root && !inject->base_path)
-    return;
+    return FALSE;
+
+  /*
+   * The marker can only be found in the uncompressed HTML.  Content
+   * compressed by the bridge goes through a decompressing filter
+   * first, and gets compressed again by the caller if the client
+   * wants that.
+   */
+  const gchar *content_type = g_hash_table_lookup (headers, "Content-Type");
+  if (g_strcmp0 (g_hash_table_lookup (headers, "Content-Encoding"), "gzip") == 0 &&
+      content_type && g_str_has_prefix (content_type, "text/html"))
+    {
+      g_autoptr(CockpitWebFilter) decompress = cockpit_web_decompress_new ();
+      cockpit_web_response_add_filter (response, decompress);
+      g_hash_table_remove (headers, "Content-Encoding");
+      decompressed = TRUE;
+    }
 
   g_autoptr(GString) str = g_string_new ("");
   CockpitCreds *creds = cockpit_web_service_get_creds (inject->service);
@@ -130,6 +149,7 @@ cockpit_channel_inject_perform (CockpitChannelInject *inject,
   g_autoptr(GBytes) content = g_string_free_to_bytes (g_steal_pointer(&str));
   g_autoptr(CockpitWebFilter) filter = cockpit_web_inject_new (marker, content, 1);
   cockpit_web_response_add_filter (response, filter);
+  return decompressed;
 }
 
 #define COCKPIT_TYPE_CHANNEL_RESPONSE  (cockpit_channel_response_get_type ())
@@ -149,6 +169,19 @@ typedef struct {
 
   /* Set when injecting data into response */
   CockpitChannelInject *inject;
+
+  /* The byte range requested from fsread1, or -1 */
+  gint64 range_first;
+  gint64 range_last;
+
+  /* An open ended range without a size-hint, until its end is known */
+  GQueue range_pending;
+  gsize range_pending_size;
+
+  /* Set while collecting a package file for the package cache */
+  gchar *cache_key;
+  GHashTable *cache_headers;
+  GByteArray *cache_body;
 } CockpitChannelResponse;
 
 typedef struct {
@@ -162,7 +195,16 @@ G_DEFINE_TYPE (CockpitChannelResponse, cockpit_channel_response, COCKPIT_TYPE_CH
 static void
 cockpit_channel_response_init (CockpitChannelResponse *self)
 {
+  self->range_first = -1;
+  self->range_last = -1;
+}
 
+static void
+clear_range_pending (CockpitChannelResponse *self)
+{
+  g_queue_foreach (&self->range_pending, (GFunc)g_bytes_unref, NULL);
+  g_queue_clear (&self->range_pending);
+  self->range_pending_size = 0;
 }
 
 static void
@@ -173,24 +215,114 @@ cockpit_channel_response_finalize (GObject *object)
   g_object_unref (self->response);
   g_hash_table_unref (self->headers);
   cockpit_channel_inject_free (self->inject);
+  g_free (self->cache_key);
+  if (self->cache_headers)
+    g_hash_table_unref (self->cache_headers);
+  if (self->cache_body)
+    g_byte_array_unref (self->cache_body);
+  clear_range_pending (self);
 
   G_OBJECT_CLASS (cockpit_channel_response_parent_class)->finalize (object);
 }
 
+static GHashTable *
+copy_headers (GHashTable *headers)
+{
+  GHashTable *copy = cockpit_web_server_new_table ();
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, headers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (copy, g_strdup (key), g_strdup (value));
+
+  return copy;
+}
+
+static void
+cache_stop (CockpitChannelResponse *self)
+{
+  g_clear_pointer (&self->cache_key, g_free);
+  g_clear_pointer (&self->cache_headers, g_hash_table_unref);
+  g_clear_pointer (&self->cache_body, g_byte_array_unref);
+}
+
+static void
+cache_start (CockpitChannelResponse *self,
+             guint status)
+{
+  if (!self->cache_key)
+    return;
+
+  /* Only complete successful responses are worth keeping */
+  if (status != 200)
+    {
+      cache_stop (self);
+      return;
+    }
+
+  self->cache_headers = copy_headers (self->headers);
+  self->cache_body = g_byte_array_new ();
+}
+
+static void
+cache_append (CockpitChannelResponse *self,
+              GBytes *payload)
+{
+  gsize size;
+
+  if (!self->cache_body)
+    return;
+
+  size = g_bytes_get_size (payload);
+  if (self->cache_body->len + size > cockpit_package_cache_get_limit ())
+    {
+      g_debug ("%s: too large for the package cache", self->logname);
+      cache_stop (self);
+      return;
+    }
+
+  g_byte_array_append (self->cache_body, g_bytes_get_data (payload, NULL), size);
+}
+
+static void
+cache_finish (CockpitChannelResponse *self)
+{
+  g_autoptr(GBytes) body = NULL;
+
+  if (!self->cache_body)
+    return;
+
+  body = g_byte_array_free_to_bytes (g_steal_pointer (&self->cache_body));
+  cockpit_package_cache_insert (self->cache_key, self->cache_headers, body);
+  cache_stop (self);
+}
+
 static gboolean
 ensure_headers (CockpitChannelResponse *self,
                 guint status,
                 const gchar *reason,
-                gsize length)
+                gssize length)
 {
 
   if (cockpit_web_response_get_state (self->response) == COCKPIT_WEB_RESPONSE_READY)
     {
+      if (self->inject && self->inject->service)
+        cockpit_channel_inject_update_checksum (self->inject, self->headers);
+
+      /* The cache keeps the content as the bridge sent it */
+      cache_start (self, status);
+
       if (self->inject && self->inject->service)
         {
-          cockpit_channel_inject_update_checksum (self->inject, self->headers);
-          cockpit_channel_inject_perform (self->inject, self->response,
-                                          cockpit_channel_get_transport (COCKPIT_CHANNEL (self)));
+          /* The length of the decompressed content isn't known */
+          if (cockpit_channel_inject_perform (self->inject, self->response, self->headers))
+            length = -1;
+        }
+      if (!g_hash_table_contains (self->headers, "Content-Encoding"))
+        {
+          cockpit_web_response_compress (self->response, status,
+                                         g_hash_table_lookup (self->headers, "Content-Type"), length);
         }
       cockpit_web_response_headers_full (self->response, status, reason, length, self->headers);
       return TRUE;
@@ -199,6 +331,80 @@ ensure_headers (CockpitChannelResponse *self,
   return FALSE;
 }
 
+static void
+ensure_range_headers (CockpitChannelResponse *self,
+                      gint64 size)
+{
+  gint64 last = self->range_last;
+  gchar *content_range;
+
+  if (cockpit_web_response_get_state (self->response) != COCKPIT_WEB_RESPONSE_READY)
+    return;
+
+  /* Without a size we can only describe a range with a known end */
+  if ((size >= 0 && self->range_first >= size) || (size < 0 && last < 0))
+    {
+      if (size >= 0)
+        {
+          content_range = g_strdup_printf ("bytes */%" G_GINT64_FORMAT, size);
+          g_hash_table_replace (self->headers, g_strdup ("Content-Range"), content_range);
+        }
+      g_hash_table_remove (self->headers, "Content-Encoding");
+      ensure_headers (self, 416, "Range Not Satisfiable", 0);
+      cockpit_web_response_complete (self->response);
+
+      /* Nothing more that the bridge sends can be used */
+      cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
+      return;
+    }
+
+  if (size >= 0)
+    {
+      if (last < 0 || last >= size)
+        last = size - 1;
+      content_range = g_strdup_printf ("bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "/%" G_GINT64_FORMAT,
+                                       self->range_first, last, size);
+    }
+  else
+    {
+      content_range = g_strdup_printf ("bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT "/*",
+                                       self->range_first, last);
+    }
+
+  g_hash_table_replace (self->headers, g_strdup ("Content-Range"), content_range);
+  ensure_headers (self, 206, "Partial Content", last - self->range_first + 1);
+}
+
+/*
+ * Files without a size-hint, such as those in /proc, are usually small:
+ * so for an open ended range of one, hold back the data until the bridge
+ * is done, and then describe what it sent. Block devices have no size-hint
+ * either, so don't hold back more than this.
+ */
+#define RANGE_PENDING_MAX (1024 * 1024)
+
+static void
+flush_range_pending (CockpitChannelResponse *self)
+{
+  gsize length = self->range_pending_size;
+  GBytes *bytes;
+
+  self->range_pending_size = 0;
+  if (cockpit_web_response_get_state (self->response) == COCKPIT_WEB_RESPONSE_READY)
+    {
+      if (self->range_last < 0 && length > 0)
+        self->range_last = self->range_first + length - 1;
+      ensure_range_headers (self, -1);
+    }
+
+  while ((bytes = g_queue_pop_head (&self->range_pending)))
+    {
+      if (cockpit_web_response_get_state (self->response) < COCKPIT_WEB_RESPONSE_COMPLETE)
+        cockpit_web_response_queue (self->response, bytes);
+      g_bytes_unref (bytes);
+    }
+}
+
 static void
 cockpit_channel_response_close (CockpitChannel *channel,
                                 const gchar *problem)
@@ -206,6 +412,10 @@ cockpit_channel_response_close (CockpitChannel *channel,
   CockpitChannelResponse *self = COCKPIT_CHANNEL_RESPONSE (channel);
   CockpitWebResponding state;
 
+  /* Data held back for a range, but no "done": truncated, see below */
+  if (problem == NULL && self->range_pending.length > 0)
+    flush_range_pending (self);
+
   /* The web response should not yet be complete */
   state = cockpit_web_response_get_state (self->response);
 
@@ -385,8 +595,39 @@ cockpit_channel_response_recv (CockpitChannel *channel,
       return;
     }
 
-  ensure_headers (self, 200, "OK", -1);
-  cockpit_web_response_queue (self->response, payload);
+  /* Already answered, for example a range that couldn't be satisfied */
+  if (cockpit_web_response_get_state (self->response) >= COCKPIT_WEB_RESPONSE_COMPLETE)
+    return;
+
+  if (self->range_first >= 0)
+    {
+      /* Without a size-hint, where this range ends is only known at the end */
+      if (self->range_last < 0 &&
+          cockpit_web_response_get_state (self->response) == COCKPIT_WEB_RESPONSE_READY)
+        {
+          self->range_pending_size += g_bytes_get_size (payload);
+          if (self->range_pending_size > RANGE_PENDING_MAX)
+            {
+              /* Too much to describe after the fact, the range can't be satisfied */
+              g_debug ("%s: too much data for a range without a size", self->logname);
+              clear_range_pending (self);
+              ensure_range_headers (self, -1);
+              return;
+            }
+          g_queue_push_tail (&self->range_pending, g_bytes_ref (payload));
+          return;
+        }
+      ensure_range_headers (self, -1);
+    }
+  else
+    {
+      ensure_headers (self, 200, "OK", -1);
+    }
+  if (cockpit_web_response_get_state (self->response) < COCKPIT_WEB_RESPONSE_COMPLETE)
+    {
+      cache_append (self, payload);
+      cockpit_web_response_queue (self->response, payload);
+    }
 }
 
 static gboolean
@@ -420,15 +661,29 @@ cockpit_channel_response_control (CockpitChannel *channel,
     {
       gint64 content_length;
       if (cockpit_json_get_int (options, "size-hint", -1, &content_length) && content_length != -1)
-        ensure_headers (self, 200, "OK", content_length);
+        {
+          /* The size-hint is that of the whole file */
+          if (self->range_first >= 0)
+            ensure_range_headers (self, content_length);
+          else
+            ensure_headers (self, 200, "OK", content_length);
+        }
 
       return TRUE;
     }
 
   if (g_str_equal (command, "done"))
     {
-      ensure_headers (self, 200, "OK", 0);
+      if (cockpit_web_response_get_state (self->response) >= COCKPIT_WEB_RESPONSE_COMPLETE)
+        return TRUE;
+      if (self->range_first >= 0)
+        flush_range_pending (self);
+      else
+        ensure_headers (self, 200, "OK", 0);
+      if (cockpit_web_response_get_state (self->response) >= COCKPIT_WEB_RESPONSE_COMPLETE)
+        return TRUE;
       cockpit_web_response_complete (self->response);
+      cache_finish (self);
       return TRUE;
     }
 
@@ -576,6 +831,76 @@ parse_host_and_etag (CockpitWebService *service,
   return TRUE;
 }
 
+static gchar *
+build_cache_key (CockpitWebService *service,
+                 GHashTable *in_headers,
+                 CockpitWebResponse *response,
+                 const gchar *host,
+                 const gchar *quoted_etag,
+                 const gchar *path)
+{
+  g_auto(GStrv) encodings = NULL;
+  g_autofree gchar *accepted = NULL;
+  const gchar *http_host;
+  const gchar *user = "";
+
+  /* Only content with a checksum is the same for everyone */
+  if (!quoted_etag || cockpit_package_cache_get_limit () == 0)
+    return NULL;
+
+  /* Partial content isn't worth keeping */
+  if (g_hash_table_lookup (in_headers, "Range"))
+    return NULL;
+
+  /*
+   * The ETag contains the checksum and the language.  The bridge might
+   * pick a precompressed file, and the Content-Security-Policy that it
+   * sends for HTML depends on the scheme and host.
+   */
+  encodings = cockpit_web_server_parse_accept_encoding (g_hash_table_lookup (in_headers, "Accept-Encoding"),
+                                                        cockpit_web_response_encodings);
+  accepted = g_strjoinv (",", encodings);
+  http_host = g_hash_table_lookup (in_headers, "Host");
+
+  /*
+   * The checksum is whatever a bridge claims, so content is only shared
+   * between bridges we trust alike: the local ones, or the connections
+   * of one user to a given remote host.
+   */
+  if (!g_str_equal (host, "localhost"))
+    user = cockpit_creds_get_user (cockpit_web_service_get_creds (service));
+
+  return g_strdup_printf ("%s\n%s\n%s\n%s\n%s\n%s\n%s", quoted_etag, path, accepted,
+                          cockpit_web_response_get_protocol (response),
+                          http_host ? http_host : "localhost",
+                          host, user ? user : "");
+}
+
+static void
+send_cached_response (CockpitWebService *service,
+                      CockpitWebResponse *response,
+                      const gchar *host,
+                      GHashTable *cached_headers,
+                      GBytes *body)
+{
+  /* The cached headers are shared, and injecting might change them */
+  g_autoptr(GHashTable) headers = copy_headers (cached_headers);
+  CockpitChannelInject *inject;
+  gssize length = g_bytes_get_size (body);
+
+  /* Do what ensure_headers() does for a response from the bridge */
+  inject = cockpit_channel_inject_new (service, NULL, host);
+  if (cockpit_channel_inject_perform (inject, response, headers))
+    length = -1;
+  cockpit_channel_inject_free (inject);
+
+  if (!g_hash_table_contains (headers, "Content-Encoding"))
+    cockpit_web_response_compress (response, 200, g_hash_table_lookup (headers, "Content-Type"), length);
+  cockpit_web_response_headers_full (response, 200, "OK", length, headers);
+  if (cockpit_web_response_queue (response, body))
+    cockpit_web_response_complete (response);
+}
+
 void
 cockpit_channel_response_serve (CockpitWebService *service,
                                 GHashTable *in_headers,
@@ -588,8 +913,9 @@ cockpit_channel_response_serve (CockpitWebService *service,
   CockpitCacheType cache_type = COCKPIT_WEB_RESPONSE_CACHE;
   const gchar *injecting_base_path = NULL;
   const gchar *host = NULL;
-  const gchar *pragma;
+  const gchar *pragma = NULL;
   gchar *quoted_etag = NULL;
+  gchar *cache_key = NULL;
   GHashTable *out_headers = NULL;
   gchar *val = NULL;
   gboolean handled = FALSE;
@@ -616,7 +942,8 @@ cockpit_channel_response_serve (CockpitWebService *service,
 
   if (quoted_etag)
     {
-      cache_type = COCKPIT_WEB_RESPONSE_CACHE;
+      /* The checksum changes whenever the package does */
+      cache_type = COCKPIT_WEB_RESPONSE_CACHE_IMMUTABLE;
       pragma = g_hash_table_lookup (in_headers, "Pragma");
 
       if ((!pragma || !strstr (pragma, "no-cache")) &&
@@ -630,6 +957,22 @@ cockpit_channel_response_serve (CockpitWebService *service,
     }
 
   cockpit_web_response_set_cache_type (response, cache_type);
+
+  /* Another session might have loaded this already */
+  cache_key = build_cache_key (service, in_headers, response, host, quoted_etag, path);
+  if (cache_key && (!pragma || !strstr (pragma, "no-cache")))
+    {
+      g_autoptr(GHashTable) cached_headers = NULL;
+      g_autoptr(GBytes) cached_body = cockpit_package_cache_lookup (cache_key, &cached_headers);
+      if (cached_body)
+        {
+          g_debug ("%s: serving from the package cache", path);
+          send_cached_response (service, response, host, cached_headers, cached_body);
+          handled = TRUE;
+          goto out;
+        }
+    }
+
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
@@ -678,6 +1021,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
           g_ascii_strcasecmp (key, "Content-MD5") == 0 ||
           g_ascii_strcasecmp (key, "Content-Range") == 0 ||
           g_ascii_strcasecmp (key, "Range") == 0 ||
+          g_ascii_strcasecmp (key, "If-Range") == 0 ||
           g_ascii_strcasecmp (key, "TE") == 0 ||
           g_ascii_strcasecmp (key, "Trailer") == 0 ||
           g_ascii_strcasecmp (key, "Upgrade") == 0 ||
@@ -706,8 +1050,22 @@ cockpit_channel_response_serve (CockpitWebService *service,
   injecting_base_path = where ? NULL : path;
   if (injecting_base_path)
     {
-      /* If we are injecting a <base> element, then we don't allow gzip compression */
-      json_object_set_string_member (heads, "Accept-Encoding", "identity");
+      /*
+       * We can inject a <base> element into gzip content, but not into
+       * other codings.  Ask for gzip only if the client takes it anyway.
+       */
+      const gchar *gzip[] = { "gzip", NULL };
+      const gchar *accept = g_hash_table_lookup (in_headers, "Accept-Encoding");
+      g_auto(GStrv) accepted = cockpit_web_server_parse_accept_encoding (accept, gzip);
+      json_object_set_string_member (heads, "Accept-Encoding", accept && accepted[0] ? "gzip" : "identity");
+    }
+  else
+    {
+      /* The bridge doesn't know our ETag, so check If-Range here */
+      const gchar *range = g_hash_table_lookup (in_headers, "Range");
+      const gchar *if_range = g_hash_table_lookup (in_headers, "If-Range");
+      if (range && (!if_range || g_strcmp0 (if_range, g_hash_table_lookup (out_headers, "ETag")) == 0))
+        json_object_set_string_member (heads, "Range", range);
     }
 
   json_object_set_object_member (object, "headers", heads);
@@ -716,6 +1074,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
                                        out_headers, object);
 
   self->inject = cockpit_channel_inject_new (service, injecting_base_path, host);
+  self->cache_key = g_steal_pointer (&cache_key);
   handled = TRUE;
 
   /* Unref when the channel closes */
@@ -725,6 +1084,7 @@ out:
   if (object)
     json_object_unref (object);
   g_free (quoted_etag);
+  g_free (cache_key);
   if (out_headers)
     g_hash_table_unref (out_headers);
   g_free (channel);
@@ -789,9 +1149,36 @@ cockpit_channel_response_open (CockpitWebService *service,
   /* We shouldn't need to send this part further */
   json_object_remove_member (open, "external");
 
+  /*
+   * A single range of a file can be read by the bridge directly. There's
+   * no ETag for these responses, so any If-Range gets the whole file.
+   */
+  const gchar *range = cockpit_web_request_lookup_header (request, "Range");
+  const gchar *payload = NULL;
+  const gchar *binary = NULL;
+  gint64 range_first = -1;
+  gint64 range_last = -1;
+  if (range && !cockpit_web_request_lookup_header (request, "If-Range") &&
+      g_str_equal (cockpit_web_request_get_method (request), "GET") &&
+      cockpit_json_get_string (open, "payload", NULL, &payload) && g_strcmp0 (payload, "fsread1") == 0 &&
+      cockpit_json_get_string (open, "binary", NULL, &binary) && g_strcmp0 (binary, "raw") == 0 &&
+      cockpit_web_server_parse_range (range, &range_first, &range_last) && range_first >= 0)
+    {
+      json_object_set_int_member (open, "offset", range_first);
+      if (range_last >= 0)
+        json_object_set_int_member (open, "length", range_last - range_first + 1);
+    }
+  else
+    {
+      range_first = range_last = -1;
+    }
+
   self = cockpit_channel_response_new (service, response, transport, headers, open);
   g_hash_table_unref (headers);
 
+  self->range_first = range_first;
+  self->range_last = range_last;
+
   /* Unref when the channel closes */
   g_signal_connect_after (self, "closed", G_CALLBACK (g_object_unref), NULL);
 }
@@ -29,8 +29,9 @@
 
 #include "common/cockpitconf.h"
 #include "common/cockpitjson.h"
+#include "common/cockpittemplate.h"
+#include "common/cockpitwebcache.h"
 #include "common/cockpitwebcertificate.h"
-#include "common/cockpitwebinject.h"
 
 #include "websocket/websocket.h"
 
@@ -399,22 +400,71 @@ build_environment (GHashTable *os_release, CockpitAuth *auth, GHashTable *reques
   return g_byte_array_free_to_bytes (buffer);
 }
 
+static const gchar *login_marker = "<meta insert=\"dynamic_content_here\" />";
+static const gchar *login_po_marker = "/*insert_translations_here*/";
+
+typedef struct {
+  GBytes *dynamic;
+  GBytes *po;
+} LoginValues;
+
+static GBytes *
+substitute_login_value (const gchar *variable,
+                        gpointer user_data)
+{
+  LoginValues *values = user_data;
+
+  if (g_str_equal (variable, login_marker))
+    return g_bytes_ref (values->dynamic);
+  else if (values->po && g_str_equal (variable, login_po_marker))
+    return g_bytes_ref (values->po);
+  else
+    return NULL;
+}
+
+static CockpitTemplate *
+load_login_template (const gchar *path,
+                     GError **error)
+{
+  const gchar *markers[] = { login_marker, login_po_marker, NULL };
+  g_autoptr(CockpitWebCacheEntry) entry = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  GError *local_error = NULL;
+
+  /* Usually login.html itself is there, and gets compiled only once */
+  entry = cockpit_web_cache_lookup (path, &local_error);
+  if (entry)
+    return cockpit_web_cache_entry_get_injection (entry, markers);
+
+  if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    {
+      g_propagate_error (error, local_error);
+      return NULL;
+    }
+
+  g_clear_error (&local_error);
+
+  /* Otherwise look for a minified or compressed variant */
+  bytes = cockpit_web_response_negotiation (path, NULL, NULL, NULL, NULL, error);
+  if (!bytes)
+    return NULL;
+
+  return cockpit_template_compile_markers (bytes, markers);
+}
+
 static void
 send_login_html (CockpitWebResponse *response,
                  CockpitHandlerData *ws,
                  const gchar *path,
                  GHashTable *headers)
 {
-  static const gchar *marker = "<meta insert=\"dynamic_content_here\" />";
-  static const gchar *po_marker = "/*insert_translations_here*/";
-
-  CockpitWebFilter *filter;
+  LoginValues values = { NULL, NULL };
+  CockpitTemplate *template;
   GBytes *environment;
   GError *error = NULL;
   GBytes *bytes;
+  GByteArray *dynamic;
 
-  GBytes *url_bytes = NULL;
-  CockpitWebFilter *filter2 = NULL;
   const gchar *url_root = NULL;
   const gchar *accept = NULL;
   gchar *content_security_policy = NULL;
@@ -423,26 +473,19 @@ send_login_html (CockpitWebResponse *response,
 
   gchar *language = NULL;
   gchar **languages = NULL;
-  GBytes *po_bytes;
-  CockpitWebFilter *filter3 = NULL;
-
-  environment = build_environment (ws->os_release, ws->auth, headers);
-  filter = cockpit_web_inject_new (marker, environment, 1);
-  g_bytes_unref (environment);
-  cockpit_web_response_add_filter (response, filter);
-  g_object_unref (filter);
 
+  /* The <base> goes right after the marker, followed by the environment */
   url_root = cockpit_web_response_get_url_root (response);
   if (url_root)
     base = g_strdup_printf ("<base href=\"%s/\">", url_root);
   else
     base = g_strdup ("<base href=\"/\">");
 
-  url_bytes = g_bytes_new_take (base, strlen(base));
-  filter2 = cockpit_web_inject_new (marker, url_bytes, 1);
-  g_bytes_unref (url_bytes);
-  cockpit_web_response_add_filter (response, filter2);
-  g_object_unref (filter2);
+  environment = build_environment (ws->os_release, ws->auth, headers);
+  dynamic = g_bytes_unref_to_array (environment);
+  g_byte_array_prepend (dynamic, (const guint8 *)base, strlen (base));
+  values.dynamic = g_byte_array_free_to_bytes (dynamic);
+  g_free (base);
 
   cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
 
@@ -456,41 +499,38 @@ send_login_html (CockpitWebResponse *response,
           language = languages[0];
         }
 
-      po_bytes = cockpit_web_response_negotiation (ws->login_po_js, NULL, language, NULL, NULL, &error);
+      values.po = cockpit_web_response_negotiation (ws->login_po_js, NULL, language, NULL, NULL, &error);
       if (error)
         {
           g_message ("%s", error->message);
           g_clear_error (&error);
         }
-      else if (po_bytes)
-        {
-          filter3 = cockpit_web_inject_new (po_marker, po_bytes, 1);
-          g_bytes_unref (po_bytes);
-          cockpit_web_response_add_filter (response, filter3);
-          g_object_unref (filter3);
-        }
     }
 
-  bytes = cockpit_web_response_negotiation (ws->login_html, NULL, NULL, NULL, NULL, &error);
+  template = load_login_template (ws->login_html, &error);
   if (error)
     {
       g_message ("%s", error->message);
       cockpit_web_response_error (response, 500, NULL, NULL);
       g_error_free (error);
     }
-  else if (!bytes)
+  else if (!template)
     {
       cockpit_web_response_error (response, 404, NULL, NULL);
     }
   else
     {
+      /* Expanded into a single block with a known length */
+      bytes = cockpit_template_render_bytes (template, substitute_login_value, &values);
+      cockpit_template_unref (template);
+
       /* The login Content-Security-Policy allows the page to have inline <script> and <style> tags. */
       gboolean secure = g_strcmp0 (cockpit_web_response_get_protocol (response), "https") == 0;
       cookie_line = cockpit_auth_empty_cookie_value (path, secure);
       content_security_policy = cockpit_web_response_security_policy ("default-src 'self' 'unsafe-inline'",
                                                                       cockpit_web_response_get_origin (response));
 
-      cockpit_web_response_headers (response, 200, "OK", -1,
+      cockpit_web_response_headers (response, 200, "OK", g_bytes_get_size (bytes),
                                     "Content-Type", "text/html",
                                     "Content-Security-Policy", content_security_policy,
                                     "Set-Cookie", cookie_line,
@@ -502,6 +542,9 @@ send_login_html (CockpitWebResponse *response,
       g_bytes_unref (bytes);
     }
 
+  if (values.po)
+    g_bytes_unref (values.po);
+  g_bytes_unref (values.dynamic);
   g_free (cookie_line);
   g_free (content_security_policy);
   g_strfreev (languages);
@@ -725,6 +768,7 @@ cockpit_handler_root (CockpitWebServer *server,
                       CockpitHandlerData *ws)
 {
   /* Don't cache forever */
+  cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_CACHE_REVALIDATE);
   cockpit_web_response_file (response, path, ws->branding_roots);
   return TRUE;
 }
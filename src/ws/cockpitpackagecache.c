@@ -0,0 +1,214 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitpackagecache.h"
+
+#include <string.h>
+
+/**
+ * CockpitPackageCache
+ *
+ * A process-wide cache of package files served by the bridges.  URLs
+ * with a package checksum (like /cockpit/$abc123/system/index.js)
+ * describe content that never changes, so once one session has
+ * loaded such a file, every other session with the same checksum can
+ * get it from here without a round trip through its bridge.
+ *
+ * The caller builds the key: it needs to contain everything that the
+ * response depends on, like the checksum, the path, the language and
+ * the accepted content codings.  The total size is bounded by
+ * cockpit_package_cache_set_limit(), and the least recently used
+ * entries get evicted first.  The limit starts out as 0, which
+ * disables the cache.
+ *
+ * This is not thread-safe; only use it from the main thread.
+ */
+
+typedef struct {
+  gchar *key;
+  GHashTable *headers;
+  GBytes *body;
+  GList link;
+  gsize cost;
+} CacheEntry;
+
+static struct {
+  gsize limit;
+  gsize size;
+  GHashTable *entries;      /* key → CacheEntry */
+  GQueue lru;               /* most recently used first */
+} cache;
+
+static gsize
+header_cost (GHashTable *headers)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  gsize cost = 0;
+
+  g_hash_table_iter_init (&iter, headers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    cost += strlen (key) + strlen (value) + 2;
+
+  return cost;
+}
+
+static void
+cache_remove (CacheEntry *entry)
+{
+  g_hash_table_remove (cache.entries, entry->key);
+  g_queue_unlink (&cache.lru, &entry->link);
+  cache.size -= entry->cost;
+
+  g_hash_table_unref (entry->headers);
+  g_bytes_unref (entry->body);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+cache_evict (void)
+{
+  while (cache.size > cache.limit && cache.lru.tail)
+    cache_remove (cache.lru.tail->data);
+}
+
+/**
+ * cockpit_package_cache_set_limit:
+ * @limit: maximum size of the cache in bytes, or 0 to disable it
+ *
+ * Entries over the new limit are evicted right away.
+ */
+void
+cockpit_package_cache_set_limit (gsize limit)
+{
+  cache.limit = limit;
+  cache_evict ();
+}
+
+gsize
+cockpit_package_cache_get_limit (void)
+{
+  return cache.limit;
+}
+
+/**
+ * cockpit_package_cache_get_size:
+ *
+ * Returns: the number of bytes that the cached entries take up
+ */
+gsize
+cockpit_package_cache_get_size (void)
+{
+  return cache.size;
+}
+
+/**
+ * cockpit_package_cache_flush:
+ *
+ * Drop all cached entries.
+ */
+void
+cockpit_package_cache_flush (void)
+{
+  while (cache.lru.head)
+    cache_remove (cache.lru.head->data);
+}
+
+/**
+ * cockpit_package_cache_lookup:
+ * @key: the key that the response was inserted with
+ * @headers: location to return the response headers
+ *
+ * The @headers must not be modified.
+ *
+ * Returns: (transfer full): the response body, or %NULL if not cached
+ */
+GBytes *
+cockpit_package_cache_lookup (const gchar *key,
+                              GHashTable **headers)
+{
+  CacheEntry *entry;
+
+  g_return_val_if_fail (key != NULL, NULL);
+  g_return_val_if_fail (headers != NULL, NULL);
+
+  if (cache.entries == NULL)
+    return NULL;
+
+  entry = g_hash_table_lookup (cache.entries, key);
+  if (entry == NULL)
+    return NULL;
+
+  g_queue_unlink (&cache.lru, &entry->link);
+  g_queue_push_head_link (&cache.lru, &entry->link);
+
+  *headers = g_hash_table_ref (entry->headers);
+  return g_bytes_ref (entry->body);
+}
+
+/**
+ * cockpit_package_cache_insert:
+ * @key: describes the request
+ * @headers: the headers of a 200 OK response
+ * @body: the complete response body
+ *
+ * Remember a response.  Both @headers and @body are referenced,
+ * and must not be modified afterwards.  Responses which are larger
+ * than the whole cache are ignored.
+ */
+void
+cockpit_package_cache_insert (const gchar *key,
+                              GHashTable *headers,
+                              GBytes *body)
+{
+  CacheEntry *entry;
+  gsize cost;
+
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (headers != NULL);
+  g_return_if_fail (body != NULL);
+
+  cost = sizeof (CacheEntry) + strlen (key) + header_cost (headers) + g_bytes_get_size (body);
+  if (cost > cache.limit)
+    return;
+
+  if (cache.entries == NULL)
+    cache.entries = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* Two sessions loaded the same file at the same time */
+  entry = g_hash_table_lookup (cache.entries, key);
+  if (entry)
+    cache_remove (entry);
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->key = g_strdup (key);
+  entry->headers = g_hash_table_ref (headers);
+  entry->body = g_bytes_ref (body);
+  entry->link.data = entry;
+  entry->cost = cost;
+
+  g_hash_table_insert (cache.entries, entry->key, entry);
+  g_queue_push_head_link (&cache.lru, &entry->link);
+  cache.size += cost;
+
+  cache_evict ();
+}
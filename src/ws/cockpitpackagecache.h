@@ -0,0 +1,44 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_PACKAGE_CACHE_H__
+#define COCKPIT_PACKAGE_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void           cockpit_package_cache_set_limit      (gsize limit);
+
+gsize          cockpit_package_cache_get_limit      (void);
+
+gsize          cockpit_package_cache_get_size       (void);
+
+void           cockpit_package_cache_flush          (void);
+
+GBytes *       cockpit_package_cache_lookup         (const gchar *key,
+                                                     GHashTable **headers);
+
+void           cockpit_package_cache_insert         (const gchar *key,
+                                                     GHashTable *headers,
+                                                     GBytes *body);
+
+G_END_DECLS
+
+#endif /* COCKPIT_PACKAGE_CACHE_H__ */
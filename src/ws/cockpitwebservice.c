@@ -1295,6 +1295,7 @@ cockpit_web_service_create_socket (const gchar **protocols,
                                    CockpitWebRequest *request)
 {
   WebSocketConnection *connection;
+  WebSocketDeflateFlags deflate;
   const gchar * const *origins;
   gchar *allocated = NULL;
   gchar *origin = NULL;
@@ -1325,6 +1326,15 @@ cockpit_web_service_create_socket (const gchar **protocols,
                                                  cockpit_web_request_get_io_stream (request),
                                                  cockpit_web_request_get_headers (request),
                                                  cockpit_web_request_get_buffer (request));
+
+  if (cockpit_conf_bool ("WebService", "WebSocketCompression", TRUE))
+    {
+      deflate = WEB_SOCKET_DEFLATE_ENABLED;
+      if (!cockpit_conf_bool ("WebService", "WebSocketContextTakeover", TRUE))
+        deflate |= WEB_SOCKET_DEFLATE_NO_CONTEXT_TAKEOVER;
+      web_socket_connection_set_deflate (connection, deflate);
+    }
+
   g_free (allocated);
   g_free (url);
   g_free (origin);
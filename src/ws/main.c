@@ -32,11 +32,14 @@
 
 #include "cockpithandlers.h"
 #include "cockpitbranding.h"
+#include "cockpitpackagecache.h"
 
 #include "common/cockpitconf.h"
 #include "common/cockpithacks-glib.h"
 #include "common/cockpitmemory.h"
 #include "common/cockpitsystem.h"
+#include "common/cockpitwebcache.h"
+#include "common/cockpitwebcompress.h"
 #include "common/cockpitwebcertificate.h"
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -183,6 +186,13 @@ main (int argc,
 
   loop = g_main_loop_new (NULL, FALSE);
 
+  /* in MiB */
+  cockpit_web_cache_set_limit ((gsize) cockpit_conf_uint ("WebService", "StaticCacheSize", 16, 1024, 0) << 20);
+  cockpit_package_cache_set_limit ((gsize) cockpit_conf_uint ("WebService", "PackageCacheSize", 16, 1024, 0) << 20);
+  cockpit_web_compress_set_level (cockpit_conf_uint ("WebService", "CompressionLevel", 6, 9, 0));
+  cockpit_web_compress_set_minimum (cockpit_conf_uint ("WebService", "CompressionMinSize",
+                                                       COCKPIT_WEB_COMPRESS_DEFAULT_MINIMUM, G_MAXINT, 0));
+
   data.os_release = cockpit_system_load_os_release ();
   data.auth = cockpit_auth_new (opt_local_ssh, opt_for_tls_proxy ? COCKPIT_AUTH_FOR_TLS_PROXY : COCKPIT_AUTH_NONE);
   roots = setup_static_roots (data.os_release);
@@ -200,6 +210,8 @@ main (int argc,
       if (!opt_no_tls)
         server_flags |= COCKPIT_WEB_SERVER_REDIRECT_TLS;
     }
+  if (cockpit_conf_bool ("WebService", "ReusePort", FALSE))
+    server_flags |= COCKPIT_WEB_SERVER_REUSE_PORT;
 
   server = cockpit_web_server_new (certificate, server_flags);
 
@@ -306,6 +318,7 @@ out:
     g_hash_table_unref (data.os_release);
   g_free (opt_address);
   g_free (opt_local_session);
+  cockpit_web_cache_flush ();
   cockpit_conf_cleanup ();
   return ret;
 }
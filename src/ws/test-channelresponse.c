@@ -0,0 +1,374 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitchannelresponse.h"
+#include "cockpitpackagecache.h"
+
+#include "common/cockpitwebrequest-private.h"
+#include "common/cockpitwebserver.h"
+
+#include "testlib/cockpittest.h"
+#include "testlib/mock-transport.h"
+
+#include <string.h>
+
+#define CHECKSUM "abc123"
+
+typedef struct {
+  MockTransport *transport;
+  CockpitWebService *service;
+} Session;
+
+typedef struct {
+  Session local;
+  Session remote;
+} TestCase;
+
+typedef struct {
+  GOutputStream *output;
+  CockpitWebResponse *response;
+  gboolean done;
+} Served;
+
+static void
+session_init (Session *session,
+              const gchar *user,
+              const gchar *host)
+{
+  CockpitCreds *creds;
+
+  creds = cockpit_creds_new ("cockpit", COCKPIT_CRED_USER, user, NULL);
+  session->transport = mock_transport_new ();
+  session->service = cockpit_web_service_new (creds, COCKPIT_TRANSPORT (session->transport));
+  cockpit_creds_unref (creds);
+
+  /* As if the bridge for the host had reported the checksum */
+  cockpit_web_service_set_host_checksum (session->service, host, CHECKSUM);
+}
+
+static void
+session_clear (Session *session)
+{
+  while (g_main_context_iteration (NULL, FALSE));
+  g_clear_object (&session->service);
+  g_clear_object (&session->transport);
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  cockpit_package_cache_set_limit (1024 * 1024);
+
+  session_init (&tc->local, "user", "localhost");
+
+  /* Another user's session, with a remote host that claims the same checksum */
+  session_init (&tc->remote, "other", "evil.example.com");
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  session_clear (&tc->local);
+  session_clear (&tc->remote);
+
+  cockpit_package_cache_set_limit (0);
+  cockpit_assert_expected ();
+}
+
+static void
+on_response_done (CockpitWebResponse *response,
+                  gboolean reusable,
+                  gpointer user_data)
+{
+  gboolean *done = user_data;
+  *done = TRUE;
+}
+
+static void
+serve (Session *session,
+       Served *served,
+       const gchar *name,
+       const gchar *value)
+{
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autoptr(GInputStream) input = g_memory_input_stream_new ();
+  g_autoptr(GIOStream) io = NULL;
+
+  g_hash_table_insert (headers, g_strdup ("Host"), g_strdup ("cockpit.example.com"));
+  if (name)
+    g_hash_table_insert (headers, g_strdup (name), g_strdup (value));
+
+  served->done = FALSE;
+  served->output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, served->output);
+  served->response = cockpit_web_response_new (io, "/cockpit/$" CHECKSUM "/package/index.js",
+                                               "/package/index.js", headers, "GET", "http");
+  g_signal_connect (served->response, "done", G_CALLBACK (on_response_done), &served->done);
+
+  cockpit_channel_response_serve (session->service, headers, served->response,
+                                  "$" CHECKSUM, "/package/index.js");
+
+  /* Let the channel send its open message */
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+emit_control (Session *session,
+              const gchar *command,
+              const gchar *channel)
+{
+  g_autofree gchar *string = g_strdup_printf ("{ \"command\": \"%s\", \"channel\": \"%s\" }", command, channel);
+  g_autoptr(GBytes) bytes = g_bytes_new (string, strlen (string));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (session->transport), NULL, bytes);
+}
+
+/* Returns whether the request went to the bridge, and answers it if so */
+static gboolean
+reply_from_bridge (Session *session,
+                   const gchar *body)
+{
+  static const gchar *head = "{ \"status\": 200, \"reason\": \"OK\", "
+                             "\"headers\": { \"Content-Type\": \"text/javascript\" } }";
+  const gchar *channel = NULL;
+  JsonObject *control;
+  GBytes *bytes;
+
+  while ((control = mock_transport_pop_control (session->transport)) != NULL)
+    {
+      if (g_str_equal (json_object_get_string_member (control, "command"), "open"))
+        {
+          channel = json_object_get_string_member (control, "channel");
+          break;
+        }
+    }
+
+  if (!channel)
+    return FALSE;
+
+  bytes = g_bytes_new_static (head, strlen (head));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (session->transport), channel, bytes);
+  g_bytes_unref (bytes);
+
+  bytes = g_bytes_new_static (body, strlen (body));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (session->transport), channel, bytes);
+  g_bytes_unref (bytes);
+
+  emit_control (session, "done", channel);
+  emit_control (session, "close", channel);
+  return TRUE;
+}
+
+static void
+assert_served (Served *served,
+               const gchar *body)
+{
+  g_autofree gchar *output = NULL;
+
+  while (!served->done)
+    g_main_context_iteration (NULL, TRUE);
+
+  output = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (served->output)),
+                      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (served->output)));
+  g_assert (g_str_has_prefix (output, "HTTP/1.1 200 OK\r\n"));
+  g_assert (strstr (output, "\r\nCache-Control: max-age=31536000, private, immutable\r\n") != NULL);
+  g_assert (strstr (output, body) != NULL);
+
+  g_clear_object (&served->response);
+  g_clear_object (&served->output);
+}
+
+static void
+test_hit (TestCase *tc,
+          gconstpointer data)
+{
+  Served served;
+
+  serve (&tc->local, &served, NULL, NULL);
+  g_assert (reply_from_bridge (&tc->local, "console.log('local');"));
+  assert_served (&served, "console.log('local');");
+  g_assert_cmpuint (cockpit_package_cache_get_size (), >, 0);
+
+  /* The second time around the bridge isn't asked */
+  serve (&tc->local, &served, NULL, NULL);
+  g_assert (!reply_from_bridge (&tc->local, "not reached"));
+  assert_served (&served, "console.log('local');");
+}
+
+static void
+test_other_host (TestCase *tc,
+                 gconstpointer data)
+{
+  Served served;
+
+  serve (&tc->local, &served, NULL, NULL);
+  g_assert (reply_from_bridge (&tc->local, "console.log('local');"));
+  assert_served (&served, "console.log('local');");
+
+  /* Same checksum, but served by another host: that bridge gets asked */
+  serve (&tc->remote, &served, NULL, NULL);
+  g_assert (reply_from_bridge (&tc->remote, "console.log('evil');"));
+  assert_served (&served, "console.log('evil');");
+
+  /* And what it sent isn't given to anyone else */
+  serve (&tc->local, &served, NULL, NULL);
+  g_assert (!reply_from_bridge (&tc->local, "not reached"));
+  assert_served (&served, "console.log('local');");
+}
+
+static void
+test_skip (TestCase *tc,
+           gconstpointer data)
+{
+  const gchar **header = (const gchar **)data;
+  Served served;
+
+  serve (&tc->local, &served, NULL, NULL);
+  g_assert (reply_from_bridge (&tc->local, "console.log('local');"));
+  assert_served (&served, "console.log('local');");
+
+  /* This request goes to the bridge, despite the cached copy */
+  serve (&tc->local, &served, header[0], header[1]);
+  g_assert (reply_from_bridge (&tc->local, "console.log('again');"));
+  assert_served (&served, "console.log('again');");
+}
+
+static const gchar *
+open_range_unknown_size (TestCase *tc,
+                         GIOStream *io,
+                         GHashTable *headers,
+                         const gchar *path)
+{
+  g_autoptr(JsonObject) open = json_object_new ();
+  JsonObject *control;
+
+  /* Satisfiable, but there's no size-hint for files in /proc or devices */
+  g_hash_table_insert (headers, g_strdup ("Range"), g_strdup ("bytes=8-"));
+  json_object_set_string_member (open, "payload", "fsread1");
+  json_object_set_string_member (open, "path", path);
+
+  cockpit_channel_response_open (tc->local.service,
+                                 WebRequest (.io = io, .headers = headers, .method = "GET",
+                                             .original_path = "/cockpit/channel/abc",
+                                             .path = "/cockpit/channel/abc"),
+                                 open);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  while ((control = mock_transport_pop_control (tc->local.transport)) != NULL)
+    {
+      if (g_str_equal (json_object_get_string_member (control, "command"), "open"))
+        break;
+    }
+  g_assert (control != NULL);
+  g_assert_cmpint (json_object_get_int_member (control, "offset"), ==, 8);
+  g_assert (!json_object_has_member (control, "length"));
+
+  emit_control (&tc->local, "ready", json_object_get_string_member (control, "channel"));
+  return json_object_get_string_member (control, "channel");
+}
+
+static void
+test_range_unknown_size (TestCase *tc,
+                         gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autoptr(GInputStream) input = g_memory_input_stream_new ();
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  g_autoptr(GIOStream) io = g_simple_io_stream_new (input, output);
+  g_autofree gchar *response = NULL;
+  const gchar *channel;
+  GBytes *bytes;
+
+  channel = open_range_unknown_size (tc, io, headers, "/proc/self/comm");
+
+  bytes = g_bytes_new_static ("bridge\n", 7);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->local.transport), channel, bytes);
+  g_bytes_unref (bytes);
+  emit_control (&tc->local, "done", channel);
+  emit_control (&tc->local, "close", channel);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  response = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                        g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+  g_assert (g_str_has_prefix (response, "HTTP/1.1 206 Partial Content\r\n"));
+  g_assert (strstr (response, "\r\nContent-Range: bytes 8-14/*\r\n") != NULL);
+  g_assert (strstr (response, "\r\nContent-Length: 7\r\n") != NULL);
+  g_assert (g_str_has_suffix (response, "\r\n\r\nbridge\n"));
+}
+
+static void
+test_range_unknown_size_too_large (TestCase *tc,
+                                   gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autoptr(GInputStream) input = g_memory_input_stream_new ();
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  g_autoptr(GIOStream) io = g_simple_io_stream_new (input, output);
+  g_autofree gchar *response = NULL;
+  const gchar *channel;
+  JsonObject *control;
+  gboolean closed = FALSE;
+  GBytes *bytes;
+  gint i;
+
+  channel = open_range_unknown_size (tc, io, headers, "/dev/sda");
+
+  /* A whole disk doesn't get held back in memory */
+  bytes = g_bytes_new_take (g_malloc0 (64 * 1024), 64 * 1024);
+  for (i = 0; i < 32; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->local.transport), channel, bytes);
+  g_bytes_unref (bytes);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  response = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                        g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+  g_assert (g_str_has_prefix (response, "HTTP/1.1 416 Range Not Satisfiable\r\n"));
+  g_assert (g_str_has_suffix (response, "\r\n\r\n"));
+
+  /* And the bridge is told to stop reading */
+  while ((control = mock_transport_pop_control (tc->local.transport)) != NULL)
+    {
+      if (g_str_equal (json_object_get_string_member (control, "command"), "close"))
+        closed = TRUE;
+    }
+  g_assert (closed);
+}
+
+static const gchar *skip_range[] = { "Range", "bytes=0-" };
+static const gchar *skip_pragma[] = { "Pragma", "no-cache" };
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/channel-response/cache/hit", TestCase, NULL, setup, test_hit, teardown);
+  g_test_add ("/channel-response/cache/other-host", TestCase, NULL, setup, test_other_host, teardown);
+  g_test_add ("/channel-response/cache/skip-range", TestCase, skip_range, setup, test_skip, teardown);
+  g_test_add ("/channel-response/cache/skip-pragma", TestCase, skip_pragma, setup, test_skip, teardown);
+  g_test_add ("/channel-response/range/unknown-size", TestCase, NULL, setup, test_range_unknown_size, teardown);
+  g_test_add ("/channel-response/range/unknown-size-too-large", TestCase, NULL,
+              setup, test_range_unknown_size_too_large, teardown);
+
+  return g_test_run ();
+}
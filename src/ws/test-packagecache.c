@@ -0,0 +1,196 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitpackagecache.h"
+
+#include "common/cockpitwebserver.h"
+
+#include "testlib/cockpittest.h"
+
+#include <string.h>
+
+typedef struct {
+  gsize limit;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->limit = 1024 * 1024;
+  cockpit_package_cache_set_limit (tc->limit);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_package_cache_set_limit (0);
+  g_assert_cmpuint (cockpit_package_cache_get_size (), ==, 0);
+}
+
+static void
+insert (const gchar *key,
+        const gchar *content_type,
+        const gchar *body)
+{
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autoptr(GBytes) bytes = g_bytes_new (body, strlen (body));
+
+  g_hash_table_insert (headers, g_strdup ("Content-Type"), g_strdup (content_type));
+  cockpit_package_cache_insert (key, headers, bytes);
+}
+
+static void
+test_hit (TestCase *tc,
+          gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = NULL;
+  g_autoptr(GBytes) body = NULL;
+
+  g_assert (cockpit_package_cache_lookup ("\"$abc\"\n/system/index.js", &headers) == NULL);
+  g_assert (headers == NULL);
+
+  insert ("\"$abc\"\n/system/index.js", "text/javascript", "alert(1);");
+  g_assert_cmpuint (cockpit_package_cache_get_size (), >, 10);
+
+  body = cockpit_package_cache_lookup ("\"$abc\"\n/system/index.js", &headers);
+  g_assert (body != NULL);
+  cockpit_assert_bytes_eq (body, "alert(1);", -1);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Type"), ==, "text/javascript");
+
+  /* different keys are different entries */
+  g_autoptr(GHashTable) other_headers = NULL;
+  g_assert (cockpit_package_cache_lookup ("\"$def\"\n/system/index.js", &other_headers) == NULL);
+}
+
+static void
+test_replace (TestCase *tc,
+              gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = NULL;
+  g_autoptr(GBytes) body = NULL;
+
+  insert ("key", "text/plain", "one");
+  gsize size = cockpit_package_cache_get_size ();
+
+  insert ("key", "text/plain", "two");
+  g_assert_cmpuint (cockpit_package_cache_get_size (), ==, size);
+
+  body = cockpit_package_cache_lookup ("key", &headers);
+  cockpit_assert_bytes_eq (body, "two", -1);
+}
+
+static void
+test_limit (TestCase *tc,
+            gconstpointer data)
+{
+  g_autofree gchar *large = g_strnfill (2000, 'x');
+  g_autoptr(GHashTable) headers = NULL;
+  g_autoptr(GBytes) body = NULL;
+
+  cockpit_package_cache_set_limit (1000);
+
+  /* too large to be cached at all */
+  insert ("large", "text/plain", large);
+  g_assert_cmpuint (cockpit_package_cache_get_size (), ==, 0);
+
+  insert ("one", "text/plain", "one");
+  gsize size = cockpit_package_cache_get_size ();
+  g_assert_cmpuint (size, >, 0);
+
+  /* only room for one of them, so the least recently used one goes */
+  cockpit_package_cache_set_limit (size + 1);
+  insert ("two", "text/plain", "two");
+  g_assert_cmpuint (cockpit_package_cache_get_size (), <=, size + 1);
+
+  g_assert (cockpit_package_cache_lookup ("one", &headers) == NULL);
+  body = cockpit_package_cache_lookup ("two", &headers);
+  cockpit_assert_bytes_eq (body, "two", -1);
+}
+
+static void
+test_lru (TestCase *tc,
+          gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = NULL;
+  g_autoptr(GBytes) body = NULL;
+
+  insert ("one", "text/plain", "one");
+  gsize size = cockpit_package_cache_get_size ();
+  insert ("two", "text/plain", "two");
+
+  /* using "one" makes "two" the oldest entry */
+  body = cockpit_package_cache_lookup ("one", &headers);
+  g_assert (body != NULL);
+  g_clear_pointer (&body, g_bytes_unref);
+  g_clear_pointer (&headers, g_hash_table_unref);
+
+  cockpit_package_cache_set_limit (2 * size + 1);
+  insert ("six", "text/plain", "six");
+
+  g_assert (cockpit_package_cache_lookup ("two", &headers) == NULL);
+  body = cockpit_package_cache_lookup ("one", &headers);
+  g_assert (body != NULL);
+}
+
+static void
+test_disabled (TestCase *tc,
+               gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = NULL;
+
+  cockpit_package_cache_set_limit (0);
+  insert ("one", "text/plain", "one");
+
+  g_assert_cmpuint (cockpit_package_cache_get_size (), ==, 0);
+  g_assert (cockpit_package_cache_lookup ("one", &headers) == NULL);
+}
+
+static void
+test_flush (TestCase *tc,
+            gconstpointer data)
+{
+  g_autoptr(GHashTable) headers = NULL;
+
+  insert ("one", "text/plain", "one");
+  insert ("two", "text/plain", "two");
+  cockpit_package_cache_flush ();
+
+  g_assert_cmpuint (cockpit_package_cache_get_size (), ==, 0);
+  g_assert (cockpit_package_cache_lookup ("one", &headers) == NULL);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/package-cache/hit", TestCase, NULL, setup, test_hit, teardown);
+  g_test_add ("/package-cache/replace", TestCase, NULL, setup, test_replace, teardown);
+  g_test_add ("/package-cache/limit", TestCase, NULL, setup, test_limit, teardown);
+  g_test_add ("/package-cache/lru", TestCase, NULL, setup, test_lru, teardown);
+  g_test_add ("/package-cache/disabled", TestCase, NULL, setup, test_disabled, teardown);
+  g_test_add ("/package-cache/flush", TestCase, NULL, setup, test_flush, teardown);
+
+  return g_test_run ();
+}
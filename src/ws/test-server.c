@@ -741,7 +741,8 @@ on_handle_source (CockpitWebServer *server,
       inject_address (response, "bus_address", bus_address);
       inject_address (response, "direct_address", direct_address);
     }
-  cockpit_web_response_file_or_gz (response, TRUE, path, (const gchar **)server_roots);
+  g_auto(GStrv) encodings = cockpit_web_request_get_accepted_encodings (request, cockpit_web_response_encodings);
+  cockpit_web_response_file_encoded (response, (const gchar * const *) encodings, path, (const gchar **)server_roots);
   return TRUE;
 }
 
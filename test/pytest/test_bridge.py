@@ -431,6 +431,24 @@ async def test_fsread1_size_hint(transport: MockTransport) -> None:
     await transport.assert_data(ch, data)
 
 
+@pytest.mark.asyncio
+async def test_fsread1_offset_length(transport: MockTransport, tmp_path: Path) -> None:
+    myfile = tmp_path / 'myfile'
+    myfile.write_bytes(b'A small test file\n')
+
+    # size-hint is always the size of the whole file
+    ch = await transport.check_open('fsread1', path=str(myfile), binary='raw', offset=2, length=5,
+                                    reply_keys={'size-hint': 18})
+    await transport.assert_data(ch, b'small')
+    await transport.assert_msg(ch, command='done')
+
+    ch = await transport.check_open('fsread1', path=str(myfile), binary='raw', offset=8)
+    await transport.assert_data(ch, b'test file\n')
+
+    await transport.check_open('fsread1', path=str(myfile), offset=-1, problem='protocol-error')
+    await transport.check_open('fsread1', path=str(myfile), length=0, problem='protocol-error')
+
+
 @pytest.mark.asyncio
 async def test_fsread1_size_hint_absent(transport: MockTransport) -> None:
     # non-binary fsread1 has no size-hint